@@ -0,0 +1,191 @@
+#include "harness.h"
+
+#include <chrono>
+#include <string>
+#include <sys/stat.h>
+#include "esp_camera.h"
+#include "simnode.h"
+
+#define   BENCH_SOURCE_NODE       2
+#define   BENCH_CAPTURE_INTERVAL  500       // ms, like a PIR burst
+#define   BENCH_SERIALIZE_ROUNDS  2000
+
+class Stopwatch {
+ public:
+  Stopwatch() : start(std::chrono::steady_clock::now()) {}
+  double seconds() const {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  }
+
+ private:
+  std::chrono::steady_clock::time_point start;
+};
+
+static void printResult(const char *name, double value, const char *unit) {
+  printf("bench: %-40s %12.2f %s\n", name, value, unit);
+}
+
+static double perSecond(uint32_t count, const Stopwatch &stopwatch) {
+  return count / max(stopwatch.seconds(), 1e-9);
+}
+
+// What sendPackage() puts on the air
+static size_t jsonSize(const painlessmesh::protocol::PackageInterface &package) {
+  MeshJsonDocument document(package.jsonObjectSize());
+  JsonObject jsonObj = document.to<JsonObject>();
+  jsonObj = package.addTo(std::move(jsonObj));
+  std::string json;
+  return serializeJson(document, json);
+}
+
+static void fillBatch(PictureReportBatchPackage &batch) {
+  batch.from = BENCH_SOURCE_NODE;
+  batch.dest = HARNESS_DEST_NODE;
+  batch.sendTime = 3000000000u;
+  batch.count = 0;
+  for (uint8_t i = 0; i < REPORT_BATCH_SIZE; i++) {
+    PictureReportPackage report;
+    report.pictureIndex = 100000 + 7 * i;
+    report.deerProbability = 0.5 + 0.04 * i;
+    report.pictureCount = 1 + i % 3;
+    report.captureTime = batch.sendTime - 90000000 + 1000000 * i;
+    report.enqueueTime = report.captureTime + 800000;
+    batch.add(report);
+  }
+}
+
+// Every other frame shows a deer, so no two reports are coalesced
+static bool benchCapture(uint32_t captures) {
+  SimNode node(BENCH_SOURCE_NODE, HARNESS_DEST_NODE);
+  if (!node.begin(HARNESS_CARD_ROOT "/bench")) {
+    return false;
+  }
+  uint32_t allocationsBefore = allocationCount();
+  uint64_t bytesBefore = allocatedBytes();
+  Stopwatch stopwatch;
+  for (uint32_t i = 0; i < captures; i++) {
+    if (!node.capture(i % 2 ? 0.2 : 0.9)) {
+      return false;
+    }
+    delay(BENCH_CAPTURE_INTERVAL);
+    node.reportQueue.flushCoalesced();
+  }
+  double seconds = stopwatch.seconds();
+  TelemetryRecord record;
+  node.telemetry.snapshot(record, BENCH_SOURCE_NODE, node.mesh.getNodeTime(), 0, node.reportQueue.getCount());
+
+  printResult("capture.captures_per_second", captures / max(seconds, 1e-9), "captures/s");
+  printResult("capture.allocations_per_capture", (double) (allocationCount() - allocationsBefore) / captures,
+              "allocations");
+  printResult("capture.heap_bytes_per_capture", (double) (allocatedBytes() - bytesBefore) / captures, "bytes");
+  printResult("capture.sd_bytes_per_capture", (double) record.counters[COUNTER_SD_BYTES] / captures, "bytes");
+  printResult("capture.sd_write_average", record.timers[TIMER_SD_WRITE].averageMicros, "us");
+
+  // Every report is found again through the segment index
+  uint32_t found = 0;
+  stopwatch = Stopwatch();
+  for (uint32_t i = 0; i < captures; i++) {
+    char logged[LOG_RECORD_SIZE];
+    char expected[32];
+    snprintf(expected, sizeof(expected), "\"pictureIndex\":%u,", i);
+    if (node.findReport(i, logged, sizeof(logged)) && strstr(logged, expected)) {
+      found++;
+    }
+  }
+  printResult("log.lookups_per_second", perSecond(captures, stopwatch), "lookups/s");
+  node.end();
+  if (found != captures) {
+    printf("bench: Only %u of %u reports were found in the log!\n", found, captures);
+    return false;
+  }
+  return true;
+}
+
+static bool benchSerialize() {
+  PictureReportBatchPackage batch;
+  fillBatch(batch);
+  PictureReportPackage single = batch.get(0);
+  CompactReportPackage compactBatch;
+  if (!compactBatch.encode(batch)) {
+    return false;
+  }
+  printResult("serialize.json_bytes_per_report", jsonSize(single), "bytes");
+  printResult("serialize.json_batch_bytes_per_report", (double) jsonSize(batch) / batch.count, "bytes");
+  printResult("serialize.compact_bytes_per_report", (double) jsonSize(compactBatch) / batch.count, "bytes");
+
+  uint32_t allocationsBefore = allocationCount();
+  Stopwatch stopwatch;
+  size_t checksum = 0;
+  for (uint32_t i = 0; i < BENCH_SERIALIZE_ROUNDS; i++) {
+    batch.reports[0].pictureIndex = i;
+    checksum += compactBatch.encode(batch) ? strlen(compactBatch.payload) : 0;
+    PictureReportBatchPackage decoded;
+    checksum += compactBatch.decode(decoded) ? decoded.count : 0;
+  }
+  printResult("serialize.compact_reports_per_second", perSecond(BENCH_SERIALIZE_ROUNDS * batch.count, stopwatch),
+              "reports/s");
+  printResult("serialize.compact_allocations_per_batch",
+              (double) (allocationCount() - allocationsBefore) / BENCH_SERIALIZE_ROUNDS, "allocations");
+
+  stopwatch = Stopwatch();
+  for (uint32_t i = 0; i < BENCH_SERIALIZE_ROUNDS; i++) {
+    batch.reports[0].pictureIndex = i;
+    checksum += jsonSize(batch);
+  }
+  printResult("serialize.json_batch_reports_per_second", perSecond(BENCH_SERIALIZE_ROUNDS * batch.count, stopwatch),
+              "reports/s");
+  return checksum > 0;
+}
+
+// Positive captures at the source, drained to the destination over one hop
+static bool benchEndToEnd(uint32_t captures) {
+  SimNode destination(HARNESS_DEST_NODE, HARNESS_DEST_NODE);
+  SimNode source(BENCH_SOURCE_NODE, HARNESS_DEST_NODE);
+  if (!destination.begin(HARNESS_CARD_ROOT "/bench_dest") || !source.begin(HARNESS_CARD_ROOT "/bench")) {
+    return false;
+  }
+  uint32_t allocationsBefore = allocationCount();
+  Stopwatch stopwatch;
+  for (uint32_t i = 0; i < captures; i++) {
+    source.capture(i % 2 ? 0.6 : 0.95);
+    delay(REPORT_COALESCE_WINDOW);    // every capture a report of its own
+    source.reportQueue.flushCoalesced();
+  }
+  // Gives up if the reports stop arriving
+  for (uint32_t round = 0; round < 4 * captures + 100
+       && (!source.reportQueue.isEmpty() || destination.stats.reportsReceived < source.stats.reportsSent); round++) {
+    unsigned long interval = source.sendReports();
+    delay(min(interval, (unsigned long) SIM_SEND_INTERVAL_DRAIN));
+    destination.update();
+  }
+  double seconds = stopwatch.seconds();
+  uint32_t received = destination.stats.reportsReceived;
+
+  printResult("pipeline.reports_per_second", received / max(seconds, 1e-9), "reports/s");
+  printResult("pipeline.air_bytes_per_report", (double) source.mesh.sentBytes / max(received, (uint32_t) 1), "bytes");
+  printResult("pipeline.allocations_per_report",
+              (double) (allocationCount() - allocationsBefore) / max(received, (uint32_t) 1), "allocations");
+  printResult("pipeline.batches", source.stats.batchesSent, "batches");
+  source.end();
+  destination.end();
+  return received == source.stats.enqueued;
+}
+
+int runBenchmarks(uint32_t captures) {
+  camera_config_t config = {PIXFORMAT_JPEG, FRAMESIZE_SVGA, 12, 1, CAMERA_FB_IN_PSRAM, CAMERA_GRAB_WHEN_EMPTY};
+  mkdir(HARNESS_CARD_ROOT, 0777);
+  if (esp_camera_init(&config) != ESP_OK) {
+    printf("bench: Camera init failed!\n");
+    return 1;
+  }
+  SimNetwork::lossRate = 0;
+  Serial.setQuiet(true);
+  bool success = benchCapture(captures) && benchSerialize() && benchEndToEnd(captures);
+  Serial.setQuiet(false);
+  esp_camera_deinit();
+  if (!success) {
+    printf("bench: A benchmark failed!\n");
+    return 1;
+  }
+  return 0;
+}
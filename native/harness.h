@@ -0,0 +1,17 @@
+#ifndef HARNESS_H
+#define HARNESS_H
+
+#include <Arduino.h>
+
+#define   HARNESS_CARD_ROOT     "native_card"     // one directory per simulated node below
+#define   HARNESS_DEST_NODE     1
+
+// Prints one "bench:" line per measurement, returns the exit code
+int runBenchmarks(uint32_t captures);
+// Replays a PIR trace, see traces/README.md
+int runSimulation(const char *tracePath, float lossRate, uint32_t hopLatency);
+// Writes "<kind>_<target version>.delta", see deltapatch.h
+int makePatch(const char *kind, const char *basePath, uint32_t baseVersion,
+              const char *targetPath, uint32_t targetVersion);
+
+#endif
@@ -0,0 +1,41 @@
+/****************************************************
+ * Host-side harness, built by [env:native].        *
+ *   program bench [captures]                       *
+ *     micro-benchmarks of the report pipeline      *
+ *   program simulate <trace> [loss] [hop ms]       *
+ *     replays a PIR trace on a simulated mesh      *
+ *   program patch <kind> <base> <version>          *
+ *                 <target> <version>               *
+ *     delta patch for an update over the mesh      *
+ * Cards of the simulated nodes go to               *
+ * HARNESS_CARD_ROOT in the working directory.      *
+ ****************************************************/
+
+#include "harness.h"
+
+#define   DEFAULT_BENCH_CAPTURES    200
+#define   DEFAULT_LOSS_RATE         0
+#define   DEFAULT_HOP_LATENCY       20      // ms
+
+static int usage(const char *program) {
+  printf("usage: %s bench [captures]\n", program);
+  printf("       %s simulate <trace> [loss rate per hop] [ms per hop]\n", program);
+  printf("       %s patch <firmware|model> <base file> <base version> <target file> <target version>\n", program);
+  return 2;
+}
+
+int main(int argc, char **argv) {
+  if (argc >= 2 && strcmp(argv[1], "bench") == 0) {
+    uint32_t captures = argc >= 3 ? strtoul(argv[2], NULL, 10) : DEFAULT_BENCH_CAPTURES;
+    return captures > 0 ? runBenchmarks(captures) : usage(argv[0]);
+  }
+  if (argc >= 3 && strcmp(argv[1], "simulate") == 0) {
+    float lossRate = argc >= 4 ? atof(argv[3]) : DEFAULT_LOSS_RATE;
+    uint32_t hopLatency = argc >= 5 ? strtoul(argv[4], NULL, 10) : DEFAULT_HOP_LATENCY;
+    return runSimulation(argv[2], lossRate, hopLatency * 1000);
+  }
+  if (argc == 7 && strcmp(argv[1], "patch") == 0) {
+    return makePatch(argv[2], argv[3], strtoul(argv[4], NULL, 10), argv[5], strtoul(argv[6], NULL, 10));
+  }
+  return usage(argv[0]);
+}
@@ -0,0 +1,84 @@
+/****************************************************
+ * Just enough of the Arduino core for the portable *
+ * modules to run on the host, see native/main.cpp. *
+ * millis() and micros() follow a simulated clock   *
+ * that only moves with delay() and advanceClock(), *
+ * so runs are repeatable. Cycle counts come from   *
+ * the host clock, so stage timers show host cost.  *
+ ****************************************************/
+
+#ifndef NATIVE_ARDUINO_H
+#define NATIVE_ARDUINO_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <algorithm>
+#include "freertos/FreeRTOS.h"
+
+using std::min;
+using std::max;
+
+#define   HIGH              1
+#define   LOW               0
+#define   IRAM_ATTR
+#define   RTC_DATA_ATTR
+#define   NATIVE_CPU_MHZ    240     // what ESP.getCpuFreqMHz() claims
+
+typedef bool boolean;
+typedef uint8_t byte;
+
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long ms);     // advances the simulated clock
+void yield();
+void advanceClock(uint64_t micros);
+uint64_t clockMicros();
+
+class HardwareSerial {
+ public:
+  void begin(unsigned long baud) {}
+  size_t printf(const char *format, ...);
+  size_t print(const char *text);
+  size_t println(const char *text = "");
+  // Benchmarks mute the logs of the modules
+  void setQuiet(bool quiet) { this->quiet = quiet; }
+
+ private:
+  bool quiet = false;
+};
+extern HardwareSerial Serial;
+
+class EspClass {
+ public:
+  uint32_t getCycleCount();
+  uint32_t getCpuFreqMHz() { return NATIVE_CPU_MHZ; }
+  uint32_t getFreeHeap();
+};
+extern EspClass ESP;
+
+#if defined(__GLIBC__) && !__GLIBC_PREREQ(2, 38)
+#define NATIVE_NEEDS_STRLCPY
+extern "C" size_t strlcpy(char *destination, const char *source, size_t size);
+#endif
+
+// Heap allocations of the modules, operator new and what the json documents
+// and heap_caps_malloc() take. The mocks themselves don't count.
+uint32_t allocationCount();
+uint64_t allocatedBytes();
+void countAllocation(size_t size);
+
+class UncountedAllocations {
+ public:
+  UncountedAllocations() { depth++; }
+  ~UncountedAllocations() { depth--; }
+  static bool active() { return depth > 0; }
+
+ private:
+  static int depth;
+};
+
+#endif
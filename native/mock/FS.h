@@ -0,0 +1,88 @@
+/****************************************************
+ * Arduino file system on top of a host directory.  *
+ * Every FS has its own root, so each simulated     *
+ * node gets a card of its own.                     *
+ ****************************************************/
+
+#ifndef NATIVE_FS_H
+#define NATIVE_FS_H
+
+#include <Arduino.h>
+#include <dirent.h>
+#include <memory>
+#include <string>
+
+#define   FILE_READ       "r"
+#define   FILE_WRITE      "w"
+#define   FILE_APPEND     "a"
+
+namespace fs {
+
+enum SeekMode {
+  SeekSet = 0,
+  SeekCur = 1,
+  SeekEnd = 2
+};
+
+struct FileImpl {
+  FILE *file = NULL;
+  DIR *directory = NULL;
+  std::string root;       // of the FS it was opened on
+  std::string path;       // below root, as the modules know it
+  ~FileImpl();
+};
+
+class File {
+ public:
+  File() {}
+  explicit File(std::shared_ptr<FileImpl> impl) : impl(impl) {}
+
+  operator bool() const { return impl && (impl->file || impl->directory); }
+  size_t read(uint8_t *buffer, size_t size);
+  int read();
+  size_t write(const uint8_t *buffer, size_t size);
+  size_t write(uint8_t value) { return write(&value, 1); }
+  bool seek(uint32_t position, SeekMode mode = SeekSet);
+  size_t position() const;
+  size_t size() const;
+  int available();
+  void flush();
+  void close() { impl.reset(); }
+  const char *name() const;
+  const char *path() const { return impl ? impl->path.c_str() : ""; }
+  bool isDirectory() const { return impl && impl->directory; }
+  File openNextFile(const char *mode = FILE_READ);
+
+ private:
+  std::shared_ptr<FileImpl> impl;
+};
+
+class FS {
+ public:
+  explicit FS(const char *root = ".") : root(root) {}
+  void setRoot(const char *root) { this->root = root; }
+  const char *getRoot() const { return root.c_str(); }
+
+  File open(const char *path, const char *mode = FILE_READ);
+  bool exists(const char *path);
+  bool mkdir(const char *path);
+  bool remove(const char *path);
+  bool rename(const char *from, const char *to);
+  bool rmdir(const char *path);
+
+ protected:
+  std::string root;
+
+  std::string hostPath(const char *path) const { return root + path; }
+};
+
+}
+
+using fs::FS;
+using fs::File;
+using fs::SeekMode;
+using fs::SeekSet;
+using fs::SeekCur;
+using fs::SeekEnd;
+
+#endif
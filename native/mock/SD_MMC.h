@@ -0,0 +1,31 @@
+#ifndef NATIVE_SD_MMC_H
+#define NATIVE_SD_MMC_H
+
+#include "FS.h"
+
+#define   NATIVE_CARD_ROOT    "native_card"
+
+typedef enum {
+  CARD_NONE,
+  CARD_MMC,
+  CARD_SD,
+  CARD_SDHC,
+  CARD_UNKNOWN
+} sdcard_type_t;
+
+// The card of the node that main.cpp would run on, lives in NATIVE_CARD_ROOT
+class SDMMCFS : public fs::FS {
+ public:
+  SDMMCFS();
+  // Creates the root directory, mountpoint and mode are ignored
+  bool begin(const char *mountpoint = "/sdcard", bool mode1bit = false);
+  void end() { mounted = false; }
+  sdcard_type_t cardType() { return mounted ? CARD_SDHC : CARD_NONE; }
+
+ private:
+  bool mounted = false;
+};
+
+extern SDMMCFS SD_MMC;
+
+#endif
@@ -0,0 +1,35 @@
+#ifndef NATIVE_ESP_HEAP_CAPS_H
+#define NATIVE_ESP_HEAP_CAPS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#define   MALLOC_CAP_8BIT         (1 << 2)
+#define   MALLOC_CAP_SPIRAM       (1 << 10)
+#define   MALLOC_CAP_INTERNAL     (1 << 11)
+
+// Sizes of an ESP32-CAM, the host heap says nothing about the device
+#define   NATIVE_INTERNAL_HEAP    (320 * 1024)
+#define   NATIVE_PSRAM_HEAP       (4 * 1024 * 1024)
+
+void countAllocation(size_t size);
+
+inline void *heap_caps_malloc(size_t size, uint32_t caps) {
+  countAllocation(size);
+  return malloc(size);
+}
+
+inline void heap_caps_free(void *pointer) {
+  free(pointer);
+}
+
+inline size_t heap_caps_get_free_size(uint32_t caps) {
+  return (caps & MALLOC_CAP_SPIRAM) ? NATIVE_PSRAM_HEAP : NATIVE_INTERNAL_HEAP;
+}
+
+inline size_t heap_caps_get_largest_free_block(uint32_t caps) {
+  return heap_caps_get_free_size(caps);
+}
+
+#endif
@@ -0,0 +1,24 @@
+#ifndef NATIVE_FREERTOS_H
+#define NATIVE_FREERTOS_H
+
+#include <stdint.h>
+
+typedef int BaseType_t;
+typedef unsigned int UBaseType_t;
+typedef uint32_t TickType_t;
+
+#define   pdTRUE            1
+#define   pdFALSE           0
+#define   pdPASS            1
+#define   portMAX_DELAY     0xffffffffUL
+#define   pdMS_TO_TICKS(ms) (ms)
+
+// The simulation is single threaded, critical sections are no-ops
+typedef struct {
+  int owner;
+} portMUX_TYPE;
+#define   portMUX_INITIALIZER_UNLOCKED  {0}
+#define   portENTER_CRITICAL(mux)       ((void) (mux))
+#define   portEXIT_CRITICAL(mux)        ((void) (mux))
+
+#endif
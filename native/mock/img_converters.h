@@ -0,0 +1,14 @@
+#ifndef NATIVE_IMG_CONVERTERS_H
+#define NATIVE_IMG_CONVERTERS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "esp_camera.h"
+
+typedef size_t (*jpg_out_cb)(void *arg, size_t index, const void *data, size_t len);
+
+// Writes the pixels out unencoded, about ten times what the encoder would
+bool fmt2jpg_cb(uint8_t *src, size_t src_len, uint16_t width, uint16_t height, pixformat_t format,
+                uint8_t quality, jpg_out_cb cb, void *arg);
+
+#endif
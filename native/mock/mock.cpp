@@ -0,0 +1,514 @@
+#include <Arduino.h>
+#include <chrono>
+#include <new>
+#include <stdarg.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "FS.h"
+#include "SD_MMC.h"
+#include "esp_camera.h"
+#include "esp_heap_caps.h"
+#include "img_converters.h"
+#include "painlessMesh.h"
+
+/*  CLOCK  */
+static uint64_t simulatedMicros = 0;
+
+unsigned long millis() {
+  return simulatedMicros / 1000;
+}
+
+unsigned long micros() {
+  return simulatedMicros;
+}
+
+void delay(unsigned long ms) {
+  simulatedMicros += (uint64_t) ms * 1000;
+}
+
+void yield() {
+}
+
+void advanceClock(uint64_t micros) {
+  simulatedMicros += micros;
+}
+
+uint64_t clockMicros() {
+  return simulatedMicros;
+}
+/*  END OF CLOCK  */
+
+/*  CORE  */
+HardwareSerial Serial;
+EspClass ESP;
+
+size_t HardwareSerial::printf(const char *format, ...) {
+  if (quiet) {
+    return 0;
+  }
+  va_list arguments;
+  va_start(arguments, format);
+  int length = vprintf(format, arguments);
+  va_end(arguments);
+  return length > 0 ? length : 0;
+}
+
+size_t HardwareSerial::print(const char *text) {
+  return quiet ? 0 : fputs(text, stdout);
+}
+
+size_t HardwareSerial::println(const char *text) {
+  return quiet ? 0 : printf("%s\n", text);
+}
+
+uint32_t EspClass::getCycleCount() {
+  auto now = std::chrono::steady_clock::now().time_since_epoch();
+  return (uint32_t) (std::chrono::duration_cast<std::chrono::nanoseconds>(now).count() * NATIVE_CPU_MHZ / 1000);
+}
+
+uint32_t EspClass::getFreeHeap() {
+  return heap_caps_get_free_size(MALLOC_CAP_INTERNAL);
+}
+
+#ifdef NATIVE_NEEDS_STRLCPY
+extern "C" size_t strlcpy(char *destination, const char *source, size_t size) {
+  size_t length = strlen(source);
+  if (size > 0) {
+    size_t copied = min(length, size - 1);
+    memcpy(destination, source, copied);
+    destination[copied] = '\0';
+  }
+  return length;
+}
+#endif
+/*  END OF CORE  */
+
+/*  ALLOCATIONS  */
+static uint32_t allocations = 0;
+static uint64_t allocationBytes = 0;
+int UncountedAllocations::depth = 0;
+
+void countAllocation(size_t size) {
+  allocations++;
+  allocationBytes += size;
+}
+
+uint32_t allocationCount() {
+  return allocations;
+}
+
+uint64_t allocatedBytes() {
+  return allocationBytes;
+}
+
+// The replacements pair operator new with malloc() themselves
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+
+void *operator new(size_t size) {
+  if (!UncountedAllocations::active()) {
+    countAllocation(size);
+  }
+  void *pointer = malloc(size ? size : 1);
+  if (!pointer) {
+    throw std::bad_alloc();
+  }
+  return pointer;
+}
+
+void *operator new[](size_t size) {
+  if (!UncountedAllocations::active()) {
+    countAllocation(size);
+  }
+  void *pointer = malloc(size ? size : 1);
+  if (!pointer) {
+    throw std::bad_alloc();
+  }
+  return pointer;
+}
+
+void operator delete(void *pointer) noexcept {
+  free(pointer);
+}
+
+void operator delete[](void *pointer) noexcept {
+  free(pointer);
+}
+
+void operator delete(void *pointer, size_t size) noexcept {
+  free(pointer);
+}
+
+void operator delete[](void *pointer, size_t size) noexcept {
+  free(pointer);
+}
+/*  END OF ALLOCATIONS  */
+
+/*  FILE SYSTEM  */
+namespace fs {
+
+FileImpl::~FileImpl() {
+  if (file) {
+    fclose(file);
+  }
+  if (directory) {
+    closedir(directory);
+  }
+}
+
+size_t File::read(uint8_t *buffer, size_t size) {
+  return impl && impl->file ? fread(buffer, 1, size, impl->file) : 0;
+}
+
+int File::read() {
+  uint8_t value;
+  return read(&value, 1) == 1 ? value : -1;
+}
+
+size_t File::write(const uint8_t *buffer, size_t size) {
+  return impl && impl->file ? fwrite(buffer, 1, size, impl->file) : 0;
+}
+
+bool File::seek(uint32_t position, SeekMode mode) {
+  return impl && impl->file && fseek(impl->file, position, mode) == 0;
+}
+
+size_t File::position() const {
+  return impl && impl->file ? ftell(impl->file) : 0;
+}
+
+size_t File::size() const {
+  struct stat status;
+  if (!impl || !impl->file) {
+    return 0;
+  }
+  fflush(impl->file);
+  return fstat(fileno(impl->file), &status) == 0 ? status.st_size : 0;
+}
+
+int File::available() {
+  return size() - position();
+}
+
+void File::flush() {
+  if (impl && impl->file) {
+    fflush(impl->file);
+  }
+}
+
+// Like the ESP32 core, the full path and not just the last part
+const char *File::name() const {
+  return path();
+}
+
+File File::openNextFile(const char *mode) {
+  UncountedAllocations uncounted;
+  if (!impl || !impl->directory) {
+    return File();
+  }
+  for (struct dirent *entry = readdir(impl->directory); entry; entry = readdir(impl->directory)) {
+    if (entry->d_name[0] == '.') {
+      continue;
+    }
+    FS parent(impl->root.c_str());
+    std::string path = impl->path + "/" + entry->d_name;
+    return parent.open(path.c_str(), mode);
+  }
+  return File();
+}
+
+File FS::open(const char *path, const char *mode) {
+  UncountedAllocations uncounted;
+  auto impl = std::make_shared<FileImpl>();
+  impl->root = root;
+  impl->path = path;
+  std::string fullPath = hostPath(path);
+
+  struct stat status;
+  if (stat(fullPath.c_str(), &status) == 0 && S_ISDIR(status.st_mode)) {
+    impl->directory = opendir(fullPath.c_str());
+    return impl->directory ? File(impl) : File();
+  }
+  std::string hostMode = std::string(mode) + "b";
+  impl->file = fopen(fullPath.c_str(), hostMode.c_str());
+  return impl->file ? File(impl) : File();
+}
+
+bool FS::exists(const char *path) {
+  UncountedAllocations uncounted;
+  struct stat status;
+  return stat(hostPath(path).c_str(), &status) == 0;
+}
+
+bool FS::mkdir(const char *path) {
+  UncountedAllocations uncounted;
+  return ::mkdir(hostPath(path).c_str(), 0777) == 0;
+}
+
+bool FS::remove(const char *path) {
+  UncountedAllocations uncounted;
+  return ::unlink(hostPath(path).c_str()) == 0;
+}
+
+bool FS::rename(const char *from, const char *to) {
+  UncountedAllocations uncounted;
+  return ::rename(hostPath(from).c_str(), hostPath(to).c_str()) == 0;
+}
+
+bool FS::rmdir(const char *path) {
+  UncountedAllocations uncounted;
+  return ::rmdir(hostPath(path).c_str()) == 0;
+}
+
+}
+
+SDMMCFS SD_MMC;
+
+SDMMCFS::SDMMCFS() : fs::FS(NATIVE_CARD_ROOT) {}
+
+bool SDMMCFS::begin(const char *mountpoint, bool mode1bit) {
+  mounted = ::mkdir(root.c_str(), 0777) == 0 || exists("");
+  return mounted;
+}
+/*  END OF FILE SYSTEM  */
+
+/*  CAMERA  */
+#define   MAX_FRAME_BUFFERS   2
+
+static camera_config_t cameraConfig;
+static bool cameraReady = false;
+static camera_fb_t frames[MAX_FRAME_BUFFERS];
+static bool frameTaken[MAX_FRAME_BUFFERS];
+static uint8_t *frameMemory[MAX_FRAME_BUFFERS];
+static size_t frameMemorySize = 0;
+static size_t jpegSize = 0;
+static uint32_t noise = 1;
+
+static void frameDimensions(framesize_t frameSize, size_t &width, size_t &height) {
+  static const uint16_t sizes[][2] = {
+    {96, 96}, {160, 120}, {176, 144}, {240, 176}, {240, 240}, {320, 240}, {400, 296},
+    {480, 320}, {640, 480}, {800, 600}, {1024, 768}, {1280, 720}, {1280, 1024}, {1600, 1200}
+  };
+  width = sizes[frameSize][0];
+  height = sizes[frameSize][1];
+}
+
+// About what the OV2640 makes of a forest at quality 10
+static size_t typicalJpegSize(size_t width, size_t height) {
+  return width * height / 8;
+}
+
+static uint8_t nextNoise() {
+  noise = noise * 1103515245 + 12345;
+  return noise >> 16;
+}
+
+esp_err_t esp_camera_init(const camera_config_t *config) {
+  if (cameraReady || config->fb_count < 1 || config->fb_count > MAX_FRAME_BUFFERS) {
+    return ESP_FAIL;
+  }
+  cameraConfig = *config;
+  size_t width, height;
+  frameDimensions(config->frame_size, width, height);
+  frameMemorySize = width * height * 2;     // RGB565 is the largest format
+  for (size_t i = 0; i < cameraConfig.fb_count; i++) {
+    frameMemory[i] = (uint8_t *) malloc(frameMemorySize);
+    frameTaken[i] = false;
+  }
+  cameraReady = true;
+  return ESP_OK;
+}
+
+esp_err_t esp_camera_deinit() {
+  for (size_t i = 0; cameraReady && i < cameraConfig.fb_count; i++) {
+    free(frameMemory[i]);
+  }
+  cameraReady = false;
+  return ESP_OK;
+}
+
+void setSimulatedJpegSize(size_t size) {
+  jpegSize = size;
+}
+
+camera_fb_t *esp_camera_fb_get() {
+  size_t index = 0;
+  while (cameraReady && index < cameraConfig.fb_count && frameTaken[index]) {
+    index++;
+  }
+  if (!cameraReady || index == cameraConfig.fb_count) {
+    return NULL;
+  }
+
+  camera_fb_t &frame = frames[index];
+  frame.buf = frameMemory[index];
+  frame.format = cameraConfig.pixel_format;
+  frameDimensions(cameraConfig.frame_size, frame.width, frame.height);
+  if (frame.format == PIXFORMAT_JPEG) {
+    frame.len = min(jpegSize ? jpegSize : typicalJpegSize(frame.width, frame.height), frameMemorySize);
+    for (size_t i = 0; i < frame.len; i++) {
+      frame.buf[i] = nextNoise();
+    }
+    frame.buf[0] = 0xFF;      // SOI
+    frame.buf[1] = 0xD8;
+    frame.buf[frame.len - 2] = 0xFF;    // EOI
+    frame.buf[frame.len - 1] = 0xD9;
+  } else {
+    frame.len = frame.width * frame.height * (frame.format == PIXFORMAT_GRAYSCALE ? 1 : 2);
+    for (size_t i = 0; i < frame.len; i++) {
+      frame.buf[i] = nextNoise();
+    }
+  }
+  frameTaken[index] = true;
+  return &frame;
+}
+
+void esp_camera_fb_return(camera_fb_t *frameBuffer) {
+  for (size_t i = 0; i < MAX_FRAME_BUFFERS; i++) {
+    if (frameBuffer == &frames[i]) {
+      frameTaken[i] = false;
+    }
+  }
+}
+
+bool fmt2jpg_cb(uint8_t *src, size_t src_len, uint16_t width, uint16_t height, pixformat_t format,
+                uint8_t quality, jpg_out_cb cb, void *arg) {
+  return cb(arg, 0, src, src_len) == src_len;
+}
+/*  END OF CAMERA  */
+
+/*  MESH  */
+uint32_t SimNetwork::hopLatency = 20000;
+float SimNetwork::lossRate = 0;
+uint32_t SimNetwork::seed = 1;
+std::map<uint64_t, uint8_t> SimNetwork::hops;
+
+std::map<uint32_t, painlessMesh *> painlessMesh::nodes;
+std::list<painlessMesh::Message> painlessMesh::inFlight;
+
+static uint64_t linkKey(uint32_t nodeA, uint32_t nodeB) {
+  return nodeA < nodeB ? ((uint64_t) nodeA << 32) | nodeB : ((uint64_t) nodeB << 32) | nodeA;
+}
+
+void SimNetwork::setHops(uint32_t nodeA, uint32_t nodeB, uint8_t count) {
+  hops[linkKey(nodeA, nodeB)] = count;
+}
+
+uint8_t SimNetwork::hopsBetween(uint32_t nodeA, uint32_t nodeB) {
+  auto link = hops.find(linkKey(nodeA, nodeB));
+  return link == hops.end() ? 1 : link->second;
+}
+
+bool SimNetwork::lose() {
+  seed = seed * 1664525 + 1013904223;
+  return (seed >> 8) < lossRate * (1 << 24);
+}
+
+void *CountingAllocator::allocate(size_t size) {
+  countAllocation(size);
+  return malloc(size);
+}
+
+void CountingAllocator::deallocate(void *pointer) {
+  free(pointer);
+}
+
+void *CountingAllocator::reallocate(void *pointer, size_t size) {
+  countAllocation(size);
+  return realloc(pointer, size);
+}
+
+// Only the document counts, like in a receive on the device
+painlessmesh::protocol::Variant::Variant(const TSTRING &json) : document(json.size() * 2 + 256) {
+  UncountedAllocations uncounted;
+  parseError = (bool) deserializeJson(document, json);
+}
+
+void painlessMesh::init(uint32_t nodeId, int32_t clockOffset) {
+  this->nodeId = nodeId;
+  this->clockOffset = clockOffset;
+  nodes[nodeId] = this;
+}
+
+void painlessMesh::stop() {
+  auto node = nodes.find(nodeId);
+  if (node != nodes.end() && node->second == this) {
+    nodes.erase(node);
+  }
+}
+
+std::list<uint32_t> painlessMesh::getNodeList(bool includeSelf) const {
+  std::list<uint32_t> nodeList;
+  for (auto &node : nodes) {
+    if (includeSelf || node.first != nodeId) {
+      nodeList.push_back(node.first);
+    }
+  }
+  return nodeList;
+}
+
+bool painlessMesh::sendPackage(const painlessmesh::protocol::PackageInterface *package) {
+  MeshJsonDocument document(package->jsonObjectSize());
+  UncountedAllocations uncounted;
+  JsonObject jsonObj = document.to<JsonObject>();
+  jsonObj = package->addTo(std::move(jsonObj));
+  TSTRING json;
+  serializeJson(document, json);
+  if (nodes.find(nodeId) == nodes.end()) {
+    return false;
+  }
+  if (jsonObj["routing"].as<int>() == painlessmesh::router::BROADCAST) {
+    for (auto &node : nodes) {
+      if (node.first != nodeId) {
+        transmit(node.first, json);
+      }
+    }
+    return true;
+  }
+
+  uint32_t dest = jsonObj["dest"].as<uint32_t>();
+  if (nodes.find(dest) == nodes.end()) {
+    return false;
+  }
+  transmit(dest, json);
+  return true;
+}
+
+void painlessMesh::transmit(uint32_t dest, const TSTRING &json) {
+  sentPackages++;
+  sentBytes += json.size();
+  uint8_t hopCount = SimNetwork::hopsBetween(nodeId, dest);
+  for (uint8_t hop = 0; hop < hopCount; hop++) {
+    if (SimNetwork::lose()) {
+      lostPackages++;
+      return;
+    }
+  }
+  Message message;
+  message.arrival = clockMicros() + (uint64_t) SimNetwork::hopLatency * hopCount;
+  message.dest = dest;
+  message.json = json;
+  inFlight.push_back(std::move(message));
+}
+
+void painlessMesh::update() {
+  for (auto message = inFlight.begin(); message != inFlight.end();) {
+    if (message->dest != nodeId || message->arrival > clockMicros()) {
+      message++;
+      continue;
+    }
+    painlessmesh::protocol::Variant variant(message->json);
+    message = inFlight.erase(message);
+    auto handler = handlers.find(variant.type());
+    if (!variant.error() && handler != handlers.end()) {
+      handler->second(variant);
+    }
+  }
+}
+
+void painlessMesh::adjustTime(int32_t offset) {
+  clockOffset += offset;
+  if (timeAdjusted) {
+    timeAdjusted(offset);
+  }
+}
+/*  END OF MESH  */
@@ -0,0 +1,177 @@
+/****************************************************
+ * painlessMesh as far as the packages and the      *
+ * simulation need it. Packages are turned into     *
+ * json and parsed again on arrival, like on the    *
+ * device, so the byte counts are the real ones.    *
+ * All meshes of a process form one network: every  *
+ * message arrives after SimNetwork's hop latency   *
+ * per hop, or is lost on the way.                  *
+ ****************************************************/
+
+#ifndef NATIVE_PAINLESSMESH_H
+#define NATIVE_PAINLESSMESH_H
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+#include <functional>
+#include <list>
+#include <map>
+#include <string>
+
+typedef std::string TSTRING;
+
+// Counts the document allocations, a send allocates one like on the device
+struct CountingAllocator {
+  void *allocate(size_t size);
+  void deallocate(void *pointer);
+  void *reallocate(void *pointer, size_t size);
+};
+typedef BasicJsonDocument<CountingAllocator> MeshJsonDocument;
+
+namespace painlessmesh {
+
+namespace router {
+enum Type { ROUTING_ERROR = -1, NEIGHBOUR, SINGLE, BROADCAST };
+}
+
+namespace protocol {
+
+class PackageInterface {
+ public:
+  virtual ~PackageInterface() {}
+  virtual JsonObject addTo(JsonObject &&jsonObj) const = 0;
+  virtual size_t jsonObjectSize() const = 0;
+};
+
+// A package as it arrived, still in json
+class Variant {
+ public:
+  Variant(const TSTRING &json);
+  bool error() const { return parseError; }
+  int type() { return document["type"].as<int>(); }
+  template <typename T> T to() { return T(document.as<JsonObject>()); }
+
+ private:
+  MeshJsonDocument document;
+  bool parseError = false;
+};
+
+}
+
+namespace plugin {
+
+class SinglePackage : public protocol::PackageInterface {
+ public:
+  uint32_t from;
+  uint32_t dest;
+  router::Type routing;
+  int type;
+  int noJsonFields = 4;
+
+  SinglePackage(int type) : routing(router::SINGLE), type(type) {}
+
+  SinglePackage(JsonObject jsonObj) {
+    from = jsonObj["from"].as<uint32_t>();
+    dest = jsonObj["dest"].as<uint32_t>();
+    type = jsonObj["type"].as<int>();
+    routing = static_cast<router::Type>(jsonObj["routing"].as<int>());
+  }
+
+  JsonObject addTo(JsonObject &&jsonObj) const {
+    jsonObj["from"] = from;
+    jsonObj["dest"] = dest;
+    jsonObj["routing"] = (int) routing;
+    jsonObj["type"] = type;
+    return jsonObj;
+  }
+};
+
+class BroadcastPackage : public protocol::PackageInterface {
+ public:
+  uint32_t from;
+  router::Type routing;
+  int type;
+  int noJsonFields = 3;
+
+  BroadcastPackage(int type) : routing(router::BROADCAST), type(type) {}
+
+  BroadcastPackage(JsonObject jsonObj) {
+    from = jsonObj["from"].as<uint32_t>();
+    type = jsonObj["type"].as<int>();
+    routing = static_cast<router::Type>(jsonObj["routing"].as<int>());
+  }
+
+  JsonObject addTo(JsonObject &&jsonObj) const {
+    jsonObj["from"] = from;
+    jsonObj["routing"] = (int) routing;
+    jsonObj["type"] = type;
+    return jsonObj;
+  }
+};
+
+}
+
+}
+
+// Radio between the simulated nodes. Hops default to 1 between any two nodes.
+struct SimNetwork {
+  static uint32_t hopLatency;       // us
+  static float lossRate;            // per hop
+  static uint32_t seed;
+  static std::map<uint64_t, uint8_t> hops;
+
+  static void setHops(uint32_t nodeA, uint32_t nodeB, uint8_t count);
+  static uint8_t hopsBetween(uint32_t nodeA, uint32_t nodeB);
+  static bool lose();               // repeatable, follows seed
+};
+
+class painlessMesh {
+ public:
+  typedef std::function<bool(painlessmesh::protocol::Variant)> PackageHandler;
+
+  ~painlessMesh() { stop(); }
+
+  // Simulation only, instead of init(prefix, password, scheduler, port).
+  // clockOffset is where this node's mesh time starts against the others.
+  void init(uint32_t nodeId, int32_t clockOffset = 0);
+  void stop();
+  void rejoin() { nodes[nodeId] = this; }    // simulation only, after stop()
+  void update();      // delivers what has arrived for this node
+
+  void onPackage(int type, PackageHandler handler) { handlers[type] = handler; }
+  void onNodeTimeAdjusted(std::function<void(int32_t)> callback) { timeAdjusted = callback; }
+  // False if this node or the destination is not in the mesh. Lost messages count as sent,
+  // a broadcast counts once per node.
+  bool sendPackage(const painlessmesh::protocol::PackageInterface *package);
+  bool isConnected(uint32_t nodeId) const { return nodes.count(nodeId) > 0; }
+
+  uint32_t getNodeId() const { return nodeId; }
+  uint32_t getNodeTime() const { return (uint32_t) clockMicros() + clockOffset; }
+  std::list<uint32_t> getNodeList(bool includeSelf = false) const;
+
+  // Simulation only, what the time sync of the mesh would do
+  void adjustTime(int32_t offset);
+
+  uint32_t sentPackages = 0;
+  uint64_t sentBytes = 0;
+  uint32_t lostPackages = 0;
+
+ private:
+  struct Message {
+    uint64_t arrival;     // clockMicros()
+    uint32_t dest;
+    TSTRING json;
+  };
+
+  uint32_t nodeId = 0;
+  int32_t clockOffset = 0;
+  std::map<int, PackageHandler> handlers;
+  std::function<void(int32_t)> timeAdjusted;
+
+  static std::map<uint32_t, painlessMesh *> nodes;
+  static std::list<Message> inFlight;
+
+  void transmit(uint32_t dest, const TSTRING &json);
+};
+
+#endif
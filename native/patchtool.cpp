@@ -0,0 +1,179 @@
+#include "harness.h"
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "crc32.h"
+#include "deltapatch.h"
+#include "FS.h"
+#include "packages.h"
+
+#define   PATCH_BLOCK_SIZE        32        // shortest copy worth its operation
+#define   PATCH_HASH_BASE         257
+
+static bool readHostFile(const char *path, std::vector<uint8_t> &bytes) {
+  FILE *file = fopen(path, "rb");
+  if (!file) {
+    printf("patch: Could not open %s!\n", path);
+    return false;
+  }
+  uint8_t buffer[4096];
+  size_t length;
+  while ((length = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+    bytes.insert(bytes.end(), buffer, buffer + length);
+  }
+  fclose(file);
+  return true;
+}
+
+static void appendUint32(std::vector<uint8_t> &patch, uint32_t value) {
+  for (int i = 0; i < 4; i++) {
+    patch.push_back((value >> (8 * i)) & 0xFF);
+  }
+}
+
+static void appendOp(std::vector<uint8_t> &patch, uint8_t op, uint32_t first, uint32_t second) {
+  patch.push_back(op);
+  appendUint32(patch, first);
+  appendUint32(patch, second);
+}
+
+static void appendInsert(std::vector<uint8_t> &patch, const std::vector<uint8_t> &target, size_t start, size_t end) {
+  if (end > start) {
+    appendOp(patch, DELTA_OP_INSERT, end - start, 0);
+    patch.insert(patch.end(), target.begin() + start, target.begin() + end);
+  }
+}
+
+// Greedy: every block of the base is indexed by a rolling hash, the target
+// is scanned byte by byte and every hit is grown as far as it goes
+static std::vector<uint8_t> diff(const std::vector<uint8_t> &base, const std::vector<uint8_t> &target,
+                                 uint32_t &copies, uint32_t &inserts) {
+  uint64_t topPower = 1;
+  for (int i = 1; i < PATCH_BLOCK_SIZE; i++) {
+    topPower *= PATCH_HASH_BASE;
+  }
+  auto blockHash = [](const uint8_t *bytes) {
+    uint64_t hash = 0;
+    for (int i = 0; i < PATCH_BLOCK_SIZE; i++) {
+      hash = hash * PATCH_HASH_BASE + bytes[i];
+    }
+    return hash;
+  };
+
+  std::unordered_map<uint64_t, uint32_t> blocks;
+  for (size_t offset = 0; offset + PATCH_BLOCK_SIZE <= base.size(); offset += PATCH_BLOCK_SIZE) {
+    blocks.emplace(blockHash(&base[offset]), offset);
+  }
+
+  std::vector<uint8_t> patch;
+  copies = 0;
+  inserts = 0;
+  size_t insertStart = 0;
+  size_t position = 0;
+  bool hashValid = false;
+  uint64_t hash = 0;
+  while (position + PATCH_BLOCK_SIZE <= target.size()) {
+    if (!hashValid) {
+      hash = blockHash(&target[position]);
+      hashValid = true;
+    }
+    auto block = blocks.find(hash);
+    if (block != blocks.end() && memcmp(&base[block->second], &target[position], PATCH_BLOCK_SIZE) == 0) {
+      size_t from = block->second;
+      size_t start = position;
+      while (start > insertStart && from > 0 && base[from - 1] == target[start - 1]) {
+        start--;
+        from--;
+      }
+      size_t length = position - start + PATCH_BLOCK_SIZE;
+      while (start + length < target.size() && from + length < base.size()
+             && base[from + length] == target[start + length]) {
+        length++;
+      }
+      inserts += start > insertStart;
+      appendInsert(patch, target, insertStart, start);
+      appendOp(patch, DELTA_OP_COPY, from, length);
+      copies++;
+      position = start + length;
+      insertStart = position;
+      hashValid = false;
+      continue;
+    }
+    if (position + PATCH_BLOCK_SIZE < target.size()) {
+      hash = (hash - target[position] * topPower) * PATCH_HASH_BASE + target[position + PATCH_BLOCK_SIZE];
+    }
+    position++;
+  }
+  inserts += target.size() > insertStart;
+  appendInsert(patch, target, insertStart, target.size());
+  return patch;
+}
+
+static bool readBase(void *arg, uint32_t offset, uint8_t *buffer, size_t length) {
+  const std::vector<uint8_t> &base = *(const std::vector<uint8_t> *) arg;
+  if (offset > base.size() || length > base.size() - offset) {
+    return false;
+  }
+  memcpy(buffer, &base[offset], length);
+  return true;
+}
+
+int makePatch(const char *kindName, const char *basePath, uint32_t baseVersion,
+              const char *targetPath, uint32_t targetVersion) {
+  uint8_t kind;
+  if (strcmp(kindName, "firmware") == 0) {
+    kind = UPDATE_FIRMWARE;
+  } else if (strcmp(kindName, "model") == 0) {
+    kind = UPDATE_MODEL;
+  } else {
+    printf("patch: The kind is firmware or model, not %s!\n", kindName);
+    return 2;
+  }
+  std::vector<uint8_t> base;
+  std::vector<uint8_t> target;
+  if (!readHostFile(basePath, base) || !readHostFile(targetPath, target)) {
+    return 1;
+  }
+
+  DeltaHeader header = {};
+  header.magic = DELTA_MAGIC;
+  header.kind = kind;
+  header.baseVersion = baseVersion;
+  header.baseSize = base.size();
+  header.baseCrc = crc32(base.data(), base.size());
+  header.targetVersion = targetVersion;
+  header.targetSize = target.size();
+  header.targetCrc = crc32(target.data(), target.size());
+  uint32_t copies;
+  uint32_t inserts;
+  std::vector<uint8_t> ops = diff(base, target, copies, inserts);
+
+  std::string name = std::string(kindName) + "_" + std::to_string(targetVersion) + ".delta";
+  FILE *output = fopen(name.c_str(), "wb");
+  if (!output || fwrite(&header, sizeof(header), 1, output) != 1
+      || (!ops.empty() && fwrite(ops.data(), ops.size(), 1, output) != 1)) {
+    printf("patch: Could not write %s!\n", name.c_str());
+    if (output) {
+      fclose(output);
+    }
+    return 1;
+  }
+  fclose(output);
+
+  // The same code as on the nodes has to get the target back
+  fs::FS card(".");
+  File patchFile = card.open(("/" + name).c_str(), FILE_READ);
+  File result = card.open("/patch_check.bin", FILE_WRITE);
+  bool applied = patchFile && result && applyDelta(patchFile, &readBase, &base, result);
+  patchFile.close();
+  result.close();
+  card.remove("/patch_check.bin");
+  if (!applied) {
+    printf("patch: %s does not give %s back!\n", name.c_str(), targetPath);
+    return 1;
+  }
+  printf("patch: Wrote %s, %zu of %zu bytes, %u copies and %u inserts.\n", name.c_str(),
+         sizeof(header) + ops.size(), target.size(), copies, inserts);
+  return 0;
+}
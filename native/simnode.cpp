@@ -0,0 +1,242 @@
+#include "simnode.h"
+
+#include <ftw.h>
+#include <sys/stat.h>
+#include "esp_camera.h"
+
+static SimNode *fusingGateway = NULL;   // detection events have no context
+
+static int removeEntry(const char *path, const struct stat *status, int flag, struct FTW *ftw) {
+  return remove(path);
+}
+
+bool removeTree(const char *path) {
+  struct stat status;
+  return stat(path, &status) != 0 || nftw(path, &removeEntry, 16, FTW_DEPTH | FTW_PHYS) == 0;
+}
+
+bool SimNode::begin(const char *cardRoot, int32_t clockOffset) {
+  if (!removeTree(cardRoot) || mkdir(cardRoot, 0777) != 0) {
+    Serial.printf("simNode: Could not clear %s!\n", cardRoot);
+    return false;
+  }
+  card.setRoot(cardRoot);
+  const char *directories[] = {PICTURES_PATH, SIM_REPORTS_PATH, SIM_ERROR_LOGS_PATH, SIM_EVENTS_PATH};
+  for (const char *directory : directories) {
+    card.mkdir(directory);
+  }
+
+  mesh.init(nodeId, clockOffset);
+  mesh.onNodeTimeAdjusted([this](int32_t offset) {
+    reportQueue.shiftTimes(offset);
+  });
+  gateways.begin(mesh, fallbackGateway);
+  mesh.onPackage(GATEWAY_ANNOUNCE_PACKAGE, [this](painlessmesh::protocol::Variant variant) {
+    gateways.onAnnounce(variant.to<GatewayAnnouncePackage>(), mesh.getNodeTime());
+    return true;
+  });
+  if (!reportQueue.begin(card) || !pictureStore.begin(card) || !reportLog.begin(card)
+      || !errorLog.begin(card) || !telemetry.begin(card)) {
+    Serial.printf("simNode: Node %u could not set up its card!\n", nodeId);
+    return false;
+  }
+  pictureStore.recover();
+  pictureIndex = pictureStore.nextPictureIndex();
+
+  if (isGateway()) {
+    fusion.begin(&onDetectionEvent);
+    eventLog.begin(card);
+    mesh.onPackage(PICTURE_REPORT_PACKAGE, [this](painlessmesh::protocol::Variant variant) {
+      receiveReport(variant.to<PictureReportPackage>());
+      return true;
+    });
+    mesh.onPackage(PICTURE_REPORT_BATCH_PACKAGE, [this](painlessmesh::protocol::Variant variant) {
+      auto batch = variant.to<PictureReportBatchPackage>();
+      for (uint8_t i = 0; i < batch.count; i++) {
+        receiveReport(batch.get(i));
+      }
+      return true;
+    });
+    mesh.onPackage(COMPACT_REPORT_PACKAGE, [this](painlessmesh::protocol::Variant variant) {
+      auto compactBatch = variant.to<CompactReportPackage>();
+      PictureReportBatchPackage batch;
+      if (!compactBatch.decode(batch)) {
+        Serial.printf("simNode: Malformed compact reports from node %u!\n", compactBatch.from);
+        return true;
+      }
+      for (uint8_t i = 0; i < batch.count; i++) {
+        receiveReport(batch.get(i));
+      }
+      return true;
+    });
+  }
+  return true;
+}
+
+void SimNode::end() {
+  reportQueue.flushCoalesced(true);
+  flushLogs();
+  mesh.stop();
+}
+
+// captureStage() to enqueueStage() of main.cpp, single-buffered
+bool SimNode::capture(float deerProbability) {
+  stats.captures++;
+  uint32_t startCycles = Telemetry::startTimer();
+  camera_fb_t *frameBuffer = esp_camera_fb_get();
+  telemetry.stopTimer(TIMER_CAPTURE, startCycles);
+  if (!frameBuffer) {
+    Serial.printf("simNode: Camera capture of node %u failed!\n", nodeId);
+    return false;
+  }
+  report.captureTime = mesh.getNodeTime();
+
+  report.from = nodeId;
+  report.dest = fallbackGateway;
+  report.pictureIndex = pictureIndex++;
+  report.pictureCount = 1;
+  startCycles = Telemetry::startTimer();
+  bool persisted = pictureStore.save(report, frameBuffer->buf, frameBuffer->len, picturePath, SIM_PATH_SIZE);
+  telemetry.stopTimer(TIMER_SD_WRITE, startCycles);
+  if (persisted) {
+    telemetry.count(COUNTER_SD_BYTES, frameBuffer->len);
+    stats.saved++;
+  }
+
+  startCycles = Telemetry::startTimer();
+  report.deerProbability = deerProbability;
+  telemetry.stopTimer(TIMER_INFERENCE, startCycles);
+
+  if (persisted) {
+    pictureStore.addToIndex(report, frameBuffer->len);
+  }
+  reportLog.append(report.pictureIndex,
+                   "{\"picture\":\"%s\",\"from\":%u,\"dest\":%u,\"pictureIndex\":%lu,\"deerProbability\":%.2f}",
+                   picturePath, report.from, report.dest, report.pictureIndex, report.deerProbability);
+  esp_camera_fb_return(frameBuffer);
+  if (report.deerProbability < SIM_PROBABILITY_THRESHOLD) {
+    return true;
+  }
+
+  if (reportQueue.isFull()) {
+    PictureReportPackage droppedReport;
+    if (!reportQueue.evict(report, droppedReport)) {
+      droppedReport = report;
+    }
+    stats.dropped++;
+    telemetry.count(COUNTER_DROPS);
+    errorLog.append(droppedReport.pictureIndex,
+                    "{\"error\":\"dropped\",\"from\":%u,\"pictureIndex\":%lu,\"pictureCount\":%u,\"deerProbability\":%.2f}",
+                    droppedReport.from, droppedReport.pictureIndex, droppedReport.pictureCount,
+                    droppedReport.deerProbability);
+    if (droppedReport.pictureIndex == report.pictureIndex) {
+      return true;
+    }
+  }
+  report.enqueueTime = mesh.getNodeTime();
+  if (!reportQueue.push(report)) {
+    return false;
+  }
+  stats.enqueued++;
+  return true;
+}
+
+// sendReport() of main.cpp, always with compact reports
+unsigned long SimNode::sendReports() {
+  reportQueue.flushCoalesced();
+  PictureReportPackage reports[REPORT_BATCH_SIZE];
+  uint16_t reportCount = reportQueue.peekBest(reports, REPORT_BATCH_SIZE);
+  if (reportCount == 0) {
+    return SIM_SEND_INTERVAL_IDLE;
+  }
+
+  uint32_t destination = isGateway() ? nodeId : gateways.choose();
+  PictureReportBatchPackage batch;
+  batch.from = reports[0].from;
+  batch.dest = destination;
+  batch.sendTime = max(mesh.getNodeTime(), (uint32_t) 1);
+  reports[0].sendTime = batch.sendTime;
+  for (uint16_t i = 0; i < reportCount; i++) {
+    reports[i].dest = destination;
+    batch.add(reports[i]);
+  }
+
+  CompactReportPackage compactBatch;
+  uint32_t startCycles = Telemetry::startTimer();
+  bool encoded = compactBatch.encode(batch);
+  telemetry.stopTimer(TIMER_SERIALIZE, startCycles);
+  startCycles = Telemetry::startTimer();
+  bool sent;
+  if (destination == nodeId) {
+    for (uint16_t i = 0; i < reportCount; i++) {
+      receiveReport(reports[i]);
+    }
+    sent = true;
+  } else {
+    sent = encoded && mesh.sendPackage(&compactBatch);
+  }
+  telemetry.stopTimer(TIMER_SEND, startCycles);
+  telemetry.count(sent ? COUNTER_REPORTS_SENT : COUNTER_SEND_FAILURES, sent ? reportCount : 1);
+  gateways.reportOutcome(destination, sent);
+
+  if (!sent && gateways.choose() != destination) {
+    stats.sendFailures++;
+    stats.failovers++;
+    return SIM_SEND_INTERVAL_DRAIN;
+  }
+  if (!sent) {
+    stats.sendFailures++;
+    sendBackoff = sendBackoff ? min<unsigned long>(sendBackoff * 2, SIM_SEND_BACKOFF_MAX) : SIM_SEND_BACKOFF_MIN;
+    return sendBackoff;
+  }
+  reportQueue.dropPeeked();
+  stats.batchesSent++;
+  stats.reportsSent += reportCount;
+  sendBackoff = 0;
+  return reportQueue.isEmpty() ? SIM_SEND_INTERVAL_IDLE : SIM_SEND_INTERVAL_DRAIN;
+}
+
+void SimNode::announce() {
+  GatewayAnnouncePackage package;
+  package.from = nodeId;
+  package.sendTime = mesh.getNodeTime();
+  package.flags = GATEWAY_COMPACT_REPORTS;
+  mesh.sendPackage(&package);
+}
+
+void SimNode::update() {
+  mesh.update();
+  if (isGateway()) {
+    fusingGateway = this;
+    fusion.update(mesh.getNodeTime());
+  }
+}
+
+void SimNode::flushLogs() {
+  reportLog.flush();
+  errorLog.flush();
+  eventLog.flush();
+}
+
+void SimNode::receiveReport(const PictureReportPackage &package) {
+  fusingGateway = this;
+  if (!fusion.addReport(package, mesh.getNodeTime())) {
+    stats.duplicates++;
+    return;
+  }
+  stats.reportsReceived++;
+  latency.add(package, mesh.getNodeTime());
+}
+
+void SimNode::onDetectionEvent(const DetectionEvent &event) {
+  fusingGateway->stats.events++;
+  Serial.printf("fusion: Event %u, %u report(s) from %u node(s) in %.1f s, best picture %u_%lu (%.2f).\n",
+                event.eventId, event.reportCount, event.nodeCount,
+                (event.lastSeen - event.firstSeen) / 1000000.0, event.bestNode % 1000,
+                event.bestPictureIndex, event.bestProbability);
+  fusingGateway->eventLog.append(event.eventId,
+                                 "{\"event\":%u,\"firstSeen\":%u,\"lastSeen\":%u,\"reports\":%u,\"nodes\":%u,"
+                                 "\"bestNode\":%u,\"bestPicture\":%lu,\"deerProbability\":%.2f}",
+                                 event.eventId, event.firstSeen, event.lastSeen, event.reportCount, event.nodeCount,
+                                 event.bestNode, event.bestPictureIndex, event.bestProbability);
+}
@@ -0,0 +1,107 @@
+/****************************************************
+ * A camera node on the host.                       *
+ * Captures run through the same stages as the      *
+ * capture pipeline in main.cpp, capture -> persist *
+ * -> classify -> enqueue, on a card of its own,    *
+ * and sendReports() is one run of taskSendReport.  *
+ * There is no model on the host, the detector      *
+ * result of a capture is handed in. Gateways       *
+ * announce themselves, fuse and time the reports.  *
+ ****************************************************/
+
+#ifndef SIMNODE_H
+#define SIMNODE_H
+
+#include <Arduino.h>
+#include <painlessMesh.h>
+#include "FS.h"
+#include "detectionfusion.h"
+#include "gatewaytable.h"
+#include "latencystats.h"
+#include "packages.h"
+#include "picturestore.h"
+#include "reportqueue.h"
+#include "segmentlog.h"
+#include "telemetry.h"
+
+// Same as in main.cpp
+#define   SIM_REPORTS_PATH            "/reports"
+#define   SIM_ERROR_LOGS_PATH         "/errorLogs"
+#define   SIM_EVENTS_PATH             "/events"
+#define   SIM_PROBABILITY_THRESHOLD   0.5
+#define   SIM_SEND_INTERVAL_DRAIN     100       // ms
+#define   SIM_SEND_INTERVAL_IDLE      5000
+#define   SIM_SEND_BACKOFF_MIN        2000
+#define   SIM_SEND_BACKOFF_MAX        300000
+#define   SIM_PATH_SIZE               48
+
+struct SimNodeStats {
+  uint32_t captures;
+  uint32_t saved;
+  uint32_t enqueued;
+  uint32_t dropped;
+  uint32_t batchesSent;
+  uint32_t reportsSent;
+  uint32_t sendFailures;
+  uint32_t failovers;           // failures that went on to another gateway
+  uint32_t reportsReceived;     // gateways only
+  uint32_t duplicates;
+  uint32_t events;
+};
+
+class SimNode {
+ public:
+  // The fallback gateway is a gateway itself
+  SimNode(uint32_t nodeId, uint32_t fallbackGateway)
+      : nodeId(nodeId), fallbackGateway(fallbackGateway), gateway(nodeId == fallbackGateway) {}
+  void makeGateway() { gateway = true; }    // before begin()
+
+  // Starts on an empty card in cardRoot
+  bool begin(const char *cardRoot, int32_t clockOffset = 0);
+  void end();
+
+  // One frame on which the detector finds a deer with deerProbability
+  bool capture(float deerProbability);
+  // One run of taskSendReport, returns the ms until the next one
+  unsigned long sendReports();
+  // One run of taskAnnounceGateway, gateways only
+  void announce();
+  // Delivers arrived packages and emits detection events
+  void update();
+  void flushLogs();
+  // The logged report about a picture, see SegmentLog::find()
+  bool findReport(uint32_t pictureIndex, char *record, size_t size) { return reportLog.find(pictureIndex, record, size); }
+
+  uint32_t getNodeId() const { return nodeId; }
+  bool isGateway() const { return gateway; }
+
+  painlessMesh mesh;
+  PersistentReportQueue reportQueue;
+  Telemetry telemetry;
+  DetectionFusion fusion;
+  LatencyStats latency;
+  GatewayTable gateways;
+  SimNodeStats stats = {};
+
+ private:
+  uint32_t nodeId;
+  uint32_t fallbackGateway;
+  bool gateway;
+  fs::FS card;
+  PictureStore pictureStore;
+  SegmentLog reportLog{SIM_REPORTS_PATH};
+  SegmentLog errorLog{SIM_ERROR_LOGS_PATH};
+  SegmentLog eventLog{SIM_EVENTS_PATH};
+  unsigned long pictureIndex = 0;
+  unsigned long sendBackoff = 0;
+  PictureReportPackage report;
+  char picturePath[SIM_PATH_SIZE];
+
+  void receiveReport(const PictureReportPackage &package);
+  static void onDetectionEvent(const DetectionEvent &event);
+};
+
+// Deletes a card of an earlier run
+bool removeTree(const char *path);
+
+#endif
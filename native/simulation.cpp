@@ -0,0 +1,293 @@
+#include "harness.h"
+
+#include <memory>
+#include <string>
+#include <vector>
+#include <sys/stat.h>
+#include "esp_camera.h"
+#include "simnode.h"
+
+// Same as in main.cpp
+#define   SIM_BURST_COUNT       3       // PIR_BURST_COUNT
+#define   SIM_BURST_INTERVAL    500     // ms, PIR_BURST_INTERVAL
+#define   SIM_DEBOUNCE          2000    // ms, PIR_DEBOUNCE_MS
+#define   SIM_FUSION_INTERVAL   1000    // ms, FUSION_CHECK_INTERVAL
+#define   SIM_ANNOUNCE_INTERVAL GATEWAY_ANNOUNCE_INTERVAL
+
+#define   SIM_TICK              10      // ms
+#define   SIM_MAX_NODES         16
+#define   SIM_MAX_DRAIN         3600000   // ms after the trace until the simulation gives up
+#define   SIM_LINE_SIZE         128
+
+struct MotionEvent {
+  unsigned long time;     // ms
+  uint32_t nodeId;
+  float deerProbability;
+};
+
+struct SyncEvent {
+  unsigned long time;
+  uint32_t nodeId;
+};
+
+struct DownEvent {
+  unsigned long time;
+  uint32_t nodeId;
+};
+
+// The node keeps capturing while it is off the mesh
+struct LinkEvent {
+  unsigned long time;
+  uint32_t nodeId;
+  bool online;
+};
+
+struct SimNodeState {
+  std::unique_ptr<SimNode> node;
+  unsigned long nextSend = 0;
+  unsigned long nextAnnounce = 0;
+  bool down = false;
+  unsigned long lastMotion = 0;
+  bool moved = false;
+  unsigned long nextCapture = 0;
+  uint8_t burstLeft = 0;
+  float burstProbability = 0;
+  int32_t clockOffset = 0;
+};
+
+struct Trace {
+  std::vector<SimNodeState> nodes;
+  std::vector<MotionEvent> motions;
+  std::vector<SyncEvent> syncs;
+  std::vector<DownEvent> downs;
+  std::vector<LinkEvent> links;
+  std::vector<std::pair<uint32_t, uint32_t>> neighbors;
+};
+
+static SimNodeState *findNode(Trace &trace, uint32_t nodeId) {
+  for (SimNodeState &state : trace.nodes) {
+    if (state.node->getNodeId() == nodeId) {
+      return &state;
+    }
+  }
+  return NULL;
+}
+
+static bool addNode(Trace &trace, uint32_t nodeId, int32_t clockOffset) {
+  if (findNode(trace, nodeId)) {
+    return true;
+  }
+  if (trace.nodes.size() >= SIM_MAX_NODES) {
+    printf("sim: More than %u nodes!\n", SIM_MAX_NODES);
+    return false;
+  }
+  SimNodeState state;
+  state.node.reset(new SimNode(nodeId, HARNESS_DEST_NODE));
+  state.clockOffset = clockOffset;
+  trace.nodes.push_back(std::move(state));
+  return true;
+}
+
+static bool readTrace(const char *path, Trace &trace) {
+  FILE *file = fopen(path, "r");
+  if (!file) {
+    printf("sim: Could not open %s!\n", path);
+    return false;
+  }
+  addNode(trace, HARNESS_DEST_NODE, 0);
+
+  char line[SIM_LINE_SIZE];
+  bool success = true;
+  for (int lineNumber = 1; success && fgets(line, sizeof(line), file); lineNumber++) {
+    unsigned long time;
+    unsigned int nodeA, nodeB, count;
+    int offset = 0;
+    float deerProbability;
+    if (line[0] == '#' || line[0] == '\n' || line[0] == '\r') {
+      continue;
+    }
+    if (sscanf(line, "motion,%lu,%u,%f", &time, &nodeA, &deerProbability) == 3) {
+      success = addNode(trace, nodeA, 0);
+      trace.motions.push_back({time, nodeA, deerProbability});
+    } else if (sscanf(line, "node,%u,%d", &nodeA, &offset) >= 1) {
+      success = addNode(trace, nodeA, offset);
+    } else if (sscanf(line, "hops,%u,%u,%u", &nodeA, &nodeB, &count) == 3) {
+      SimNetwork::setHops(nodeA, nodeB, count);
+    } else if (sscanf(line, "neighbors,%u,%u", &nodeA, &nodeB) == 2) {
+      trace.neighbors.push_back({nodeA, nodeB});
+    } else if (sscanf(line, "sync,%lu,%u", &time, &nodeA) == 2) {
+      trace.syncs.push_back({time, nodeA});
+    } else if (sscanf(line, "gateway,%u", &nodeA) == 1) {
+      success = addNode(trace, nodeA, 0);
+      if (success) {
+        findNode(trace, nodeA)->node->makeGateway();
+      }
+    } else if (sscanf(line, "down,%lu,%u", &time, &nodeA) == 2) {
+      trace.downs.push_back({time, nodeA});
+    } else if (sscanf(line, "offline,%lu,%u", &time, &nodeA) == 2) {
+      trace.links.push_back({time, nodeA, false});
+    } else if (sscanf(line, "online,%lu,%u", &time, &nodeA) == 2) {
+      trace.links.push_back({time, nodeA, true});
+    } else {
+      printf("sim: Line %d of %s is not understood: %s", lineNumber, path, line);
+      success = false;
+    }
+  }
+  fclose(file);
+  return success;
+}
+
+// A PIR edge starts a burst unless it belongs to the movement before
+static void handleMotion(SimNodeState &state, const MotionEvent &motion) {
+  if (state.moved && motion.time - state.lastMotion < SIM_DEBOUNCE) {
+    return;
+  }
+  state.moved = true;
+  state.lastMotion = motion.time;
+  if (state.burstLeft == 0) {
+    state.nextCapture = motion.time;
+  }
+  state.burstLeft = SIM_BURST_COUNT;
+  state.burstProbability = motion.deerProbability;
+}
+
+static bool isDrained(Trace &trace) {
+  for (SimNodeState &state : trace.nodes) {
+    if (!state.down && (state.burstLeft > 0 || !state.node->reportQueue.isEmpty())) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static void printSummary(Trace &trace, unsigned long endTime, float lossRate, uint32_t hopLatency) {
+  printf("sim: %u node(s), %lu ms simulated, loss rate %.2f per hop, %u ms per hop.\n",
+         (unsigned) trace.nodes.size(), endTime, lossRate, hopLatency / 1000);
+  for (SimNodeState &state : trace.nodes) {
+    SimNode &node = *state.node;
+    if (node.isGateway()) {
+      continue;
+    }
+    printf("sim: Node %u, %u capture(s), %u with a deer, coalesced into %u report(s) sent in %u batch(es), "
+           "%u dropped, %u failover(s), %llu bytes in %u package(s) on the air, %u lost.\n",
+           node.getNodeId(), node.stats.captures, node.stats.enqueued, node.stats.reportsSent,
+           node.stats.batchesSent, node.stats.dropped, node.stats.failovers,
+           (unsigned long long) node.mesh.sentBytes, node.mesh.sentPackages, node.mesh.lostPackages);
+  }
+  for (SimNodeState &state : trace.nodes) {
+    SimNode &node = *state.node;
+    if (!node.isGateway()) {
+      continue;
+    }
+    printf("sim: Gateway %u%s received %u report(s), %u of them again, fused into %u event(s).\n",
+           node.getNodeId(), state.down ? " (down)" : "", node.stats.reportsReceived,
+           node.stats.duplicates, node.stats.events);
+    node.latency.print();
+  }
+}
+
+int runSimulation(const char *tracePath, float lossRate, uint32_t hopLatency) {
+  Trace trace;
+  SimNetwork::lossRate = lossRate;
+  SimNetwork::hopLatency = hopLatency;
+  if (!readTrace(tracePath, trace)) {
+    return 1;
+  }
+
+  camera_config_t config = {PIXFORMAT_JPEG, FRAMESIZE_SVGA, 12, 1, CAMERA_FB_IN_PSRAM, CAMERA_GRAB_WHEN_EMPTY};
+  mkdir(HARNESS_CARD_ROOT, 0777);
+  if (esp_camera_init(&config) != ESP_OK) {
+    printf("sim: Camera init failed!\n");
+    return 1;
+  }
+  for (SimNodeState &state : trace.nodes) {
+    char cardRoot[SIM_LINE_SIZE];
+    snprintf(cardRoot, sizeof(cardRoot), "%s/node%u", HARNESS_CARD_ROOT, state.node->getNodeId());
+    if (!state.node->begin(cardRoot, state.clockOffset)) {
+      return 1;
+    }
+    if (state.node->isGateway()) {
+      for (auto &pair : trace.neighbors) {
+        state.node->fusion.addNeighbors(pair.first, pair.second);
+      }
+    }
+  }
+
+  unsigned long traceEnd = 0;
+  for (const MotionEvent &motion : trace.motions) {
+    traceEnd = max(traceEnd, motion.time);
+  }
+  // The fusion emits the last event FUSION_WINDOW after its last report
+  unsigned long quietUntil = 0;
+  size_t nextMotion = 0;
+  size_t nextSync = 0;
+  size_t nextDown = 0;
+  size_t nextLink = 0;
+  unsigned long now = 0;
+  for (; now <= traceEnd + SIM_MAX_DRAIN; now += SIM_TICK) {
+    for (; nextMotion < trace.motions.size() && trace.motions[nextMotion].time <= now; nextMotion++) {
+      SimNodeState *state = findNode(trace, trace.motions[nextMotion].nodeId);
+      handleMotion(*state, trace.motions[nextMotion]);
+    }
+    for (; nextSync < trace.syncs.size() && trace.syncs[nextSync].time <= now; nextSync++) {
+      SimNodeState *state = findNode(trace, trace.syncs[nextSync].nodeId);
+      if (state) {
+        state->node->mesh.adjustTime(-state->clockOffset);
+        state->clockOffset = 0;
+      }
+    }
+    for (; nextDown < trace.downs.size() && trace.downs[nextDown].time <= now; nextDown++) {
+      SimNodeState *state = findNode(trace, trace.downs[nextDown].nodeId);
+      if (state && !state->down) {
+        state->node->mesh.stop();
+        state->down = true;
+      }
+    }
+    for (; nextLink < trace.links.size() && trace.links[nextLink].time <= now; nextLink++) {
+      SimNodeState *state = findNode(trace, trace.links[nextLink].nodeId);
+      if (state && !state->down && trace.links[nextLink].online) {
+        state->node->mesh.rejoin();
+      } else if (state && !state->down) {
+        state->node->mesh.stop();
+      }
+    }
+
+    for (SimNodeState &state : trace.nodes) {
+      SimNode &node = *state.node;
+      if (state.down) {
+        continue;
+      }
+      if (node.isGateway() && now >= state.nextAnnounce) {
+        node.announce();
+        state.nextAnnounce = now + SIM_ANNOUNCE_INTERVAL;
+      }
+      if (state.burstLeft > 0 && now >= state.nextCapture) {
+        node.capture(state.burstProbability);
+        state.burstLeft--;
+        state.nextCapture = now + SIM_BURST_INTERVAL;
+      }
+      if (now >= state.nextSend) {
+        state.nextSend = now + node.sendReports();
+      }
+      if (node.isGateway() && now % SIM_FUSION_INTERVAL == 0) {
+        node.update();
+      } else {
+        node.mesh.update();
+      }
+    }
+
+    if (now < traceEnd || !isDrained(trace)) {
+      quietUntil = now + FUSION_WINDOW / 1000 + 2 * SIM_FUSION_INTERVAL;
+    } else if (now >= quietUntil) {
+      break;
+    }
+    delay(SIM_TICK);
+  }
+
+  for (SimNodeState &state : trace.nodes) {
+    state.node->end();
+  }
+  esp_camera_deinit();
+  printSummary(trace, now, lossRate, hopLatency);
+  return 0;
+}
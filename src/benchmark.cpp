@@ -0,0 +1,337 @@
+#include "benchmark.h"
+
+#include "esp_camera.h"
+#include "esp_heap_caps.h"
+#include "inference.h"
+
+#define   BENCH_NAME_SIZE   48
+
+struct BenchFrameSize {
+  framesize_t frameSize;
+  const char *name;
+};
+
+// what initializeCamera() chooses from for the archive stream
+static const BenchFrameSize archiveFrameSizes[] = {
+  {FRAMESIZE_QVGA, "QVGA"},
+  {FRAMESIZE_CIF, "CIF"},
+  {FRAMESIZE_VGA, "VGA"},
+  {FRAMESIZE_SVGA, "SVGA"},
+  {FRAMESIZE_XGA, "XGA"},
+  {FRAMESIZE_SXGA, "SXGA"},
+  {FRAMESIZE_UXGA, "UXGA"}
+};
+static const int jpegQualities[] = {10, 12, 15, 20};
+
+// and for the detector stream
+static const BenchFrameSize detectorFrameSizes[] = {
+  {FRAMESIZE_96X96, "96X96"},
+  {FRAMESIZE_QQVGA, "QQVGA"},
+  {FRAMESIZE_QVGA, "QVGA"}
+};
+
+static const size_t sdBlockSizes[] = {512, 1024, 4096, 8192, 16384, BENCH_SD_MAX_BLOCK};
+static const uint16_t pingPaddings[] = {0, 256, BENCHMARK_MAX_PADDING};
+
+void printBenchResult(const char *name, double value, const char *unit) {
+  Serial.printf("bench: %-40s %12.2f %s\n", name, value, unit);
+}
+
+/*  CAMERA  */
+// Times BENCH_CAMERA_FRAMES frames with the settings the sensor has now
+static bool timeFrames(const char *setting) {
+  for (int i = 0; i < BENCH_STALE_FRAMES; i++) {
+    camera_fb_t *staleFrame = esp_camera_fb_get();
+    if (staleFrame) {
+      esp_camera_fb_return(staleFrame);
+    }
+  }
+
+  unsigned long sumMicros = 0;
+  unsigned long maxMicros = 0;
+  size_t sumBytes = 0;
+  for (int i = 0; i < BENCH_CAMERA_FRAMES; i++) {
+    unsigned long startMicros = micros();
+    camera_fb_t *frameBuffer = esp_camera_fb_get();
+    unsigned long frameMicros = micros() - startMicros;
+    if (!frameBuffer) {
+      Serial.printf("bench: camera.%s failed\n", setting);
+      return false;
+    }
+    sumBytes += frameBuffer->len;
+    esp_camera_fb_return(frameBuffer);
+    sumMicros += frameMicros;
+    maxMicros = max(maxMicros, frameMicros);
+  }
+
+  char name[BENCH_NAME_SIZE];
+  snprintf(name, sizeof(name), "camera.%s.fb_get_average", setting);
+  printBenchResult(name, (double) sumMicros / BENCH_CAMERA_FRAMES, "us");
+  snprintf(name, sizeof(name), "camera.%s.fb_get_max", setting);
+  printBenchResult(name, maxMicros, "us");
+  snprintf(name, sizeof(name), "camera.%s.frame_bytes", setting);
+  printBenchResult(name, (double) sumBytes / BENCH_CAMERA_FRAMES, "bytes");
+  return true;
+}
+
+// A setting the buffers are too small for fails on its own, the others still run
+bool benchmarkCamera() {
+  sensor_t *sensor = esp_camera_sensor_get();
+  if (!sensor) {
+    Serial.println("bench: Camera is not initialized!");
+    return false;
+  }
+
+  char setting[BENCH_NAME_SIZE];
+  sensor->set_pixformat(sensor, PIXFORMAT_JPEG);
+  for (const BenchFrameSize &frameSize : archiveFrameSizes) {
+    for (int quality : jpegQualities) {
+      snprintf(setting, sizeof(setting), "%s.q%d", frameSize.name, quality);
+      if (sensor->set_framesize(sensor, frameSize.frameSize) != 0 || sensor->set_quality(sensor, quality) != 0) {
+        Serial.printf("bench: camera.%s failed\n", setting);
+        continue;
+      }
+      timeFrames(setting);
+    }
+  }
+
+  const pixformat_t rawFormats[] = {PIXFORMAT_GRAYSCALE, PIXFORMAT_RGB565};
+  const char *rawFormatNames[] = {"gray", "rgb565"};
+  for (int format = 0; format < 2; format++) {
+    for (const BenchFrameSize &frameSize : detectorFrameSizes) {
+      snprintf(setting, sizeof(setting), "%s.%s", frameSize.name, rawFormatNames[format]);
+      if (sensor->set_pixformat(sensor, rawFormats[format]) != 0
+          || sensor->set_framesize(sensor, frameSize.frameSize) != 0) {
+        Serial.printf("bench: camera.%s failed\n", setting);
+        continue;
+      }
+      timeFrames(setting);
+    }
+  }
+
+  // Back to what initializeCamera() would have left
+  sensor->set_pixformat(sensor, PIXFORMAT_JPEG);
+  sensor->set_framesize(sensor, FRAMESIZE_SVGA);
+  sensor->set_quality(sensor, 12);
+  return true;
+}
+/*  END OF CAMERA  */
+
+/*  SD CARD  */
+static bool timeBlockSize(fs::FS &fs, uint8_t *block, size_t blockSize) {
+  char name[BENCH_NAME_SIZE];
+  File file = fs.open(BENCH_SD_PATH, FILE_WRITE);
+  if (!file) {
+    Serial.printf("bench: Could not open %s!\n", BENCH_SD_PATH);
+    return false;
+  }
+  unsigned long startMicros = micros();
+  size_t written = 0;
+  while (written < BENCH_SD_TOTAL && file.write(block, blockSize) == blockSize) {
+    written += blockSize;
+  }
+  file.close();     // the last blocks only reach the card here
+  unsigned long writeMicros = micros() - startMicros;
+  if (written < BENCH_SD_TOTAL) {
+    Serial.printf("bench: sd.write.%u failed after %u bytes\n", (unsigned) blockSize, (unsigned) written);
+    return false;
+  }
+
+  file = fs.open(BENCH_SD_PATH, FILE_READ);
+  startMicros = micros();
+  size_t read = 0;
+  while (read < BENCH_SD_TOTAL && file.read(block, blockSize) == blockSize) {
+    read += blockSize;
+  }
+  unsigned long readMicros = micros() - startMicros;
+  file.close();
+
+  snprintf(name, sizeof(name), "sd.write.%u", (unsigned) blockSize);
+  printBenchResult(name, BENCH_SD_TOTAL / 1024.0 / (writeMicros / 1000000.0), "KB/s");
+  snprintf(name, sizeof(name), "sd.read.%u", (unsigned) blockSize);
+  printBenchResult(name, read / 1024.0 / (readMicros / 1000000.0), "KB/s");
+  return true;
+}
+
+bool benchmarkStorage(fs::FS &fs) {
+  uint8_t *block = (uint8_t *) heap_caps_malloc(BENCH_SD_MAX_BLOCK, MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+  if (!block) {
+    Serial.println("bench: No memory for the sd card blocks!");
+    return false;
+  }
+  for (size_t i = 0; i < BENCH_SD_MAX_BLOCK; i++) {
+    block[i] = i * 31;
+  }
+
+  bool success = true;
+  for (size_t blockSize : sdBlockSizes) {
+    success = timeBlockSize(fs, block, blockSize) && success;
+  }
+  heap_caps_free(block);
+  fs.remove(BENCH_SD_PATH);
+  return success;
+}
+/*  END OF SD CARD  */
+
+/*  INFERENCE  */
+static bool timeDetector(const char *setting) {
+  unsigned long sumPreprocess = 0;
+  unsigned long sumInvoke = 0;
+  unsigned long sumTotal = 0;
+  for (int i = 0; i < BENCH_INFERENCE_RUNS; i++) {
+    camera_fb_t *frameBuffer = esp_camera_fb_get();
+    float deerProbability;
+    unsigned long startMicros = micros();
+    bool classified = detectDeer(frameBuffer, deerProbability);
+    sumTotal += micros() - startMicros;
+    if (frameBuffer) {
+      esp_camera_fb_return(frameBuffer);
+    }
+    if (!classified) {
+      Serial.printf("bench: inference.%s failed\n", setting);
+      return false;
+    }
+    sumPreprocess += getDetectorStats().lastPreprocessMicros;
+    sumInvoke += getDetectorStats().lastInvokeMicros;
+  }
+
+  char name[BENCH_NAME_SIZE];
+  snprintf(name, sizeof(name), "inference.%s.preprocess_average", setting);
+  printBenchResult(name, (double) sumPreprocess / BENCH_INFERENCE_RUNS, "us");
+  snprintf(name, sizeof(name), "inference.%s.invoke_average", setting);
+  printBenchResult(name, (double) sumInvoke / BENCH_INFERENCE_RUNS, "us");
+  snprintf(name, sizeof(name), "inference.%s.total_average", setting);
+  printBenchResult(name, (double) sumTotal / BENCH_INFERENCE_RUNS, "us");
+  return true;
+}
+
+// On a detector frame and on the archive frames of both settings initializeCamera() chooses from
+bool benchmarkInference(fs::FS &fs) {
+  if (!initializeDetector(fs)) {
+    Serial.println("bench: No model, skipping inference.");
+    return false;
+  }
+  sensor_t *sensor = esp_camera_sensor_get();
+  if (!sensor) {
+    return false;
+  }
+
+  sensor->set_pixformat(sensor, PIXFORMAT_GRAYSCALE);
+  sensor->set_framesize(sensor, FRAMESIZE_QQVGA);
+  bool success = timeDetector("QQVGA.gray");
+  sensor->set_pixformat(sensor, PIXFORMAT_JPEG);
+  sensor->set_framesize(sensor, FRAMESIZE_SVGA);
+  sensor->set_quality(sensor, 12);
+  success = timeDetector("SVGA.q12") && success;
+  sensor->set_framesize(sensor, FRAMESIZE_UXGA);
+  sensor->set_quality(sensor, 10);
+  success = timeDetector("UXGA.q10") && success;
+
+  const DetectorStats &stats = getDetectorStats();
+  printBenchResult("inference.invoke_max", stats.maxInvokeMicros, "us");
+  printBenchResult("inference.arena_high_water_mark", stats.arenaHighWaterMark, "bytes");
+  sensor->set_framesize(sensor, FRAMESIZE_SVGA);
+  sensor->set_quality(sensor, 12);
+  return success;
+}
+/*  END OF INFERENCE  */
+
+/*  MESH  */
+void MeshBenchmark::begin(painlessMesh &mesh, uint32_t preferredPeer) {
+  this->mesh = &mesh;
+  this->preferredPeer = preferredPeer;
+  peer = 0;
+  startMillis = millis();
+  payloadStep = 0;
+  sent = 0;
+  received = 0;
+  failed = 0;
+  roundTripSum = 0;
+  roundTripMax = 0;
+  sendCallSum = 0;
+}
+
+// Any node will do once the preferred one has not shown up for a while
+bool MeshBenchmark::findPeer() {
+  std::list<uint32_t> nodes = mesh->getNodeList();
+  for (uint32_t node : nodes) {
+    if (node == preferredPeer) {
+      peer = node;
+      return true;
+    }
+  }
+  if (!nodes.empty() && millis() - startMillis >= BENCH_PEER_WAIT / 4) {
+    peer = nodes.front();
+  }
+  return peer != 0;
+}
+
+void MeshBenchmark::printResults() {
+  char name[BENCH_NAME_SIZE];
+  uint16_t padding = pingPaddings[payloadStep];
+  snprintf(name, sizeof(name), "mesh.%u.round_trip_average", padding);
+  printBenchResult(name, received ? (double) roundTripSum / received : 0, "us");
+  snprintf(name, sizeof(name), "mesh.%u.round_trip_max", padding);
+  printBenchResult(name, roundTripMax, "us");
+  snprintf(name, sizeof(name), "mesh.%u.send_call_average", padding);
+  printBenchResult(name, sent ? (double) sendCallSum / sent : 0, "us");
+  snprintf(name, sizeof(name), "mesh.%u.lost", padding);
+  printBenchResult(name, sent - received - failed, "pings");
+  snprintf(name, sizeof(name), "mesh.%u.send_failures", padding);
+  printBenchResult(name, failed, "pings");
+}
+
+bool MeshBenchmark::step() {
+  if (payloadStep >= sizeof(pingPaddings) / sizeof(pingPaddings[0])) {
+    return false;
+  }
+  if (!peer && !findPeer()) {
+    if (millis() - startMillis < BENCH_PEER_WAIT) {
+      return true;
+    }
+    Serial.println("bench: No other node in the mesh, skipping the round trips.");
+    payloadStep = sizeof(pingPaddings) / sizeof(pingPaddings[0]);
+    return false;
+  }
+
+  // The last pings of a payload size get BENCH_PING_TIMEOUT to come back
+  if (sent >= BENCH_PING_COUNT) {
+    if (received + failed < sent && micros() - lastSendMicros < BENCH_PING_TIMEOUT) {
+      return true;
+    }
+    printResults();
+    payloadStep++;
+    sent = received = failed = 0;
+    roundTripSum = sendCallSum = 0;
+    roundTripMax = 0;
+    return payloadStep < sizeof(pingPaddings) / sizeof(pingPaddings[0]);
+  }
+
+  BenchmarkPackage ping;
+  ping.from = mesh->getNodeId();
+  ping.dest = peer;
+  ping.sequence = payloadStep * BENCH_PING_COUNT + sent;
+  memset(ping.padding, 'x', pingPaddings[payloadStep]);
+  ping.padding[pingPaddings[payloadStep]] = '\0';
+  ping.sendMicros = micros();
+  bool success = mesh->sendPackage(&ping);
+  lastSendMicros = micros();
+  sendCallSum += lastSendMicros - ping.sendMicros;
+  sent++;
+  if (!success) {
+    failed++;
+  }
+  return true;
+}
+
+// Late echoes of an earlier payload size are ignored
+void MeshBenchmark::onEcho(const BenchmarkPackage &package) {
+  if (package.sequence / BENCH_PING_COUNT != payloadStep) {
+    return;
+  }
+  uint32_t roundTrip = micros() - package.sendMicros;
+  received++;
+  roundTripSum += roundTrip;
+  roundTripMax = max(roundTripMax, roundTrip);
+}
+/*  END OF MESH  */
@@ -0,0 +1,69 @@
+/****************************************************
+ * On-target benchmarks, [env:esp32cam-bench].      *
+ * The node boots into these instead of the normal  *
+ * tasks and prints one line per measurement,       *
+ * "bench: <name> <value> <unit>", like the host    *
+ * harness in native/. Camera, sd card and model    *
+ * run one after the other in setup(). The mesh     *
+ * round trips follow as a task, they need another  *
+ * node with the normal firmware, which sends every *
+ * BenchmarkPackage straight back.                  *
+ ****************************************************/
+
+#ifndef BENCHMARK_H
+#define BENCHMARK_H
+
+#include <Arduino.h>
+#include <painlessMesh.h>
+#include "FS.h"
+#include "packages.h"
+
+#define   BENCH_CAMERA_FRAMES     5         // timed frames per setting
+#define   BENCH_STALE_FRAMES      2         // still exposed with the settings before
+#define   BENCH_SD_PATH           "/bench.bin"
+#define   BENCH_SD_TOTAL          (512 * 1024)   // bytes per block size
+#define   BENCH_SD_MAX_BLOCK      32768
+#define   BENCH_INFERENCE_RUNS    10
+#define   BENCH_PING_COUNT        20        // per payload size
+#define   BENCH_PING_INTERVAL     TASK_MILLISECOND * 100
+#define   BENCH_PING_TIMEOUT      2000000   // us until a ping counts as lost
+#define   BENCH_PEER_WAIT         60000     // ms to wait for another node
+
+void printBenchResult(const char *name, double value, const char *unit);
+
+// The camera has to be initialized with buffers for the largest frame
+bool benchmarkCamera();
+bool benchmarkStorage(fs::FS &fs);
+// Skipped without a model on the card
+bool benchmarkInference(fs::FS &fs);
+
+// Round trips of BenchmarkPackage to the destination node, or to any node
+// if that is not in the mesh
+class MeshBenchmark {
+ public:
+  void begin(painlessMesh &mesh, uint32_t preferredPeer);
+  // Sends the next ping, call every BENCH_PING_INTERVAL. False once done.
+  bool step();
+  void onEcho(const BenchmarkPackage &package);
+
+ private:
+  painlessMesh *mesh = NULL;
+  uint32_t preferredPeer = 0;
+  uint32_t peer = 0;
+  unsigned long startMillis = 0;
+  uint8_t payloadStep = 0;
+  uint16_t sent = 0;
+  uint32_t lastSendMicros = 0;
+
+  // of the current payload size
+  uint16_t received = 0;
+  uint16_t failed = 0;
+  uint64_t roundTripSum = 0;
+  uint32_t roundTripMax = 0;
+  uint64_t sendCallSum = 0;
+
+  bool findPeer();
+  void printResults();
+};
+
+#endif
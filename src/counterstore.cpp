@@ -0,0 +1,93 @@
+#include "counterstore.h"
+
+#include <Preferences.h>
+#include "freertos/semphr.h"
+
+// One NVS handle for all counters, next() may renew from either core
+static Preferences preferences;
+static SemaphoreHandle_t preferencesMutex = NULL;
+
+static bool openPreferences() {
+  if (preferencesMutex) {
+    return true;
+  }
+  if (!preferences.begin(COUNTER_NAMESPACE, false)) {
+    Serial.printf("counterStore: Could not open NVS namespace %s!\n", COUNTER_NAMESPACE);
+    return false;
+  }
+  preferencesMutex = xSemaphoreCreateMutex();
+  return true;
+}
+
+bool LeasedCounter::begin(uint32_t lowerBound, const CounterState *warmState) {
+  if (!openPreferences()) {
+    value = lowerBound;
+    return false;
+  }
+
+  // NVS still holds the end of this lease, nothing to write
+  if (warmState) {
+    value = warmState->value;
+    leaseEnd = warmState->leaseEnd;
+    return true;
+  }
+
+  uint32_t storedEnd = preferences.getULong(key, 0);
+  value = max(storedEnd, lowerBound);
+  leaseEnd = value.load();
+  if (!renew(value)) {
+    return false;
+  }
+  Serial.printf("counterStore: %s continues at %u.\n", key, value.load());
+  return true;
+}
+
+void LeasedCounter::saveState(CounterState &state) const {
+  state.value = value;
+  state.leaseEnd = leaseEnd;
+}
+
+uint32_t LeasedCounter::next() {
+  uint32_t current = value.fetch_add(1);
+  if (current >= leaseEnd) {
+    renew(current + 1);
+  }
+  return current;
+}
+
+void LeasedCounter::renewIfLow() {
+  if (leaseEnd - value < leaseSize / 2) {
+    renew(value);
+  }
+}
+
+// Reserves [from, from + leaseSize) unless that is already covered
+bool LeasedCounter::renew(uint32_t from) {
+  if (!preferencesMutex) {
+    return false;
+  }
+
+  bool success = true;
+  xSemaphoreTake(preferencesMutex, portMAX_DELAY);
+  uint32_t newEnd = from + leaseSize;
+  if (newEnd > leaseEnd) {
+    success = preferences.putULong(key, newEnd) == sizeof(uint32_t);
+    if (success) {
+      leaseEnd = newEnd;
+    } else {
+      Serial.printf("counterStore: Could not save %s!\n", key);
+    }
+  }
+  xSemaphoreGive(preferencesMutex);
+  return success;
+}
+
+bool resetCounters() {
+  if (!openPreferences()) {
+    return false;
+  }
+  xSemaphoreTake(preferencesMutex, portMAX_DELAY);
+  bool success = preferences.clear();
+  xSemaphoreGive(preferencesMutex);
+  return success;
+}
@@ -0,0 +1,54 @@
+/****************************************************
+ * Crash-safe counters in NVS.                      *
+ * NVS already spreads its writes over the flash    *
+ * pages. On top of that a counter only stores the  *
+ * end of a lease of values that are handed out     *
+ * from RAM, so flash is written once per lease     *
+ * instead of once per picture. A reset skips the   *
+ * rest of the lease, a value is never reused.      *
+ ****************************************************/
+
+#ifndef COUNTERSTORE_H
+#define COUNTERSTORE_H
+
+#include <Arduino.h>
+#include <atomic>
+
+#define   COUNTER_NAMESPACE       "counters"
+
+// Kept across deep sleep, see lowpower.h
+struct CounterState {
+  uint32_t value;
+  uint32_t leaseEnd;
+};
+
+class LeasedCounter {
+ public:
+  LeasedCounter(const char *key, uint32_t leaseSize) : key(key), leaseSize(leaseSize) {}
+
+  // Continues after the last lease, but never below lowerBound. Call once.
+  // With a state saved before deep sleep the running lease is continued.
+  bool begin(uint32_t lowerBound = 0, const CounterState *warmState = NULL);
+  void saveState(CounterState &state) const;
+
+  // Safe to call from any task. Only writes to flash if the lease ran out
+  // before renewIfLow() got to it.
+  uint32_t next();
+  // Takes the next lease ahead of time, meant for a low priority task
+  void renewIfLow();
+
+  uint32_t peek() const { return value; }
+
+ private:
+  const char *key;
+  uint32_t leaseSize;
+  std::atomic<uint32_t> value{0};       // next value to hand out
+  std::atomic<uint32_t> leaseEnd{0};    // first value not covered by flash
+
+  bool renew(uint32_t from);
+};
+
+// Sets every counter in the namespace back to 0 on the next begin()
+bool resetCounters();
+
+#endif
@@ -0,0 +1,13 @@
+#include "crc32.h"
+
+uint32_t crc32(const void *data, size_t length, uint32_t crc) {
+  const uint8_t *bytes = (const uint8_t *) data;
+  crc = ~crc;
+  while (length--) {
+    crc ^= *bytes++;
+    for (int bit = 0; bit < 8; bit++) {
+      crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+    }
+  }
+  return ~crc;
+}
@@ -0,0 +1,10 @@
+#ifndef CRC32_H
+#define CRC32_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// CRC-32 (IEEE), pass the previous result as crc to continue a checksum
+uint32_t crc32(const void *data, size_t length, uint32_t crc = 0);
+
+#endif
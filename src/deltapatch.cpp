@@ -0,0 +1,79 @@
+#include "deltapatch.h"
+
+#include "crc32.h"
+
+static_assert(sizeof(DeltaHeader) == 32, "DeltaHeader is stored as it is");
+
+static inline uint32_t readUint32(const uint8_t *bytes) {
+  return bytes[0] | (bytes[1] << 8) | (bytes[2] << 16) | ((uint32_t) bytes[3] << 24);
+}
+
+bool readDeltaHeader(File &patch, DeltaHeader &header) {
+  return patch.seek(0) && patch.read((uint8_t *) &header, sizeof(header)) == sizeof(header)
+         && header.magic == DELTA_MAGIC;
+}
+
+static bool checkBase(const DeltaHeader &header, DeltaBaseReader readBase, void *baseArg) {
+  uint8_t buffer[DELTA_BUFFER_SIZE];
+  uint32_t crc = 0;
+  for (uint32_t offset = 0; offset < header.baseSize; offset += sizeof(buffer)) {
+    size_t length = min<size_t>(sizeof(buffer), header.baseSize - offset);
+    if (!readBase(baseArg, offset, buffer, length)) {
+      return false;
+    }
+    crc = crc32(buffer, length, crc);
+  }
+  return crc == header.baseCrc;
+}
+
+bool applyDelta(File &patch, DeltaBaseReader readBase, void *baseArg, File &output) {
+  DeltaHeader header;
+  if (!readDeltaHeader(patch, header)) {
+    Serial.println("delta: Not a patch!");
+    return false;
+  }
+  if (!checkBase(header, readBase, baseArg)) {
+    Serial.printf("delta: The running image is not version %u!\n", header.baseVersion);
+    return false;
+  }
+
+  uint8_t buffer[DELTA_BUFFER_SIZE];
+  uint32_t written = 0;
+  uint32_t crc = 0;
+  while (written < header.targetSize) {
+    uint8_t op[DELTA_OP_SIZE];
+    if (patch.read(op, sizeof(op)) != sizeof(op)) {
+      Serial.println("delta: The patch ends too early!");
+      return false;
+    }
+    uint32_t first = readUint32(op + 1);
+    uint32_t second = readUint32(op + 5);
+    uint32_t length = (op[0] == DELTA_OP_COPY) ? second : first;
+    if ((op[0] != DELTA_OP_COPY && op[0] != DELTA_OP_INSERT) || length > header.targetSize - written
+        || (op[0] == DELTA_OP_COPY && (first > header.baseSize || length > header.baseSize - first))) {
+      Serial.printf("delta: Broken operation at byte %u of the result!\n", written);
+      return false;
+    }
+
+    while (length > 0) {
+      size_t part = min<size_t>(sizeof(buffer), length);
+      bool read = (op[0] == DELTA_OP_COPY) ? readBase(baseArg, first, buffer, part)
+                                           : patch.read(buffer, part) == part;
+      if (!read || output.write(buffer, part) != part) {
+        Serial.println("delta: Could not read or write the image!");
+        return false;
+      }
+      crc = crc32(buffer, part, crc);
+      first += part;
+      written += part;
+      length -= part;
+    }
+    yield();
+  }
+
+  if (crc != header.targetCrc) {
+    Serial.printf("delta: Version %u came out wrong!\n", header.targetVersion);
+    return false;
+  }
+  return true;
+}
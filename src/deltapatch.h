@@ -0,0 +1,47 @@
+/****************************************************
+ * Delta patches from one version of an image to    *
+ * the next. A patch is a DeltaHeader followed by   *
+ * operations, little endian:                       *
+ *   copy:   op, base offset, length                *
+ *   insert: op, length, 0, then the new bytes      *
+ * Only the bytes that changed travel, the rest is  *
+ * copied from the image that is running. The base  *
+ * and the result are checked against the crcs in   *
+ * the header. Patches are made on a computer, see  *
+ * "program patch" in native/main.cpp.              *
+ ****************************************************/
+
+#ifndef DELTAPATCH_H
+#define DELTAPATCH_H
+
+#include <Arduino.h>
+#include "FS.h"
+
+#define   DELTA_MAGIC             0x31444653    // "SFD1"
+#define   DELTA_OP_COPY           1
+#define   DELTA_OP_INSERT         2
+#define   DELTA_OP_SIZE           9             // op byte and two uint32
+#define   DELTA_BUFFER_SIZE       1024
+
+struct DeltaHeader {
+  uint32_t magic;
+  uint8_t kind;                 // UPDATE_FIRMWARE or UPDATE_MODEL
+  uint8_t reserved[3];
+  uint32_t baseVersion;
+  uint32_t baseSize;
+  uint32_t baseCrc;
+  uint32_t targetVersion;
+  uint32_t targetSize;
+  uint32_t targetCrc;
+};
+
+// Reads length bytes of the base image from offset
+typedef bool (*DeltaBaseReader)(void *arg, uint32_t offset, uint8_t *buffer, size_t length);
+
+// False if the file is not a patch
+bool readDeltaHeader(File &patch, DeltaHeader &header);
+// Writes the patched image to output. False if the base is not the one the
+// patch was made for, the patch is broken or the result has the wrong crc.
+bool applyDelta(File &patch, DeltaBaseReader readBase, void *baseArg, File &output);
+
+#endif
@@ -0,0 +1,147 @@
+#include "detectionfusion.h"
+
+#include "meshtime.h"
+
+void DetectionFusion::begin(DetectionEventCallback onEvent) {
+  this->onEvent = onEvent;
+  nodeCount = 0;
+  openCount = 0;
+}
+
+bool DetectionFusion::addNeighbors(uint32_t nodeA, uint32_t nodeB) {
+  if (neighborCount >= FUSION_MAX_NEIGHBOR_PAIRS) {
+    return false;
+  }
+  neighbors[neighborCount][0] = nodeA;
+  neighbors[neighborCount][1] = nodeB;
+  neighborCount++;
+  return true;
+}
+
+bool DetectionFusion::areNeighbors(uint32_t nodeA, uint32_t nodeB) const {
+  if (nodeA == nodeB || neighborCount == 0) {
+    return true;
+  }
+  for (uint8_t i = 0; i < neighborCount; i++) {
+    if ((neighbors[i][0] == nodeA && neighbors[i][1] == nodeB)
+        || (neighbors[i][0] == nodeB && neighbors[i][1] == nodeA)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// A full table forgets the node that has been quiet the longest
+FusionNode &DetectionFusion::nodeFor(uint32_t nodeId) {
+  uint8_t quietest = 0;
+  for (uint8_t i = 0; i < nodeCount; i++) {
+    if (nodes[i].nodeId == nodeId) {
+      return nodes[i];
+    }
+    uint32_t lastReport = nodes[i].reports[nodes[i].newest].meshTime;
+    uint32_t quietestReport = nodes[quietest].reports[nodes[quietest].newest].meshTime;
+    if (timeSince(quietestReport, lastReport) > 0) {
+      quietest = i;
+    }
+  }
+
+  FusionNode &node = nodes[nodeCount < FUSION_MAX_NODES ? nodeCount++ : quietest];
+  node.nodeId = nodeId;
+  node.newest = 0;
+  node.count = 0;
+  return node;
+}
+
+// Reports of a backlog come in any order, so an event grows both ways
+bool DetectionFusion::belongsTo(const DetectionEvent &event, uint32_t nodeId, uint32_t meshTime) const {
+  if (timeSince(meshTime, event.lastSeen) > FUSION_WINDOW || timeSince(event.firstSeen, meshTime) > FUSION_WINDOW) {
+    return false;
+  }
+  for (uint8_t i = 0; i < min(event.nodeCount, (uint8_t) FUSION_EVENT_MAX_NODES); i++) {
+    if (areNeighbors(event.nodes[i], nodeId)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+bool DetectionFusion::addReport(const PictureReportPackage &report, uint32_t meshTime) {
+  // A report is sent again whenever its ack got lost
+  FusionNode &node = nodeFor(report.from);
+  for (uint8_t i = 0; i < node.count; i++) {
+    if (node.reports[i].pictureIndex == report.pictureIndex) {
+      return false;
+    }
+  }
+  if (node.count > 0) {
+    node.newest = (node.newest + 1) % FUSION_NODE_HISTORY;
+  }
+  node.count = min((uint8_t) (node.count + 1), (uint8_t) FUSION_NODE_HISTORY);
+  node.reports[node.newest] = {report.pictureIndex, report.deerProbability, meshTime};
+
+  // A queued report arrives long after it was taken
+  uint32_t seenTime = report.captureTime ? report.captureTime : meshTime;
+  DetectionEvent *event = NULL;
+  for (uint8_t i = 0; i < openCount && !event; i++) {
+    if (belongsTo(openEvents[i], report.from, seenTime)) {
+      event = &openEvents[i];
+    }
+  }
+
+  if (!event) {
+    if (openCount >= FUSION_MAX_OPEN_EVENTS) {
+      emit(0);    // the oldest one, ends a bit early
+    }
+    event = &openEvents[openCount++];
+    event->eventId = nextEventId++;
+    event->firstSeen = seenTime;
+    event->lastSeen = seenTime;
+    event->reportCount = 0;
+    event->nodeCount = 0;
+    event->bestProbability = -1;
+  }
+
+  if (timeSince(seenTime, event->lastSeen) > 0) {
+    event->lastSeen = seenTime;
+  }
+  if (timeSince(event->firstSeen, seenTime) > 0) {
+    event->firstSeen = seenTime;
+  }
+  event->lastArrival = meshTime;
+  event->reportCount++;
+  bool knownNode = false;
+  for (uint8_t i = 0; i < min(event->nodeCount, (uint8_t) FUSION_EVENT_MAX_NODES); i++) {
+    knownNode = knownNode || event->nodes[i] == report.from;
+  }
+  if (!knownNode) {
+    if (event->nodeCount < FUSION_EVENT_MAX_NODES) {
+      event->nodes[event->nodeCount] = report.from;
+    }
+    event->nodeCount++;
+  }
+  if (report.deerProbability > event->bestProbability) {
+    event->bestNode = report.from;
+    event->bestPictureIndex = report.pictureIndex;
+    event->bestProbability = report.deerProbability;
+  }
+  return true;
+}
+
+void DetectionFusion::update(uint32_t meshTime) {
+  for (uint8_t i = 0; i < openCount;) {
+    if (timeSince(meshTime, openEvents[i].lastArrival) > FUSION_WINDOW) {
+      emit(i);
+    } else {
+      i++;
+    }
+  }
+}
+
+void DetectionFusion::emit(uint8_t index) {
+  DetectionEvent event = openEvents[index];
+  openCount--;
+  memmove(openEvents + index, openEvents + index + 1, (openCount - index) * sizeof(DetectionEvent));
+  if (onEvent) {
+    onEvent(event);
+  }
+}
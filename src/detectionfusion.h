@@ -0,0 +1,88 @@
+/****************************************************
+ * Fuses the reports arriving at the destination    *
+ * node into detection events.                      *
+ * Every node has a small ring of its last reports  *
+ * by mesh time, which also drops reports that were *
+ * sent twice. A report joins an open event if its  *
+ * node or a neighbor of it saw the event less than *
+ * FUSION_WINDOW before or after the report was     *
+ * captured, so one deer passing a few trees        *
+ * becomes one event, and a backlog sent all at     *
+ * once still becomes one event per visit. Reports  *
+ * without a capture time count by arrival. An      *
+ * event is emitted once nothing joined it for      *
+ * FUSION_WINDOW.                                   *
+ ****************************************************/
+
+#ifndef DETECTIONFUSION_H
+#define DETECTIONFUSION_H
+
+#include <Arduino.h>
+#include "packages.h"
+
+#define   FUSION_WINDOW               10000000  // us of mesh time
+#define   FUSION_MAX_NODES            16
+#define   FUSION_NODE_HISTORY         8         // reports kept per node
+#define   FUSION_MAX_NEIGHBOR_PAIRS   32
+#define   FUSION_MAX_OPEN_EVENTS      8         // a backlog comes in out of order
+#define   FUSION_EVENT_MAX_NODES      4
+
+struct FusionReport {
+  unsigned long pictureIndex;
+  float deerProbability;
+  uint32_t meshTime;      // when it arrived
+};
+
+struct FusionNode {
+  uint32_t nodeId;
+  FusionReport reports[FUSION_NODE_HISTORY];
+  uint8_t newest;
+  uint8_t count;
+};
+
+struct DetectionEvent {
+  uint32_t eventId;
+  uint32_t firstSeen;     // mesh time of the captures
+  uint32_t lastSeen;
+  uint32_t lastArrival;   // of a report that joined
+  uint16_t reportCount;
+  uint8_t nodeCount;
+  uint32_t nodes[FUSION_EVENT_MAX_NODES];   // the first ones if more nodes saw it
+  // the most certain picture of the event
+  uint32_t bestNode;
+  unsigned long bestPictureIndex;
+  float bestProbability;
+};
+
+typedef void (*DetectionEventCallback)(const DetectionEvent &event);
+
+class DetectionFusion {
+ public:
+  void begin(DetectionEventCallback onEvent);
+
+  // Cameras that can see the same animal. Without any pairs every node
+  // counts as a neighbor of every other one.
+  bool addNeighbors(uint32_t nodeA, uint32_t nodeB);
+
+  // meshTime is when the report arrived. Returns false if it was added before.
+  bool addReport(const PictureReportPackage &report, uint32_t meshTime);
+  // Emits the events that are over, call regularly
+  void update(uint32_t meshTime);
+
+ private:
+  DetectionEventCallback onEvent = NULL;
+  FusionNode nodes[FUSION_MAX_NODES];
+  uint8_t nodeCount = 0;
+  uint32_t neighbors[FUSION_MAX_NEIGHBOR_PAIRS][2];
+  uint8_t neighborCount = 0;
+  DetectionEvent openEvents[FUSION_MAX_OPEN_EVENTS];
+  uint8_t openCount = 0;
+  uint32_t nextEventId = 1;
+
+  FusionNode &nodeFor(uint32_t nodeId);
+  bool areNeighbors(uint32_t nodeA, uint32_t nodeB) const;
+  bool belongsTo(const DetectionEvent &event, uint32_t nodeId, uint32_t meshTime) const;
+  void emit(uint8_t index);
+};
+
+#endif
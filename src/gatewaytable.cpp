@@ -0,0 +1,128 @@
+#include "gatewaytable.h"
+
+#include "meshtime.h"
+
+// Part of the way to a new value, rounded away from zero so an average
+// always gets all the way there instead of stalling a few steps short
+static int32_t averageStep(int32_t difference) {
+  const int32_t divisor = 1 << GATEWAY_AVERAGE_SHIFT;
+  return (difference + (difference >= 0 ? divisor - 1 : 1 - divisor)) / divisor;
+}
+
+void GatewayTable::begin(painlessMesh &mesh, uint32_t fallbackGateway) {
+  this->mesh = &mesh;
+  this->fallbackGateway = fallbackGateway;
+  current = fallbackGateway;
+  count = 0;
+}
+
+GatewayInfo *GatewayTable::find(uint32_t nodeId) {
+  for (uint8_t i = 0; i < count; i++) {
+    if (gateways[i].nodeId == nodeId) {
+      return &gateways[i];
+    }
+  }
+  return NULL;
+}
+
+const GatewayInfo *GatewayTable::find(uint32_t nodeId) const {
+  return const_cast<GatewayTable *>(this)->find(nodeId);
+}
+
+// A full table forgets the gateway that has been quiet the longest
+void GatewayTable::onAnnounce(const GatewayAnnouncePackage &package, uint32_t meshTime) {
+  int32_t latency = latencySince(meshTime, package.sendTime, GATEWAY_MAX_LATENCY);
+
+  GatewayInfo *gateway = find(package.from);
+  if (!gateway) {
+    uint8_t quietest = 0;
+    for (uint8_t i = 1; i < count; i++) {
+      if (gateways[i].lastAnnounce < gateways[quietest].lastAnnounce) {
+        quietest = i;
+      }
+    }
+    gateway = &gateways[count < GATEWAY_MAX_COUNT ? count++ : quietest];
+    *gateway = {};
+    gateway->nodeId = package.from;
+    gateway->latencyMicros = latency;
+    gateway->successRate = GATEWAY_RATE_ONE;
+    Serial.printf("gateways: Found gateway %u, %d us away.\n", package.from, latency);
+  }
+  int32_t latencyChange = latency - (int32_t) gateway->latencyMicros;
+  gateway->latencyMicros += averageStep(latencyChange);
+  gateway->lastAnnounce = millis();
+  gateway->failures = 0;      // it can be reached again
+  gateway->flags = package.flags;
+}
+
+bool GatewayTable::isUsable(const GatewayInfo &gateway) const {
+  return millis() - gateway.lastAnnounce < GATEWAY_TIMEOUT
+         && gateway.failures < GATEWAY_MAX_FAILURES
+         && mesh->isConnected(gateway.nodeId);
+}
+
+// Latency divided by the success rate, so a gateway that drops half of the
+// packages has to be more than twice as close
+uint64_t GatewayTable::cost(const GatewayInfo &gateway) {
+  return (uint64_t) (gateway.latencyMicros + GATEWAY_LATENCY_FLOOR) * GATEWAY_RATE_ONE
+         / max<uint16_t>(gateway.successRate, 1);
+}
+
+// Sticks with the current gateway unless another one is clearly better
+uint32_t GatewayTable::choose() {
+  const GatewayInfo *best = NULL;
+  for (uint8_t i = 0; i < count; i++) {
+    if (isUsable(gateways[i]) && (!best || cost(gateways[i]) < cost(*best))) {
+      best = &gateways[i];
+    }
+  }
+  if (!best) {
+    if (current != fallbackGateway) {
+      Serial.printf("gateways: No gateway reachable, falling back to %u.\n", fallbackGateway);
+      current = fallbackGateway;
+    }
+    return current;
+  }
+
+  const GatewayInfo *active = find(current);
+  if (active && active != best && isUsable(*active)
+      && cost(*active) * 100 <= cost(*best) * (100 + GATEWAY_SWITCH_MARGIN)) {
+    return current;
+  }
+  if (best->nodeId != current) {
+    Serial.printf("gateways: Switching from %u to %u.\n", current, best->nodeId);
+    current = best->nodeId;
+  }
+  return current;
+}
+
+void GatewayTable::reportOutcome(uint32_t nodeId, bool sent) {
+  GatewayInfo *gateway = find(nodeId);
+  if (!gateway) {
+    return;
+  }
+  int32_t target = sent ? GATEWAY_RATE_ONE : 0;
+  gateway->successRate += averageStep(target - gateway->successRate);
+  if (sent) {
+    gateway->sentCount++;
+    gateway->failures = 0;
+  } else {
+    gateway->failedCount++;
+    gateway->failures = min<uint8_t>(gateway->failures + 1, GATEWAY_MAX_FAILURES);
+  }
+}
+
+bool GatewayTable::acceptsCompactReports(uint32_t nodeId) const {
+  const GatewayInfo *gateway = find(nodeId);
+  return gateway && (gateway->flags & GATEWAY_COMPACT_REPORTS);
+}
+
+void GatewayTable::print() const {
+  for (uint8_t i = 0; i < count; i++) {
+    const GatewayInfo &gateway = gateways[i];
+    Serial.printf("gateways: %u%s, %u us, success %u%%, %u sent, %u failed, last announce %lu s ago.\n",
+                  gateway.nodeId, gateway.nodeId == current ? " (current)" : "",
+                  gateway.latencyMicros, gateway.successRate * 100 / GATEWAY_RATE_ONE,
+                  gateway.sentCount, gateway.failedCount, (millis() - gateway.lastAnnounce) / 1000);
+  }
+}
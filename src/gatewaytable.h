@@ -0,0 +1,71 @@
+/****************************************************
+ * Picks the gateway the reports go to.             *
+ * Every gateway broadcasts an announce once per    *
+ * GATEWAY_ANNOUNCE_INTERVAL, stamped with its mesh *
+ * time, which gives the latency to it. The outcome *
+ * of every sendPackage() to a gateway goes into    *
+ * its success rate. Reports go to the reachable    *
+ * gateway with the lowest latency per success. A   *
+ * gateway that missed its announces or failed      *
+ * GATEWAY_MAX_FAILURES times in a row is skipped   *
+ * until it announces itself again. Until the first *
+ * announce arrives everything goes to the fallback *
+ * gateway.                                         *
+ ****************************************************/
+
+#ifndef GATEWAYTABLE_H
+#define GATEWAYTABLE_H
+
+#include <Arduino.h>
+#include <painlessMesh.h>
+#include "packages.h"
+
+#define   GATEWAY_MAX_COUNT           4
+#define   GATEWAY_ANNOUNCE_INTERVAL   30000     // ms
+#define   GATEWAY_TIMEOUT             (3 * GATEWAY_ANNOUNCE_INTERVAL)
+#define   GATEWAY_MAX_FAILURES        3
+#define   GATEWAY_MAX_LATENCY         5000000   // us, announces from before a time sync
+#define   GATEWAY_LATENCY_FLOOR       1000      // us, keeps a close gateway from looking perfect
+#define   GATEWAY_AVERAGE_SHIFT       2         // latency and success rate move 1/4 of the way
+#define   GATEWAY_RATE_ONE            1024      // success rate of a gateway that never failed
+#define   GATEWAY_SWITCH_MARGIN       25        // percent a gateway has to be better to switch to it
+
+struct GatewayInfo {
+  uint32_t nodeId;
+  unsigned long lastAnnounce;     // millis()
+  uint32_t latencyMicros;         // of the announces, averaged
+  uint16_t successRate;           // averaged, GATEWAY_RATE_ONE is all sent
+  uint8_t failures;               // in a row
+  uint8_t flags;                  // GATEWAY_*
+  uint32_t sentCount;
+  uint32_t failedCount;
+};
+
+class GatewayTable {
+ public:
+  void begin(painlessMesh &mesh, uint32_t fallbackGateway);
+
+  // meshTime is the one of this node when the announce arrived
+  void onAnnounce(const GatewayAnnouncePackage &package, uint32_t meshTime);
+  // Where the next package should go
+  uint32_t choose();
+  void reportOutcome(uint32_t gateway, bool sent);
+
+  // Only known from an announce
+  bool acceptsCompactReports(uint32_t gateway) const;
+  void print() const;
+
+ private:
+  painlessMesh *mesh = NULL;
+  uint32_t fallbackGateway = 0;
+  uint32_t current = 0;
+  GatewayInfo gateways[GATEWAY_MAX_COUNT];
+  uint8_t count = 0;
+
+  GatewayInfo *find(uint32_t nodeId);
+  const GatewayInfo *find(uint32_t nodeId) const;
+  bool isUsable(const GatewayInfo &gateway) const;
+  static uint64_t cost(const GatewayInfo &gateway);
+};
+
+#endif
@@ -0,0 +1,561 @@
+#include "inference.h"
+
+#include <TensorFlowLite_ESP32.h>
+#include <tensorflow/lite/experimental/micro/kernels/micro_ops.h>
+#include <tensorflow/lite/experimental/micro/micro_mutable_op_resolver.h>
+#include <tensorflow/lite/experimental/micro/micro_error_reporter.h>
+#include <tensorflow/lite/experimental/micro/micro_interpreter.h>
+#include "tensorflow/lite/schema/schema_generated.h"
+#include "tensorflow/lite/version.h"
+
+#include <new>
+#include "esp_heap_caps.h"
+#include "esp_jpg_decode.h"
+#include "freertos/semphr.h"
+#include "modelstore.h"
+
+#define   ARENA_CANARY      0xA5
+
+// Everything below is set up in initializeDetector() and reused until reloadDetector()
+static tflite::MicroErrorReporter microErrorReporter;
+static tflite::MicroMutableOpResolver microOpResolver;
+static tflite::MicroInterpreter *interpreter = NULL;
+alignas(tflite::MicroInterpreter) static uint8_t interpreterStorage[sizeof(tflite::MicroInterpreter)];
+static TfLiteTensor *inputTensor = NULL;
+static TfLiteTensor *outputTensor = NULL;
+static ModelStore modelStore;
+static const uint8_t *modelData = NULL;      // mapped from the model partition, or modelBuffer
+static uint8_t *modelBuffer = NULL;          // PSRAM copy, only without a model partition
+static uint8_t *tensorArena = NULL;
+
+static int inputHeight = 0;
+static int inputWidth = 0;
+static int inputChannels = 0;
+static int16_t quantizedPixel[256];   // pixel value -> quantized input value
+
+static DetectorStats detectorStats;
+static bool arenaPainted = false;
+static SemaphoreHandle_t detectorMutex = NULL;   // capture workers may classify from both cores
+
+static float realPixel(uint8_t pixel) {
+  return MODEL_INPUT_MIN + (MODEL_INPUT_MAX - MODEL_INPUT_MIN) * pixel / 255.0f;
+}
+
+static void buildQuantizationTable() {
+  for (int pixel = 0; pixel < 256; pixel++) {
+    if (inputTensor->type == kTfLiteFloat32) {
+      quantizedPixel[pixel] = pixel;
+      continue;
+    }
+    int32_t value = lroundf(realPixel(pixel) / inputTensor->params.scale) + inputTensor->params.zero_point;
+    int32_t low = (inputTensor->type == kTfLiteInt8) ? -128 : 0;
+    int32_t high = (inputTensor->type == kTfLiteInt8) ? 127 : 255;
+    quantizedPixel[pixel] = constrain(value, low, high);
+  }
+}
+
+static inline void setInput(size_t index, uint8_t pixel) {
+  switch (inputTensor->type) {
+    case kTfLiteInt8:
+      inputTensor->data.int8[index] = (int8_t) quantizedPixel[pixel];
+      break;
+    case kTfLiteUInt8:
+      inputTensor->data.uint8[index] = (uint8_t) quantizedPixel[pixel];
+      break;
+    default:
+      inputTensor->data.f[index] = realPixel(pixel);
+      break;
+  }
+}
+
+static void registerOps() {
+  static bool opsRegistered = false;
+  if (opsRegistered) {
+    return;
+  }
+  opsRegistered = true;
+
+  // Only the ops used by the deer model, every other kernel gets stripped by the linker
+  microOpResolver.AddBuiltin(tflite::BuiltinOperator_CONV_2D,
+                             tflite::ops::micro::Register_CONV_2D(), 1, 3);
+  microOpResolver.AddBuiltin(tflite::BuiltinOperator_DEPTHWISE_CONV_2D,
+                             tflite::ops::micro::Register_DEPTHWISE_CONV_2D(), 1, 3);
+  microOpResolver.AddBuiltin(tflite::BuiltinOperator_AVERAGE_POOL_2D,
+                             tflite::ops::micro::Register_AVERAGE_POOL_2D(), 1, 2);
+  microOpResolver.AddBuiltin(tflite::BuiltinOperator_FULLY_CONNECTED,
+                             tflite::ops::micro::Register_FULLY_CONNECTED(), 1, 4);
+  microOpResolver.AddBuiltin(tflite::BuiltinOperator_RESHAPE,
+                             tflite::ops::micro::Register_RESHAPE());
+  microOpResolver.AddBuiltin(tflite::BuiltinOperator_SOFTMAX,
+                             tflite::ops::micro::Register_SOFTMAX(), 1, 2);
+}
+
+// Without a model partition the model is copied from the card into PSRAM
+static bool loadModel(fs::FS &fs) {
+  File modelFile = fs.open(MODEL_FILE_PATH, FILE_READ);
+  if (!modelFile) {
+    Serial.printf("detector: Could not open %s!\n", MODEL_FILE_PATH);
+    return false;
+  }
+
+  size_t modelSize = modelFile.size();
+  if (modelSize == 0 || modelSize > MODEL_MAX_SIZE) {
+    Serial.printf("detector: Model size of %u bytes is not supported!\n", modelSize);
+    modelFile.close();
+    return false;
+  }
+
+  modelBuffer = (uint8_t *) heap_caps_malloc(modelSize, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+  if (!modelBuffer) {
+    Serial.println("detector: Could not allocate the model buffer!");
+    modelFile.close();
+    return false;
+  }
+  size_t readBytes = modelFile.read(modelBuffer, modelSize);
+  modelFile.close();
+  if (readBytes != modelSize) {
+    Serial.println("detector: Could not read the whole model!");
+    heap_caps_free(modelBuffer);
+    modelBuffer = NULL;
+    return false;
+  }
+
+  modelData = modelBuffer;
+  Serial.printf("detector: Loaded %u bytes from %s.\n", modelSize, MODEL_FILE_PATH);
+  return true;
+}
+
+// The card holds the model that is meant to run, it goes into the partition if the
+// partition holds another one. Unless checkCard is true only the sizes are compared.
+static bool openModel(fs::FS &fs, bool checkCard) {
+  if (!modelStore.begin()) {
+    return loadModel(fs);
+  }
+  File modelFile = fs.open(MODEL_FILE_PATH, FILE_READ);
+  if (modelFile && !modelStore.matches(modelFile, checkCard)) {
+    Serial.printf("detector: Copying %s into the model partition.\n", MODEL_FILE_PATH);
+    modelStore.write(modelFile);
+  }
+  modelFile.close();
+
+  modelData = modelStore.map();
+  if (!modelData) {
+    Serial.println("detector: No model in the model partition!");
+    return loadModel(fs);
+  }
+  Serial.printf("detector: Mapped %u bytes from the model partition.\n", modelStore.size());
+  return true;
+}
+
+static void closeModel() {
+  modelStore.unmap();
+  if (modelBuffer) {
+    heap_caps_free(modelBuffer);
+    modelBuffer = NULL;
+  }
+  modelData = NULL;
+}
+
+static void destroyInterpreter(tflite::MicroInterpreter *built) {
+  built->~MicroInterpreter();
+  if (built == interpreter) {
+    interpreter = NULL;
+  }
+}
+
+static bool buildInterpreter(size_t knownHighWaterMark) {
+  const tflite::Model *model = tflite::GetModel(modelData);
+  if (model->version() != TFLITE_SCHEMA_VERSION) {
+    Serial.printf("detector: Model schema %d does not match %d!\n", model->version(), TFLITE_SCHEMA_VERSION);
+    return false;
+  }
+
+  // Fixed buffers, allocated exactly once and never freed
+  if (!tensorArena) {
+    tensorArena = (uint8_t *) heap_caps_malloc(TENSOR_ARENA_SIZE, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+  }
+  if (!tensorArena) {
+    Serial.println("detector: Could not allocate the tensor arena!");
+    return false;
+  }
+  arenaPainted = (knownHighWaterMark == 0);
+  if (arenaPainted) {
+    memset(tensorArena, ARENA_CANARY, TENSOR_ARENA_SIZE);   // paint for the high-water mark
+  }
+
+  registerOps();
+  // Built in place, so a new model never needs the heap either
+  tflite::MicroInterpreter *built = new (interpreterStorage)
+      tflite::MicroInterpreter(model, microOpResolver, tensorArena, TENSOR_ARENA_SIZE, &microErrorReporter);
+  if (built->AllocateTensors() != kTfLiteOk) {
+    Serial.println("detector: AllocateTensors() failed, increase TENSOR_ARENA_SIZE!");
+    destroyInterpreter(built);
+    return false;
+  }
+
+  inputTensor = built->input(0);
+  outputTensor = built->output(0);
+  if (inputTensor->dims->size != 4 || (inputTensor->dims->data[3] != 1 && inputTensor->dims->data[3] != 3)) {
+    Serial.println("detector: Expected an input of shape [1, height, width, 1 or 3]!");
+    destroyInterpreter(built);
+    return false;
+  }
+  inputHeight = inputTensor->dims->data[1];
+  inputWidth = inputTensor->dims->data[2];
+  inputChannels = inputTensor->dims->data[3];
+  buildQuantizationTable();
+
+  interpreter = built;
+  detectorStats.arenaSize = TENSOR_ARENA_SIZE;
+  detectorStats.arenaHighWaterMark = arenaPainted ? measureArenaHighWaterMark() : knownHighWaterMark;
+  Serial.printf("detector: Ready with input %dx%dx%d, arena uses %u of %u bytes.\n",
+                inputWidth, inputHeight, inputChannels,
+                detectorStats.arenaHighWaterMark, detectorStats.arenaSize);
+  return true;
+}
+
+bool initializeDetector(fs::FS &fs, size_t knownHighWaterMark, bool checkCard) {
+  if (interpreter) {
+    return true;
+  }
+  if (!psramFound()) {
+    Serial.println("detector: No PSRAM found, the tensor arena does not fit!");
+    return false;
+  }
+  if (!detectorMutex) {
+    detectorMutex = xSemaphoreCreateMutex();
+  }
+  if (!detectorMutex) {
+    return false;
+  }
+  if (!modelData && !openModel(fs, checkCard)) {
+    return false;
+  }
+  return buildInterpreter(knownHighWaterMark);
+}
+
+uint32_t modelCapacity() {
+  return modelStore.begin() ? modelStore.capacity() : MODEL_MAX_SIZE;
+}
+
+bool isDetectorReady() {
+  return interpreter != NULL;
+}
+
+/*  PREPROCESSING  */
+// JPEG frames are decoded with DCT scaling one MCU at a time. Each decoded
+// block is sampled and quantized straight into the input tensor, so no
+// RGB picture is ever materialized. The thumbnail is sampled from the
+// same blocks.
+static int16_t sourceColumnToInput[SENSOR_MAX_WIDTH];   // -1 if the column is not sampled
+static int16_t sourceRowToInput[SENSOR_MAX_HEIGHT];
+static int16_t sourceColumnToThumbnail[SENSOR_MAX_WIDTH];
+static int16_t sourceRowToThumbnail[SENSOR_MAX_HEIGHT];
+static uint16_t mappedWidth = 0;
+static uint16_t mappedHeight = 0;
+static bool decodeStarted = false;
+static Thumbnail *currentThumbnail = NULL;   // of the running decode
+
+// Centre of the source span covered by an input pixel
+static inline size_t samplePosition(int inputPosition, int inputSize, size_t sourceSize) {
+  return (2 * inputPosition + 1) * sourceSize / (2 * inputSize);
+}
+
+// Never bigger than the source, so every thumbnail pixel gets sampled
+static inline uint16_t thumbnailSize(uint16_t maxSize, size_t sourceSize) {
+  return min<size_t>(maxSize, sourceSize);
+}
+
+static void buildSamplingTable(int16_t *table, size_t tableSize, int targetSize, size_t sourceSize) {
+  memset(table, 0xFF, tableSize * sizeof(int16_t));
+  for (int target = 0; target < targetSize; target++) {
+    table[samplePosition(target, targetSize, sourceSize)] = target;
+  }
+}
+
+// Nearest neighbour lookup tables from source pixels to input and thumbnail pixels
+static bool buildSamplingTables(uint16_t sourceWidth, uint16_t sourceHeight) {
+  if (sourceWidth < inputWidth || sourceHeight < inputHeight
+      || sourceWidth > SENSOR_MAX_WIDTH || sourceHeight > SENSOR_MAX_HEIGHT) {
+    return false;
+  }
+  if (sourceWidth == mappedWidth && sourceHeight == mappedHeight) {
+    return true;
+  }
+
+  buildSamplingTable(sourceColumnToInput, SENSOR_MAX_WIDTH, inputWidth, sourceWidth);
+  buildSamplingTable(sourceRowToInput, SENSOR_MAX_HEIGHT, inputHeight, sourceHeight);
+  buildSamplingTable(sourceColumnToThumbnail, SENSOR_MAX_WIDTH,
+                     thumbnailSize(THUMBNAIL_WIDTH, sourceWidth), sourceWidth);
+  buildSamplingTable(sourceRowToThumbnail, SENSOR_MAX_HEIGHT,
+                     thumbnailSize(THUMBNAIL_HEIGHT, sourceHeight), sourceHeight);
+  mappedWidth = sourceWidth;
+  mappedHeight = sourceHeight;
+  return true;
+}
+
+// Biggest DCT scaling that still leaves at least one source pixel per
+// input pixel, and per thumbnail pixel if there is one
+static jpg_scale_t chooseScale(size_t frameWidth, size_t frameHeight) {
+  size_t minWidth = currentThumbnail ? max(inputWidth, THUMBNAIL_WIDTH) : inputWidth;
+  size_t minHeight = currentThumbnail ? max(inputHeight, THUMBNAIL_HEIGHT) : inputHeight;
+  for (int scale = JPG_SCALE_8X; scale > JPG_SCALE_NONE; scale--) {
+    if ((frameWidth >> scale) >= minWidth && (frameHeight >> scale) >= minHeight) {
+      return (jpg_scale_t) scale;
+    }
+  }
+  return JPG_SCALE_NONE;
+}
+
+static size_t readJpeg(void *arg, size_t index, uint8_t *buf, size_t len) {
+  camera_fb_t *frameBuffer = (camera_fb_t *) arg;
+  if (index + len > frameBuffer->len) {
+    len = frameBuffer->len - index;
+  }
+  if (buf) {
+    memcpy(buf, frameBuffer->buf + index, len);
+  }
+  return len;
+}
+
+static bool writeInputTensor(void *arg, uint16_t x, uint16_t y, uint16_t w, uint16_t h, uint8_t *data) {
+  if (!data) {
+    // x == 0 && y == 0 marks the start, w and h are the scaled picture size then
+    if (x == 0 && y == 0) {
+      decodeStarted = buildSamplingTables(w, h);
+      if (decodeStarted && currentThumbnail) {
+        currentThumbnail->width = thumbnailSize(THUMBNAIL_WIDTH, w);
+        currentThumbnail->height = thumbnailSize(THUMBNAIL_HEIGHT, h);
+      }
+      return decodeStarted;
+    }
+    return true;
+  }
+
+  for (uint16_t row = 0; row < h; row++) {
+    int16_t inY = sourceRowToInput[y + row];
+    int16_t thumbnailY = currentThumbnail ? sourceRowToThumbnail[y + row] : -1;
+    if (inY < 0 && thumbnailY < 0) {
+      continue;
+    }
+    const uint8_t *pixel = data + row * w * 3;
+    size_t rowIndex = (size_t) inY * inputWidth;
+    for (uint16_t column = 0; column < w; column++, pixel += 3) {
+      int16_t inX = (inY >= 0) ? sourceColumnToInput[x + column] : -1;
+      int16_t thumbnailX = (thumbnailY >= 0) ? sourceColumnToThumbnail[x + column] : -1;
+      if (inX < 0 && thumbnailX < 0) {
+        continue;
+      }
+      uint8_t gray = (pixel[0] * 77 + pixel[1] * 150 + pixel[2] * 29) >> 8;
+      if (thumbnailX >= 0) {
+        currentThumbnail->pixels[thumbnailY * currentThumbnail->width + thumbnailX] = gray;
+      }
+      if (inX < 0) {
+        continue;
+      }
+      size_t index = (rowIndex + inX) * inputChannels;
+      if (inputChannels == 1) {
+        setInput(index, gray);
+      } else {
+        setInput(index, pixel[0]);
+        setInput(index + 1, pixel[1]);
+        setInput(index + 2, pixel[2]);
+      }
+    }
+  }
+  return true;
+}
+
+static inline uint8_t rawGray(const uint8_t *pixel, size_t bytesPerPixel) {
+  if (bytesPerPixel == 1) {
+    return pixel[0];
+  }
+  uint8_t red = pixel[0] & 0xF8;
+  uint8_t green = ((pixel[0] & 0x07) << 5) | ((pixel[1] & 0xE0) >> 3);
+  uint8_t blue = (pixel[1] & 0x1F) << 3;
+  return (red * 77 + green * 150 + blue * 29) >> 8;
+}
+
+static void sampleRawThumbnail(camera_fb_t *frameBuffer, size_t bytesPerPixel) {
+  Thumbnail &thumbnail = *currentThumbnail;
+  thumbnail.width = thumbnailSize(THUMBNAIL_WIDTH, frameBuffer->width);
+  thumbnail.height = thumbnailSize(THUMBNAIL_HEIGHT, frameBuffer->height);
+  uint8_t *target = thumbnail.pixels;
+  for (int thumbnailY = 0; thumbnailY < thumbnail.height; thumbnailY++) {
+    const uint8_t *sourceRow = frameBuffer->buf
+                               + samplePosition(thumbnailY, thumbnail.height, frameBuffer->height) * frameBuffer->width * bytesPerPixel;
+    for (int thumbnailX = 0; thumbnailX < thumbnail.width; thumbnailX++) {
+      *target++ = rawGray(sourceRow + samplePosition(thumbnailX, thumbnail.width, frameBuffer->width) * bytesPerPixel,
+                          bytesPerPixel);
+    }
+  }
+}
+
+// Raw detector frames are sampled directly, there is nothing to decode
+static bool preprocessRaw(camera_fb_t *frameBuffer) {
+  size_t bytesPerPixel = (frameBuffer->format == PIXFORMAT_GRAYSCALE) ? 1 : 2;
+  if (frameBuffer->width < (size_t) inputWidth || frameBuffer->height < (size_t) inputHeight
+      || frameBuffer->len < frameBuffer->width * frameBuffer->height * bytesPerPixel) {
+    return false;
+  }
+  if (currentThumbnail) {
+    sampleRawThumbnail(frameBuffer, bytesPerPixel);
+  }
+
+  size_t index = 0;
+  for (int inY = 0; inY < inputHeight; inY++) {
+    const uint8_t *sourceRow = frameBuffer->buf
+                               + samplePosition(inY, inputHeight, frameBuffer->height) * frameBuffer->width * bytesPerPixel;
+    for (int inX = 0; inX < inputWidth; inX++) {
+      const uint8_t *pixel = sourceRow + samplePosition(inX, inputWidth, frameBuffer->width) * bytesPerPixel;
+      uint8_t red, green, blue;
+      if (bytesPerPixel == 1) {
+        red = green = blue = pixel[0];
+      } else {
+        // RGB565, high byte first
+        red = pixel[0] & 0xF8;
+        green = ((pixel[0] & 0x07) << 5) | ((pixel[1] & 0xE0) >> 3);
+        blue = (pixel[1] & 0x1F) << 3;
+      }
+      if (inputChannels == 1) {
+        setInput(index++, rawGray(pixel, bytesPerPixel));
+      } else {
+        setInput(index++, red);
+        setInput(index++, green);
+        setInput(index++, blue);
+      }
+    }
+  }
+  return true;
+}
+
+static bool preprocess(camera_fb_t *frameBuffer) {
+  if (frameBuffer->format == PIXFORMAT_GRAYSCALE || frameBuffer->format == PIXFORMAT_RGB565) {
+    return preprocessRaw(frameBuffer);
+  }
+  if (frameBuffer->format != PIXFORMAT_JPEG) {
+    Serial.println("detector: Only JPEG, grayscale and RGB565 frames are supported!");
+    return false;
+  }
+  decodeStarted = false;
+  jpg_scale_t scale = chooseScale(frameBuffer->width, frameBuffer->height);
+  if (esp_jpg_decode(frameBuffer->len, scale, &readJpeg, &writeInputTensor, frameBuffer) != ESP_OK
+      || !decodeStarted) {
+    Serial.println("detector: JPEG decoding failed!");
+    return false;
+  }
+  return true;
+}
+/*  END OF PREPROCESSING  */
+
+static bool runDetector(camera_fb_t *frameBuffer, float &deerProbability, Thumbnail *thumbnail) {
+
+  unsigned long startMicros = micros();
+  currentThumbnail = thumbnail;
+  bool preprocessed = preprocess(frameBuffer);
+  currentThumbnail = NULL;
+  if (!preprocessed) {
+    if (thumbnail) {
+      thumbnail->width = thumbnail->height = 0;
+    }
+    return false;
+  }
+  unsigned long invokeMicros = micros();
+  detectorStats.lastPreprocessMicros = invokeMicros - startMicros;
+
+  if (interpreter->Invoke() != kTfLiteOk) {
+    Serial.println("detector: Invoke() failed!");
+    return false;
+  }
+  detectorStats.lastInvokeMicros = micros() - invokeMicros;
+  detectorStats.maxInvokeMicros = max(detectorStats.maxInvokeMicros, detectorStats.lastInvokeMicros);
+  if (detectorStats.invokeCount++ == 0 && arenaPainted) {
+    // scratch buffers of the kernels are only touched during the first invoke
+    detectorStats.arenaHighWaterMark = measureArenaHighWaterMark();
+  }
+
+  // Single output means a sigmoid, otherwise pick the deer class
+  int outputCount = outputTensor->dims->data[outputTensor->dims->size - 1];
+  int deerIndex = (outputCount > 1) ? DEER_CLASS_INDEX : 0;
+  switch (outputTensor->type) {
+    case kTfLiteInt8:
+      deerProbability = (outputTensor->data.int8[deerIndex] - outputTensor->params.zero_point)
+                        * outputTensor->params.scale;
+      break;
+    case kTfLiteUInt8:
+      deerProbability = (outputTensor->data.uint8[deerIndex] - outputTensor->params.zero_point)
+                        * outputTensor->params.scale;
+      break;
+    default:
+      deerProbability = outputTensor->data.f[deerIndex];
+      break;
+  }
+
+  Serial.printf("detector: Preprocessing took %lu us, invoke took %lu us (max %lu us).\n",
+                detectorStats.lastPreprocessMicros, detectorStats.lastInvokeMicros,
+                detectorStats.maxInvokeMicros);
+  return true;
+}
+
+bool detectDeer(camera_fb_t *frameBuffer, float &deerProbability, Thumbnail *thumbnail) {
+  if (!interpreter || !frameBuffer) {
+    return false;
+  }
+
+  // There is only one interpreter and one input tensor, and reloadDetector() may have taken it away
+  xSemaphoreTake(detectorMutex, portMAX_DELAY);
+  bool success = interpreter && runDetector(frameBuffer, deerProbability, thumbnail);
+  xSemaphoreGive(detectorMutex);
+  return success;
+}
+
+bool reloadDetector(fs::FS &fs) {
+  if (!detectorMutex) {
+    return initializeDetector(fs);
+  }
+
+  // Pictures taken while the partition is written stay unclassified
+  xSemaphoreTake(detectorMutex, portMAX_DELAY);
+  if (interpreter) {
+    destroyInterpreter(interpreter);
+  }
+  xSemaphoreGive(detectorMutex);
+  closeModel();
+  if (!openModel(fs, true)) {
+    return false;
+  }
+
+  xSemaphoreTake(detectorMutex, portMAX_DELAY);
+  mappedWidth = mappedHeight = 0;   // the input size may have changed
+  detectorStats.invokeCount = 0;
+  detectorStats.maxInvokeMicros = 0;
+  bool ready = buildInterpreter(0);
+  xSemaphoreGive(detectorMutex);
+  return ready;
+}
+
+size_t measureArenaHighWaterMark() {
+  if (!tensorArena) {
+    return 0;
+  }
+  if (!arenaPainted) {
+    return detectorStats.arenaHighWaterMark;   // carried over from before deep sleep
+  }
+
+  // The longest untouched run is the free gap between head and tail allocations
+  size_t longestRun = 0;
+  size_t currentRun = 0;
+  for (size_t i = 0; i < TENSOR_ARENA_SIZE; i++) {
+    if (tensorArena[i] == ARENA_CANARY) {
+      currentRun++;
+      longestRun = max(longestRun, currentRun);
+    } else {
+      currentRun = 0;
+    }
+  }
+  return TENSOR_ARENA_SIZE - longestRun;
+}
+
+const DetectorStats &getDetectorStats() {
+  return detectorStats;
+}
@@ -0,0 +1,77 @@
+/****************************************************
+ * On-device deer detection with TFLite Micro. The  *
+ * model is mapped from its flash partition, see    *
+ * modelstore.h, and the interpreter is built on    *
+ * top of a fixed tensor arena in PSRAM, so         *
+ * classifying a picture never touches the heap. A  *
+ * new model is swapped in without a reboot.        *
+ ****************************************************/
+
+#ifndef INFERENCE_H
+#define INFERENCE_H
+
+#include <Arduino.h>
+#include "esp_camera.h"
+#include "FS.h"
+
+// model handling
+#define   MODELS_PATH                 "/models"
+#define   MODEL_FILE_PATH             "/models/deer.tflite"
+#define   MODEL_MAX_SIZE              (1024 * 1024)
+#define   TENSOR_ARENA_SIZE           (512 * 1024)
+#define   DEER_CLASS_INDEX            1
+
+// real value range the model expects for a pixel
+#define   MODEL_INPUT_MIN             0.0f
+#define   MODEL_INPUT_MAX             1.0f
+
+// biggest frame the sensor delivers (UXGA)
+#define   SENSOR_MAX_WIDTH            1600
+#define   SENSOR_MAX_HEIGHT           1200
+
+// grayscale preview sampled during preprocessing
+#define   THUMBNAIL_WIDTH             160
+#define   THUMBNAIL_HEIGHT            120
+
+// width and height may come out smaller than the maximum for small frames,
+// 0 if no thumbnail was made
+struct Thumbnail {
+  uint8_t *pixels;    // THUMBNAIL_WIDTH * THUMBNAIL_HEIGHT bytes, owned by the caller
+  uint16_t width;
+  uint16_t height;
+};
+
+struct DetectorStats {
+  unsigned long invokeCount;
+  unsigned long lastPreprocessMicros;
+  unsigned long lastInvokeMicros;
+  unsigned long maxInvokeMicros;
+  size_t arenaSize;
+  size_t arenaHighWaterMark;    // bytes of the arena touched so far
+};
+
+// Maps the model and builds the interpreter. Call once, reloadDetector()
+// swaps the model later. The high-water mark of an earlier run saves painting
+// and scanning the arena. A model that was put on the card goes into the model
+// partition first, checkCard reads the whole file for the comparison instead
+// of only its size. That pays off after a cold boot, the card may have been
+// changed while the node was off.
+bool initializeDetector(fs::FS &fs, size_t knownHighWaterMark = 0, bool checkCard = true);
+// Runs the model that is now at MODEL_FILE_PATH, without a reboot
+bool reloadDetector(fs::FS &fs);
+bool isDetectorReady();
+// Biggest model this node can run, the model partition or MODEL_MAX_SIZE
+// in PSRAM if the partition table has none
+uint32_t modelCapacity();
+
+// Runs the model on a captured JPEG, grayscale or RGB565 frame. Returns false
+// if the frame could not be classified, deerProbability is left untouched then.
+// A thumbnail is filled from the same decode pass if one is given.
+bool detectDeer(camera_fb_t *frameBuffer, float &deerProbability, Thumbnail *thumbnail = NULL);
+
+// Scans the arena for the painted canary pattern. Takes a few ms, so
+// this is not done on every invoke.
+size_t measureArenaHighWaterMark();
+const DetectorStats &getDetectorStats();
+
+#endif
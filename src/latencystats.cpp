@@ -0,0 +1,96 @@
+#include "latencystats.h"
+
+#include "meshtime.h"
+
+static uint8_t bucketOf(uint32_t millis) {
+  uint8_t bucket = 0;
+  while (bucket < LATENCY_BUCKETS - 1 && millis >= ((uint32_t) LATENCY_FIRST_BUCKET << bucket)) {
+    bucket++;
+  }
+  return bucket;
+}
+
+// Upper end of the bucket that holds the given share of the reports
+static uint32_t percentile(const NodeLatency &node, float share) {
+  uint32_t total = node.reportCount - node.skewedCount;
+  uint32_t needed = (uint32_t) ceilf(total * share);
+  uint32_t counted = 0;
+  for (uint8_t bucket = 0; bucket < LATENCY_BUCKETS; bucket++) {
+    counted += node.endToEnd[bucket];
+    if (counted >= needed) {
+      return (uint32_t) LATENCY_FIRST_BUCKET << bucket;
+    }
+  }
+  return (uint32_t) LATENCY_FIRST_BUCKET << (LATENCY_BUCKETS - 1);
+}
+
+// A full table keeps counting for the nodes it has
+NodeLatency *LatencyStats::nodeFor(uint32_t nodeId) {
+  for (uint8_t i = 0; i < nodeCount; i++) {
+    if (nodes[i].nodeId == nodeId) {
+      return &nodes[i];
+    }
+  }
+  if (nodeCount >= LATENCY_MAX_NODES) {
+    return NULL;
+  }
+  NodeLatency *node = &nodes[nodeCount++];
+  memset(node, 0, sizeof(NodeLatency));
+  node->nodeId = nodeId;
+  return node;
+}
+
+void LatencyStats::add(const PictureReportPackage &report, uint32_t receiveTime) {
+  if (!report.captureTime) {
+    return;   // from a node without timestamps
+  }
+  NodeLatency *node = nodeFor(report.from);
+  if (!node) {
+    return;
+  }
+
+  node->reportCount++;
+  // Unsigned, so a delay of more than half the mesh time range still counts, see latencystats.h
+  uint32_t endToEnd = receiveTime - report.captureTime;
+  uint32_t ahead = report.captureTime - receiveTime;
+  if (ahead != 0 && ahead <= (uint32_t) LATENCY_SKEW_TOLERANCE * 1000) {
+    node->skewedCount++;
+  } else {
+    node->endToEnd[bucketOf(endToEnd / 1000)]++;
+  }
+
+  // Both times come from the sending node, so the queue time never suffers from the sync
+  if (report.sendTime && report.enqueueTime) {
+    uint32_t queueMillis = (report.sendTime - report.enqueueTime) / 1000;
+    int32_t transit = timeSince(receiveTime, report.sendTime);
+    uint32_t transitMillis = transit > 0 ? transit / 1000 : 0;
+    node->queueCount++;
+    node->queueSum += queueMillis;
+    node->queueMax = max(node->queueMax, queueMillis);
+    node->transitSum += transitMillis;
+    node->transitMax = max(node->transitMax, transitMillis);
+  }
+}
+
+void LatencyStats::print() const {
+  for (uint8_t i = 0; i < nodeCount; i++) {
+    const NodeLatency &node = nodes[i];
+    Serial.printf("latency: Node %u, %u report(s), %u with skewed clocks.\n",
+                  node.nodeId, node.reportCount, node.skewedCount);
+    if (node.reportCount > node.skewedCount) {
+      Serial.printf("latency:   Capture to arrival p50 < %u ms, p90 < %u ms, p99 < %u ms.\n",
+                    percentile(node, 0.5), percentile(node, 0.9), percentile(node, 0.99));
+      Serial.print("latency:   Histogram");
+      for (uint8_t bucket = 0; bucket < LATENCY_BUCKETS; bucket++) {
+        Serial.printf(" %u", node.endToEnd[bucket]);
+      }
+      Serial.println();
+    }
+    if (node.queueCount) {
+      Serial.printf("latency:   In the queue %u ms on average, %u ms at most.\n",
+                    (uint32_t) (node.queueSum / node.queueCount), node.queueMax);
+      Serial.printf("latency:   Through the mesh %u ms on average, %u ms at most.\n",
+                    (uint32_t) (node.transitSum / node.queueCount), node.transitMax);
+    }
+  }
+}
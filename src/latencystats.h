@@ -0,0 +1,50 @@
+/****************************************************
+ * Latency statistics on the destination node.      *
+ * Per source node: a histogram of the time from    *
+ * capture to arrival, and how long the reports     *
+ * waited in the queue and travelled through the    *
+ * mesh. All times are mesh time, so they are only  *
+ * as good as the time sync. Mesh time wraps after  *
+ * 71.6 min: a capture up to LATENCY_SKEW_TOLERANCE *
+ * after its arrival counts as skewed and is left   *
+ * out, anything else is a latency of up to 71.6    *
+ * min minus the tolerance.                         *
+ ****************************************************/
+
+#ifndef LATENCYSTATS_H
+#define LATENCYSTATS_H
+
+#include <Arduino.h>
+#include "packages.h"
+
+#define   LATENCY_MAX_NODES       16
+#define   LATENCY_BUCKETS         16    // bucket i ends at LATENCY_FIRST_BUCKET << i ms
+#define   LATENCY_FIRST_BUCKET    128   // ms, the last bucket takes everything from 35 min on
+#define   LATENCY_SKEW_TOLERANCE  60000 // ms a capture may seem to be after its arrival
+
+struct NodeLatency {
+  uint32_t nodeId;
+  uint32_t reportCount;
+  uint32_t skewedCount;       // seemed to arrive before they were taken
+  uint32_t endToEnd[LATENCY_BUCKETS];
+  uint32_t queueCount;
+  uint64_t queueSum;          // ms
+  uint32_t queueMax;
+  uint64_t transitSum;        // ms, counted with queueCount
+  uint32_t transitMax;
+};
+
+class LatencyStats {
+ public:
+  // receiveTime is the mesh time the report arrived at
+  void add(const PictureReportPackage &report, uint32_t receiveTime);
+  void print() const;
+
+ private:
+  NodeLatency nodes[LATENCY_MAX_NODES];
+  uint8_t nodeCount = 0;
+
+  NodeLatency *nodeFor(uint32_t nodeId);
+};
+
+#endif
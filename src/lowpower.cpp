@@ -0,0 +1,37 @@
+#include "lowpower.h"
+
+#include <sys/time.h>
+
+#define   WARM_STATE_MAGIC    0x57524D31
+
+// Survives deep sleep, but not a power cycle
+RTC_DATA_ATTR static WarmState rtcWarmState;
+
+bool takeWarmState(WarmState &state) {
+  esp_sleep_wakeup_cause_t cause = esp_sleep_get_wakeup_cause();
+  bool valid = rtcWarmState.magic == WARM_STATE_MAGIC
+               && (cause == ESP_SLEEP_WAKEUP_TIMER || cause == ESP_SLEEP_WAKEUP_EXT0);
+  if (valid) {
+    state = rtcWarmState;
+  }
+  rtcWarmState.magic = 0;
+  return valid;
+}
+
+void enterDeepSleep(WarmState &state, uint64_t sleepMicros, gpio_num_t wakePin, int wakeLevel) {
+  state.magic = WARM_STATE_MAGIC;
+  rtcWarmState = state;
+
+  esp_sleep_enable_timer_wakeup(sleepMicros);
+  esp_sleep_enable_ext0_wakeup(wakePin, wakeLevel);
+  Serial.printf("lowPower: Sleeping for %llu s.\n", sleepMicros / 1000000);
+  Serial.flush();
+  esp_deep_sleep_start();
+}
+
+// The system time is driven by the RTC timer during deep sleep
+uint64_t rtcMicros() {
+  struct timeval now;
+  gettimeofday(&now, NULL);
+  return (uint64_t) now.tv_sec * 1000000 + now.tv_usec;
+}
@@ -0,0 +1,45 @@
+/****************************************************
+ * Deep-sleep duty cycling.                         *
+ * Before sleeping, everything a wake would         *
+ * otherwise recover from the card or NVS goes into *
+ * RTC memory. takeWarmState() hands it back once   *
+ * after the wake and invalidates it right away, so *
+ * a crash on the way always ends in a cold boot.   *
+ ****************************************************/
+
+#ifndef LOWPOWER_H
+#define LOWPOWER_H
+
+#include <Arduino.h>
+#include "esp_sleep.h"
+#include "counterstore.h"
+#include "motiongate.h"
+#include "reportqueue.h"
+#include "retention.h"
+#include "segmentlog.h"
+
+struct WarmState {
+  uint32_t magic;
+  uint32_t wakeCount;
+  unsigned long bootIndex;
+  bool meshTimeValid;
+  int64_t meshTimeOffset;       // mesh time minus rtcMicros()
+  size_t arenaHighWaterMark;
+  ReportQueueState reportQueue;
+  CounterState pictureCounter;
+  SegmentLogState reportLog;
+  SegmentLogState errorLog;
+  SegmentLogState uptimeLog;
+  MotionGateState motionGate;
+  RetentionState retention;
+};
+
+// True only after a deep-sleep wake with a state saved by enterDeepSleep()
+bool takeWarmState(WarmState &state);
+// Does not return. wakePin has to be an RTC GPIO.
+void enterDeepSleep(WarmState &state, uint64_t sleepMicros, gpio_num_t wakePin, int wakeLevel);
+
+// Microseconds since the cold boot, keeps counting through deep sleep
+uint64_t rtcMicros();
+
+#endif
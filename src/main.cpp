@@ -1,32 +1,47 @@
 /****************************************************
  * Connects to or builds the mesh,                  *
- * takes a picture once every two minutes,          *
+ * looks for deer with a TFLite Micro model,        *
+ * takes a picture whenever it sees one             *
+ * or the PIR sensor reports movement,              *
  * saves it to a memory card,                       *
  * makes a report about the picture,                *
- * puts the report in a queue,                      *
- * tries to send the next report once every minute. *
- * Logs its uptime once every 15 minutes.           *
+ * puts the report in a queue on the memory card,   *
+ * sends the queued reports in batches.             *
+ * Logs its uptime once every 10 minutes.           *
  ****************************************************/
 
 #include <Arduino.h>
-#include <cppQueue.h>
+#include <atomic>
 #include <painlessMesh.h>
 
-#include <TensorFlowLite_ESP32.h>
-#include <tensorflow/lite/experimental/micro/kernels/micro_ops.h>
-#include <tensorflow/lite/experimental/micro/micro_mutable_op_resolver.h>
-#include <tensorflow/lite/experimental/micro/micro_error_reporter.h>
-#include <tensorflow/lite/experimental/micro/micro_interpreter.h>
-#include "tensorflow/lite/schema/schema_generated.h"
-#include "tensorflow/lite/version.h"
+#include "benchmark.h"
+#include "counterstore.h"
+#include "detectionfusion.h"
+#include "gatewaytable.h"
+#include "inference.h"
+#include "latencystats.h"
+#include "lowpower.h"
+#include "meshupdate.h"
+#include "motiongate.h"
+#include "nodeconfig.h"
+#include "packages.h"
+#include "picturestore.h"
+#include "picturetransfer.h"
+#include "reportqueue.h"
+#include "retention.h"
+#include "segmentlog.h"
+#include "spscring.h"
+#include "telemetry.h"
 
-#include <EEPROM.h>
 #include "esp_camera.h"
+#include "esp_heap_caps.h"
 #include "FS.h"
 #include "SD_MMC.h"
 #include "soc/soc.h"           // Disable brownout problems
 #include "soc/rtc_cntl_reg.h"  // Disable brownout problems
 #include "driver/rtc_io.h"
+#include "freertos/queue.h"
+#include "freertos/task.h"
 
 // assign names to pin numbers
 #define   PWDN_GPIO_NUM   32
@@ -47,16 +62,46 @@
 #define   PCLK_GPIO_NUM   22
 #define   PIR_SENSOR_PIN  16
 
-// index handling with EEPROM
-#define   EEPROM_SIZE             8
-#define   PICTURE_INDEX_ADDRESS   0
-#define   UPTIME_INDEX_ADDRESS    4
+// Low-power mode: deep sleep between PIR and timer wakeups, see lowpower.h.
+// Only an RTC GPIO can wake the node, so the PIR moves from GPIO 16 to 13.
+// 13 is free because the sd card runs in 1-bit mode then.
+// A sleeping node does not relay, so only use this on leaf nodes.
+#define   LOW_POWER_MODE          false
+#define   PIR_WAKE_PIN            GPIO_NUM_13
+#define   LOW_POWER_SLEEP_TIME    120       // s, same as taskTakePicture
+#define   LOW_POWER_MIN_AWAKE     TASK_SECOND * 15   // time for the mesh to form and take the reports
+#define   LOW_POWER_MAX_AWAKE     TASK_SECOND * 60   // sleeps even if that did not work
+
+// PIR trigger
+#define   PIR_MOTION_LEVEL        LOW     // TODO: Check if HIGH or LOW
+#define   PIR_DEBOUNCE_MS         2000    // edges closer than this belong to the same movement
+#define   PIR_BURST_COUNT         3       // pictures per movement
+#define   PIR_BURST_INTERVAL      TASK_MILLISECOND * 500
+#define   PIR_POLL_INTERVAL       TASK_MILLISECOND * 10
+
+// periodic pictures without the detector stream
+#define   CAPTURE_INTERVAL        TASK_SECOND * 120
+
+// changing the config on the serial port of a gateway, see readSerial()
+#define   SERIAL_POLL_INTERVAL    TASK_MILLISECOND * 100
+
+// boot, see advanceBoot()
+#define   BOOT_POLL_INTERVAL      TASK_MILLISECOND * 20    // while the camera init runs
+#define   BOOT_RETRY_MIN          TASK_MILLISECOND * 500   // doubled after every failed attempt
+#define   BOOT_RETRY_MAX          TASK_SECOND * 30
+
+// buffered logs, see segmentlog.h
+#define   LOG_FLUSH_CHECK_INTERVAL  TASK_SECOND
+
+// index handling, see counterstore.h
+#define   PICTURE_INDEX_LEASE     64      // picture indices per flash write
+#define   COUNTER_RENEW_INTERVAL  TASK_SECOND * 10
 
 // directory paths
-#define   PICTURES_PATH     "/pictures"
 #define   REPORTS_PATH      "/reports"
 #define   UPTIME_LOGS_PATH  "/uptimeLogs"
 #define   ERROR_LOGS_PATH   "/errorLogs"
+#define   EVENTS_PATH       "/events"
 
 // mesh network
 #define   MESH_PREFIX       "SmartForestMesh"
@@ -64,360 +109,1048 @@
 #define   MESH_PORT         5555
 #define   DEST_NODE         3177562153        // Identify with mesh.getNodeId()
 
-#define   QUEUE_SIZE        10
 
-// custom package for transmission over the mesh network
-class PictureReportPackage : public painlessmesh::plugin::SinglePackage {
- public:
-  unsigned long pictureIndex;
-  float deerProbability;
+// sending reports, see sendReport()
+#define   SEND_INTERVAL_DRAIN     TASK_MILLISECOND * 100   // between batches while the queue drains
+#define   SEND_INTERVAL_IDLE      TASK_SECOND * 5
+#define   SEND_BACKOFF_MIN        TASK_SECOND * 2
+#define   SEND_BACKOFF_MAX        TASK_MINUTE * 5
+#define   FORCE_JSON_REPORTS      false     // true to read reports in plain json while debugging
 
-  // Each package has to be identified by a unique ID
-  // Values <30 are reserved for default messages, 
-  // so using 31 for this package
-  PictureReportPackage() : painlessmesh::plugin::SinglePackage(31) {}
+// picture transfer, see picturetransfer.h
+#define   AUTO_FETCH_THUMBNAILS   true      // destination node pulls the thumbnail of every report
+#define   AUTO_FETCH_PICTURES     false     // and the full picture of likely deer
+#define   PICTURE_FETCH_THRESHOLD 0.8
+#define   PATH_BUFFER_SIZE  48
 
-  // Convert json object into a PictureReportPackage
-  PictureReportPackage(JsonObject jsonObj) : painlessmesh::plugin::SinglePackage(jsonObj) {
-    pictureIndex = jsonObj["pictureIndex"].as<unsigned long>();
-    deerProbability = jsonObj["deerProbability"].as<float>();
-  }
+// detection fusion on the destination node, see detectionfusion.h
+#define   FUSION_CHECK_INTERVAL   TASK_SECOND
 
-  // Convert PictureReportPackage to json object
-  JsonObject addTo(JsonObject &&jsonObj) const {
-    jsonObj = painlessmesh::plugin::SinglePackage::addTo(std::move(jsonObj));
-    jsonObj["pictureIndex"] = pictureIndex;
-    jsonObj["deerProbability"] = deerProbability;
+// latency statistics on the destination node, see latencystats.h
+#define   LATENCY_PRINT_INTERVAL  TASK_MINUTE * 5
 
-    return jsonObj;
-  }
-  
-  // Memory to reserve for converting this object to json
-  size_t jsonObjectSize() const {
-    return JSON_OBJECT_SIZE(noJsonFields + 2)
-            + round(1.1*sizeof(pictureIndex)
-                    + 1.1*sizeof(deerProbability));
+// performance counters, see telemetry.h
+#define   TELEMETRY_INTERVAL      TASK_MINUTE * 5
 
-  }
+// updates over the mesh, see meshupdate.h
+#define   FIRMWARE_VERSION        1         // raise with every image that goes out
 
-  String getFullPictureName() {
-    return String(this->from % 1000) + "_" + String(pictureIndex) + ".jpg";
-  }
+// sd card retention, see retention.h
+#define   RETENTION_CHECK_INTERVAL    TASK_MINUTE
+#define   RETENTION_EVICT_INTERVAL    TASK_MILLISECOND * 200   // between batches while evicting
+#define   RETENTION_RECENT_PICTURES   32        // never evicted, the pipeline may still work on them
 
-  String getFullReportName() {
-    return String(this->from % 1000) + "_" + String(pictureIndex) + ".log";
-  }
+// boots into the benchmarks instead of the normal tasks, see benchmark.h
+#ifndef BENCHMARK_MODE
+#define   BENCHMARK_MODE          false     // set by [env:esp32cam-bench]
+#endif
 
-  String getFullErrorName() {
-    return String(this->from % 1000) + "_" + String(pictureIndex) + ".err";
-  }
-};
+// reports below this probability are not sent, see deerThreshold()
+#define   DEER_PROBABILITY_THRESHOLD  0.5
+
+// Dual-stream capture: watch a small raw stream with the detector and
+// only switch to the big JPEG stream when a deer shows up
+#define   DUAL_STREAM_CAPTURE         true
+#define   DETECTOR_PIXEL_FORMAT       PIXFORMAT_GRAYSCALE   // or PIXFORMAT_RGB565
+#define   DETECTOR_FRAME_SIZE         FRAMESIZE_QQVGA
+#define   DETECTOR_SAMPLE_INTERVAL    TASK_SECOND * 2
+
+// Frames of an unchanged scene are neither classified nor saved, see motiongate.h
+#define   MOTION_GATE                 true
+
+// Capture runs on its own worker on the other core, the scheduler only
+// hands it the triggers and takes back the reports, see spscring.h.
+// Double-buffered capture: the next frame is captured while the SD writer
+// and the classifier work on the last one.
+#define   DOUBLE_BUFFERED_CAPTURE     true
+#define   CAPTURE_WORKER_CORE         0       // capture, persist and classify, loop() and the mesh run on core 1
+#define   CAPTURE_WORKER_PRIORITY     1
+#define   CAPTURE_WORKER_STACK_SIZE   8192
+#define   CAPTURE_CONTEXT_COUNT       2       // one per frame buffer
+#define   CAPTURE_TRIGGER_RING_SIZE   4       // power of two
+#define   REPORT_RING_SIZE            16      // power of two, one ring per worker
+#define   REPORT_DRAIN_INTERVAL       TASK_MILLISECOND * 100
 
 painlessMesh mesh;
 Scheduler userScheduler; 
-cppQueue reportQueue(sizeof(PictureReportPackage), QUEUE_SIZE, FIFO);
-String directories[] = {
+PersistentReportQueue reportQueue;   // survives reboots, see reportqueue.h
+LeasedCounter pictureCounter("pictureIndex", PICTURE_INDEX_LEASE);
+LeasedCounter uptimeCounter("uptimeIndex", 1);   // once per boot anyway
+PictureStore pictureStore;
+PictureSender pictureSender;
+PictureReceiver pictureReceiver;
+RetentionManager cardRetention;
+SegmentLog reportLog(REPORTS_PATH);
+SegmentLog errorLog(ERROR_LOGS_PATH);
+SegmentLog uptimeLog(UPTIME_LOGS_PATH);
+SegmentLog eventLog(EVENTS_PATH);    // destination node only
+DetectionFusion detectionFusion;
+LatencyStats latencyStats;
+GatewayTable gatewayTable;
+MotionGate motionGate;
+MeshUpdater meshUpdater;
+ConfigStore configStore;    // built-in config below, see nodeconfig.h
+Telemetry telemetry;
+MeshBenchmark meshBenchmark;    // benchmark mode only
+const char *directories[] = {
   PICTURES_PATH,
   REPORTS_PATH,
   UPTIME_LOGS_PATH,
-  ERROR_LOGS_PATH
+  ERROR_LOGS_PATH,
+  MODELS_PATH
 };
-String uptimeLogPath;
+unsigned long bootIndex = 0;
+const int pirPin = LOW_POWER_MODE ? PIR_WAKE_PIN : PIR_SENSOR_PIN;
 
-/*  USER TASKS  */
-void sendReport();
-Task taskSendReport(TASK_SECOND * 60, TASK_FOREVER, &sendReport);
-void sendReport() {
-  if (reportQueue.isEmpty()) {
-    Serial.println("taskSendReport: Queue is empty, nothing to send.");
-    return;
+// set in setup() if the node woke up from deep sleep
+bool warmStart = false;
+WarmState warmState;
+bool meshTimeSynced = false;
+
+// boot steps that are done, see advanceBoot()
+enum BootStep {
+  BOOT_CAMERA = 0x01,
+  BOOT_STORAGE = 0x02,
+  BOOT_INFERENCE = 0x04
+};
+uint8_t bootReady = 0;
+
+// Set by initializeCamera() depending on PSRAM, a config can only go below
+// that, see applyArchiveConfig()
+framesize_t archiveFrameSize = FRAMESIZE_SVGA;
+int archiveJpegQuality = 12;
+bool dualStreamActive = false;
+bool doubleBuffered = false;
+
+/*  CAMERA STREAMS  */
+// The frame buffers are allocated for the archive stream in initializeCamera(),
+// so the smaller detector stream always fits into them.
+bool switchCameraStream(bool archive) {
+  sensor_t *sensor = esp_camera_sensor_get();
+  if (!sensor) {
+    return false;
   }
-  
-  PictureReportPackage oldestReport;
-  reportQueue.peek(&oldestReport);
-  if (mesh.sendPackage(&oldestReport)) {
-    Serial.printf("taskSendReport: Transmission of report %s was successful.\n", oldestReport.getFullReportName().c_str());
-    reportQueue.drop();
+
+  bool success;
+  if (archive) {
+    success = sensor->set_pixformat(sensor, PIXFORMAT_JPEG) == 0
+              && sensor->set_framesize(sensor, archiveFrameSize) == 0
+              && sensor->set_quality(sensor, archiveJpegQuality) == 0;
   } else {
-    Serial.printf("taskSendReport: Failed to send report %s!\n", oldestReport.getFullReportName().c_str());
+    success = sensor->set_pixformat(sensor, DETECTOR_PIXEL_FORMAT) == 0
+              && sensor->set_framesize(sensor, DETECTOR_FRAME_SIZE) == 0;
+  }
+
+  // The next frame was still exposed with the old settings
+  camera_fb_t *staleFrame = esp_camera_fb_get();
+  if (staleFrame) {
+    esp_camera_fb_return(staleFrame);
   }
+  return success;
 }
 
-void takePicture();
-Task taskTakePicture(TASK_SECOND * 120, TASK_FOREVER, &takePicture);
-void takePicture() {
-  Serial.println("taskTakePicture: Starting to take a picture.");
-  fs::FS &fs = SD_MMC;
-  unsigned long nextPictureIndex = EEPROM.readULong(PICTURE_INDEX_ADDRESS);
-  EEPROM.writeULong(PICTURE_INDEX_ADDRESS, nextPictureIndex + 1);   // increment picture number in EEPROM
-  EEPROM.commit(); // EEPROM.end(); ???
-
-  // Take the picture
-  camera_fb_t * frameBuffer = NULL;
-  frameBuffer = esp_camera_fb_get();
-  if(!frameBuffer) {
-    Serial.println("taskTakePicture: Camera capture failed!");
-    return;
+// Hands the frame back to the driver and returns to the detector stream.
+// Switching needs a free frame buffer, so with a single one this can't
+// happen any earlier. Double-buffered captures switch back in captureStage().
+void releaseFrame(camera_fb_t *frameBuffer) {
+  esp_camera_fb_return(frameBuffer);
+  if (dualStreamActive && !doubleBuffered && !switchCameraStream(false)) {
+    Serial.println("camera: Could not switch back to the detector stream!");
   }
-  
-  // Save the picture to the sd card
-  String path = String(PICTURES_PATH) + "/" + String(mesh.getNodeId()).substring(7) + "_" + String(nextPictureIndex) + ".jpg";
-  File file = fs.open(path.c_str(), FILE_WRITE);
-  if (!file) {
-    Serial.println("taskTakePicture: Failed to open file in writing mode!");
+}
+/*  END OF CAMERA STREAMS  */
+
+/*  CAPTURE PIPELINE  */
+// trigger -> capture -> persist -> classify -> enqueue
+// Contexts are reused by every capture. Paths are formatted into their
+// fixed buffers, so the pipeline never touches the heap.
+// The scheduler on the mesh core only pushes the trigger, the capture
+// worker on the other core runs the pipeline. Double-buffered, persist and
+// classify of frame N run in parallel while frame N+1 is captured.
+// Reports come back through lock-free rings, so the queue is only ever
+// touched by the mesh core, see drainReports().
+struct CaptureContext {
+  const char *taskName;
+  camera_fb_t *frameBuffer;
+  bool classified;
+  bool persisted;
+  std::atomic<int> pendingStages;
+  PictureReportPackage report;
+  Thumbnail thumbnail;    // pixels stay NULL without a detector
+  char picturePath[PATH_BUFFER_SIZE];
+};
+CaptureContext captureContexts[CAPTURE_CONTEXT_COUNT];
+QueueHandle_t freeCaptureContexts = NULL;
+QueueHandle_t persistJobs = NULL;
+QueueHandle_t classifyJobs = NULL;
+
+// One ring per producer, so every ring has a single writer: the persist and
+// the classify worker double-buffered, the capture worker in persistReports
+// otherwise. Drained by the mesh core.
+typedef SpscRing<PictureReportPackage, REPORT_RING_SIZE> ReportRing;
+ReportRing persistReports;
+ReportRing classifyReports;
+
+// Can be changed over the mesh
+float deerThreshold() {
+  return configStore.get().deerThreshold;
+}
+
+Thumbnail *thumbnailFor(CaptureContext &context) {
+  return context.thumbnail.pixels ? &context.thumbnail : NULL;
+}
+
+camera_fb_t *grabFrame() {
+  uint32_t startCycles = Telemetry::startTimer();
+  camera_fb_t *frameBuffer = esp_camera_fb_get();
+  telemetry.stopTimer(TIMER_CAPTURE, startCycles);
+  return frameBuffer;
+}
+
+bool classifyFrame(CaptureContext &context) {
+  uint32_t startCycles = Telemetry::startTimer();
+  bool classified = detectDeer(context.frameBuffer, context.report.deerProbability, thumbnailFor(context));
+  telemetry.stopTimer(TIMER_INFERENCE, startCycles);
+  return classified;
+}
+
+// Hands the frame back right away if nothing moved since the last ones
+bool sceneChanged(CaptureContext &context) {
+  if (!MOTION_GATE || motionGate.hasMotion(context.frameBuffer)) {
+    return true;
+  }
+  telemetry.count(COUNTER_MOTION_SKIPS);
+  esp_camera_fb_return(context.frameBuffer);
+  context.frameBuffer = NULL;
+  return false;
+}
+
+// Grabs the frame to archive. In dual-stream mode the detector frame is
+// classified first and nothing is archived if there is no deer on it.
+// Either way nothing happens if the motion gate sees an unchanged scene.
+bool captureStage(CaptureContext &context) {
+  context.frameBuffer = grabFrame();
+  context.report.captureTime = mesh.getNodeTime();
+  if (!context.frameBuffer) {
+    Serial.printf("%s: Camera capture failed!\n", context.taskName);
+    return false;
+  }
+  if (!dualStreamActive) {
+    if (!sceneChanged(context)) {
+      Serial.printf("%s: Scene did not change, skipping the picture.\n", context.taskName);
+      return false;
+    }
+    return true;
+  }
+
+  // Detector frame is never archived. Quiet scenes are skipped silently,
+  // they come every DETECTOR_SAMPLE_INTERVAL.
+  if (!sceneChanged(context)) {
+    return false;
+  }
+  context.classified = classifyFrame(context);
+  esp_camera_fb_return(context.frameBuffer);
+  context.frameBuffer = NULL;
+  if (context.classified && context.report.deerProbability < deerThreshold()) {
+    return false;
+  }
+
+  Serial.printf("%s: Deer probability %.2f, switching to the archive stream.\n",
+                context.taskName, context.report.deerProbability);
+  if (!switchCameraStream(true)) {
+    Serial.printf("%s: Could not switch to the archive stream!\n", context.taskName);
+  }
+  context.frameBuffer = grabFrame();
+  if (!context.frameBuffer || doubleBuffered) {
+    // The second frame buffer is still free, so go back right away
+    switchCameraStream(false);
+  }
+  if (!context.frameBuffer) {
+    Serial.printf("%s: Camera capture failed!\n", context.taskName);
+    return false;
+  }
+  return true;
+}
+
+// Saves the picture to the sd card under the next picture index
+void persistStage(CaptureContext &context) {
+  context.report.from = mesh.getNodeId();
+  context.report.dest = DEST_NODE;
+  context.report.pictureIndex = pictureCounter.next();   // RAM only, see renewCounters()
+  context.report.pictureCount = 1;
+
+  uint32_t startCycles = Telemetry::startTimer();
+  context.persisted = pictureStore.save(context.report, context.frameBuffer->buf, context.frameBuffer->len,
+                                        context.picturePath, PATH_BUFFER_SIZE);
+  telemetry.stopTimer(TIMER_SD_WRITE, startCycles);
+  if (context.persisted) {
+    telemetry.count(COUNTER_SD_BYTES, context.frameBuffer->len);
+  }
+  if (!context.persisted) {
+    Serial.printf("%s: Could not save %s!\n", context.taskName, context.picturePath);
   } else {
-    file.write(frameBuffer->buf, frameBuffer->len);   // payload (image), payload length
-    Serial.printf("taskTakePicture: Saved picture to path: %s\n", path.c_str());
+    Serial.printf("%s: Saved picture to path: %s\n", context.taskName, context.picturePath);
   }
-  file.close();
-  
-  // Build the new report
-  // TODO: put report handling in separate function
-  PictureReportPackage newReport;
-  newReport.from = mesh.getNodeId();
-  newReport.dest = DEST_NODE;
-  newReport.pictureIndex = nextPictureIndex;
-  newReport.deerProbability = 0.5; // put tensorflow stuff here later
-
-  // Save Report to SD card
-  String newReportLogPath = String(REPORTS_PATH) + "/" + newReport.getFullReportName();
-  File newReportLog = fs.open(newReportLogPath, FILE_WRITE);
-  if (!newReportLog) {
-    Serial.printf("taskTakePicture: Could not create %s!\n", newReportLogPath.c_str());
+}
+
+void classifyStage(CaptureContext &context) {
+  if (!context.classified) {
+    context.classified = classifyFrame(context);
+  }
+  if (!context.classified) {
+    context.report.deerProbability = deerThreshold();   // unclassified, let a human decide
+  }
+}
+
+// Mesh core only. Drops the least valuable report if the queue is full and
+// creates an error log, that can be the new one as well.
+void queueReport(PictureReportPackage &newReport) {
+  if (reportQueue.isFull()) {
+    Serial.println("queue: Queue is full.");
+
+    PictureReportPackage droppedReport;
+    if (!reportQueue.evict(newReport, droppedReport)) {
+      droppedReport = newReport;
+    }
+    Serial.printf("queue: Dropped the report about picture %lu.\n", droppedReport.pictureIndex);
+    telemetry.count(COUNTER_DROPS);
+    errorLog.append(droppedReport.pictureIndex,
+                    "{\"error\":\"dropped\",\"from\":%u,\"pictureIndex\":%lu,\"pictureCount\":%u,\"deerProbability\":%.2f}",
+                    droppedReport.from, droppedReport.pictureIndex, droppedReport.pictureCount,
+                    droppedReport.deerProbability);
+    if (droppedReport.pictureIndex == newReport.pictureIndex) {
+      return;
+    }
+  }
+
+  // Push new report to queue
+  newReport.enqueueTime = mesh.getNodeTime();
+  if (reportQueue.push(newReport)) {
+    Serial.printf("queue: Pushed the report about picture %lu.\n", newReport.pictureIndex);
   } else {
-    // TODO: Use proper json objects
-    newReportLog.printf("Report about %s\n\n", newReport.getFullPictureName().c_str());
-    newReportLog.printf("from: %zu\n", newReport.from);
-    newReportLog.printf("dest: %zu\n", newReport.dest);
-    newReportLog.printf("pictureIndex: %lu\n", newReport.pictureIndex);
-    newReportLog.printf("deerProbability: %.2f\n", newReport.deerProbability);
-    newReportLog.close();
+    Serial.println("queue: Could not push report to queue!");
+  }
+}
 
-    Serial.printf("taskTakePicture: Saved report to path: %s\n", newReportLogPath.c_str());
+// Logs the report and hands it to the mesh core if it shows a deer.
+// Without a ring it is already on the mesh core.
+void enqueueStage(CaptureContext &context, ReportRing *reports) {
+  PictureReportPackage &newReport = context.report;
+  if (context.persisted) {
+    pictureStore.addToIndex(newReport, context.frameBuffer->len);
+    // Comes from the detector pass, in dual-stream mode from the detector frame
+    if (newReport.deerProbability >= deerThreshold() && context.thumbnail.width > 0
+        && pictureStore.saveThumbnail(newReport, context.thumbnail.pixels,
+                                      context.thumbnail.width, context.thumbnail.height)) {
+      Serial.printf("%s: Saved a %ux%u thumbnail.\n", context.taskName,
+                    context.thumbnail.width, context.thumbnail.height);
+    }
+  }
+  bool logged = reportLog.append(newReport.pictureIndex,
+                                 "{\"picture\":\"%s\",\"from\":%u,\"dest\":%u,\"pictureIndex\":%lu,\"deerProbability\":%.2f}",
+                                 context.picturePath, newReport.from, newReport.dest,
+                                 newReport.pictureIndex, newReport.deerProbability);
+  if (logged) {
+    Serial.printf("%s: Logged report about %s.\n", context.taskName, context.picturePath);
   }
 
   // Return if no deer was found
-  if (newReport.deerProbability < 0.5) {
-    Serial.printf("taskTakePicture: No deer found on %s.\n", newReport.getFullPictureName().c_str());
-    Serial.println("taskTakePicture: Report will not get pushed to queue.");
-    esp_camera_fb_return(frameBuffer);
+  if (newReport.deerProbability < deerThreshold()) {
+    Serial.printf("%s: No deer found on %s.\n", context.taskName, context.picturePath);
+    Serial.printf("%s: Report will not get pushed to queue.\n", context.taskName);
     return;
   }
 
-  // Drop oldest report if queue is full and create error log.
-  if (reportQueue.isFull()) {
-    Serial.println("taskTakePicture: Queue is full.");
-
-    PictureReportPackage oldestReport;
-    reportQueue.pop(&oldestReport);
-    Serial.printf("taskTakePicture: Dropped the oldest report: %s\n", oldestReport.getFullReportName().c_str());
-    String newErrorLogPath = String(ERROR_LOGS_PATH) + "/" + oldestReport.getFullErrorName();
-    File newErrorLog = fs.open(newErrorLogPath.c_str(), FILE_WRITE);
-    if (!newErrorLog) {
-      Serial.printf("taskTakePicture: Could not create %s!\n", newErrorLogPath.c_str());
-    } else {
-      Serial.printf("taskTakePicture: Saved error log to path: %s\n", newErrorLogPath.c_str());
-      newErrorLog.close();
-    }
+  if (!reports) {
+    queueReport(newReport);
+    return;
   }
+  // Only full if the mesh core is stuck, the frame is held until it drains
+  while (!reports->push(newReport)) {
+    vTaskDelay(pdMS_TO_TICKS(REPORT_DRAIN_INTERVAL));
+  }
+  Serial.printf("%s: Handed the report over to the mesh core.\n", context.taskName);
+}
 
-  // Push new report to queue
-  reportQueue.push(&newReport);
-  Serial.println("taskTakePicture: Pushed report to queue.");
+// Mesh core only
+void drainReports() {
+  PictureReportPackage report;
+  while (persistReports.pop(report)) {
+    queueReport(report);
+  }
+  while (classifyReports.pop(report)) {
+    queueReport(report);
+  }
+}
+
+void finishCapture(CaptureContext &context, ReportRing *reports) {
+  enqueueStage(context, reports);
 
   // Cleanup
-  esp_camera_fb_return(frameBuffer);
+  releaseFrame(context.frameBuffer);
   digitalWrite(GPIO_NUM_4, LOW);
+  if (doubleBuffered) {
+    CaptureContext *freeContext = &context;
+    xQueueSend(freeCaptureContexts, &freeContext, portMAX_DELAY);
+  }
 }
 
-void takePicturePIR();
-Task taskTakePicturePIR(TASK_SECOND * 15, TASK_FOREVER, &takePicturePIR);
-void takePicturePIR() {
-  // Return if no movement is being detected
-  if (digitalRead(PIR_SENSOR_PIN) == HIGH) {   // TODO: Check if HIGH or LOW
+// The last of the two workers to finish its stage hands the report on
+void completeStage(CaptureContext &context, ReportRing &reports) {
+  if (--context.pendingStages == 0) {
+    finishCapture(context, &reports);
+  }
+}
+
+void persistWorker(void *parameter) {
+  CaptureContext *context;
+  for (;;) {
+    if (xQueueReceive(persistJobs, &context, portMAX_DELAY) == pdTRUE) {
+      persistStage(*context);
+      completeStage(*context, persistReports);
+    }
+  }
+}
+
+void classifyWorker(void *parameter) {
+  CaptureContext *context;
+  for (;;) {
+    if (xQueueReceive(classifyJobs, &context, portMAX_DELAY) == pdTRUE) {
+      classifyStage(*context);
+      completeStage(*context, classifyReports);
+    }
+  }
+}
+
+bool startStageWorkers() {
+  freeCaptureContexts = xQueueCreate(CAPTURE_CONTEXT_COUNT, sizeof(CaptureContext *));
+  persistJobs = xQueueCreate(CAPTURE_CONTEXT_COUNT, sizeof(CaptureContext *));
+  classifyJobs = xQueueCreate(CAPTURE_CONTEXT_COUNT, sizeof(CaptureContext *));
+  if (!freeCaptureContexts || !persistJobs || !classifyJobs) {
+    return false;
+  }
+  for (int i = 0; i < CAPTURE_CONTEXT_COUNT; i++) {
+    CaptureContext *context = &captureContexts[i];
+    xQueueSend(freeCaptureContexts, &context, 0);
+  }
+  return xTaskCreatePinnedToCore(&persistWorker, "persistWorker", CAPTURE_WORKER_STACK_SIZE, NULL,
+                                 CAPTURE_WORKER_PRIORITY, NULL, CAPTURE_WORKER_CORE) == pdPASS
+         && xTaskCreatePinnedToCore(&classifyWorker, "classifyWorker", CAPTURE_WORKER_STACK_SIZE, NULL,
+                                    CAPTURE_WORKER_PRIORITY, NULL, CAPTURE_WORKER_CORE) == pdPASS;
+}
+
+// Only the capture worker takes the triggers off the ring
+struct CaptureTrigger {
+  const char *taskName;
+};
+SpscRing<CaptureTrigger, CAPTURE_TRIGGER_RING_SIZE> captureTriggers;
+TaskHandle_t captureWorkerHandle = NULL;
+std::atomic<bool> captureRunning(false);
+std::atomic<bool> archiveConfigChanged(false);    // applied by the capture worker, see applyConfig()
+
+// A trigger waits or a frame is between capture and enqueue on the worker core
+bool captureInFlight() {
+  if (!captureWorkerHandle) {
+    return false;
+  }
+  return captureRunning || !captureTriggers.isEmpty()
+         || (doubleBuffered && uxQueueMessagesWaiting(freeCaptureContexts) != CAPTURE_CONTEXT_COUNT);
+}
+
+void runCapturePipeline(const char *taskName, ReportRing *reports) {
+  CaptureContext *context = &captureContexts[0];
+  if (doubleBuffered && xQueueReceive(freeCaptureContexts, &context, 0) != pdTRUE) {
+    Serial.printf("%s: Both frames are still being processed, skipping.\n", taskName);
     return;
   }
-  
-  Serial.println("taskTakePicturePIR: Starting to take a picture.");
-  fs::FS &fs = SD_MMC;
-  unsigned long nextPictureIndex = EEPROM.readULong(PICTURE_INDEX_ADDRESS);
-  EEPROM.writeULong(PICTURE_INDEX_ADDRESS, nextPictureIndex + 1);   // increment picture number in EEPROM
-  EEPROM.commit(); // EEPROM.end(); ???
-
-  // Taking the picture
-  camera_fb_t * frameBuffer = NULL;
-  frameBuffer = esp_camera_fb_get();
-  if(!frameBuffer) {
-    Serial.println("taskTakePicturePIR: Camera capture failed!");
+  context->taskName = taskName;
+  context->frameBuffer = NULL;
+  context->classified = false;
+  context->persisted = false;
+  context->thumbnail.width = 0;
+  context->thumbnail.height = 0;
+
+  if (!captureStage(*context)) {
+    if (doubleBuffered) {
+      xQueueSend(freeCaptureContexts, &context, portMAX_DELAY);
+    }
     return;
   }
-  
-  // Saving the picture to the sd card
-  String path = String(PICTURES_PATH) + "/" + String(mesh.getNodeId()).substring(7) + "_" + String(nextPictureIndex) + ".jpg";
-  File file = fs.open(path.c_str(), FILE_WRITE);
-  if(!file) {
-    Serial.println("taskTakePicturePIR: Failed to open file in writing mode!");
+
+  if (doubleBuffered) {
+    context->pendingStages = 2;
+    xQueueSend(persistJobs, &context, portMAX_DELAY);
+    xQueueSend(classifyJobs, &context, portMAX_DELAY);
+    return;
+  }
+  persistStage(*context);
+  classifyStage(*context);
+  finishCapture(*context, reports);
+}
+
+void applyArchiveConfig(const NodeConfig &config);
+
+void captureWorker(void *parameter) {
+  CaptureTrigger trigger;
+  for (;;) {
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    captureRunning = true;
+    while (captureTriggers.pop(trigger)) {
+      if (archiveConfigChanged.exchange(false)) {
+        applyArchiveConfig(configStore.get());
+      }
+      runCapturePipeline(trigger.taskName, &persistReports);
+    }
+    captureRunning = false;
+  }
+}
+
+bool startCaptureWorker() {
+  return xTaskCreatePinnedToCore(&captureWorker, "captureWorker", CAPTURE_WORKER_STACK_SIZE, NULL,
+                                 CAPTURE_WORKER_PRIORITY, &captureWorkerHandle, CAPTURE_WORKER_CORE) == pdPASS;
+}
+
+// Never blocks the scheduler, a trigger is skipped if the worker is still
+// busy with the last ones. Without the worker the pipeline runs right here.
+void triggerCapture(const char *taskName) {
+  if (!captureWorkerHandle) {
+    runCapturePipeline(taskName, NULL);
+    return;
+  }
+  CaptureTrigger trigger = {taskName};
+  if (!captureTriggers.push(trigger)) {
+    Serial.printf("%s: Capture worker is still busy, skipping.\n", taskName);
+    return;
+  }
+  xTaskNotifyGive(captureWorkerHandle);
+}
+/*  END OF CAPTURE PIPELINE  */
+
+/*  USER TASKS  */
+// Nodes that take the reports of the others and announce themselves to them,
+// see gatewaytable.h. If one goes down, the reports go to the next best one.
+const uint32_t gatewayNodes[] = { DEST_NODE };
+
+bool isGateway() {
+  for (uint32_t gateway : gatewayNodes) {
+    if (gateway == mesh.getNodeId()) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Destinations that understand CompactReportPackage, any other one gets json.
+// Announced gateways say so themselves.
+const uint32_t compactReportDestinations[] = { DEST_NODE };
+
+bool receivesCompactReports(uint32_t destination) {
+  if (FORCE_JSON_REPORTS) {
+    return false;
+  }
+  if (gatewayTable.acceptsCompactReports(destination)) {
+    return true;
+  }
+  for (uint32_t compactDestination : compactReportDestinations) {
+    if (compactDestination == destination) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void receiveReport(const PictureReportPackage &package);
+
+// Moves the reports of the capture workers into the queue, see drainReports()
+Task taskDrainReports(REPORT_DRAIN_INTERVAL, TASK_FOREVER, &drainReports);
+
+// Drains the queue as fast as the mesh accepts the reports, in batches of
+// up to REPORT_BATCH_SIZE. Only backs off exponentially if sending fails
+// and there is no other gateway to fail over to.
+unsigned long sendBackoff = 0;
+void sendReport();
+Task taskSendReport(SEND_INTERVAL_IDLE, TASK_FOREVER, &sendReport);
+void sendReport() {
+  reportQueue.flushCoalesced();
+  PictureReportPackage reports[REPORT_BATCH_SIZE];
+  uint16_t reportCount = reportQueue.peekBest(reports, REPORT_BATCH_SIZE);
+  if (reportCount == 0) {
+    taskSendReport.setInterval(configStore.get().sendInterval);
+    return;
+  }
+
+  // Compact binary batch if the destination understands it, else json.
+  // A lone json report goes out as type 31, so older destination nodes still read it.
+  bool sent;
+  uint32_t gateway = isGateway() ? mesh.getNodeId() : gatewayTable.choose();
+  PictureReportBatchPackage batch;
+  batch.from = reports[0].from;
+  batch.dest = gateway;
+  batch.sendTime = max(mesh.getNodeTime(), (uint32_t) 1);   // 0 means no timestamps
+  reports[0].sendTime = batch.sendTime;
+  for (uint16_t i = 0; i < reportCount; i++) {
+    reports[i].dest = gateway;
+    batch.add(reports[i]);
+  }
+
+  // painlessMesh turns the package into json inside sendPackage(), so "send" includes that
+  CompactReportPackage compactBatch;
+  uint32_t startCycles = Telemetry::startTimer();
+  bool compact = receivesCompactReports(batch.dest) && compactBatch.encode(batch);
+  telemetry.stopTimer(TIMER_SERIALIZE, startCycles);
+  startCycles = Telemetry::startTimer();
+  if (gateway == mesh.getNodeId()) {
+    // A gateway takes its own reports
+    for (uint16_t i = 0; i < reportCount; i++) {
+      receiveReport(reports[i]);
+    }
+    sent = true;
+  } else if (compact) {
+    sent = mesh.sendPackage(&compactBatch);
+  } else if (reportCount == 1) {
+    sent = mesh.sendPackage(&reports[0]);
   } else {
-    file.write(frameBuffer->buf, frameBuffer->len);   
-    Serial.printf("taskTakePicturePIR: Saved picture to path: %s\n", path.c_str());
+    sent = mesh.sendPackage(&batch);
   }
-  file.close();
-  
-  // Build the new report
-  PictureReportPackage newReport;
-  newReport.from = mesh.getNodeId();
-  newReport.dest = DEST_NODE;
-  newReport.pictureIndex = nextPictureIndex;
-  newReport.deerProbability = 0.5; // put tensorflow stuff here later
-
-  // Save Report to SD card
-  String newReportLogPath = String(REPORTS_PATH) + "/" + newReport.getFullReportName();
-  File newReportLog = fs.open(newReportLogPath, FILE_WRITE);
-  if (!newReportLog) {
-    Serial.printf("taskTakePicturePIR: Could not create %s!\n", newReportLogPath.c_str());
+  telemetry.stopTimer(TIMER_SEND, startCycles);
+  telemetry.count(sent ? COUNTER_REPORTS_SENT : COUNTER_SEND_FAILURES, sent ? reportCount : 1);
+  gatewayTable.reportOutcome(gateway, sent);
+
+  if (sent) {
+    reportQueue.dropPeeked();
+  }
+  bool queueEmpty = reportQueue.isEmpty();
+
+  if (sent) {
+    Serial.printf("taskSendReport: Transmission of %u report(s) was successful.\n", reportCount);
+    sendBackoff = 0;
+    taskSendReport.setInterval(queueEmpty ? configStore.get().sendInterval : SEND_INTERVAL_DRAIN);
+  } else if (gatewayTable.choose() != gateway) {
+    Serial.printf("taskSendReport: Failed to send %u report(s) to %u, trying the next gateway.\n",
+                  reportCount, gateway);
+    taskSendReport.setInterval(SEND_INTERVAL_DRAIN);
   } else {
-    // TODO: Use proper json objects
-    newReportLog.printf("Report about %s\n\n", newReport.getFullPictureName().c_str());
-    newReportLog.printf("from: %zu\n", newReport.from);
-    newReportLog.printf("dest: %zu\n", newReport.dest);
-    newReportLog.printf("pictureIndex: %lu\n", newReport.pictureIndex);
-    newReportLog.printf("deerProbability: %.2f\n", newReport.deerProbability);
-    newReportLog.close();
+    sendBackoff = sendBackoff ? min<unsigned long>(sendBackoff * 2, SEND_BACKOFF_MAX) : SEND_BACKOFF_MIN;
+    Serial.printf("taskSendReport: Failed to send %u report(s), next try in %lu ms!\n", reportCount, sendBackoff);
+    taskSendReport.setInterval(sendBackoff);
+  }
+}
 
-    Serial.printf("taskTakePicture: Saved report to path: %s\n", newReportLogPath.c_str());
+// Chunks only go out while no reports are waiting, so a picture never
+// holds up the reports behind it
+void transferPicture();
+Task taskTransferPicture(TASK_MILLISECOND * PICTURE_CHUNK_INTERVAL, TASK_FOREVER, &transferPicture);
+void transferPicture() {
+  bool reportsDraining = !reportQueue.isEmpty() && sendBackoff == 0;
+  if (!reportsDraining) {
+    pictureSender.sendNext();
   }
+  pictureReceiver.update();
+}
 
-  // Return if no deer was found
-  if (newReport.deerProbability < 0.5) {
-    Serial.printf("taskTakePicturePIR: No deer found on %s.\n", newReport.getFullPictureName().c_str());
-    Serial.println("taskTakePicturePIR: Report will not get pushed to queue.");
-    esp_camera_fb_return(frameBuffer);
+// Update chunks give way to the reports as well
+void transferUpdate();
+Task taskTransferUpdate(TASK_MILLISECOND * UPDATE_CHUNK_INTERVAL, TASK_FOREVER, &transferUpdate);
+void transferUpdate() {
+  bool reportsDraining = !reportQueue.isEmpty() && sendBackoff == 0;
+  meshUpdater.update(!reportsDraining);
+}
+
+void offerUpdates();
+Task taskOfferUpdates(UPDATE_OFFER_INTERVAL, TASK_FOREVER, &offerUpdates);
+void offerUpdates() {
+  meshUpdater.offer();
+}
+
+void receiveTelemetry(const TelemetryRecord &record);
+
+// A gateway only prints its own record
+void sendTelemetry();
+Task taskSendTelemetry(TELEMETRY_INTERVAL, TASK_FOREVER, &sendTelemetry);
+void sendTelemetry() {
+  uint32_t queueDepth = reportQueue.getCount();
+
+  TelemetryRecord record;
+  telemetry.snapshot(record, mesh.getNodeId(), mesh.getNodeTime(), bootIndex, queueDepth);
+  if (!telemetry.write(record)) {
+    Serial.println("taskSendTelemetry: Could not write to the ring log!");
+  }
+
+  if (isGateway()) {
+    receiveTelemetry(record);
     return;
   }
+  gatewayTable.print();
+  TelemetryPackage package;
+  package.from = mesh.getNodeId();
+  package.dest = gatewayTable.choose();
+  bool sent = package.encode(record) && mesh.sendPackage(&package);
+  gatewayTable.reportOutcome(package.dest, sent);
+  if (!sent) {
+    Serial.println("taskSendTelemetry: Could not send the telemetry!");
+  }
+}
 
-  // Drop oldest report if queue is full and create error log.
-  if (reportQueue.isFull()) {
-    Serial.println("taskTakePicturePIR: Queue is full.");
-
-    PictureReportPackage oldestReport;
-    reportQueue.pop(&oldestReport);
-    Serial.printf("taskTakePicturePIR: Dropped the oldest report: %s\n", oldestReport.getFullReportName().c_str());
-    String newErrorLogPath = String(ERROR_LOGS_PATH) + "/" + oldestReport.getFullErrorName();
-    File newErrorLog = fs.open(newErrorLogPath.c_str(), FILE_WRITE);
-    if (!newErrorLog) {
-      Serial.printf("taskTakePicturePIR: Could not create %s!\n", newErrorLogPath.c_str());
-    } else {
-      Serial.printf("taskTakePicturePIR: Saved error log to path: %s\n", newErrorLogPath.c_str());
-      newErrorLog.close();
-    }
+// Also right after the connections changed, so new and woken nodes don't
+// have to wait for the next round
+void broadcastConfig() {
+  ConfigPackage package;
+  package.from = mesh.getNodeId();
+  package.config = configStore.get();
+  if (!mesh.sendPackage(&package)) {
+    Serial.println("config: Could not broadcast the config!");
   }
+}
 
-  // Push new report to queue
-  reportQueue.push(&newReport);
-  Serial.println("taskTakePicture: Pushed report to queue.");
+void announceGateway();
+Task taskAnnounceGateway(GATEWAY_ANNOUNCE_INTERVAL, TASK_FOREVER, &announceGateway);
+void announceGateway() {
+  GatewayAnnouncePackage package;
+  package.from = mesh.getNodeId();
+  package.sendTime = mesh.getNodeTime();
+  package.flags = FORCE_JSON_REPORTS ? 0 : GATEWAY_COMPACT_REPORTS;
+  if (!mesh.sendPackage(&package)) {
+    Serial.println("taskAnnounceGateway: Could not announce this gateway!");
+  }
+  // Only a config that was changed somewhere has to go around
+  if (configStore.get().sequence > 0) {
+    broadcastConfig();
+  }
+}
 
-  // Cleanup
-  esp_camera_fb_return(frameBuffer);
-  digitalWrite(GPIO_NUM_4, LOW);
+void takePicture();
+Task taskTakePicture(CAPTURE_INTERVAL, TASK_FOREVER, &takePicture);
+void takePicture() {
+  triggerCapture("taskTakePicture");
+}
+
+// Set by the PIR interrupt, the scheduler must not be touched from an ISR
+volatile bool pirEventPending = false;
+volatile unsigned long lastPirEdgeMillis = 0;
+
+void IRAM_ATTR onPirEdge() {
+  unsigned long now = millis();
+  if (now - lastPirEdgeMillis >= PIR_DEBOUNCE_MS) {
+    lastPirEdgeMillis = now;
+    pirEventPending = true;
+  }
+}
+
+void takePicturePIR();
+Task taskTakePicturePIR(PIR_BURST_INTERVAL, PIR_BURST_COUNT, &takePicturePIR);
+void takePicturePIR() {
+  // End the burst early once the movement is over
+  if (!taskTakePicturePIR.isFirstIteration() && digitalRead(pirPin) != PIR_MOTION_LEVEL) {
+    taskTakePicturePIR.disable();
+    return;
+  }
+  triggerCapture("taskTakePicturePIR");
+}
+
+void handlePirEvent();
+Task taskHandlePirEvent(PIR_POLL_INTERVAL, TASK_FOREVER, &handlePirEvent);
+void handlePirEvent() {
+  if (!pirEventPending) {
+    return;
+  }
+  pirEventPending = false;
+
+  // Starts a new burst right away, a running burst starts over
+  Serial.println("taskHandlePirEvent: Movement detected.");
+  taskTakePicturePIR.restart();
+}
+
+void enablePirTrigger() {
+  attachInterrupt(digitalPinToInterrupt(pirPin), &onPirEdge,
+                  PIR_MOTION_LEVEL == HIGH ? RISING : FALLING);
+  taskHandlePirEvent.setInterval(configStore.get().pirPollInterval);
+  taskHandlePirEvent.enableIfNot();
+}
+
+// Mesh time, estimated from before deep sleep until the mesh synced again
+uint32_t meshTime() {
+  if (meshTimeSynced || !warmStart || !warmState.meshTimeValid) {
+    return mesh.getNodeTime();
+  }
+  return (uint32_t) (rtcMicros() + warmState.meshTimeOffset);
 }
 
 void logUptime();
 Task taskLogUptime(TASK_MINUTE * 10, TASK_FOREVER, &logUptime);
 void logUptime() {
-  fs::FS &fs = SD_MMC;
-  File uptimeLog = fs.open(uptimeLogPath.c_str(), FILE_APPEND);
-  if(!uptimeLog) {
-    Serial.printf("taskInitializeStorage: Failed to open %s!\n", uptimeLogPath.c_str());
-  } else {
-    float newUptime = (float) millis() / 60000;   // uptime in minutes
-    String newUptimeEntry = String(newUptime) + " min" ;
-    uptimeLog.println(newUptimeEntry.c_str());
-    uptimeLog.close();
-
+  float newUptime = (float) (rtcMicros() / 1000) / 60000;   // uptime in minutes, including deep sleep
+  if (uptimeLog.append(bootIndex, "{\"boot\":%lu,\"uptime\":%.2f,\"meshTime\":%u}",
+                       bootIndex, newUptime, meshTime())) {
     Serial.printf("taskLogUptime: Appended new uptime: %.2f min.\n", newUptime);
   }
 }
 
+// Records wait in RAM until a buffer fills up or gets too old
+void flushLogs();
+Task taskFlushLogs(LOG_FLUSH_CHECK_INTERVAL, TASK_FOREVER, &flushLogs);
+void flushLogs() {
+  reportLog.flushIfStale();
+  errorLog.flushIfStale();
+  uptimeLog.flushIfStale();
+  eventLog.flushIfStale();
+}
+
+// Keeps flash writes off the capture path
+void renewCounters();
+Task taskRenewCounters(COUNTER_RENEW_INTERVAL, TASK_FOREVER, &renewCounters);
+void renewCounters() {
+  pictureCounter.renewIfLow();
+}
 
-void resetEeprom(int range) {
-  for (int eepromAddress = 0; eepromAddress < range; eepromAddress++) {
-    EEPROM.write(eepromAddress, 0);
+// FatFs walks the whole FAT to count the free clusters after a mount and
+// whenever it lost track, seconds on a large card. So the space is measured
+// on the worker core, and each call of the task takes the last measurement.
+enum CardSpaceState {
+  CARD_SPACE_IDLE,
+  CARD_SPACE_RUNNING,
+  CARD_SPACE_DONE
+};
+std::atomic<int> cardSpaceState(CARD_SPACE_IDLE);
+uint64_t cardTotalBytes = 0;
+uint64_t cardUsedBytes = 0;
+
+void cardSpaceWorker(void *parameter) {
+  cardTotalBytes = SD_MMC.totalBytes();
+  cardUsedBytes = SD_MMC.usedBytes();
+  cardSpaceState = CARD_SPACE_DONE;
+  vTaskDelete(NULL);
+}
+
+// Deletes old pictures once the card runs low, a batch at a time and
+// never while a capture uses the card
+bool retentionStuck = false;
+void manageRetention();
+Task taskManageRetention(RETENTION_CHECK_INTERVAL, TASK_FOREVER, &manageRetention);
+void manageRetention() {
+  if (cardSpaceState == CARD_SPACE_DONE) {
+    cardRetention.checkSpace(cardTotalBytes, cardUsedBytes);
+    cardSpaceState = CARD_SPACE_IDLE;
+  }
+  if (cardSpaceState == CARD_SPACE_IDLE) {
+    cardSpaceState = CARD_SPACE_RUNNING;
+    if (xTaskCreatePinnedToCore(&cardSpaceWorker, "cardSpace", CAPTURE_WORKER_STACK_SIZE, NULL,
+                                CAPTURE_WORKER_PRIORITY, NULL, CAPTURE_WORKER_CORE) != pdPASS) {
+      cardSpaceState = CARD_SPACE_IDLE;
+      Serial.println("taskManageRetention: Could not start measuring the free space, trying again later!");
+    }
+  }
+  if (!cardRetention.isEvicting()) {
+    retentionStuck = false;
+    taskManageRetention.setInterval(RETENTION_CHECK_INTERVAL);
+    return;
+  }
+  taskManageRetention.setInterval(RETENTION_EVICT_INTERVAL);
+  if (captureInFlight()) {
+    return;
+  }
+
+  uint32_t newestPicture = pictureCounter.peek();
+  uint32_t keepFrom = (newestPicture > RETENTION_RECENT_PICTURES) ? newestPicture - RETENTION_RECENT_PICTURES : 0;
+  uint32_t waitedFor = reportQueue.oldestPictureIndex();
+  if (cardRetention.evictSome(deerThreshold(), keepFrom, waitedFor)) {
+    return;
+  }
+
+  // Tried again once new pictures came in or reports went out
+  taskManageRetention.setInterval(RETENTION_CHECK_INTERVAL);
+  if (!retentionStuck) {
+    retentionStuck = true;
+    Serial.println("taskManageRetention: Every picture left on the card is still needed!");
+    cardRetention.print();
+    errorLog.append(newestPicture, "{\"error\":\"cardFull\",\"pictureIndex\":%u,\"freeMB\":%u}",
+                    newestPicture, (uint32_t) (cardRetention.getFreeBytes() >> 20));
+  }
+}
+
+void advanceBoot(BootStep step);
+
+void initializeInference();
+Task taskInitializeInference(TASK_IMMEDIATE, TASK_ONCE, &initializeInference);
+void initializeInference() {
+  // Started by advanceBoot() once both the camera and the sd card are ready
+  // The card can only have been swapped while the node was off
+  if (initializeDetector(SD_MMC, warmStart ? warmState.arenaHighWaterMark : 0, !warmStart)) {
+    Serial.println("taskInitializeInference: Deer detector is ready.");
+  } else {
+    Serial.println("taskInitializeInference: Deer detector is not available, reports stay unclassified!");
+  }
+
+  // Thumbnails are sampled by the detector, so they need it as well
+  if (isDetectorReady()) {
+    for (CaptureContext &context : captureContexts) {
+      context.thumbnail.pixels = (uint8_t *) heap_caps_malloc(THUMBNAIL_WIDTH * THUMBNAIL_HEIGHT,
+                                                              MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    }
+  }
+
+  // Without a detector there is nothing to watch the small stream with
+  if (DUAL_STREAM_CAPTURE && isDetectorReady()) {
+    dualStreamActive = switchCameraStream(false);
+    if (dualStreamActive) {
+      taskTakePicture.setInterval(configStore.get().detectorInterval);
+      Serial.println("taskInitializeInference: Sampling the detector stream, archiving only deer.");
+    } else {
+      switchCameraStream(true);
+      Serial.println("taskInitializeInference: Could not switch to the detector stream!");
+    }
+  }
+
+  if (!dualStreamActive) {
+    taskTakePicture.setInterval(configStore.get().captureInterval);
+  }
+
+  // Next state
+  taskTakePicture.enableIfNot();
+  enablePirTrigger();
+  advanceBoot(BOOT_INFERENCE);
+  taskInitializeInference.disable();
+}
+
+// Camera, sd card and mesh come up independently of each other. A step
+// that needs several of them starts as soon as the last one is ready.
+void advanceBoot(BootStep step) {
+  bootReady |= step;
+  const uint8_t inferenceNeeds = BOOT_CAMERA | BOOT_STORAGE;
+  if (step != BOOT_INFERENCE && (bootReady & inferenceNeeds) == inferenceNeeds) {
+    taskInitializeInference.enableIfNot();
   }
-  EEPROM.commit();
-  return;
+  if (step == BOOT_INFERENCE) {
+    Serial.printf("boot: Ready to take pictures after %lu ms.\n", millis());
+  }
+}
+
+// Failed boot steps try again with a doubled delay
+unsigned long nextBootRetry(unsigned long &retryDelay) {
+  retryDelay = retryDelay ? min((unsigned long) (retryDelay * 2), (unsigned long) BOOT_RETRY_MAX) : BOOT_RETRY_MIN;
+  return retryDelay;
 }
+
+unsigned long storageRetryDelay = 0;
+
 void initializeStorage();
-Task taskInitializeStorage(TASK_SECOND * 30, TASK_ONCE, &initializeStorage);
+Task taskInitializeStorage(TASK_IMMEDIATE, TASK_FOREVER, &initializeStorage);
 void initializeStorage() {
-  // Initializing EEPROM
-  EEPROM.begin(EEPROM_SIZE);
-  Serial.println("taskInitializeStorage: Initialized EEPROM.");
-  // resetEeprom(EEPROM_SIZE); // uncomment if needed
-
-  // Mounting the sd card
-  if (!SD_MMC.begin()) {
-    Serial.println("taskInitializeStorage: SD card mount failed!");
+  // resetCounters(); // uncomment if needed
+
+  // Mounting the sd card, 1-bit mode leaves GPIO 13 to the PIR
+  if (!SD_MMC.begin("/sdcard", LOW_POWER_MODE)) {
+    Serial.printf("taskInitializeStorage: SD card mount failed, trying again in %lu ms!\n",
+                  nextBootRetry(storageRetryDelay));
+    taskInitializeStorage.setInterval(storageRetryDelay);
     return;
   }
   uint8_t cardType = SD_MMC.cardType();
   if (cardType == CARD_NONE) {
-    Serial.println("taskInitializeStorage: No SD card attached!");
+    SD_MMC.end();
+    Serial.printf("taskInitializeStorage: No SD card attached, trying again in %lu ms!\n",
+                  nextBootRetry(storageRetryDelay));
+    taskInitializeStorage.setInterval(storageRetryDelay);
     return;
   }
   Serial.println("taskInitializeStorage: SD card mount was successful.");
   
-  // Creating directories
-  Serial.println("taskInitializeStorage: Starting to create nonexistent directories.");
+  // Creating directories, they all exist already after a deep-sleep wake
   fs::FS &fs = SD_MMC;
-  for (String currentDirectory: directories) {
-    if (!fs.exists(currentDirectory.c_str())) {
-      if (fs.mkdir(currentDirectory.c_str())) {
-        Serial.printf("taskInitializeStorage: Created directory: %s \n", currentDirectory.c_str());
+  if (!warmStart) {
+    Serial.println("taskInitializeStorage: Starting to create nonexistent directories.");
+  }
+  for (const char *currentDirectory: directories) {
+    if (warmStart) {
+      break;
+    }
+    if (!fs.exists(currentDirectory)) {
+      if (fs.mkdir(currentDirectory)) {
+        Serial.printf("taskInitializeStorage: Created directory: %s \n", currentDirectory);
       } else {
-        Serial.printf("taskInitializeStorage: Could not create directory: %s !\n", currentDirectory.c_str());
+        Serial.printf("taskInitializeStorage: Could not create directory: %s !\n", currentDirectory);
         // Try again?
       }
     } else {
-      Serial.printf("taskInitializeStorage: Directory %s already exists.\n", currentDirectory.c_str());
+      Serial.printf("taskInitializeStorage: Directory %s already exists.\n", currentDirectory);
+    }
+  }
+
+  // Recovering the reports that were not sent before the last reboot
+  if (!reportQueue.begin(fs, warmStart ? &warmState.reportQueue : NULL)) {
+    Serial.println("taskInitializeStorage: Report queue is not available!");
+  }
+
+  // Recovering the indices
+  // The card wins in case NVS was erased or it comes from a node with EEPROM counters
+  if (!pictureStore.begin(fs)) {
+    Serial.println("taskInitializeStorage: Pictures can not be saved!");
+  }
+  if (warmStart) {
+    // The counter never fell behind the card while sleeping
+    if (!pictureCounter.begin(0, &warmState.pictureCounter)) {
+      Serial.println("taskInitializeStorage: Counters are not saved, indices might repeat after a reboot!");
+    }
+  } else {
+    // Only a cold boot can follow a crash in the middle of a capture
+    pictureStore.recover();
+    unsigned long scannedPictureIndex = pictureStore.nextPictureIndex();
+    Serial.printf("taskInitializeStorage: Highest picture on the card is %ld.\n", (long) scannedPictureIndex - 1);
+    if (!pictureCounter.begin(scannedPictureIndex) || !uptimeCounter.begin()) {
+      Serial.println("taskInitializeStorage: Counters are not saved, indices might repeat after a reboot!");
     }
   }
 
-  // Creating new uptimeLogPath 
-  unsigned long nextUptimeIndex = EEPROM.readULong(UPTIME_INDEX_ADDRESS);
-  EEPROM.writeULong(UPTIME_INDEX_ADDRESS, nextUptimeIndex + 1);
-  EEPROM.commit(); // EEPROM.end(); ?
-  String newUptimelogPath = String(UPTIME_LOGS_PATH) + "/ut" + String(nextUptimeIndex) + ".log";
+  // Opening the logs
+  const SegmentLogState *warmLogStates[] = {&warmState.reportLog, &warmState.errorLog, &warmState.uptimeLog};
+  SegmentLog *segmentLogs[] = {&reportLog, &errorLog, &uptimeLog};
+  for (int i = 0; i < 3; i++) {
+    if (!segmentLogs[i]->begin(fs, warmStart ? warmLogStates[i] : NULL)) {
+      Serial.println("taskInitializeStorage: Could not open a log!");
+    }
+  }
+  if (isGateway() && !eventLog.begin(fs)) {
+    Serial.println("taskInitializeStorage: Could not open the event log!");
+  }
 
-  // Creating new uptimeLog (the actual file)
-  File newUptimeLog = fs.open(newUptimelogPath.c_str(), FILE_WRITE);
-  if(!newUptimeLog) {
-    Serial.printf("taskInitializeStorage: Failed to create %s!\n", newUptimelogPath.c_str());
+  // A wake from deep sleep continues the boot it belongs to
+  if (warmStart) {
+    bootIndex = warmState.bootIndex;
+    Serial.printf("taskInitializeStorage: Wake %u of boot %lu.\n", warmState.wakeCount, bootIndex);
   } else {
-    Serial.printf("taskInitializeStorage: Saved uptime log to path: %s\n", newUptimelogPath.c_str());
-    uptimeLogPath = newUptimelogPath;
+    bootIndex = uptimeCounter.next();
+    Serial.printf("taskInitializeStorage: This is boot %lu.\n", bootIndex);
+  }
+
+  if (!telemetry.begin(fs)) {
+    Serial.println("taskInitializeStorage: Telemetry is not written to the card!");
+  }
+
+  // Serving pictures, and fetching them on the destination node
+  pictureSender.begin(mesh, pictureStore);
+  cardRetention.begin(pictureStore, pictureSender, warmStart ? &warmState.retention : NULL);
+  if (isGateway() && !pictureReceiver.begin(mesh, fs)) {
+    Serial.println("taskInitializeStorage: Pictures can not be downloaded!");
+  }
+
+  // Passing updates on, and installing them
+  if (!meshUpdater.begin(mesh, fs, FIRMWARE_VERSION, isGateway())) {
+    Serial.println("taskInitializeStorage: Updates can not be received!");
   }
-  newUptimeLog.close();
 
   // Next state
-  taskTakePicture.enableIfNot();
+  advanceBoot(BOOT_STORAGE);
   taskLogUptime.enableIfNot();
+  taskFlushLogs.enableIfNot();
+  taskRenewCounters.enableIfNot();
+  taskManageRetention.enableIfNot();
+  taskDrainReports.enableIfNot();
+  taskTransferPicture.enableIfNot();
+  taskTransferUpdate.enableIfNot();
+  taskOfferUpdates.enableIfNot();
   taskInitializeStorage.disable();
 }
 
-void initializeCamera();
-Task taskInitializeCamera(TASK_SECOND * 30, TASK_ONCE, &initializeCamera);
-void initializeCamera() {
-  // GPIO 4 is soldered to SD card and LED flash
-  // This fixes current drops which causes SD problems (somehow)
-  pinMode(GPIO_NUM_4, OUTPUT);   
-  digitalWrite(4, LOW);
-  rtc_gpio_hold_dis(GPIO_NUM_4);
-
-  // Prepare for readings from PIR sensor
-  pinMode(PIR_SENSOR_PIN, INPUT);
-  
-  Serial.println("taskInitializeCamera: Configuring camera and picture properties.");
-  camera_config_t config;
+void configureCamera(camera_config_t &config) {
   config.ledc_channel = LEDC_CHANNEL_0;
   config.ledc_timer = LEDC_TIMER_0;
   config.pin_d0 = Y2_GPIO_NUM;
@@ -440,47 +1173,408 @@ void initializeCamera() {
   config.pixel_format = PIXFORMAT_JPEG; 
   
   // configuring picture properties
+  // The buffers get sized for the archive stream, see switchCameraStream()
+  config.fb_location = CAMERA_FB_IN_PSRAM;
+  config.grab_mode = CAMERA_GRAB_WHEN_EMPTY;
   if (psramFound()){
-    config.frame_size = FRAMESIZE_UXGA; // FRAMESIZE_ + QVGA|CIF|VGA|SVGA|XGA|SXGA|UXGA
-    config.jpeg_quality = 10;
-    config.fb_count = 1;  // = 2 was unstable and led to errors 
+    archiveFrameSize = FRAMESIZE_UXGA; // FRAMESIZE_ + QVGA|CIF|VGA|SVGA|XGA|SXGA|UXGA
+    archiveJpegQuality = 10;
+    config.fb_count = 1;
+    if (DOUBLE_BUFFERED_CAPTURE) {
+      // = 2 was unstable with CAMERA_GRAB_WHEN_EMPTY, the second buffer held stale frames
+      config.fb_count = 2;
+      config.grab_mode = CAMERA_GRAB_LATEST;
+    }
   } else {
-    config.frame_size = FRAMESIZE_SVGA;
-    config.jpeg_quality = 12;
+    archiveFrameSize = FRAMESIZE_SVGA;
+    archiveJpegQuality = 12;
     config.fb_count = 1;
+    config.fb_location = CAMERA_FB_IN_DRAM;
   }
-  
-  // Init Camera
-  esp_err_t err = esp_camera_init(&config);
-  if (err != ESP_OK) {
-    Serial.printf("taskInitializeCamera: Camera init failed with error 0x%x!", err);
-    return;
+  config.frame_size = archiveFrameSize;
+  config.jpeg_quality = archiveJpegQuality;
+}
+
+// esp_camera_init() probes the sensor and allocates the frame buffers for a
+// few hundred ms. It runs on the worker core, so the sd card can be mounted
+// and the mesh keeps being served in the meantime.
+enum CameraInitState {
+  CAMERA_INIT_IDLE,
+  CAMERA_INIT_RUNNING,
+  CAMERA_INIT_DONE,
+  CAMERA_INIT_FAILED
+};
+std::atomic<int> cameraInitState(CAMERA_INIT_IDLE);
+camera_config_t cameraConfig;
+esp_err_t cameraInitError = ESP_OK;
+unsigned long cameraRetryDelay = 0;
+
+void cameraInitWorker(void *parameter) {
+  cameraInitError = esp_camera_init(&cameraConfig);
+  if (cameraInitError != ESP_OK) {
+    esp_camera_deinit();   // frees whatever the failed attempt left behind
+  }
+  cameraInitState = (cameraInitError == ESP_OK) ? CAMERA_INIT_DONE : CAMERA_INIT_FAILED;
+  vTaskDelete(NULL);
+}
+
+void initializeCamera();
+Task taskInitializeCamera(BOOT_POLL_INTERVAL, TASK_FOREVER, &initializeCamera);
+void initializeCamera() {
+  switch (cameraInitState) {
+    case CAMERA_INIT_RUNNING:
+      return;
+    case CAMERA_INIT_IDLE:
+      Serial.println("taskInitializeCamera: Configuring camera and picture properties.");
+      configureCamera(cameraConfig);
+      cameraInitState = CAMERA_INIT_RUNNING;
+      if (xTaskCreatePinnedToCore(&cameraInitWorker, "cameraInit", CAPTURE_WORKER_STACK_SIZE, NULL,
+                                  CAPTURE_WORKER_PRIORITY, NULL, CAPTURE_WORKER_CORE) != pdPASS) {
+        cameraInitState = CAMERA_INIT_IDLE;
+        Serial.printf("taskInitializeCamera: Could not start the camera init, trying again in %lu ms!\n",
+                      nextBootRetry(cameraRetryDelay));
+        taskInitializeCamera.setInterval(cameraRetryDelay);
+        return;
+      }
+      taskInitializeCamera.setInterval(BOOT_POLL_INTERVAL);
+      return;
+    case CAMERA_INIT_FAILED:
+      cameraInitState = CAMERA_INIT_IDLE;
+      Serial.printf("taskInitializeCamera: Camera init failed with error 0x%x, trying again in %lu ms!\n",
+                    cameraInitError, nextBootRetry(cameraRetryDelay));
+      taskInitializeCamera.setInterval(cameraRetryDelay);
+      return;
   }
 
   Serial.println("taskInitializeCamera: Finished configuration.");
+  applyArchiveConfig(configStore.get());
+
+  // The stage workers first, the capture worker reads doubleBuffered
+  if (cameraConfig.fb_count > 1) {
+    doubleBuffered = startStageWorkers();
+    Serial.printf("taskInitializeCamera: Double-buffered capture %s.\n",
+                  doubleBuffered ? "is running" : "could not be started");
+  }
+  if (!startCaptureWorker()) {
+    Serial.println("taskInitializeCamera: Could not start the capture worker, capturing on the mesh core!");
+  }
 
   // Next state
-  taskInitializeStorage.enableIfNot();
+  advanceBoot(BOOT_CAMERA);
   taskInitializeCamera.disable();
 }
+// The frame buffers are sized for the built-in archive stream
+void applyArchiveConfig(const NodeConfig &config) {
+  archiveFrameSize = cameraConfig.frame_size;
+  if (config.frameSize != 0 && config.frameSize < cameraConfig.frame_size) {
+    archiveFrameSize = (framesize_t) config.frameSize;
+  }
+  archiveJpegQuality = config.jpegQuality ? config.jpegQuality : cameraConfig.jpeg_quality;
+
+  // The detector stream switches to the archive stream with the new settings anyway
+  sensor_t *sensor = esp_camera_sensor_get();
+  if (!(bootReady & BOOT_CAMERA) || dualStreamActive || !sensor) {
+    return;
+  }
+  if (sensor->set_framesize(sensor, archiveFrameSize) != 0
+      || sensor->set_quality(sensor, archiveJpegQuality) != 0) {
+    Serial.println("config: Could not change the archive stream!");
+  }
+}
+
+// A new config takes effect right away, no reboot needed
+void applyConfig() {
+  const NodeConfig &config = configStore.get();
+  char line[CONFIG_JSON_SIZE];
+  ConfigStore::format(config, line, sizeof(line));
+  Serial.printf("config: Applying %s\n", line);
+
+  taskTakePicture.setInterval(dualStreamActive ? config.detectorInterval : config.captureInterval);
+  taskHandlePirEvent.setInterval(config.pirPollInterval);
+  if (taskSendReport.isEnabled()) {
+    taskSendReport.forceNextIteration();    // picks its next interval itself
+  }
+  reportQueue.setLimit(config.queueLimit);
+  // The sensor must not change under a frame the capture worker takes
+  if (captureWorkerHandle) {
+    archiveConfigChanged = true;
+  } else if (bootReady & BOOT_CAMERA) {
+    applyArchiveConfig(config);
+  }
+}
+
+// "config <field>=<value> ..." on the serial port of a gateway changes the
+// config of every node, a lone "config" sends the current one around again.
+// "update" looks for images that were put on the card, see meshupdate.h.
+// "report <picture index>" prints the logged report about that picture.
+char serialLine[CONFIG_JSON_SIZE];
+size_t serialLength = 0;
+void readSerial();
+Task taskReadSerial(SERIAL_POLL_INTERVAL, TASK_FOREVER, &readSerial);
+void readSerial() {
+  while (Serial.available() > 0) {
+    char character = Serial.read();
+    if (character != '\n' && character != '\r') {
+      if (serialLength < sizeof(serialLine) - 1) {
+        serialLine[serialLength++] = character;
+      }
+      continue;
+    }
+    serialLine[serialLength] = '\0';
+    bool empty = serialLength == 0;
+    serialLength = 0;
+    if (empty) {
+      continue;
+    }
+    if (strcmp(serialLine, "update") == 0) {
+      meshUpdater.scan();
+      meshUpdater.print();
+      meshUpdater.offer();
+      continue;
+    }
+    if (strncmp(serialLine, "report ", 7) == 0) {
+      char record[LOG_RECORD_SIZE];
+      uint32_t pictureIndex = strtoul(serialLine + 7, NULL, 10);
+      if (reportLog.find(pictureIndex, record, sizeof(record))) {
+        Serial.printf("serial: %s\n", record);
+      } else {
+        Serial.printf("serial: No report about picture %u in the log!\n", pictureIndex);
+      }
+      continue;
+    }
+    if (strncmp(serialLine, "config", 6) != 0) {
+      Serial.println("serial: Unknown command, try config <field>=<value> ..., update or report <picture index>");
+      continue;
+    }
+    if (configStore.edit(serialLine + 6)) {
+      applyConfig();
+      broadcastConfig();
+    }
+  }
+}
 /*  END OF USER TASKS */
 
+// Low-power mode only. Sleeps once nothing is left to do, or after
+// LOW_POWER_MAX_AWAKE once the captures already started are done, and
+// wakes up on the PIR or the timer.
+void enterSleep();
+Task taskEnterSleep(TASK_SECOND, TASK_FOREVER, &enterSleep);
+void enterSleep() {
+  unsigned long awake = millis();
+  if (awake < LOW_POWER_MIN_AWAKE) {
+    return;
+  }
+  drainReports();    // a report still in a ring counts as waiting to be sent
+  bool initializing = taskInitializeCamera.isEnabled() || taskInitializeStorage.isEnabled()
+                      || taskInitializeInference.isEnabled();
+  bool capturing = pirEventPending || taskTakePicturePIR.isEnabled() || captureInFlight();
+  bool sending = pictureSender.isActive() || meshUpdater.isActive() || (!reportQueue.isEmpty() && sendBackoff == 0);
+  if (awake < LOW_POWER_MAX_AWAKE && (initializing || capturing || sending)) {
+    return;
+  }
+  if (capturing) {
+    // Past LOW_POWER_MAX_AWAKE no capture starts anymore, but the ones on the
+    // worker core still use their frame buffers and have reports to hand back
+    taskTakePicture.disable();
+    taskTakePicturePIR.disable();
+    taskHandlePirEvent.disable();
+    detachInterrupt(digitalPinToInterrupt(pirPin));
+    pirEventPending = false;
+    if (captureInFlight()) {
+      return;
+    }
+  }
+  drainReports();    // whatever the workers handed back since the drain above
+  if (cameraInitState == CAMERA_INIT_RUNNING) {
+    return;   // the camera can't be deinitialized halfway through its init
+  }
+  if (cardSpaceState == CARD_SPACE_RUNNING) {
+    return;   // nor the card powered off while FatFs reads the FAT
+  }
+  if (initializing) {
+    // Nothing to save yet, a cold boot starts over anyway
+    Serial.println("taskEnterSleep: Initialization did not finish, going to sleep without a warm state.");
+  }
+
+  // The RTC memory gets everything the next wake would have to recover
+  WarmState state = {};
+  if (!initializing) {
+    reportLog.flush();
+    errorLog.flush();
+    uptimeLog.flush();
+    state.wakeCount = warmStart ? warmState.wakeCount + 1 : 1;
+    state.bootIndex = bootIndex;
+    state.arenaHighWaterMark = measureArenaHighWaterMark();
+    reportQueue.flushCoalesced(true);
+    reportQueue.saveState(state.reportQueue);
+    pictureCounter.saveState(state.pictureCounter);
+    reportLog.saveState(state.reportLog);
+    errorLog.saveState(state.errorLog);
+    uptimeLog.saveState(state.uptimeLog);
+    motionGate.saveState(state.motionGate);
+    cardRetention.saveState(state.retention);
+    if (meshTimeSynced) {
+      state.meshTimeValid = true;
+      state.meshTimeOffset = (int64_t) mesh.getNodeTime() - (int64_t) rtcMicros();
+    } else if (warmStart && warmState.meshTimeValid) {
+      state.meshTimeValid = true;
+      state.meshTimeOffset = warmState.meshTimeOffset;
+    }
+  }
+
+  detachInterrupt(digitalPinToInterrupt(pirPin));
+  esp_camera_deinit();
+  mesh.stop();
+  if (initializing) {
+    esp_sleep_enable_timer_wakeup(LOW_POWER_SLEEP_TIME * 1000000ULL);
+    esp_deep_sleep_start();
+  }
+  enterDeepSleep(state, LOW_POWER_SLEEP_TIME * 1000000ULL, PIR_WAKE_PIN, PIR_MOTION_LEVEL);
+}
+
 // Needed for painless library
 void newConnectionCallback(uint32_t nodeId) {
   Serial.printf("mesh: New connection with node %u.\n", nodeId);
 }
 void changedConnectionCallback() {
   Serial.println("mesh: Changed connections.");
+  if (taskAnnounceGateway.isEnabled()) {
+    taskAnnounceGateway.forceNextIteration();
+  }
 }
 void nodeTimeAdjustedCallback(int32_t offset) {
+  meshTimeSynced = true;
+  // Waiting reports were stamped with the old time
+  reportQueue.shiftTimes(offset);
   // Uncomment if needed.
   // Serial.printf("mesh: Adjusted time %u, offset = %d.\n", mesh.getNodeTime(), offset);
 }
 
+// Telemetry arriving at a gateway, one json line per record
+void receiveTelemetry(const TelemetryRecord &record) {
+  char line[TELEMETRY_JSON_SIZE];
+  if (Telemetry::format(record, line, sizeof(line)) > 0) {
+    Serial.printf("telemetry: %s\n", line);
+  }
+}
+
+// Reports arriving at a gateway
+void receiveReport(const PictureReportPackage &package) {
+  char pictureName[PATH_BUFFER_SIZE];
+  package.formatPath(pictureName, PATH_BUFFER_SIZE, NULL, ".jpg");
+  if (!detectionFusion.addReport(package, mesh.getNodeTime())) {
+    Serial.printf("mesh: Got the report of %s again, skipping.\n", pictureName);
+    return;
+  }
+  latencyStats.add(package, mesh.getNodeTime());
+  if (package.pictureCount > 1) {
+    Serial.printf("mesh: Node %zu has taken the picture %s and %u after it.\n",
+                  package.from, pictureName, package.pictureCount - 1);
+  } else {
+    Serial.printf("mesh: Node %zu has taken the picture %s.\n", package.from, pictureName);
+  }
+  Serial.printf("mesh: Deer probability: %.2f\n", package.deerProbability);
+}
+
+// One event per animal, however many nodes saw it. Only the best picture
+// of an event is fetched.
+void onDetectionEvent(const DetectionEvent &event) {
+  PictureReportPackage best;
+  best.from = event.bestNode;
+  best.pictureIndex = event.bestPictureIndex;
+  char pictureName[PATH_BUFFER_SIZE];
+  best.formatPath(pictureName, PATH_BUFFER_SIZE, NULL, ".jpg");
+  Serial.printf("fusion: Event %u, %u report(s) from %u node(s) in %.1f s, best picture %s (%.2f).\n",
+                event.eventId, event.reportCount, event.nodeCount,
+                (event.lastSeen - event.firstSeen) / 1000000.0, pictureName, event.bestProbability);
+  eventLog.append(event.eventId,
+                  "{\"event\":%u,\"firstSeen\":%u,\"lastSeen\":%u,\"reports\":%u,\"nodes\":%u,"
+                  "\"bestNode\":%u,\"bestPicture\":%lu,\"deerProbability\":%.2f}",
+                  event.eventId, event.firstSeen, event.lastSeen, event.reportCount, event.nodeCount,
+                  event.bestNode, event.bestPictureIndex, event.bestProbability);
+
+  if (AUTO_FETCH_THUMBNAILS && !pictureReceiver.fetch(best.from, best.pictureIndex, true)) {
+    Serial.printf("fusion: Too many pictures to fetch, skipping the thumbnail of %s.\n", pictureName);
+  }
+  if (AUTO_FETCH_PICTURES && event.bestProbability >= PICTURE_FETCH_THRESHOLD
+      && !pictureReceiver.fetch(best.from, best.pictureIndex)) {
+    Serial.printf("fusion: Too many pictures to fetch, skipping %s.\n", pictureName);
+  }
+}
+
+void fuseDetections();
+Task taskFuseDetections(FUSION_CHECK_INTERVAL, TASK_FOREVER, &fuseDetections);
+void fuseDetections() {
+  detectionFusion.update(mesh.getNodeTime());
+}
+
+void printLatency();
+Task taskPrintLatency(LATENCY_PRINT_INTERVAL, TASK_FOREVER, &printLatency);
+void printLatency() {
+  latencyStats.print();
+}
+
+/*  BENCHMARK MODE  */
+void benchmarkMesh();
+Task taskBenchmarkMesh(BENCH_PING_INTERVAL, TASK_FOREVER, &benchmarkMesh);
+void benchmarkMesh() {
+  if (meshBenchmark.step()) {
+    return;
+  }
+  Serial.println("bench: done");
+
+  // Next state
+  taskBenchmarkMesh.disable();
+}
+
+// Runs instead of the boot tasks. The camera gets a single buffer that
+// fits UXGA, so every frame is timed from the start of its exposure.
+void runBenchmarks() {
+  Serial.println("bench: start");
+  camera_config_t config;
+  configureCamera(config);
+  config.fb_count = 1;
+  config.grab_mode = CAMERA_GRAB_WHEN_EMPTY;
+  esp_err_t cameraError = esp_camera_init(&config);
+  if (cameraError != ESP_OK) {
+    Serial.printf("bench: Camera init failed with error 0x%x!\n", cameraError);
+  } else {
+    benchmarkCamera();
+  }
+
+  if (!SD_MMC.begin("/sdcard", LOW_POWER_MODE) || SD_MMC.cardType() == CARD_NONE) {
+    Serial.println("bench: No SD card, skipping the sd card and the model.");
+  } else {
+    benchmarkStorage(SD_MMC);
+    if (cameraError == ESP_OK) {
+      benchmarkInference(SD_MMC);
+    }
+  }
+
+  meshBenchmark.begin(mesh, DEST_NODE);
+  userScheduler.addTask(taskBenchmarkMesh);
+  taskBenchmarkMesh.enableIfNot();
+}
+/*  END OF BENCHMARK MODE  */
+
 void setup() {
   WRITE_PERI_REG(RTC_CNTL_BROWN_OUT_REG, 0); // disable brownout detector
   Serial.begin(115200);
 
+  // GPIO 4 is soldered to SD card and LED flash
+  // This fixes current drops which causes SD problems (somehow)
+  pinMode(GPIO_NUM_4, OUTPUT);   
+  digitalWrite(4, LOW);
+  rtc_gpio_hold_dis(GPIO_NUM_4);
+
+  // Prepare for readings from PIR sensor
+  pinMode(pirPin, INPUT);
+
+  warmStart = LOW_POWER_MODE && takeWarmState(warmState);
+  if (LOW_POWER_MODE && esp_sleep_get_wakeup_cause() == ESP_SLEEP_WAKEUP_EXT0) {
+    pirEventPending = true;   // the edge that woke the node is gone by now
+  }
+
   // starting the mesh
   mesh.setDebugMsgTypes( ERROR | STARTUP );
   mesh.init( MESH_PREFIX, MESH_PASSWORD, &userScheduler, MESH_PORT );
@@ -489,27 +1583,181 @@ void setup() {
   mesh.onNodeTimeAdjusted(&nodeTimeAdjustedCallback);
 
   // How to handle a package of type 31
-  mesh.onPackage(31, [](painlessmesh::protocol::Variant variant) {
+  mesh.onPackage(PICTURE_REPORT_PACKAGE, [](painlessmesh::protocol::Variant variant) {
     auto package = variant.to<PictureReportPackage>(); 
-    Serial.printf("mesh: Node %zu has taken the picture %s.\n", package.from, package.getFullPictureName().c_str());
-    Serial.printf("mesh: Deer probability: %.2f\n", package.deerProbability);
+    receiveReport(package);
+    return true;
+  });
+
+  // How to handle a package of type 32
+  mesh.onPackage(PICTURE_REPORT_BATCH_PACKAGE, [](painlessmesh::protocol::Variant variant) {
+    auto batch = variant.to<PictureReportBatchPackage>();
+    for (uint8_t i = 0; i < batch.count; i++) {
+      receiveReport(batch.get(i));
+    }
+    return true;
+  });
+
+  // How to handle a package of type 33
+  mesh.onPackage(COMPACT_REPORT_PACKAGE, [](painlessmesh::protocol::Variant variant) {
+    auto compactBatch = variant.to<CompactReportPackage>();
+    PictureReportBatchPackage batch;
+    if (!compactBatch.decode(batch)) {
+      Serial.printf("mesh: Malformed compact reports from node %zu!\n", compactBatch.from);
+      return true;
+    }
+    for (uint8_t i = 0; i < batch.count; i++) {
+      receiveReport(batch.get(i));
+    }
+    return true;
+  });
+
+  // How to handle a package of type 34
+  mesh.onPackage(PICTURE_REQUEST_PACKAGE, [](painlessmesh::protocol::Variant variant) {
+    pictureSender.onRequest(variant.to<PictureRequestPackage>());
+    return true;
+  });
+
+  // How to handle a package of type 35
+  mesh.onPackage(PICTURE_CHUNK_PACKAGE, [](painlessmesh::protocol::Variant variant) {
+    pictureReceiver.onChunk(variant.to<PictureChunkPackage>());
+    return true;
+  });
+
+  // How to handle a package of type 36
+  mesh.onPackage(TELEMETRY_PACKAGE, [](painlessmesh::protocol::Variant variant) {
+    auto package = variant.to<TelemetryPackage>();
+    TelemetryRecord record;
+    if (!package.decode(record)) {
+      Serial.printf("mesh: Malformed telemetry from node %zu!\n", package.from);
+      return true;
+    }
+    receiveTelemetry(record);
+    return true;
+  });
+
+  // How to handle a package of type 37
+  mesh.onPackage(BENCHMARK_PACKAGE, [](painlessmesh::protocol::Variant variant) {
+    auto package = variant.to<BenchmarkPackage>();
+    if (package.echo) {
+      meshBenchmark.onEcho(package);
+      return true;
+    }
+    package.dest = package.from;
+    package.from = mesh.getNodeId();
+    package.echo = true;
+    mesh.sendPackage(&package);
+    return true;
+  });
+
+  // How to handle a package of type 38
+  mesh.onPackage(GATEWAY_ANNOUNCE_PACKAGE, [](painlessmesh::protocol::Variant variant) {
+    gatewayTable.onAnnounce(variant.to<GatewayAnnouncePackage>(), mesh.getNodeTime());
+    return true;
+  });
+
+  // How to handle a package of type 39
+  mesh.onPackage(CONFIG_PACKAGE, [](painlessmesh::protocol::Variant variant) {
+    if (configStore.update(variant.to<ConfigPackage>().config)) {
+      applyConfig();
+    }
+    return true;
+  });
+
+  // How to handle a package of type 40
+  mesh.onPackage(UPDATE_OFFER_PACKAGE, [](painlessmesh::protocol::Variant variant) {
+    meshUpdater.onOffer(variant.to<UpdateOfferPackage>(), mesh.getNodeTime());
+    return true;
+  });
+
+  // How to handle a package of type 41
+  mesh.onPackage(UPDATE_REQUEST_PACKAGE, [](painlessmesh::protocol::Variant variant) {
+    meshUpdater.onRequest(variant.to<UpdateRequestPackage>());
+    return true;
+  });
+
+  // How to handle a package of type 42
+  mesh.onPackage(UPDATE_CHUNK_PACKAGE, [](painlessmesh::protocol::Variant variant) {
+    meshUpdater.onChunk(variant.to<UpdateChunkPackage>());
     return true;
   });
 
   Serial.printf("\nmesh: The ID of this node is %zu.\n", mesh.getNodeId());
 
+  if (BENCHMARK_MODE) {
+    runBenchmarks();
+    return;
+  }
+
+  // A warm background saves the wake frame from counting as motion
+  motionGate.begin(warmStart ? &warmState.motionGate : NULL);
+
+  // Built-in config, a stored one replaces it
+  NodeConfig builtInConfig = {0, CAPTURE_INTERVAL, DETECTOR_SAMPLE_INTERVAL, SEND_INTERVAL_IDLE, PIR_POLL_INTERVAL,
+                              REPORT_QUEUE_CAPACITY, DEER_PROBABILITY_THRESHOLD, 0, 0};
+  configStore.begin(builtInConfig);
+  reportQueue.setLimit(configStore.get().queueLimit);
+
+  // Reports go to DEST_NODE until a gateway announces itself
+  gatewayTable.begin(mesh, DEST_NODE);
+
+  // Neighboring cameras that see the same animals, all nodes are neighbors without any
+  detectionFusion.begin(&onDetectionEvent);
+  // detectionFusion.addNeighbors(3177562153, 3177562154);
+
   // use this instead of adding more actions to setup() or loop()
   userScheduler.addTask(taskInitializeCamera);
   userScheduler.addTask(taskInitializeStorage);
+  userScheduler.addTask(taskInitializeInference);
   userScheduler.addTask(taskTakePicture);
+  userScheduler.addTask(taskTakePicturePIR);
+  userScheduler.addTask(taskHandlePirEvent);
   userScheduler.addTask(taskSendReport);
   userScheduler.addTask(taskLogUptime);
+  userScheduler.addTask(taskFlushLogs);
+  userScheduler.addTask(taskRenewCounters);
+  userScheduler.addTask(taskManageRetention);
+  userScheduler.addTask(taskDrainReports);
+  userScheduler.addTask(taskTransferPicture);
+  userScheduler.addTask(taskTransferUpdate);
+  userScheduler.addTask(taskOfferUpdates);
+  userScheduler.addTask(taskEnterSleep);
+  userScheduler.addTask(taskFuseDetections);
+  userScheduler.addTask(taskPrintLatency);
+  userScheduler.addTask(taskSendTelemetry);
+  userScheduler.addTask(taskAnnounceGateway);
+  userScheduler.addTask(taskReadSerial);
   
   // Next state
   taskTakePicture.disable();
+  taskTakePicturePIR.disable();
+  taskHandlePirEvent.disable();
   taskLogUptime.disable();
-  taskInitializeStorage.disable();
-  taskInitializeCamera.enableIfNot();
+  taskFlushLogs.disable();
+  taskRenewCounters.disable();
+  taskManageRetention.disable();
+  taskDrainReports.disable();
+  taskTransferPicture.disable();
+  taskTransferUpdate.disable();
+  taskOfferUpdates.disable();
+  taskInitializeInference.disable();
+  taskEnterSleep.disable();
+  taskFuseDetections.disable();
+  taskPrintLatency.disable();
+  taskSendTelemetry.enableDelayed();
+  taskAnnounceGateway.disable();
+  taskReadSerial.disable();
+  if (isGateway()) {
+    taskFuseDetections.enableIfNot();
+    taskPrintLatency.enableDelayed();
+    taskAnnounceGateway.enable();
+    taskReadSerial.enable();
+  }
+  if (LOW_POWER_MODE) {
+    taskEnterSleep.enableIfNot();
+  }
+  taskInitializeCamera.enableIfNot();     // both at once, see advanceBoot()
+  taskInitializeStorage.enableIfNot();
   taskSendReport.enableIfNot();   // race conditions?
 }
 
@@ -0,0 +1,18 @@
+#ifndef MESHTIME_H
+#define MESHTIME_H
+
+#include <stdint.h>
+
+// Mesh time wraps every 71 minutes, differences stay right across that
+inline int32_t timeSince(uint32_t meshTime, uint32_t since) {
+  return (int32_t) (meshTime - since);
+}
+
+// The latency of a package stamped with the sender's mesh time, a sender
+// whose clock is ahead counts as none, one from before a sync as maxLatency
+inline int32_t latencySince(uint32_t meshTime, uint32_t sendTime, int32_t maxLatency) {
+  int32_t latency = timeSince(meshTime, sendTime);
+  return latency < 0 ? 0 : (latency > maxLatency ? maxLatency : latency);
+}
+
+#endif
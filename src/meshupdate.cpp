@@ -0,0 +1,893 @@
+#include "meshupdate.h"
+
+#include <Preferences.h>
+#include <Update.h>
+#include "esp_ota_ops.h"
+#include "esp_partition.h"
+#include "crc32.h"
+#include "deltapatch.h"
+#include "inference.h"
+#include "meshtime.h"
+
+static const char *kindNames[] = {"firmware", "model"};
+
+// In NVS, so the crcs of the images are not read from the card after every boot
+struct StoredUpdates {
+  uint8_t version;
+  uint8_t count;
+  uint8_t reserved[2];
+  uint32_t modelVersion;
+  uint32_t flashedFirmware;
+  HeldImage images[UPDATE_MAX_IMAGES];
+  uint32_t checksum;
+};
+
+static uint32_t storedChecksum(const StoredUpdates &stored) {
+  return crc32(&stored, offsetof(StoredUpdates, checksum));
+}
+
+// Reads "<firmware|model>_<version>.<bin|delta>", part if ".part" follows
+static bool parseImageName(const char *name, UpdateImage &image, bool &part) {
+  const char *separator = strchr(name, '_');
+  if (!separator) {
+    return false;
+  }
+  image = {};
+  bool known = false;
+  for (uint8_t kind = UPDATE_FIRMWARE; kind <= UPDATE_MODEL; kind++) {
+    if (strlen(kindNames[kind]) == (size_t) (separator - name) && strncmp(name, kindNames[kind], separator - name) == 0) {
+      image.kind = kind;
+      known = true;
+    }
+  }
+  char *end;
+  image.version = strtoul(separator + 1, &end, 10);
+  if (!known || end == separator + 1) {
+    return false;
+  }
+  if (strncmp(end, ".bin", 4) == 0) {
+    end += 4;
+  } else if (strncmp(end, ".delta", 6) == 0) {
+    image.delta = true;
+    end += 6;
+  } else {
+    return false;
+  }
+  part = strcmp(end, ".part") == 0;
+  return part || *end == '\0';
+}
+
+static bool readPartition(void *arg, uint32_t offset, uint8_t *buffer, size_t length) {
+  return esp_partition_read((const esp_partition_t *) arg, offset, buffer, length) == ESP_OK;
+}
+
+static bool readFile(void *arg, uint32_t offset, uint8_t *buffer, size_t length) {
+  File &file = *(File *) arg;
+  return file.seek(offset) && file.read(buffer, length) == length;
+}
+
+bool MeshUpdater::begin(painlessMesh &mesh, fs::FS &fs, uint32_t firmwareVersion, bool alwaysOffer) {
+  this->mesh = &mesh;
+  this->alwaysOffer = alwaysOffer;
+  runningVersions[UPDATE_FIRMWARE] = firmwareVersion;
+  if (!fs.exists(UPDATES_PATH) && !fs.mkdir(UPDATES_PATH)) {
+    Serial.printf("update: Could not create %s!\n", UPDATES_PATH);
+    return false;
+  }
+  this->fs = &fs;
+  scan();
+  if (flashedFirmware > firmwareVersion) {
+    // Not flashed again, that would never end
+    Serial.printf("update: Flashed firmware %u, but %u is running! Was FIRMWARE_VERSION raised?\n",
+                  flashedFirmware, firmwareVersion);
+  }
+  lastActivityMillis = millis();    // neighbors might wait for what this node just installed
+  print();
+  return true;
+}
+
+void MeshUpdater::imagePath(const UpdateImage &image, bool part, char *path, size_t size) const {
+  snprintf(path, size, "%s/%s_%u.%s%s", UPDATES_PATH, kindNames[image.kind], image.version,
+           image.delta ? "delta" : "bin", part ? ".part" : "");
+}
+
+bool MeshUpdater::isComplete(const HeldImage &held) {
+  return held.available >= held.image.size;
+}
+
+// A patch against the running image that came in completely
+bool MeshUpdater::isUsableDelta(const HeldImage &held) const {
+  uint8_t kind = held.image.kind;
+  return held.image.delta && isComplete(held) && held.image.baseVersion == runningVersions[kind]
+         && held.image.version > failedDeltas[kind];
+}
+
+HeldImage *MeshUpdater::findImage(const UpdateImage &image) {
+  for (uint8_t i = 0; i < imageCount; i++) {
+    if (images[i].image.sameFile(image)) {
+      return &images[i];
+    }
+  }
+  return NULL;
+}
+
+HeldImage *MeshUpdater::addImage(const UpdateImage &image) {
+  if (imageCount == UPDATE_MAX_IMAGES) {
+    Serial.println("update: Too many images on the card!");
+    return NULL;
+  }
+  images[imageCount] = {image, 0};
+  return &images[imageCount++];
+}
+
+// The last image takes its place, pointers to it are gone afterwards
+void MeshUpdater::removeImage(HeldImage *held) {
+  char path[UPDATE_PATH_SIZE];
+  imagePath(held->image, !isComplete(*held), path, sizeof(path));
+  closeSessions(held->image);
+  if (downloading && downloadImage.sameFile(held->image)) {
+    partFile.close();
+    downloading = false;
+  }
+  fs->remove(path);
+  *held = images[--imageCount];
+}
+
+void MeshUpdater::removeOlder(uint8_t kind, uint32_t version) {
+  for (int i = imageCount - 1; i >= 0; i--) {
+    if (images[i].image.kind == kind && images[i].image.version < version) {
+      Serial.printf("update: Removing %s %u.\n", kindNames[kind], images[i].image.version);
+      removeImage(&images[i]);
+    }
+  }
+}
+
+// Versions that are not installed again
+uint32_t MeshUpdater::installedVersion(uint8_t kind) const {
+  uint32_t version = max(runningVersions[kind], failedVersions[kind]);
+  return (kind == UPDATE_FIRMWARE) ? max(version, flashedFirmware) : version;
+}
+
+// Versions that are not fetched again
+uint32_t MeshUpdater::newestVersion(uint8_t kind) const {
+  uint32_t version = installedVersion(kind);
+  for (uint8_t i = 0; i < imageCount; i++) {
+    const HeldImage &held = images[i];
+    if (held.image.kind == kind && ((!held.image.delta && isComplete(held)) || isUsableDelta(held))) {
+      version = max(version, held.image.version);
+    }
+  }
+  return version;
+}
+
+bool MeshUpdater::loadStored(HeldImage *stored, uint8_t &count) {
+  count = 0;
+  Preferences preferences;
+  if (!preferences.begin(UPDATE_NAMESPACE, true)) {
+    return false;   // nothing stored yet
+  }
+  StoredUpdates data;
+  bool valid = preferences.getBytes(UPDATE_KEY, &data, sizeof(data)) == sizeof(data)
+               && data.version == UPDATE_STORE_VERSION && data.checksum == storedChecksum(data)
+               && data.count <= UPDATE_MAX_IMAGES;
+  preferences.end();
+  if (!valid) {
+    return false;
+  }
+  runningVersions[UPDATE_MODEL] = data.modelVersion;
+  flashedFirmware = data.flashedFirmware;
+  count = data.count;
+  memcpy(stored, data.images, count * sizeof(HeldImage));
+  return true;
+}
+
+bool MeshUpdater::save() {
+  StoredUpdates data = {};
+  data.version = UPDATE_STORE_VERSION;
+  data.count = imageCount;
+  data.modelVersion = runningVersions[UPDATE_MODEL];
+  data.flashedFirmware = flashedFirmware;
+  memcpy(data.images, images, imageCount * sizeof(HeldImage));
+  data.checksum = storedChecksum(data);
+
+  Preferences preferences;
+  if (!preferences.begin(UPDATE_NAMESPACE, false)) {
+    Serial.printf("update: Could not open NVS namespace %s!\n", UPDATE_NAMESPACE);
+    return false;
+  }
+  bool saved = preferences.putBytes(UPDATE_KEY, &data, sizeof(data)) == sizeof(data);
+  preferences.end();
+  if (!saved) {
+    Serial.println("update: Could not save the images!");
+  }
+  return saved;
+}
+
+bool MeshUpdater::fileCrc(const char *path, uint32_t size, uint32_t &crc) {
+  File file = fs->open(path, FILE_READ);
+  if (!file) {
+    return false;
+  }
+  uint8_t buffer[UPDATE_CHUNK_SIZE];
+  crc = 0;
+  uint32_t offset = 0;
+  while (offset < size) {
+    size_t length = file.read(buffer, min<size_t>(sizeof(buffer), size - offset));
+    if (length == 0) {
+      break;
+    }
+    crc = crc32(buffer, length, crc);
+    offset += length;
+    yield();
+  }
+  file.close();
+  return offset == size;
+}
+
+// Images the table does not know yet are read once for their crc. Parts
+// are only kept if the table knows what they belong to.
+void MeshUpdater::scan() {
+  if (!fs) {
+    return;
+  }
+  stopDownload();
+  for (Session &session : sessions) {
+    endSession(session);
+  }
+  // runningVersions[UPDATE_MODEL] and flashedFirmware come from here as well
+  HeldImage stored[UPDATE_MAX_IMAGES];
+  uint8_t storedCount;
+  loadStored(stored, storedCount);
+  imageCount = 0;
+
+  File directory = fs->open(UPDATES_PATH);
+  if (!directory) {
+    Serial.printf("update: Could not open %s!\n", UPDATES_PATH);
+    return;
+  }
+  for (File entry = directory.openNextFile(); entry; entry = directory.openNextFile()) {
+    const char *name = strrchr(entry.name(), '/');
+    name = name ? name + 1 : entry.name();
+    UpdateImage image;
+    bool part;
+    bool isImage = !entry.isDirectory() && parseImageName(name, image, part);
+    uint32_t fileSize = entry.size();
+    entry.close();
+    if (!isImage || findImage(image)) {
+      continue;
+    }
+
+    const HeldImage *known = NULL;
+    for (uint8_t i = 0; i < storedCount; i++) {
+      if (stored[i].image.sameFile(image)) {
+        known = &stored[i];
+      }
+    }
+    char path[UPDATE_PATH_SIZE];
+    imagePath(image, part, path, sizeof(path));
+    HeldImage held = {image, fileSize};
+    if (part) {
+      if (!known || fileSize > known->image.size) {
+        fs->remove(path);
+        continue;
+      }
+      held.image = known->image;
+    } else if (known && isComplete(*known) && known->image.size == fileSize) {
+      held.image = known->image;
+    } else {
+      held.image.size = fileSize;
+      if (image.delta) {
+        File patch = fs->open(path, FILE_READ);
+        DeltaHeader header;
+        bool valid = patch && readDeltaHeader(patch, header) && header.kind == image.kind
+                     && header.targetVersion == image.version;
+        patch.close();
+        if (!valid) {
+          Serial.printf("update: %s is not a patch to that version!\n", path);
+          continue;
+        }
+        held.image.baseVersion = header.baseVersion;
+      }
+      if (!fileCrc(path, fileSize, held.image.crc)) {
+        Serial.printf("update: Could not read %s!\n", path);
+        continue;
+      }
+      Serial.printf("update: Found %s.\n", path);
+    }
+    HeldImage *added = addImage(held.image);
+    if (added) {
+      added->available = held.available;
+    }
+  }
+  directory.close();
+
+  for (uint8_t kind = UPDATE_FIRMWARE; kind <= UPDATE_MODEL; kind++) {
+    uint32_t newest = 0;
+    for (uint8_t i = 0; i < imageCount; i++) {
+      if (images[i].image.kind == kind) {
+        newest = max(newest, images[i].image.version);
+      }
+    }
+    removeOlder(kind, newest);
+  }
+  save();
+}
+
+void MeshUpdater::offerImage(const HeldImage &held) {
+  UpdateOfferPackage package;
+  package.from = mesh->getNodeId();
+  package.image = held.image;
+  package.available = held.available;
+  package.sendTime = mesh->getNodeTime();
+  if (!mesh->sendPackage(&package)) {
+    Serial.println("update: Could not offer an image!");
+  }
+}
+
+// Nodes only offer for a while after they got or served an image, gateways always
+void MeshUpdater::offer() {
+  if (!fs || (!alwaysOffer && millis() - lastActivityMillis >= UPDATE_SPREAD_TIME)) {
+    return;
+  }
+  for (uint8_t i = 0; i < imageCount; i++) {
+    if (images[i].available > 0) {
+      offerImage(images[i]);
+    }
+  }
+}
+
+MeshUpdater::Source *MeshUpdater::findSource(uint32_t nodeId, bool delta) {
+  for (uint8_t i = 0; i < sourceCount; i++) {
+    if (sources[i].nodeId == nodeId && sources[i].image.delta == delta) {
+      return &sources[i];
+    }
+  }
+  return NULL;
+}
+
+// Only one version is fetched at a time, the other kind comes after it
+void MeshUpdater::onOffer(const UpdateOfferPackage &offer, uint32_t meshTime) {
+  const UpdateImage &image = offer.image;
+  if (!fs || image.kind > UPDATE_MODEL || offer.available == 0 || image.version <= newestVersion(image.kind)) {
+    return;
+  }
+  if (image.delta && (image.baseVersion != runningVersions[image.kind] || image.version <= failedDeltas[image.kind])) {
+    return;   // does not fit the running image
+  }
+  if (wanting && (image.kind != wantedKind || image.version < wantedVersion)) {
+    return;
+  }
+  if (!wanting || image.version > wantedVersion) {
+    stopDownload();
+    removeOlder(image.kind, image.version);
+    save();
+    wanting = true;
+    wantedKind = image.kind;
+    wantedVersion = image.version;
+    sourceCount = 0;
+    Serial.printf("update: Version %u of the %s is out, %u is running.\n", image.version,
+                  kindNames[image.kind], runningVersions[image.kind]);
+  }
+
+  // A full table forgets the node that has been quiet the longest
+  Source *source = findSource(offer.from, image.delta);
+  if (!source) {
+    uint8_t quietest = 0;
+    for (uint8_t i = 1; i < sourceCount; i++) {
+      if (sources[i].heardMillis < sources[quietest].heardMillis) {
+        quietest = i;
+      }
+    }
+    if (sourceCount == UPDATE_MAX_SOURCES && downloading && sources[quietest].nodeId == sourceNode) {
+      return;     // keeps the one that is sending
+    }
+    source = &sources[sourceCount < UPDATE_MAX_SOURCES ? sourceCount++ : quietest];
+    *source = {};
+    source->nodeId = offer.from;
+  }
+  source->latencyMicros = latencySince(meshTime, offer.sendTime, UPDATE_MAX_LATENCY);
+  source->image = image;
+  source->available = offer.available;
+  source->heardMillis = millis();
+}
+
+// The closest node that has more than this node, deltas first
+MeshUpdater::Source *MeshUpdater::chooseSource() {
+  Source *best = NULL;
+  for (uint8_t i = 0; i < sourceCount; i++) {
+    Source &source = sources[i];
+    if (millis() - source.heardMillis >= UPDATE_SOURCE_TIMEOUT
+        || (source.busyMillis && millis() - source.busyMillis < UPDATE_BUSY_BACKOFF)
+        || (source.image.delta && source.image.version <= failedDeltas[source.image.kind])
+        || !mesh->isConnected(source.nodeId)) {
+      continue;
+    }
+    const HeldImage *held = findImage(source.image);
+    bool samePart = held && held->image.size == source.image.size && held->image.crc == source.image.crc;
+    if (source.available <= (samePart ? held->available : 0)) {
+      continue;
+    }
+    if (!best || source.image.delta > best->image.delta
+        || (source.image.delta == best->image.delta && source.latencyMicros < best->latencyMicros)) {
+      best = &source;
+    }
+  }
+  return best;
+}
+
+// Continues a part from an earlier attempt, from whichever node has it
+bool MeshUpdater::startDownload() {
+  Source *chosen = chooseSource();
+  if (!chosen) {
+    return false;
+  }
+  HeldImage *held = findImage(chosen->image);
+  if (held && (held->image.size != chosen->image.size || held->image.crc != chosen->image.crc)) {
+    Serial.printf("update: Another build of %s %u is out, starting over.\n", kindNames[held->image.kind],
+                  held->image.version);
+    removeImage(held);
+    held = NULL;
+  }
+  if (!held && !(held = addImage(chosen->image))) {
+    return false;
+  }
+
+  char path[UPDATE_PATH_SIZE];
+  imagePath(held->image, true, path, sizeof(path));
+  partFile = fs->open(path, FILE_APPEND);
+  if (!partFile) {
+    Serial.printf("update: Could not open %s!\n", path);
+    return false;
+  }
+  downloadWindow.start(partFile.size());
+  held->available = downloadWindow.expectedOffset;
+  downloadImage = held->image;
+  sourceNode = chosen->nodeId;
+  downloading = true;
+  offeredPart = false;
+  save();   // a reboot does not lose what the part belongs to
+  Serial.printf("update: Fetching %s %u%s from node %u, from byte %u of %u.\n", kindNames[downloadImage.kind],
+                downloadImage.version, downloadImage.delta ? " as a delta" : "", sourceNode,
+                downloadWindow.expectedOffset, downloadImage.size);
+  request();
+  return true;
+}
+
+void MeshUpdater::request() {
+  UpdateRequestPackage package;
+  package.from = mesh->getNodeId();
+  package.dest = sourceNode;
+  package.kind = downloadImage.kind;
+  package.delta = downloadImage.delta;
+  package.version = downloadImage.version;
+  package.offset = downloadWindow.expectedOffset;
+  mesh->sendPackage(&package);
+  downloadWindow.requested();
+}
+
+// The part stays, the next source continues it
+void MeshUpdater::stopDownload() {
+  if (!downloading) {
+    return;
+  }
+  partFile.close();
+  downloading = false;
+  HeldImage *held = findImage(downloadImage);
+  if (held) {
+    held->available = downloadWindow.expectedOffset;   // everything is on the card after the close
+  }
+}
+
+void MeshUpdater::onChunk(const UpdateChunkPackage &chunk) {
+  if (!downloading || chunk.from != sourceNode || chunk.kind != downloadImage.kind
+      || chunk.delta != downloadImage.delta || chunk.version != downloadImage.version) {
+    return;
+  }
+  Source *source = findSource(sourceNode, downloadImage.delta);
+  if (chunk.totalSize != downloadImage.size) {
+    if (source) {
+      if (chunk.busy) {
+        source->busyMillis = max<unsigned long>(millis(), 1);
+      } else {
+        source->available = min(source->available, chunk.offset);
+      }
+    }
+    Serial.printf("update: Node %u %s.\n", sourceNode, chunk.busy ? "is busy" : "does not have the next part");
+    stopDownload();
+    return;
+  }
+
+  if (chunk.offset != downloadWindow.expectedOffset) {
+    if (downloadWindow.reportGap(chunk.offset)) {
+      request();
+    }
+    return;
+  }
+
+  uint8_t buffer[UPDATE_CHUNK_SIZE];
+  size_t length = base64Decode(chunk.data, buffer, sizeof(buffer));
+  HeldImage *held = findImage(downloadImage);
+  if (!held || length == 0 || length > downloadImage.size - downloadWindow.expectedOffset
+      || partFile.write(buffer, length) != length) {
+    Serial.printf("update: Could not store a chunk of %s %u!\n", kindNames[downloadImage.kind],
+                  downloadImage.version);
+    stopDownload();
+    return;
+  }
+  downloadWindow.received(length);
+  lastActivityMillis = millis();
+  // The nodes behind this one get what is flushed, and hear of it right away
+  // instead of with the next round of offers
+  if (downloadWindow.expectedOffset - held->available >= UPDATE_FLUSH_SIZE) {
+    partFile.flush();
+    held->available = downloadWindow.expectedOffset;
+    if (!offeredPart) {
+      offeredPart = true;
+      offerImage(*held);
+    }
+  }
+  request();
+
+  if (downloadWindow.expectedOffset >= downloadImage.size) {
+    finishDownload();
+  }
+}
+
+void MeshUpdater::finishDownload() {
+  stopDownload();
+  HeldImage *held = findImage(downloadImage);
+  if (!held) {
+    return;
+  }
+  char partPath[UPDATE_PATH_SIZE];
+  char path[UPDATE_PATH_SIZE];
+  imagePath(held->image, true, partPath, sizeof(partPath));
+  imagePath(held->image, false, path, sizeof(path));
+  uint32_t crc;
+  if (!fileCrc(partPath, held->image.size, crc) || crc != held->image.crc) {
+    Serial.printf("update: %s came out wrong, fetching it again!\n", partPath);
+    removeImage(held);
+    save();
+    return;
+  }
+  closeSessions(held->image);
+  if (!fs->rename(partPath, path)) {
+    Serial.printf("update: Could not rename %s!\n", partPath);
+    return;
+  }
+  Serial.printf("update: Received %s.\n", path);
+  save();
+  offerImage(*held);
+}
+
+// Into the full image, which goes out to the nodes that run other versions
+bool MeshUpdater::applyPatch(UpdateImage patch) {
+  UpdateImage target = {patch.kind, false, patch.version, 0, 0, 0};
+  HeldImage *part = findImage(target);
+  if (part) {
+    removeImage(part);    // not needed any more, and it is in the way
+  }
+  char patchPath[UPDATE_PATH_SIZE];
+  char partPath[UPDATE_PATH_SIZE];
+  char path[UPDATE_PATH_SIZE];
+  imagePath(patch, false, patchPath, sizeof(patchPath));
+  imagePath(target, true, partPath, sizeof(partPath));
+  imagePath(target, false, path, sizeof(path));
+  Serial.printf("update: Applying %s.\n", patchPath);
+
+  File patchFile = fs->open(patchPath, FILE_READ);
+  File output = fs->open(partPath, FILE_WRITE);
+  DeltaHeader header;
+  bool applied = patchFile && output && readDeltaHeader(patchFile, header);
+  if (applied && target.kind == UPDATE_FIRMWARE) {
+    const esp_partition_t *running = esp_ota_get_running_partition();
+    applied = running && applyDelta(patchFile, &readPartition, (void *) running, output);
+  } else if (applied) {
+    File base = fs->open(MODEL_FILE_PATH, FILE_READ);
+    applied = base && applyDelta(patchFile, &readFile, &base, output);
+    base.close();
+  }
+  patchFile.close();
+  output.close();
+  if (!applied || !fs->rename(partPath, path)) {
+    Serial.printf("update: Could not apply %s, waiting for the full image!\n", patchPath);
+    fs->remove(partPath);
+    failedDeltas[target.kind] = target.version;
+    return false;
+  }
+  target.size = header.targetSize;
+  target.crc = header.targetCrc;
+  HeldImage *held = addImage(target);
+  if (held) {
+    held->available = target.size;
+    offerImage(*held);
+  }
+  save();
+  return held != NULL;
+}
+
+void MeshUpdater::onRequest(const UpdateRequestPackage &request) {
+  if (!fs || request.kind > UPDATE_MODEL) {
+    return;
+  }
+  UpdateImage image = {request.kind, request.delta, request.version, 0, 0, 0};
+  HeldImage *held = findImage(image);
+  Session *session = NULL;
+  Session *freeSession = NULL;
+  for (Session &candidate : sessions) {
+    if (candidate.active && candidate.receiver == request.from && candidate.image.sameFile(image)) {
+      session = &candidate;
+    } else if (!candidate.active && !freeSession) {
+      freeSession = &candidate;
+    }
+  }
+
+  // A part that is still coming in is served as it grows
+  bool growing = held && downloading && downloadImage.sameFile(held->image);
+  if (!held || (request.offset >= held->available && request.offset < held->image.size && !growing)) {
+    if (session) {
+      endSession(*session);
+    }
+    sendUnavailable(request, false);
+    return;
+  }
+  if (!session) {
+    if (request.offset >= held->image.size) {
+      return;   // the last ack of a session that already ended
+    }
+    if (!freeSession) {
+      sendUnavailable(request, true);
+      return;
+    }
+    session = freeSession;
+    session->active = true;
+    session->receiver = request.from;
+    session->image = held->image;
+    session->window.start(request.offset);
+    Serial.printf("update: Sending %s %u%s to node %u from byte %u.\n", kindNames[image.kind], image.version,
+                  image.delta ? " as a delta" : "", request.from, request.offset);
+  }
+  session->window.onAck(request.offset);
+  lastActivityMillis = session->window.lastAckMillis;
+
+  if (request.offset >= held->image.size) {
+    Serial.printf("update: Node %u has %s %u.\n", request.from, kindNames[image.kind], image.version);
+    endSession(*session);
+  }
+}
+
+void MeshUpdater::sendUnavailable(const UpdateRequestPackage &request, bool busy) {
+  UpdateChunkPackage chunk;
+  chunk.from = mesh->getNodeId();
+  chunk.dest = request.from;
+  chunk.kind = request.kind;
+  chunk.delta = request.delta;
+  chunk.version = request.version;
+  chunk.offset = request.offset;
+  chunk.busy = busy;
+  mesh->sendPackage(&chunk);
+}
+
+void MeshUpdater::sendChunk(Session &session) {
+  HeldImage *held = findImage(session.image);
+  if (!held) {
+    endSession(session);
+    return;
+  }
+  if (!session.window.canSend(held->available, UPDATE_TRANSFER_WINDOW * UPDATE_CHUNK_SIZE, UPDATE_ACK_TIMEOUT)) {
+    return;
+  }
+  if (!session.file) {
+    char path[UPDATE_PATH_SIZE];
+    imagePath(held->image, !isComplete(*held), path, sizeof(path));
+    session.file = fs->open(path, FILE_READ);
+  }
+
+  uint8_t buffer[UPDATE_CHUNK_SIZE];
+  size_t length = 0;
+  if (session.file && session.file.seek(session.window.nextOffset)) {
+    length = session.file.read(buffer, min<size_t>(sizeof(buffer), held->available - session.window.nextOffset));
+  }
+  UpdateChunkPackage chunk;
+  if (length == 0 || !base64Encode(buffer, length, chunk.data, sizeof(chunk.data))) {
+    Serial.printf("update: Could not read %s %u!\n", kindNames[held->image.kind], held->image.version);
+    endSession(session);
+    return;
+  }
+  chunk.from = mesh->getNodeId();
+  chunk.dest = session.receiver;
+  chunk.kind = held->image.kind;
+  chunk.delta = held->image.delta;
+  chunk.version = held->image.version;
+  chunk.offset = session.window.nextOffset;
+  chunk.totalSize = held->image.size;
+  if (mesh->sendPackage(&chunk)) {
+    session.window.sent(length);
+  }
+}
+
+void MeshUpdater::endSession(Session &session) {
+  session.file.close();
+  session.active = false;
+}
+
+// They open the file again by its new name
+void MeshUpdater::closeSessions(const UpdateImage &image) {
+  for (Session &session : sessions) {
+    if (session.active && session.image.sameFile(image)) {
+      session.file.close();
+    }
+  }
+}
+
+void MeshUpdater::update(bool sending) {
+  if (!fs) {
+    return;
+  }
+
+  // Serving, one chunk per call, the sessions take turns
+  for (Session &session : sessions) {
+    if (session.active && session.window.isQuiet(UPDATE_SESSION_TIMEOUT)) {
+      Serial.printf("update: Node %u went quiet.\n", session.receiver);
+      endSession(session);
+    }
+  }
+  for (uint8_t i = 0; sending && i < UPDATE_MAX_SESSIONS; i++) {
+    Session &session = sessions[(nextSession + i) % UPDATE_MAX_SESSIONS];
+    if (session.active) {
+      sendChunk(session);
+      nextSession = (nextSession + i + 1) % UPDATE_MAX_SESSIONS;
+      break;
+    }
+  }
+
+  // Receiving
+  if (downloading && downloadWindow.isQuiet(UPDATE_ACK_TIMEOUT)) {
+    if (++downloadWindow.retries > UPDATE_REQUEST_RETRIES) {
+      Serial.printf("update: Node %u went quiet, trying another one.\n", sourceNode);
+      Source *source = findSource(sourceNode, downloadImage.delta);
+      if (source) {
+        source->busyMillis = max<unsigned long>(millis(), 1);
+      }
+      stopDownload();
+    } else {
+      request();
+    }
+  } else if (!downloading && wanting && downloadWindow.isQuiet(UPDATE_ACK_TIMEOUT)) {
+    downloadWindow.requested();
+    if (newestVersion(wantedKind) >= wantedVersion) {
+      wanting = false;
+    } else {
+      startDownload();
+    }
+  }
+
+  // A finished delta becomes the full image
+  for (uint8_t i = 0; i < imageCount; i++) {
+    const HeldImage &held = images[i];
+    UpdateImage full = {held.image.kind, false, held.image.version, 0, 0, 0};
+    const HeldImage *fullImage = findImage(full);
+    if (isUsableDelta(held) && held.image.version > installedVersion(held.image.kind)
+        && !(fullImage && isComplete(*fullImage))) {
+      applyPatch(held.image);
+      return;
+    }
+  }
+
+  // Installing once the nodes behind this one got what they need, or waited long enough
+  HeldImage *ready = NULL;
+  for (uint8_t i = 0; i < imageCount; i++) {
+    HeldImage &held = images[i];
+    if (!held.image.delta && isComplete(held) && held.image.version > installedVersion(held.image.kind)) {
+      ready = &held;
+    }
+  }
+  if (!ready) {
+    installableMillis = 0;
+    return;
+  }
+  if (!installableMillis) {
+    installableMillis = max<unsigned long>(millis(), 1);
+  }
+  bool serving = false;
+  for (const Session &session : sessions) {
+    serving = serving || session.active;
+  }
+  if (serving && millis() - installableMillis < UPDATE_INSTALL_WAIT) {
+    return;
+  }
+  if (!install(*ready)) {
+    failedVersions[ready->image.kind] = ready->image.version;   // until the next boot
+  }
+}
+
+// Reboots into new firmware, a new model is swapped in while running
+bool MeshUpdater::install(const HeldImage &held) {
+  char path[UPDATE_PATH_SIZE];
+  imagePath(held.image, false, path, sizeof(path));
+  File image = fs->open(path, FILE_READ);
+  if (!image) {
+    Serial.printf("update: Could not open %s!\n", path);
+    return false;
+  }
+  Serial.printf("update: Installing %s.\n", path);
+  stopDownload();
+  uint8_t buffer[UPDATE_CHUNK_SIZE];
+
+  if (held.image.kind == UPDATE_FIRMWARE) {
+    if (!Update.begin(held.image.size)) {
+      Serial.printf("update: Can't flash %s: %s!\n", path, Update.errorString());
+      image.close();
+      return false;
+    }
+    size_t length;
+    while ((length = image.read(buffer, sizeof(buffer))) > 0) {
+      if (Update.write(buffer, length) != length) {
+        break;
+      }
+      yield();
+    }
+    image.close();
+    if (!Update.end()) {
+      Serial.printf("update: Flashing %s failed: %s!\n", path, Update.errorString());
+      return false;
+    }
+    flashedFirmware = held.image.version;
+  } else {
+    // The old model stays until the new one is complete
+    if (held.image.size > modelCapacity()) {
+      Serial.printf("update: %s is too big for a model!\n", path);
+      image.close();
+      return false;
+    }
+    char newPath[UPDATE_PATH_SIZE];
+    snprintf(newPath, sizeof(newPath), "%s.new", MODEL_FILE_PATH);
+    File model = fs->open(newPath, FILE_WRITE);
+    size_t length;
+    uint32_t copied = 0;
+    while (model && (length = image.read(buffer, sizeof(buffer))) > 0 && model.write(buffer, length) == length) {
+      copied += length;
+      yield();
+    }
+    image.close();
+    model.close();
+    if (copied != held.image.size || (fs->exists(MODEL_FILE_PATH) && !fs->remove(MODEL_FILE_PATH))
+        || !fs->rename(newPath, MODEL_FILE_PATH)) {
+      Serial.printf("update: Could not copy %s to %s!\n", path, MODEL_FILE_PATH);
+      return false;
+    }
+    runningVersions[UPDATE_MODEL] = held.image.version;
+    save();
+    if (reloadDetector(*fs)) {
+      Serial.printf("update: Running model %u.\n", held.image.version);
+      installableMillis = 0;
+      lastActivityMillis = millis();    // the nodes behind this one might still need it
+      return true;
+    }
+    Serial.println("update: Could not swap the model in, rebooting!");
+  }
+
+  save();
+  Serial.printf("update: Rebooting into %s %u.\n", kindNames[held.image.kind], held.image.version);
+  Serial.flush();
+  ESP.restart();
+  return true;
+}
+
+bool MeshUpdater::isActive() const {
+  bool serving = false;
+  for (const Session &session : sessions) {
+    serving = serving || session.active;
+  }
+  return downloading || serving;
+}
+
+void MeshUpdater::print() const {
+  Serial.printf("update: Running firmware %u and model %u.\n", runningVersions[UPDATE_FIRMWARE],
+                runningVersions[UPDATE_MODEL]);
+  for (uint8_t i = 0; i < imageCount; i++) {
+    const HeldImage &held = images[i];
+    Serial.printf("update: %s %u%s, %u of %u bytes, crc %08x.\n", kindNames[held.image.kind], held.image.version,
+                  held.image.delta ? " (delta)" : "", held.available, held.image.size, held.image.crc);
+  }
+}
@@ -0,0 +1,162 @@
+/****************************************************
+ * Firmware and model updates over the mesh.        *
+ * Images wait in UPDATES_PATH as                   *
+ * "<firmware|model>_<version>.bin", or as ".delta" *
+ * patches from an older version, see deltapatch.h. *
+ * For a new release they are put on the card of a  *
+ * gateway. Every node broadcasts what it has once  *
+ * per UPDATE_OFFER_INTERVAL, parts of an image it  *
+ * is still receiving included. A node that runs an *
+ * older version pulls the image from the closest   *
+ * node that has the next bytes, the same way as    *
+ * pictures, and serves what it has to the nodes    *
+ * behind it while it is still receiving. So an     *
+ * update spreads out like a tree instead of going  *
+ * out from the gateway once per node. Deltas win   *
+ * over full images when they fit the running       *
+ * version. A finished image is checked and         *
+ * installed once nobody is served any more.        *
+ * Firmware reboots into it, a model is swapped in  *
+ * while running. The image stays on the card for   *
+ * the nodes that are still missing it, they are    *
+ * offered for UPDATE_SPREAD_TIME.                  *
+ ****************************************************/
+
+#ifndef MESHUPDATE_H
+#define MESHUPDATE_H
+
+#include <Arduino.h>
+#include <painlessMesh.h>
+#include "FS.h"
+#include "packages.h"
+#include "transferwindow.h"
+
+#define   UPDATES_PATH                "/updates"
+#define   UPDATE_PATH_SIZE            48
+#define   UPDATE_NAMESPACE            "update"
+#define   UPDATE_KEY                  "images"
+#define   UPDATE_STORE_VERSION        1
+#define   UPDATE_MAX_IMAGES           4         // a full image and a delta per kind
+#define   UPDATE_MAX_SOURCES          8         // offers remembered for the wanted version
+#define   UPDATE_MAX_SESSIONS         2         // nodes served at once
+#define   UPDATE_OFFER_INTERVAL       60000     // ms
+#define   UPDATE_SOURCE_TIMEOUT       (3 * UPDATE_OFFER_INTERVAL)
+#define   UPDATE_MAX_LATENCY          5000000   // us, offers from before a time sync
+#define   UPDATE_BUSY_BACKOFF         20000     // ms a busy node is not asked again
+#define   UPDATE_TRANSFER_WINDOW      4         // chunks in flight
+#define   UPDATE_CHUNK_INTERVAL       50        // ms between chunks
+#define   UPDATE_ACK_TIMEOUT          2000      // ms until the window is sent again
+#define   UPDATE_SESSION_TIMEOUT      30000     // ms until a quiet receiver is dropped
+#define   UPDATE_REQUEST_RETRIES      5         // then the next source is tried
+#define   UPDATE_FLUSH_SIZE           (16 * 1024)   // a part is served up to its last flush
+#define   UPDATE_INSTALL_WAIT         600000    // ms an install waits for the nodes it serves
+#define   UPDATE_SPREAD_TIME          3600000   // ms a node offers after it got or served an image
+
+// An image on the card, available is below the size while it is received
+struct HeldImage {
+  UpdateImage image;
+  uint32_t available;
+};
+
+class MeshUpdater {
+ public:
+  // Finds the images on the card. Gateways offer theirs all the time.
+  bool begin(painlessMesh &mesh, fs::FS &fs, uint32_t firmwareVersion, bool alwaysOffer);
+  // Again, after images were put on the card
+  void scan();
+
+  // meshTime is the one of this node when the offer arrived
+  void onOffer(const UpdateOfferPackage &offer, uint32_t meshTime);
+  void onRequest(const UpdateRequestPackage &request);
+  void onChunk(const UpdateChunkPackage &chunk);
+
+  // Broadcasts what is on the card
+  void offer();
+  // Sends the next chunk if sending is true, asks again if a source went
+  // quiet and installs a finished image. Call every UPDATE_CHUNK_INTERVAL.
+  void update(bool sending);
+  // Receiving or serving an image
+  bool isActive() const;
+
+  uint32_t runningVersion(uint8_t kind) const { return runningVersions[kind]; }
+  void print() const;
+
+ private:
+  painlessMesh *mesh = NULL;
+  fs::FS *fs = NULL;
+  bool alwaysOffer = false;
+  unsigned long lastActivityMillis = 0;   // an image came in or went out
+  uint32_t runningVersions[2] = {0, 0};
+  uint32_t flashedFirmware = 0;       // the last version flashed by this node
+  uint32_t failedVersions[2] = {0, 0};    // did not install, until the next boot
+  uint32_t failedDeltas[2] = {0, 0};      // did not fit, until the next boot
+
+  HeldImage images[UPDATE_MAX_IMAGES];
+  uint8_t imageCount = 0;
+
+  struct Source {
+    uint32_t nodeId;
+    UpdateImage image;
+    uint32_t available;
+    uint32_t latencyMicros;
+    unsigned long heardMillis;
+    unsigned long busyMillis;         // millis() of the last busy answer, 0 if none
+  };
+  bool wanting = false;
+  uint8_t wantedKind;
+  uint32_t wantedVersion;
+  Source sources[UPDATE_MAX_SOURCES];
+  uint8_t sourceCount = 0;
+
+  // Receiving side
+  bool downloading = false;
+  UpdateImage downloadImage;
+  uint32_t sourceNode;
+  File partFile;
+  ReceiveWindow downloadWindow;       // also paces the looks for a source while wanting
+  bool offeredPart;                   // since the download started
+
+  // Serving side
+  struct Session {
+    bool active;
+    uint32_t receiver;
+    UpdateImage image;
+    File file;                        // opened again after the part was finished
+    SendWindow window;
+  };
+  Session sessions[UPDATE_MAX_SESSIONS];
+  uint8_t nextSession = 0;
+
+  unsigned long installableMillis = 0;    // since an image waits for its install, 0 if none
+
+  void imagePath(const UpdateImage &image, bool part, char *path, size_t size) const;
+  static bool isComplete(const HeldImage &held);
+  bool isUsableDelta(const HeldImage &held) const;
+  HeldImage *findImage(const UpdateImage &image);
+  HeldImage *addImage(const UpdateImage &image);
+  void removeImage(HeldImage *held);
+  void removeOlder(uint8_t kind, uint32_t version);
+  uint32_t installedVersion(uint8_t kind) const;
+  uint32_t newestVersion(uint8_t kind) const;
+  bool loadStored(HeldImage *stored, uint8_t &count);
+  bool save();
+  bool fileCrc(const char *path, uint32_t size, uint32_t &crc);
+
+  Source *findSource(uint32_t nodeId, bool delta);
+  Source *chooseSource();
+  bool startDownload();
+  void request();
+  void stopDownload();
+  void finishDownload();
+  bool applyPatch(UpdateImage patch);
+
+  void offerImage(const HeldImage &held);
+  void sendChunk(Session &session);
+  void sendUnavailable(const UpdateRequestPackage &request, bool busy);
+  void endSession(Session &session);
+  void closeSessions(const UpdateImage &image);
+
+  bool install(const HeldImage &held);
+};
+
+#endif
@@ -0,0 +1,130 @@
+#include "modelstore.h"
+
+#include "crc32.h"
+
+static_assert(sizeof(ModelHeader) <= MODEL_HEADER_SIZE, "ModelHeader does not fit in front of the model");
+
+static uint32_t headerChecksum(const ModelHeader &header) {
+  return crc32(&header, offsetof(ModelHeader, headerCrc));
+}
+
+bool ModelStore::begin() {
+  if (partition) {
+    return true;
+  }
+  partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, (esp_partition_subtype_t) MODEL_PARTITION_SUBTYPE,
+                                       MODEL_PARTITION_LABEL);
+  if (!partition) {
+    Serial.println("model: No model partition in the partition table!");
+    return false;
+  }
+  readHeader();
+  return true;
+}
+
+bool ModelStore::readHeader() {
+  valid = esp_partition_read(partition, 0, &header, sizeof(header)) == ESP_OK
+          && header.magic == MODEL_STORE_MAGIC && header.headerCrc == headerChecksum(header)
+          && header.size > 0 && header.size <= capacity();
+  return valid;
+}
+
+const uint8_t *ModelStore::map() {
+  if (mapped || !partition || !valid) {
+    return mapped;
+  }
+  const void *pointer;
+  if (esp_partition_mmap(partition, 0, MODEL_HEADER_SIZE + header.size, SPI_FLASH_MMAP_DATA,
+                         &pointer, &mapHandle) != ESP_OK) {
+    Serial.println("model: Could not map the model partition!");
+    return NULL;
+  }
+  mapped = (const uint8_t *) pointer + MODEL_HEADER_SIZE;
+  return mapped;
+}
+
+void ModelStore::unmap() {
+  if (mapped) {
+    spi_flash_munmap(mapHandle);
+    mapped = NULL;
+  }
+}
+
+bool ModelStore::matches(File &model, bool checkContent) {
+  if (!valid || model.size() != header.size) {
+    return false;
+  }
+  if (!checkContent) {
+    return true;
+  }
+  uint8_t buffer[MODEL_COPY_BUFFER_SIZE];
+  uint32_t crc = 0;
+  size_t length;
+  model.seek(0);
+  while ((length = model.read(buffer, sizeof(buffer))) > 0) {
+    crc = crc32(buffer, length, crc);
+    yield();
+  }
+  return crc == header.crc;
+}
+
+bool ModelStore::write(File &model) {
+  if (!partition) {
+    return false;
+  }
+  uint32_t modelSize = model.size();
+  if (modelSize == 0 || modelSize > capacity()) {
+    Serial.printf("model: %u bytes do not fit in the model partition!\n", modelSize);
+    return false;
+  }
+  unmap();
+  valid = false;
+
+  // The header sector is erased with the rest, so the old model is invalid before a byte of the new one is written
+  uint32_t eraseSize = (MODEL_HEADER_SIZE + modelSize + MODEL_SECTOR_SIZE - 1) / MODEL_SECTOR_SIZE * MODEL_SECTOR_SIZE;
+  if (esp_partition_erase_range(partition, 0, eraseSize) != ESP_OK) {
+    Serial.println("model: Could not erase the model partition!");
+    return false;
+  }
+
+  uint8_t buffer[MODEL_COPY_BUFFER_SIZE];
+  uint32_t written = 0;
+  uint32_t crc = 0;
+  size_t length;
+  model.seek(0);
+  while (written < modelSize && (length = model.read(buffer, sizeof(buffer))) > 0) {
+    if (esp_partition_write(partition, MODEL_HEADER_SIZE + written, buffer, length) != ESP_OK) {
+      break;
+    }
+    crc = crc32(buffer, length, crc);
+    written += length;
+    yield();
+  }
+  if (written != modelSize) {
+    Serial.println("model: Could not copy the model into its partition!");
+    return false;
+  }
+
+  // Read back, a model that is not the one of the file is never marked valid
+  uint32_t storedCrc = 0;
+  for (uint32_t offset = 0; offset < modelSize; offset += sizeof(buffer)) {
+    length = min<size_t>(sizeof(buffer), modelSize - offset);
+    if (esp_partition_read(partition, MODEL_HEADER_SIZE + offset, buffer, length) != ESP_OK) {
+      break;
+    }
+    storedCrc = crc32(buffer, length, storedCrc);
+  }
+  if (storedCrc != crc) {
+    Serial.println("model: The model partition does not read back what was written!");
+    return false;
+  }
+
+  ModelHeader stored = {MODEL_STORE_MAGIC, modelSize, crc, 0};
+  stored.headerCrc = headerChecksum(stored);
+  if (esp_partition_write(partition, 0, &stored, sizeof(stored)) != ESP_OK || !readHeader()) {
+    Serial.println("model: Could not write the header of the model partition!");
+    return false;
+  }
+  Serial.printf("model: Stored %u bytes in the model partition.\n", modelSize);
+  return true;
+}
@@ -0,0 +1,68 @@
+/****************************************************
+ * The model in its own flash partition, next to    *
+ * the app slots. It is mapped into the data        *
+ * address space, so the interpreter reads the      *
+ * flatbuffer straight out of flash and no copy of  *
+ * it sits in RAM or PSRAM. The partition starts    *
+ * with a ModelHeader, the model follows at         *
+ * MODEL_HEADER_SIZE. The header is written last,   *
+ * so a model cut off by a reset is never mapped. A *
+ * new model goes in without a firmware build, from *
+ * the card or over the mesh.                       *
+ ****************************************************/
+
+#ifndef MODELSTORE_H
+#define MODELSTORE_H
+
+#include <Arduino.h>
+#include "esp_partition.h"
+#include "FS.h"
+
+#define   MODEL_PARTITION_LABEL       "model"
+#define   MODEL_PARTITION_SUBTYPE     0x40          // first custom data subtype, see partitions.csv
+#define   MODEL_STORE_MAGIC           0x4C444F4D    // "MODL"
+#define   MODEL_HEADER_SIZE           64            // keeps the flatbuffer aligned
+#define   MODEL_SECTOR_SIZE           4096          // erase unit of the flash
+#define   MODEL_COPY_BUFFER_SIZE      1024
+
+struct ModelHeader {
+  uint32_t magic;
+  uint32_t size;
+  uint32_t crc;                 // of the model
+  uint32_t headerCrc;           // of the fields above
+};
+
+class ModelStore {
+ public:
+  // False if the partition table has no model partition, as on nodes that
+  // only got the firmware over the air, the partition table stays then
+  bool begin();
+  bool isAvailable() const { return partition != NULL; }
+  // A complete model is stored
+  bool isValid() const { return valid; }
+  uint32_t size() const { return valid ? header.size : 0; }
+  // Biggest model that fits behind the header
+  uint32_t capacity() const { return partition ? partition->size - MODEL_HEADER_SIZE : 0; }
+
+  // The stored model in the data address space, NULL if there is none.
+  // Stays valid until unmap() or write().
+  const uint8_t *map();
+  void unmap();
+
+  // The file holds the stored model. Only compares the size unless
+  // checkContent is true, which reads the whole file.
+  bool matches(File &model, bool checkContent);
+  // Replaces the stored model with the file, unmapped while it is written
+  bool write(File &model);
+
+ private:
+  const esp_partition_t *partition = NULL;
+  ModelHeader header;
+  bool valid = false;
+  spi_flash_mmap_handle_t mapHandle;
+  const uint8_t *mapped = NULL;
+
+  bool readHeader();
+};
+
+#endif
@@ -0,0 +1,174 @@
+#include "motiongate.h"
+
+#include "esp_jpg_decode.h"
+
+// A running decode, esp_jpg_decode() hands the same argument to both callbacks
+struct JpegFingerprint {
+  MotionGate *gate;
+  camera_fb_t *frameBuffer;
+  uint16_t width;       // of the scaled picture
+  uint16_t height;
+  bool started;
+};
+
+static size_t readJpeg(void *arg, size_t index, uint8_t *buf, size_t len) {
+  camera_fb_t *frameBuffer = ((JpegFingerprint *) arg)->frameBuffer;
+  if (index + len > frameBuffer->len) {
+    len = frameBuffer->len - index;
+  }
+  if (buf) {
+    memcpy(buf, frameBuffer->buf + index, len);
+  }
+  return len;
+}
+
+static inline uint8_t rawGray(const uint8_t *pixel, size_t bytesPerPixel) {
+  if (bytesPerPixel == 1) {
+    return pixel[0];
+  }
+  // RGB565, high byte first
+  uint8_t red = pixel[0] & 0xF8;
+  uint8_t green = ((pixel[0] & 0x07) << 5) | ((pixel[1] & 0xE0) >> 3);
+  uint8_t blue = (pixel[1] & 0x1F) << 3;
+  return (red * 77 + green * 150 + blue * 29) >> 8;
+}
+
+void MotionGate::begin(const MotionGateState *warmState) {
+  if (warmState && warmState->valid) {
+    state = *warmState;
+  } else {
+    state.valid = false;
+  }
+  stats = {};
+}
+
+// Sums up a few pixels spread over every cell
+void MotionGate::fingerprintRaw(camera_fb_t *frameBuffer, size_t bytesPerPixel) {
+  size_t stepX = max<size_t>(1, frameBuffer->width / (MOTION_GRID_WIDTH * MOTION_SAMPLES_PER_CELL));
+  size_t stepY = max<size_t>(1, frameBuffer->height / (MOTION_GRID_HEIGHT * MOTION_SAMPLES_PER_CELL));
+  for (int cellY = 0; cellY < MOTION_GRID_HEIGHT; cellY++) {
+    size_t startY = cellY * frameBuffer->height / MOTION_GRID_HEIGHT;
+    size_t endY = (cellY + 1) * frameBuffer->height / MOTION_GRID_HEIGHT;
+    for (int cellX = 0; cellX < MOTION_GRID_WIDTH; cellX++) {
+      size_t startX = cellX * frameBuffer->width / MOTION_GRID_WIDTH;
+      size_t endX = (cellX + 1) * frameBuffer->width / MOTION_GRID_WIDTH;
+      uint32_t sum = 0;
+      uint16_t count = 0;
+      for (size_t y = startY; y < endY; y += stepY) {
+        const uint8_t *pixel = frameBuffer->buf + (y * frameBuffer->width + startX) * bytesPerPixel;
+        for (size_t x = startX; x < endX; x += stepX, pixel += stepX * bytesPerPixel) {
+          sum += rawGray(pixel, bytesPerPixel);
+          count++;
+        }
+      }
+      cellSums[cellY * MOTION_GRID_WIDTH + cellX] = sum;
+      cellCounts[cellY * MOTION_GRID_WIDTH + cellX] = count;
+    }
+  }
+}
+
+bool MotionGate::writeJpegBlock(void *arg, uint16_t x, uint16_t y, uint16_t w, uint16_t h, uint8_t *data) {
+  JpegFingerprint &decode = *(JpegFingerprint *) arg;
+  if (!data) {
+    // x == 0 && y == 0 marks the start, w and h are the scaled picture size then
+    if (x == 0 && y == 0) {
+      decode.width = w;
+      decode.height = h;
+      decode.started = w >= MOTION_GRID_WIDTH && h >= MOTION_GRID_HEIGHT;
+      return decode.started;
+    }
+    return true;
+  }
+
+  MotionGate &gate = *decode.gate;
+  for (uint16_t row = 0; row < h; row++) {
+    size_t cellRow = (size_t) (y + row) * MOTION_GRID_HEIGHT / decode.height * MOTION_GRID_WIDTH;
+    const uint8_t *pixel = data + row * w * 3;
+    for (uint16_t column = 0; column < w; column++, pixel += 3) {
+      size_t cell = cellRow + (size_t) (x + column) * MOTION_GRID_WIDTH / decode.width;
+      gate.cellSums[cell] += (pixel[0] * 77 + pixel[1] * 150 + pixel[2] * 29) >> 8;
+      gate.cellCounts[cell]++;
+    }
+  }
+  return true;
+}
+
+// Decoded at 1/8 scale, only the DC coefficients are needed for that
+bool MotionGate::fingerprintJpeg(camera_fb_t *frameBuffer) {
+  memset(cellSums, 0, sizeof(cellSums));
+  memset(cellCounts, 0, sizeof(cellCounts));
+  JpegFingerprint decode = {this, frameBuffer, 0, 0, false};
+  return esp_jpg_decode(frameBuffer->len, JPG_SCALE_8X, &readJpeg, &writeJpegBlock, &decode) == ESP_OK
+         && decode.started;
+}
+
+bool MotionGate::fingerprint(camera_fb_t *frameBuffer) {
+  if (frameBuffer->format == PIXFORMAT_JPEG) {
+    return fingerprintJpeg(frameBuffer);
+  }
+  if (frameBuffer->format != PIXFORMAT_GRAYSCALE && frameBuffer->format != PIXFORMAT_RGB565) {
+    return false;
+  }
+  size_t bytesPerPixel = (frameBuffer->format == PIXFORMAT_GRAYSCALE) ? 1 : 2;
+  if (frameBuffer->width < MOTION_GRID_WIDTH || frameBuffer->height < MOTION_GRID_HEIGHT
+      || frameBuffer->len < frameBuffer->width * frameBuffer->height * bytesPerPixel) {
+    return false;
+  }
+  fingerprintRaw(frameBuffer, bytesPerPixel);
+  return true;
+}
+
+bool MotionGate::hasMotion(camera_fb_t *frameBuffer) {
+  unsigned long startMicros = micros();
+  stats.checkCount++;
+  if (!fingerprint(frameBuffer)) {
+    stats.lastCheckMicros = micros() - startMicros;
+    return true;
+  }
+
+  // Luminance * 256 like the background
+  int32_t cells[MOTION_GRID_CELLS];
+  for (int i = 0; i < MOTION_GRID_CELLS; i++) {
+    cells[i] = cellCounts[i] ? (int32_t) ((cellSums[i] << 8) / cellCounts[i]) : 0;
+  }
+
+  // Another format or size can't be compared, start over with this frame
+  bool sameSource = state.valid && state.format == frameBuffer->format
+                    && state.width == frameBuffer->width && state.height == frameBuffer->height;
+  if (!sameSource) {
+    for (int i = 0; i < MOTION_GRID_CELLS; i++) {
+      state.background[i] = cells[i];
+    }
+    state.format = frameBuffer->format;
+    state.width = frameBuffer->width;
+    state.height = frameBuffer->height;
+    state.valid = true;
+    stats.lastChangedCells = MOTION_GRID_CELLS;
+    stats.lastCheckMicros = micros() - startMicros;
+    return true;
+  }
+
+  // Sun and clouds shift every cell at once, the exposure control as well
+  int32_t meanDifference = 0;
+  for (int i = 0; i < MOTION_GRID_CELLS; i++) {
+    meanDifference += cells[i] - state.background[i];
+  }
+  meanDifference /= MOTION_GRID_CELLS;
+
+  uint16_t changedCells = 0;
+  for (int i = 0; i < MOTION_GRID_CELLS; i++) {
+    int32_t difference = cells[i] - state.background[i];
+    if (abs(difference - meanDifference) > (MOTION_CELL_THRESHOLD << 8)) {
+      changedCells++;
+    }
+    state.background[i] += (difference >> MOTION_BACKGROUND_SHIFT);
+  }
+
+  bool motion = changedCells >= MOTION_MIN_CELLS;
+  if (!motion) {
+    stats.skipCount++;
+  }
+  stats.lastChangedCells = changedCells;
+  stats.lastCheckMicros = micros() - startMicros;
+  return motion;
+}
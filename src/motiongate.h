@@ -0,0 +1,69 @@
+/****************************************************
+ * Frame differencing in front of the detector.     *
+ * Every frame is boiled down to a fingerprint of   *
+ * MOTION_GRID_WIDTH x MOTION_GRID_HEIGHT cells,    *
+ * the mean luminance of each. The background is a  *
+ * running average of the fingerprints. A frame     *
+ * shows motion if at least MOTION_MIN_CELLS cells  *
+ * differ from it by more than                      *
+ * MOTION_CELL_THRESHOLD, after taking out the      *
+ * change in overall brightness. Slow changes fade  *
+ * into the background, a deer that stands still    *
+ * does too after some time.                        *
+ ****************************************************/
+
+#ifndef MOTIONGATE_H
+#define MOTIONGATE_H
+
+#include <Arduino.h>
+#include "esp_camera.h"
+
+#define   MOTION_GRID_WIDTH         16
+#define   MOTION_GRID_HEIGHT        12
+#define   MOTION_GRID_CELLS         (MOTION_GRID_WIDTH * MOTION_GRID_HEIGHT)
+#define   MOTION_CELL_THRESHOLD     20      // luminance levels
+#define   MOTION_MIN_CELLS          3       // of MOTION_GRID_CELLS
+#define   MOTION_BACKGROUND_SHIFT   3       // background moves 1/8 of the way to every frame
+#define   MOTION_SAMPLES_PER_CELL   8       // per direction, raw frames
+
+// Kept through deep sleep, see lowpower.h
+struct MotionGateState {
+  bool valid;
+  uint8_t format;       // pixformat_t of the frames behind the background
+  uint16_t width;
+  uint16_t height;
+  uint16_t background[MOTION_GRID_CELLS];   // luminance * 256
+};
+
+struct MotionGateStats {
+  uint32_t checkCount;
+  uint32_t skipCount;
+  uint16_t lastChangedCells;
+  unsigned long lastCheckMicros;
+};
+
+class MotionGate {
+ public:
+  void begin(const MotionGateState *warmState = NULL);
+  void saveState(MotionGateState &state) const { state = this->state; }
+
+  // Compares the frame with the background and learns it. True if the scene
+  // changed, and for the first frame of a format or size and frames that
+  // can't be decoded, so the classifier gets those.
+  bool hasMotion(camera_fb_t *frameBuffer);
+
+  const MotionGateStats &getStats() const { return stats; }
+
+ private:
+  MotionGateState state = {};
+  MotionGateStats stats = {};
+  uint32_t cellSums[MOTION_GRID_CELLS];
+  uint16_t cellCounts[MOTION_GRID_CELLS];
+
+  bool fingerprint(camera_fb_t *frameBuffer);
+  void fingerprintRaw(camera_fb_t *frameBuffer, size_t bytesPerPixel);
+  bool fingerprintJpeg(camera_fb_t *frameBuffer);
+  static bool writeJpegBlock(void *arg, uint16_t x, uint16_t y, uint16_t w, uint16_t h, uint8_t *data);
+};
+
+#endif
@@ -0,0 +1,157 @@
+#include "nodeconfig.h"
+
+#include <Preferences.h>
+#include "crc32.h"
+
+// In NVS, a config of another layout is ignored
+struct StoredConfig {
+  uint8_t version;
+  uint8_t reserved[3];
+  NodeConfig config;
+  uint32_t checksum;
+};
+
+enum ConfigFieldType {
+  FIELD_UINT32,
+  FIELD_UINT8,
+  FIELD_FLOAT
+};
+
+struct ConfigField {
+  const char *name;
+  ConfigFieldType type;
+  size_t offset;
+};
+
+static const ConfigField configFields[] = {
+  {"captureInterval", FIELD_UINT32, offsetof(NodeConfig, captureInterval)},
+  {"detectorInterval", FIELD_UINT32, offsetof(NodeConfig, detectorInterval)},
+  {"sendInterval", FIELD_UINT32, offsetof(NodeConfig, sendInterval)},
+  {"pirPollInterval", FIELD_UINT32, offsetof(NodeConfig, pirPollInterval)},
+  {"queueLimit", FIELD_UINT32, offsetof(NodeConfig, queueLimit)},
+  {"deerThreshold", FIELD_FLOAT, offsetof(NodeConfig, deerThreshold)},
+  {"frameSize", FIELD_UINT8, offsetof(NodeConfig, frameSize)},
+  {"jpegQuality", FIELD_UINT8, offsetof(NodeConfig, jpegQuality)}
+};
+
+static uint32_t storedChecksum(const StoredConfig &stored) {
+  return crc32(&stored, offsetof(StoredConfig, checksum));
+}
+
+static inline uint32_t clampInterval(uint32_t interval) {
+  return min<uint32_t>(max<uint32_t>(interval, CONFIG_MIN_INTERVAL), CONFIG_MAX_INTERVAL);
+}
+
+bool ConfigStore::begin(const NodeConfig &builtIn) {
+  config = builtIn;
+  maxQueueLimit = builtIn.queueLimit;
+
+  Preferences preferences;
+  if (!preferences.begin(CONFIG_NAMESPACE, true)) {
+    return false;   // nothing stored yet
+  }
+  StoredConfig stored;
+  bool valid = preferences.getBytes(CONFIG_KEY, &stored, sizeof(stored)) == sizeof(stored)
+               && stored.version == CONFIG_VERSION && stored.checksum == storedChecksum(stored);
+  preferences.end();
+  if (!valid) {
+    return false;
+  }
+  config = stored.config;
+  clamp(config);
+  Serial.printf("config: Loaded config %u.\n", config.sequence);
+  return true;
+}
+
+void ConfigStore::clamp(NodeConfig &newConfig) const {
+  newConfig.captureInterval = clampInterval(newConfig.captureInterval);
+  newConfig.detectorInterval = clampInterval(newConfig.detectorInterval);
+  newConfig.sendInterval = clampInterval(newConfig.sendInterval);
+  newConfig.pirPollInterval = clampInterval(newConfig.pirPollInterval);
+  newConfig.queueLimit = min<uint32_t>(max<uint32_t>(newConfig.queueLimit, 1), maxQueueLimit);
+  if (!(newConfig.deerThreshold >= 0.0f && newConfig.deerThreshold <= 1.0f)) {
+    newConfig.deerThreshold = config.deerThreshold;   // NaN as well
+  }
+  if (newConfig.jpegQuality != 0) {
+    newConfig.jpegQuality = min<uint8_t>(max<uint8_t>(newConfig.jpegQuality, CONFIG_MIN_QUALITY), CONFIG_MAX_QUALITY);
+  }
+}
+
+bool ConfigStore::save() {
+  StoredConfig stored = {};
+  stored.version = CONFIG_VERSION;
+  stored.config = config;
+  stored.checksum = storedChecksum(stored);
+
+  Preferences preferences;
+  if (!preferences.begin(CONFIG_NAMESPACE, false)) {
+    Serial.printf("config: Could not open NVS namespace %s!\n", CONFIG_NAMESPACE);
+    return false;
+  }
+  bool saved = preferences.putBytes(CONFIG_KEY, &stored, sizeof(stored)) == sizeof(stored);
+  preferences.end();
+  if (!saved) {
+    Serial.println("config: Could not save the config!");
+  }
+  return saved;
+}
+
+// Applied even if it could not be stored, it comes again with the next announce
+bool ConfigStore::update(NodeConfig newConfig) {
+  if (newConfig.sequence <= config.sequence) {
+    return false;
+  }
+  clamp(newConfig);
+  config = newConfig;
+  save();
+  return true;
+}
+
+bool ConfigStore::edit(const char *line) {
+  char buffer[CONFIG_JSON_SIZE];
+  strlcpy(buffer, line, sizeof(buffer));
+  NodeConfig newConfig = config;
+  newConfig.sequence = config.sequence + 1;
+
+  char *position = NULL;
+  for (char *pair = strtok_r(buffer, " \t\r\n", &position); pair; pair = strtok_r(NULL, " \t\r\n", &position)) {
+    char *value = strchr(pair, '=');
+    if (!value) {
+      Serial.printf("config: Expected <field>=<value>, got %s!\n", pair);
+      return false;
+    }
+    *value++ = '\0';
+    const ConfigField *field = NULL;
+    for (const ConfigField &candidate : configFields) {
+      if (strcmp(candidate.name, pair) == 0) {
+        field = &candidate;
+      }
+    }
+    if (!field) {
+      Serial.printf("config: There is no field %s!\n", pair);
+      return false;
+    }
+    uint8_t *target = (uint8_t *) &newConfig + field->offset;
+    switch (field->type) {
+      case FIELD_UINT32:
+        *(uint32_t *) target = strtoul(value, NULL, 10);
+        break;
+      case FIELD_UINT8:
+        *target = (uint8_t) strtoul(value, NULL, 10);
+        break;
+      case FIELD_FLOAT:
+        *(float *) target = strtof(value, NULL);
+        break;
+    }
+  }
+  return update(newConfig);
+}
+
+int ConfigStore::format(const NodeConfig &config, char *buffer, size_t size) {
+  return snprintf(buffer, size,
+                  "{\"sequence\":%u,\"captureInterval\":%u,\"detectorInterval\":%u,\"sendInterval\":%u,"
+                  "\"pirPollInterval\":%u,\"queueLimit\":%u,\"deerThreshold\":%.2f,\"frameSize\":%u,\"jpegQuality\":%u}",
+                  config.sequence, config.captureInterval, config.detectorInterval, config.sendInterval,
+                  config.pirPollInterval, config.queueLimit, config.deerThreshold, config.frameSize,
+                  config.jpegQuality);
+}
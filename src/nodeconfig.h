@@ -0,0 +1,61 @@
+/****************************************************
+ * Settings that can be changed over the mesh.      *
+ * A gateway broadcasts its config with every       *
+ * announce and right after it was changed on its   *
+ * serial port. A node takes every config with a    *
+ * higher sequence than its own, stores it in NVS   *
+ * and applies it without a reboot. Nodes that      *
+ * slept or joined later catch up with the next     *
+ * announce. Values out of range are clamped.       *
+ ****************************************************/
+
+#ifndef NODECONFIG_H
+#define NODECONFIG_H
+
+#include <Arduino.h>
+
+#define   CONFIG_NAMESPACE        "config"
+#define   CONFIG_KEY              "node"
+#define   CONFIG_VERSION          1
+#define   CONFIG_JSON_SIZE        256
+#define   CONFIG_MIN_INTERVAL     10          // ms
+#define   CONFIG_MAX_INTERVAL     86400000    // ms, a day
+#define   CONFIG_MIN_QUALITY      4           // lower is better and bigger
+#define   CONFIG_MAX_QUALITY      63
+
+struct NodeConfig {
+  uint32_t sequence;            // 0 is the built-in config
+  uint32_t captureInterval;     // ms, taskTakePicture without the detector stream
+  uint32_t detectorInterval;    // ms, taskTakePicture with it
+  uint32_t sendInterval;        // ms, taskSendReport while the queue is empty
+  uint32_t pirPollInterval;     // ms, taskHandlePirEvent
+  uint32_t queueLimit;          // reports
+  float deerThreshold;          // reports below are not sent
+  uint8_t frameSize;            // framesize_t of the archive stream, 0 for the built-in one
+  uint8_t jpegQuality;          // of the archive stream, 0 for the built-in one
+};
+
+class ConfigStore {
+ public:
+  // Loads the stored config, or keeps the built-in one if there is none
+  bool begin(const NodeConfig &builtIn);
+  const NodeConfig &get() const { return config; }
+
+  // Takes the config if it is newer than the current one and stores it.
+  // False if it is not newer.
+  bool update(NodeConfig newConfig);
+  // Applies "<field>=<value>" pairs as the next sequence, for the serial port
+  bool edit(const char *line);
+
+  // Same field names as in ConfigPackage
+  static int format(const NodeConfig &config, char *buffer, size_t size);
+
+ private:
+  NodeConfig config = {};
+  uint32_t maxQueueLimit = 0;   // the one of the built-in config
+
+  void clamp(NodeConfig &config) const;
+  bool save();
+};
+
+#endif
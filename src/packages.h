@@ -0,0 +1,576 @@
+/****************************************************
+ * Custom packages for transmission over the mesh.  *
+ ****************************************************/
+
+#ifndef PACKAGES_H
+#define PACKAGES_H
+
+#include <Arduino.h>
+#include <painlessMesh.h>
+#include "nodeconfig.h"
+#include "telemetry.h"
+#include "wireformat.h"
+
+// Each package has to be identified by a unique ID
+// Values <30 are reserved for default messages
+#define   PICTURE_REPORT_PACKAGE        31
+#define   PICTURE_REPORT_BATCH_PACKAGE  32
+#define   COMPACT_REPORT_PACKAGE        33
+#define   PICTURE_REQUEST_PACKAGE       34
+#define   PICTURE_CHUNK_PACKAGE         35
+#define   TELEMETRY_PACKAGE             36
+#define   BENCHMARK_PACKAGE             37
+#define   GATEWAY_ANNOUNCE_PACKAGE      38
+#define   CONFIG_PACKAGE                39
+#define   UPDATE_OFFER_PACKAGE          40
+#define   UPDATE_REQUEST_PACKAGE        41
+#define   UPDATE_CHUNK_PACKAGE          42
+
+// what a gateway can take, see gatewaytable.h
+#define   GATEWAY_COMPACT_REPORTS       0x01
+
+// round trips, see benchmark.h
+#define   BENCHMARK_MAX_PADDING         1024
+
+// picture transfer, see picturetransfer.h
+#define   PICTURE_CHUNK_SIZE            1024    // bytes of the jpeg per chunk
+
+// over-the-mesh updates, see meshupdate.h
+#define   UPDATE_FIRMWARE               0
+#define   UPDATE_MODEL                  1
+#define   UPDATE_CHUNK_SIZE             1024    // bytes of the image per chunk
+
+// A firmware or model image, or a delta patch that makes it
+struct UpdateImage {
+  uint8_t kind;             // UPDATE_*
+  bool delta;               // from baseVersion on, see deltapatch.h
+  uint32_t version;
+  uint32_t baseVersion;     // delta only
+  uint32_t size;            // of the file that travels
+  uint32_t crc;             // of the file that travels
+
+  bool sameFile(const UpdateImage &other) const {
+    return kind == other.kind && delta == other.delta && version == other.version;
+  }
+};
+
+// Report about a single picture, or about a burst of consecutive ones
+class PictureReportPackage : public painlessmesh::plugin::SinglePackage {
+ public:
+  unsigned long pictureIndex;
+  float deerProbability;        // the highest one of the burst
+  uint16_t pictureCount = 1;
+  // mesh time in us, 0 if unknown
+  uint32_t captureTime = 0;     // of the first picture
+  uint32_t enqueueTime = 0;
+  uint32_t sendTime = 0;
+
+  PictureReportPackage() : painlessmesh::plugin::SinglePackage(PICTURE_REPORT_PACKAGE) {}
+
+  // Convert json object into a PictureReportPackage
+  PictureReportPackage(JsonObject jsonObj) : painlessmesh::plugin::SinglePackage(jsonObj) {
+    pictureIndex = jsonObj["pictureIndex"].as<unsigned long>();
+    deerProbability = jsonObj["deerProbability"].as<float>();
+    pictureCount = jsonObj["pictureCount"] | 1;   // older nodes never coalesce
+    captureTime = jsonObj["captureTime"].as<uint32_t>();
+    enqueueTime = jsonObj["enqueueTime"].as<uint32_t>();
+    sendTime = jsonObj["sendTime"].as<uint32_t>();
+  }
+
+  // Convert PictureReportPackage to json object
+  JsonObject addTo(JsonObject &&jsonObj) const {
+    jsonObj = painlessmesh::plugin::SinglePackage::addTo(std::move(jsonObj));
+    jsonObj["pictureIndex"] = pictureIndex;
+    jsonObj["deerProbability"] = deerProbability;
+    jsonObj["pictureCount"] = pictureCount;
+    jsonObj["captureTime"] = captureTime;
+    jsonObj["enqueueTime"] = enqueueTime;
+    jsonObj["sendTime"] = sendTime;
+
+    return jsonObj;
+  }
+  
+  // Memory to reserve for converting this object to json
+  size_t jsonObjectSize() const {
+    return JSON_OBJECT_SIZE(noJsonFields + 6)
+            + round(1.1*sizeof(pictureIndex)
+                    + 1.1*sizeof(deerProbability)
+                    + 1.1*sizeof(pictureCount)
+                    + 3.3*sizeof(captureTime));
+
+  }
+
+  // Writes "<directory>/<node>_<index><extension>" into buffer, without
+  // the directory part if directory is NULL. Never allocates.
+  int formatPath(char *buffer, size_t size, const char *directory, const char *extension) const {
+    if (!directory) {
+      return snprintf(buffer, size, "%u_%lu%s", this->from % 1000, pictureIndex, extension);
+    }
+    return snprintf(buffer, size, "%s/%u_%lu%s", directory, this->from % 1000, pictureIndex, extension);
+  }
+};
+
+// Several reports of the same node in a single mesh message
+class PictureReportBatchPackage : public painlessmesh::plugin::SinglePackage {
+ public:
+  uint8_t count = 0;
+  PictureReport reports[REPORT_BATCH_SIZE];
+  uint32_t sendTime = 0;
+
+  PictureReportBatchPackage() : painlessmesh::plugin::SinglePackage(PICTURE_REPORT_BATCH_PACKAGE) {}
+
+  // Convert json object into a PictureReportBatchPackage
+  PictureReportBatchPackage(JsonObject jsonObj) : painlessmesh::plugin::SinglePackage(jsonObj) {
+    JsonArray pictureIndices = jsonObj["pictureIndices"].as<JsonArray>();
+    JsonArray deerProbabilities = jsonObj["deerProbabilities"].as<JsonArray>();
+    JsonArray pictureCounts = jsonObj["pictureCounts"].as<JsonArray>();   // missing on older nodes
+    JsonArray captureTimes = jsonObj["captureTimes"].as<JsonArray>();
+    JsonArray enqueueTimes = jsonObj["enqueueTimes"].as<JsonArray>();
+    sendTime = jsonObj["sendTime"].as<uint32_t>();
+    count = min<size_t>(min(pictureIndices.size(), deerProbabilities.size()), REPORT_BATCH_SIZE);
+    for (uint8_t i = 0; i < count; i++) {
+      reports[i].pictureIndex = pictureIndices[i].as<unsigned long>();
+      reports[i].deerProbability = deerProbabilities[i].as<float>();
+      reports[i].pictureCount = pictureCounts[i] | 1;
+      reports[i].captureTime = captureTimes[i].as<uint32_t>();
+      reports[i].enqueueTime = enqueueTimes[i].as<uint32_t>();
+    }
+  }
+
+  // Convert PictureReportBatchPackage to json object
+  JsonObject addTo(JsonObject &&jsonObj) const {
+    jsonObj = painlessmesh::plugin::SinglePackage::addTo(std::move(jsonObj));
+    JsonArray pictureIndices = jsonObj.createNestedArray("pictureIndices");
+    JsonArray deerProbabilities = jsonObj.createNestedArray("deerProbabilities");
+    JsonArray pictureCounts = jsonObj.createNestedArray("pictureCounts");
+    JsonArray captureTimes = jsonObj.createNestedArray("captureTimes");
+    JsonArray enqueueTimes = jsonObj.createNestedArray("enqueueTimes");
+    jsonObj["sendTime"] = sendTime;
+    for (uint8_t i = 0; i < count; i++) {
+      pictureIndices.add(reports[i].pictureIndex);
+      deerProbabilities.add(reports[i].deerProbability);
+      pictureCounts.add(reports[i].pictureCount);
+      captureTimes.add(reports[i].captureTime);
+      enqueueTimes.add(reports[i].enqueueTime);
+    }
+
+    return jsonObj;
+  }
+
+  // Memory to reserve for converting this object to json
+  size_t jsonObjectSize() const {
+    return JSON_OBJECT_SIZE(noJsonFields + 6)
+            + 5 * JSON_ARRAY_SIZE(REPORT_BATCH_SIZE);
+  }
+
+  bool isFull() const {
+    return count >= REPORT_BATCH_SIZE;
+  }
+
+  void add(const PictureReportPackage &report) {
+    reports[count].pictureIndex = report.pictureIndex;
+    reports[count].deerProbability = report.deerProbability;
+    reports[count].pictureCount = report.pictureCount;
+    reports[count].captureTime = report.captureTime;
+    reports[count].enqueueTime = report.enqueueTime;
+    count++;
+  }
+
+  // Expands a single report of the batch back into a PictureReportPackage
+  PictureReportPackage get(uint8_t index) const {
+    PictureReportPackage report;
+    report.from = this->from;
+    report.dest = this->dest;
+    report.pictureIndex = reports[index].pictureIndex;
+    report.deerProbability = reports[index].deerProbability;
+    report.pictureCount = reports[index].pictureCount;
+    report.captureTime = reports[index].captureTime;
+    report.enqueueTime = reports[index].enqueueTime;
+    report.sendTime = sendTime;
+    return report;
+  }
+};
+
+// Same content as a PictureReportBatchPackage, but the reports travel as
+// one base64 string of the binary encoding in wireformat.h
+class CompactReportPackage : public painlessmesh::plugin::SinglePackage {
+ public:
+  char payload[BASE64_SIZE(COMPACT_REPORTS_MAX_SIZE)] = "";
+
+  CompactReportPackage() : painlessmesh::plugin::SinglePackage(COMPACT_REPORT_PACKAGE) {}
+
+  // Convert json object into a CompactReportPackage
+  CompactReportPackage(JsonObject jsonObj) : painlessmesh::plugin::SinglePackage(jsonObj) {
+    strlcpy(payload, jsonObj["payload"] | "", sizeof(payload));
+  }
+
+  // Convert CompactReportPackage to json object
+  JsonObject addTo(JsonObject &&jsonObj) const {
+    jsonObj = painlessmesh::plugin::SinglePackage::addTo(std::move(jsonObj));
+    jsonObj["payload"] = (const char *) payload;   // stored by pointer, no copy
+
+    return jsonObj;
+  }
+
+  // Memory to reserve for converting this object to json
+  size_t jsonObjectSize() const {
+    return JSON_OBJECT_SIZE(noJsonFields + 1);
+  }
+
+  bool encode(const PictureReportBatchPackage &batch) {
+    uint8_t buffer[COMPACT_REPORTS_MAX_SIZE];
+    size_t length = encodeReports(batch.reports, batch.count, batch.sendTime, buffer, sizeof(buffer));
+    this->from = batch.from;
+    this->dest = batch.dest;
+    return length && base64Encode(buffer, length, payload, sizeof(payload));
+  }
+
+  bool decode(PictureReportBatchPackage &batch) const {
+    uint8_t buffer[COMPACT_REPORTS_MAX_SIZE];
+    size_t length = base64Decode(payload, buffer, sizeof(buffer));
+    batch.from = this->from;
+    batch.dest = this->dest;
+    batch.count = decodeReports(buffer, length, batch.reports, REPORT_BATCH_SIZE, batch.sendTime);
+    return batch.count > 0;
+  }
+};
+
+// Asks for a picture or its thumbnail starting at offset. Also acknowledges
+// everything before offset, so the same package starts, resumes and acks a transfer.
+class PictureRequestPackage : public painlessmesh::plugin::SinglePackage {
+ public:
+  unsigned long pictureIndex;
+  bool thumbnail = false;
+  uint32_t offset = 0;
+
+  PictureRequestPackage() : painlessmesh::plugin::SinglePackage(PICTURE_REQUEST_PACKAGE) {}
+
+  // Convert json object into a PictureRequestPackage
+  PictureRequestPackage(JsonObject jsonObj) : painlessmesh::plugin::SinglePackage(jsonObj) {
+    pictureIndex = jsonObj["pictureIndex"].as<unsigned long>();
+    thumbnail = jsonObj["thumbnail"].as<bool>();
+    offset = jsonObj["offset"].as<uint32_t>();
+  }
+
+  // Convert PictureRequestPackage to json object
+  JsonObject addTo(JsonObject &&jsonObj) const {
+    jsonObj = painlessmesh::plugin::SinglePackage::addTo(std::move(jsonObj));
+    jsonObj["pictureIndex"] = pictureIndex;
+    jsonObj["thumbnail"] = thumbnail;
+    jsonObj["offset"] = offset;
+
+    return jsonObj;
+  }
+
+  // Memory to reserve for converting this object to json
+  size_t jsonObjectSize() const {
+    return JSON_OBJECT_SIZE(noJsonFields + 3);
+  }
+};
+
+// Part of a picture, base64 encoded. A totalSize of 0 means the picture
+// is not on the card, a chunk without data at totalSize that the
+// receiver has all of it.
+class PictureChunkPackage : public painlessmesh::plugin::SinglePackage {
+ public:
+  unsigned long pictureIndex;
+  bool thumbnail = false;
+  uint32_t offset = 0;
+  uint32_t totalSize = 0;
+  char data[BASE64_SIZE(PICTURE_CHUNK_SIZE)] = "";
+
+  PictureChunkPackage() : painlessmesh::plugin::SinglePackage(PICTURE_CHUNK_PACKAGE) {}
+
+  // Convert json object into a PictureChunkPackage
+  PictureChunkPackage(JsonObject jsonObj) : painlessmesh::plugin::SinglePackage(jsonObj) {
+    pictureIndex = jsonObj["pictureIndex"].as<unsigned long>();
+    thumbnail = jsonObj["thumbnail"].as<bool>();
+    offset = jsonObj["offset"].as<uint32_t>();
+    totalSize = jsonObj["totalSize"].as<uint32_t>();
+    strlcpy(data, jsonObj["data"] | "", sizeof(data));
+  }
+
+  // Convert PictureChunkPackage to json object
+  JsonObject addTo(JsonObject &&jsonObj) const {
+    jsonObj = painlessmesh::plugin::SinglePackage::addTo(std::move(jsonObj));
+    jsonObj["pictureIndex"] = pictureIndex;
+    jsonObj["thumbnail"] = thumbnail;
+    jsonObj["offset"] = offset;
+    jsonObj["totalSize"] = totalSize;
+    jsonObj["data"] = (const char *) data;   // stored by pointer, no copy
+
+    return jsonObj;
+  }
+
+  // Memory to reserve for converting this object to json
+  size_t jsonObjectSize() const {
+    return JSON_OBJECT_SIZE(noJsonFields + 5);
+  }
+};
+
+// A TelemetryRecord, base64 encoded
+class TelemetryPackage : public painlessmesh::plugin::SinglePackage {
+ public:
+  char payload[BASE64_SIZE(sizeof(TelemetryRecord))] = "";
+
+  TelemetryPackage() : painlessmesh::plugin::SinglePackage(TELEMETRY_PACKAGE) {}
+
+  // Convert json object into a TelemetryPackage
+  TelemetryPackage(JsonObject jsonObj) : painlessmesh::plugin::SinglePackage(jsonObj) {
+    strlcpy(payload, jsonObj["payload"] | "", sizeof(payload));
+  }
+
+  // Convert TelemetryPackage to json object
+  JsonObject addTo(JsonObject &&jsonObj) const {
+    jsonObj = painlessmesh::plugin::SinglePackage::addTo(std::move(jsonObj));
+    jsonObj["payload"] = (const char *) payload;   // stored by pointer, no copy
+
+    return jsonObj;
+  }
+
+  // Memory to reserve for converting this object to json
+  size_t jsonObjectSize() const {
+    return JSON_OBJECT_SIZE(noJsonFields + 1);
+  }
+
+  bool encode(const TelemetryRecord &record) {
+    return base64Encode((const uint8_t *) &record, sizeof(record), payload, sizeof(payload)) > 0;
+  }
+
+  bool decode(TelemetryRecord &record) const {
+    return base64Decode(payload, (uint8_t *) &record, sizeof(record)) == sizeof(record)
+           && Telemetry::isValid(record);
+  }
+};
+
+// Ping of the mesh benchmark. A node that gets one with echo unset sends
+// it straight back with echo set.
+class BenchmarkPackage : public painlessmesh::plugin::SinglePackage {
+ public:
+  uint16_t sequence = 0;
+  uint32_t sendMicros = 0;      // of the sender, comes back unchanged
+  bool echo = false;
+  char padding[BENCHMARK_MAX_PADDING + 1] = "";
+
+  BenchmarkPackage() : painlessmesh::plugin::SinglePackage(BENCHMARK_PACKAGE) {}
+
+  // Convert json object into a BenchmarkPackage
+  BenchmarkPackage(JsonObject jsonObj) : painlessmesh::plugin::SinglePackage(jsonObj) {
+    sequence = jsonObj["sequence"].as<uint16_t>();
+    sendMicros = jsonObj["sendMicros"].as<uint32_t>();
+    echo = jsonObj["echo"].as<bool>();
+    strlcpy(padding, jsonObj["padding"] | "", sizeof(padding));
+  }
+
+  // Convert BenchmarkPackage to json object
+  JsonObject addTo(JsonObject &&jsonObj) const {
+    jsonObj = painlessmesh::plugin::SinglePackage::addTo(std::move(jsonObj));
+    jsonObj["sequence"] = sequence;
+    jsonObj["sendMicros"] = sendMicros;
+    jsonObj["echo"] = echo;
+    jsonObj["padding"] = (const char *) padding;   // stored by pointer, no copy
+
+    return jsonObj;
+  }
+
+  // Memory to reserve for converting this object to json
+  size_t jsonObjectSize() const {
+    return JSON_OBJECT_SIZE(noJsonFields + 4);
+  }
+};
+
+// Broadcast by every gateway, see gatewaytable.h
+class GatewayAnnouncePackage : public painlessmesh::plugin::BroadcastPackage {
+ public:
+  uint32_t sendTime = 0;        // mesh time in us
+  uint8_t flags = 0;            // GATEWAY_*
+
+  GatewayAnnouncePackage() : painlessmesh::plugin::BroadcastPackage(GATEWAY_ANNOUNCE_PACKAGE) {}
+
+  // Convert json object into a GatewayAnnouncePackage
+  GatewayAnnouncePackage(JsonObject jsonObj) : painlessmesh::plugin::BroadcastPackage(jsonObj) {
+    sendTime = jsonObj["sendTime"].as<uint32_t>();
+    flags = jsonObj["flags"].as<uint8_t>();
+  }
+
+  // Convert GatewayAnnouncePackage to json object
+  JsonObject addTo(JsonObject &&jsonObj) const {
+    jsonObj = painlessmesh::plugin::BroadcastPackage::addTo(std::move(jsonObj));
+    jsonObj["sendTime"] = sendTime;
+    jsonObj["flags"] = flags;
+
+    return jsonObj;
+  }
+
+  // Memory to reserve for converting this object to json
+  size_t jsonObjectSize() const {
+    return JSON_OBJECT_SIZE(noJsonFields + 2);
+  }
+};
+
+// Broadcast by a gateway, see nodeconfig.h
+class ConfigPackage : public painlessmesh::plugin::BroadcastPackage {
+ public:
+  NodeConfig config = {};
+
+  ConfigPackage() : painlessmesh::plugin::BroadcastPackage(CONFIG_PACKAGE) {}
+
+  // Convert json object into a ConfigPackage
+  ConfigPackage(JsonObject jsonObj) : painlessmesh::plugin::BroadcastPackage(jsonObj) {
+    config.sequence = jsonObj["sequence"].as<uint32_t>();
+    config.captureInterval = jsonObj["captureInterval"].as<uint32_t>();
+    config.detectorInterval = jsonObj["detectorInterval"].as<uint32_t>();
+    config.sendInterval = jsonObj["sendInterval"].as<uint32_t>();
+    config.pirPollInterval = jsonObj["pirPollInterval"].as<uint32_t>();
+    config.queueLimit = jsonObj["queueLimit"].as<uint32_t>();
+    config.deerThreshold = jsonObj["deerThreshold"].as<float>();
+    config.frameSize = jsonObj["frameSize"].as<uint8_t>();
+    config.jpegQuality = jsonObj["jpegQuality"].as<uint8_t>();
+  }
+
+  // Convert ConfigPackage to json object
+  JsonObject addTo(JsonObject &&jsonObj) const {
+    jsonObj = painlessmesh::plugin::BroadcastPackage::addTo(std::move(jsonObj));
+    jsonObj["sequence"] = config.sequence;
+    jsonObj["captureInterval"] = config.captureInterval;
+    jsonObj["detectorInterval"] = config.detectorInterval;
+    jsonObj["sendInterval"] = config.sendInterval;
+    jsonObj["pirPollInterval"] = config.pirPollInterval;
+    jsonObj["queueLimit"] = config.queueLimit;
+    jsonObj["deerThreshold"] = config.deerThreshold;
+    jsonObj["frameSize"] = config.frameSize;
+    jsonObj["jpegQuality"] = config.jpegQuality;
+
+    return jsonObj;
+  }
+
+  // Memory to reserve for converting this object to json
+  size_t jsonObjectSize() const {
+    return JSON_OBJECT_SIZE(noJsonFields + 9);
+  }
+};
+
+// Broadcast by every node that has an image or a part of it, see meshupdate.h
+class UpdateOfferPackage : public painlessmesh::plugin::BroadcastPackage {
+ public:
+  UpdateImage image = {};
+  uint32_t available = 0;       // bytes from the start that can be served
+  uint32_t sendTime = 0;        // mesh time in us
+
+  UpdateOfferPackage() : painlessmesh::plugin::BroadcastPackage(UPDATE_OFFER_PACKAGE) {}
+
+  // Convert json object into an UpdateOfferPackage
+  UpdateOfferPackage(JsonObject jsonObj) : painlessmesh::plugin::BroadcastPackage(jsonObj) {
+    image.kind = jsonObj["kind"].as<uint8_t>();
+    image.delta = jsonObj["delta"].as<bool>();
+    image.version = jsonObj["version"].as<uint32_t>();
+    image.baseVersion = jsonObj["baseVersion"].as<uint32_t>();
+    image.size = jsonObj["size"].as<uint32_t>();
+    image.crc = jsonObj["crc"].as<uint32_t>();
+    available = jsonObj["available"].as<uint32_t>();
+    sendTime = jsonObj["sendTime"].as<uint32_t>();
+  }
+
+  // Convert UpdateOfferPackage to json object
+  JsonObject addTo(JsonObject &&jsonObj) const {
+    jsonObj = painlessmesh::plugin::BroadcastPackage::addTo(std::move(jsonObj));
+    jsonObj["kind"] = image.kind;
+    jsonObj["delta"] = image.delta;
+    jsonObj["version"] = image.version;
+    jsonObj["baseVersion"] = image.baseVersion;
+    jsonObj["size"] = image.size;
+    jsonObj["crc"] = image.crc;
+    jsonObj["available"] = available;
+    jsonObj["sendTime"] = sendTime;
+
+    return jsonObj;
+  }
+
+  // Memory to reserve for converting this object to json
+  size_t jsonObjectSize() const {
+    return JSON_OBJECT_SIZE(noJsonFields + 8);
+  }
+};
+
+// Asks for an image from offset on and acknowledges everything before,
+// like PictureRequestPackage
+class UpdateRequestPackage : public painlessmesh::plugin::SinglePackage {
+ public:
+  uint8_t kind = UPDATE_FIRMWARE;
+  bool delta = false;
+  uint32_t version = 0;
+  uint32_t offset = 0;
+
+  UpdateRequestPackage() : painlessmesh::plugin::SinglePackage(UPDATE_REQUEST_PACKAGE) {}
+
+  // Convert json object into an UpdateRequestPackage
+  UpdateRequestPackage(JsonObject jsonObj) : painlessmesh::plugin::SinglePackage(jsonObj) {
+    kind = jsonObj["kind"].as<uint8_t>();
+    delta = jsonObj["delta"].as<bool>();
+    version = jsonObj["version"].as<uint32_t>();
+    offset = jsonObj["offset"].as<uint32_t>();
+  }
+
+  // Convert UpdateRequestPackage to json object
+  JsonObject addTo(JsonObject &&jsonObj) const {
+    jsonObj = painlessmesh::plugin::SinglePackage::addTo(std::move(jsonObj));
+    jsonObj["kind"] = kind;
+    jsonObj["delta"] = delta;
+    jsonObj["version"] = version;
+    jsonObj["offset"] = offset;
+
+    return jsonObj;
+  }
+
+  // Memory to reserve for converting this object to json
+  size_t jsonObjectSize() const {
+    return JSON_OBJECT_SIZE(noJsonFields + 4);
+  }
+};
+
+// Part of an image, base64 encoded. A totalSize of 0 means the sender does
+// not have that part, busy that it serves too many nodes already.
+class UpdateChunkPackage : public painlessmesh::plugin::SinglePackage {
+ public:
+  uint8_t kind = UPDATE_FIRMWARE;
+  bool delta = false;
+  uint32_t version = 0;
+  uint32_t offset = 0;
+  uint32_t totalSize = 0;
+  bool busy = false;
+  char data[BASE64_SIZE(UPDATE_CHUNK_SIZE)] = "";
+
+  UpdateChunkPackage() : painlessmesh::plugin::SinglePackage(UPDATE_CHUNK_PACKAGE) {}
+
+  // Convert json object into an UpdateChunkPackage
+  UpdateChunkPackage(JsonObject jsonObj) : painlessmesh::plugin::SinglePackage(jsonObj) {
+    kind = jsonObj["kind"].as<uint8_t>();
+    delta = jsonObj["delta"].as<bool>();
+    version = jsonObj["version"].as<uint32_t>();
+    offset = jsonObj["offset"].as<uint32_t>();
+    totalSize = jsonObj["totalSize"].as<uint32_t>();
+    busy = jsonObj["busy"].as<bool>();
+    strlcpy(data, jsonObj["data"] | "", sizeof(data));
+  }
+
+  // Convert UpdateChunkPackage to json object
+  JsonObject addTo(JsonObject &&jsonObj) const {
+    jsonObj = painlessmesh::plugin::SinglePackage::addTo(std::move(jsonObj));
+    jsonObj["kind"] = kind;
+    jsonObj["delta"] = delta;
+    jsonObj["version"] = version;
+    jsonObj["offset"] = offset;
+    jsonObj["totalSize"] = totalSize;
+    jsonObj["busy"] = busy;
+    jsonObj["data"] = (const char *) data;   // stored by pointer, no copy
+
+    return jsonObj;
+  }
+
+  // Memory to reserve for converting this object to json
+  size_t jsonObjectSize() const {
+    return JSON_OBJECT_SIZE(noJsonFields + 7);
+  }
+};
+
+#endif
@@ -0,0 +1,487 @@
+#include "picturestore.h"
+
+#include "crc32.h"
+#include "img_converters.h"
+
+#define   SHARD_PATH_SIZE   32
+#define   THUMBNAIL_SUFFIX  ".thumb.jpg"
+#define   TEMPORARY_SUFFIX  ".tmp"
+
+static uint32_t entryChecksum(const PictureIndexEntry &entry) {
+  return crc32(&entry, offsetof(PictureIndexEntry, checksum));
+}
+
+static uint32_t journalChecksum(const PictureJournalEntry &entry) {
+  return crc32(&entry, offsetof(PictureJournalEntry, checksum));
+}
+
+// Reads "<node>_<index>.jpg", returns false for anything else
+static bool parsePictureName(const char *name, unsigned long &pictureIndex) {
+  const char *separator = strrchr(name, '_');
+  if (!separator) {
+    return false;
+  }
+  char *end;
+  pictureIndex = strtoul(separator + 1, &end, 10);
+  return end != separator + 1 && strcmp(end, ".jpg") == 0;
+}
+
+void PictureStore::shardPath(uint32_t shard, char *path, size_t size) const {
+  snprintf(path, size, "%s/%05u", PICTURES_PATH, shard);
+}
+
+void PictureStore::indexPath(uint32_t shard, char *path, size_t size) const {
+  snprintf(path, size, "%s/%05u/%s", PICTURES_PATH, shard, PICTURE_INDEX_NAME);
+}
+
+void PictureStore::fetchedPath(uint32_t shard, char *path, size_t size) const {
+  snprintf(path, size, "%s/%05u/%s", PICTURES_PATH, shard, PICTURE_FETCHED_NAME);
+}
+
+void PictureStore::picturePath(uint32_t from, unsigned long pictureIndex, char *path, size_t size,
+                               const char *extension) const {
+  snprintf(path, size, "%s/%05lu/%u_%lu%s", PICTURES_PATH, pictureIndex / PICTURE_SHARD_SIZE,
+           from % 1000, pictureIndex, extension);
+}
+
+bool PictureStore::begin(fs::FS &fs) {
+  if (!fs.exists(PICTURES_PATH) && !fs.mkdir(PICTURES_PATH)) {
+    Serial.printf("pictureStore: Could not create %s!\n", PICTURES_PATH);
+    return false;
+  }
+  if (!mutex) {
+    mutex = xSemaphoreCreateMutex();
+  }
+  this->fs = &fs;
+  return true;
+}
+
+// One write per capture, a slot is only overwritten once its capture is long done
+bool PictureStore::writeJournal(const PictureReportPackage &report) {
+  PictureJournalEntry entry;
+  entry.pictureIndex = report.pictureIndex;
+  entry.from = report.from;
+  entry.checksum = journalChecksum(entry);
+
+  xSemaphoreTake(mutex, portMAX_DELAY);
+  if (!journalFile) {
+    journalFile = fs->open(PICTURE_JOURNAL_PATH, fs->exists(PICTURE_JOURNAL_PATH) ? "r+" : "w+");
+  }
+  bool success = journalFile
+                 && journalFile.seek((report.pictureIndex % PICTURE_JOURNAL_SLOTS) * sizeof(entry))
+                 && journalFile.write((const uint8_t *) &entry, sizeof(entry)) == sizeof(entry);
+  if (success) {
+    journalFile.flush();
+  }
+  xSemaphoreGive(mutex);
+  return success;
+}
+
+// Returns the number of valid entries
+uint8_t PictureStore::readJournal(PictureJournalEntry *entries) {
+  File file = fs->open(PICTURE_JOURNAL_PATH, FILE_READ);
+  if (!file) {
+    return 0;
+  }
+  uint8_t count = 0;
+  PictureJournalEntry entry;
+  for (uint8_t slot = 0; slot < PICTURE_JOURNAL_SLOTS; slot++) {
+    if (file.read((uint8_t *) &entry, sizeof(entry)) != sizeof(entry)) {
+      break;
+    }
+    if (entry.checksum == journalChecksum(entry)) {
+      entries[count++] = entry;
+    }
+  }
+  file.close();
+  return count;
+}
+
+void PictureStore::recover() {
+  if (!fs) {
+    return;
+  }
+  PictureJournalEntry entries[PICTURE_JOURNAL_SLOTS];
+  uint8_t count = readJournal(entries);
+  uint8_t finished = 0;
+  uint8_t dropped = 0;
+  for (uint8_t i = 0; i < count; i++) {
+    char temporaryPath[PICTURE_PATH_SIZE];
+    char path[PICTURE_PATH_SIZE];
+    PictureIndexEntry indexEntry;
+    picturePath(entries[i].from, entries[i].pictureIndex, temporaryPath, sizeof(temporaryPath),
+                ".jpg" TEMPORARY_SUFFIX);
+    picturePath(entries[i].from, entries[i].pictureIndex, path, sizeof(path), THUMBNAIL_SUFFIX TEMPORARY_SUFFIX);
+    if (fs->exists(path)) {
+      fs->remove(path);
+    }
+    if (!fs->exists(temporaryPath)) {
+      continue;   // renamed, or the crash came before the first byte
+    }
+
+    // Indexed means the picture was complete, only the rename is missing
+    File picture = fs->open(temporaryPath, FILE_READ);
+    size_t size = picture ? picture.size() : 0;
+    picture.close();
+    if (lookup(entries[i].pictureIndex, indexEntry, path, sizeof(path)) && indexEntry.size == size
+        && fs->rename(temporaryPath, path)) {
+      finished++;
+    } else if (fs->remove(temporaryPath)) {
+      dropped++;
+      Serial.printf("pictureStore: Deleted %s, it was not complete.\n", temporaryPath);
+    }
+  }
+  if (finished + dropped > 0) {
+    Serial.printf("pictureStore: Recovered %u and dropped %u pictures of the journal.\n", finished, dropped);
+  }
+}
+
+bool PictureStore::save(const PictureReportPackage &report, const uint8_t *data, size_t length,
+                        char *path, size_t pathSize) {
+  picturePath(report.from, report.pictureIndex, path, pathSize);
+  if (!fs) {
+    return false;
+  }
+
+  // The shard only needs checking when the index crosses into a new one
+  uint32_t pictureShard = report.pictureIndex / PICTURE_SHARD_SIZE;
+  xSemaphoreTake(mutex, portMAX_DELAY);
+  if (pictureShard != shard) {
+    char directory[SHARD_PATH_SIZE];
+    shardPath(pictureShard, directory, sizeof(directory));
+    if (fs->exists(directory) || fs->mkdir(directory)) {
+      shard = pictureShard;
+    } else {
+      Serial.printf("pictureStore: Could not create %s!\n", directory);
+    }
+  }
+  xSemaphoreGive(mutex);
+
+  // Without the journal entry a crash would leave the file behind for good
+  if (!writeJournal(report)) {
+    Serial.println("pictureStore: Could not write the journal!");
+    return false;
+  }
+  char temporaryPath[PICTURE_PATH_SIZE];
+  picturePath(report.from, report.pictureIndex, temporaryPath, sizeof(temporaryPath), ".jpg" TEMPORARY_SUFFIX);
+  File file = fs->open(temporaryPath, FILE_WRITE);
+  if (!file) {
+    return false;
+  }
+  bool success = file.write(data, length) == length;
+  file.close();
+  if (!success) {
+    fs->remove(temporaryPath);
+  }
+  return success;
+}
+
+// The encoder writes in order and stops at the first short write, so the offset it passes is not needed
+static size_t writeThumbnail(void *arg, size_t, const void *data, size_t length) {
+  return ((File *) arg)->write((const uint8_t *) data, length);
+}
+
+// Runs after save(), so the shard exists already
+bool PictureStore::saveThumbnail(const PictureReportPackage &report, const uint8_t *pixels,
+                                 uint16_t width, uint16_t height) {
+  if (!fs || width == 0 || height == 0) {
+    return false;
+  }
+  char temporaryPath[PICTURE_PATH_SIZE];
+  char path[PICTURE_PATH_SIZE];
+  picturePath(report.from, report.pictureIndex, temporaryPath, sizeof(temporaryPath),
+              THUMBNAIL_SUFFIX TEMPORARY_SUFFIX);
+  picturePath(report.from, report.pictureIndex, path, sizeof(path), THUMBNAIL_SUFFIX);
+  File file = fs->open(temporaryPath, FILE_WRITE);
+  if (!file) {
+    return false;
+  }
+  bool success = fmt2jpg_cb((uint8_t *) pixels, (size_t) width * height, width, height, PIXFORMAT_GRAYSCALE,
+                            THUMBNAIL_JPEG_QUALITY, &writeThumbnail, &file);
+  file.close();
+  success = success && fs->rename(temporaryPath, path);
+  if (!success) {
+    fs->remove(temporaryPath);
+  }
+  return success;
+}
+
+// The index file of the current shard stays open between pictures
+bool PictureStore::openIndex(uint32_t newShard, bool create) {
+  if (newShard == indexShard && indexFile) {
+    return true;
+  }
+  if (indexFile) {
+    indexFile.close();
+  }
+  indexShard = UINT32_MAX;
+
+  char path[SHARD_PATH_SIZE + sizeof(PICTURE_INDEX_NAME)];
+  indexPath(newShard, path, sizeof(path));
+  if (fs->exists(path)) {
+    indexFile = fs->open(path, "r+");
+  } else if (create) {
+    indexFile = fs->open(path, "w+");
+  }
+  if (!indexFile) {
+    return false;
+  }
+  indexShard = newShard;
+  return true;
+}
+
+bool PictureStore::addToIndex(const PictureReportPackage &report, size_t length) {
+  if (!fs) {
+    return false;
+  }
+
+  PictureIndexEntry entry;
+  entry.pictureIndex = report.pictureIndex;
+  entry.from = report.from;
+  entry.size = length;
+  entry.deerProbability = report.deerProbability;
+  entry.checksum = entryChecksum(entry);
+
+  xSemaphoreTake(mutex, portMAX_DELAY);
+  bool success = openIndex(report.pictureIndex / PICTURE_SHARD_SIZE, true)
+                 && indexFile.seek((report.pictureIndex % PICTURE_SHARD_SIZE) * sizeof(entry))
+                 && indexFile.write((const uint8_t *) &entry, sizeof(entry)) == sizeof(entry);
+  if (success) {
+    indexFile.flush();
+  } else {
+    Serial.printf("pictureStore: Could not index picture %lu!\n", report.pictureIndex);
+  }
+  xSemaphoreGive(mutex);
+
+  // The entry is on the card, so from here on recover() would finish the rename as well
+  char temporaryPath[PICTURE_PATH_SIZE];
+  char path[PICTURE_PATH_SIZE];
+  picturePath(report.from, report.pictureIndex, temporaryPath, sizeof(temporaryPath), ".jpg" TEMPORARY_SUFFIX);
+  picturePath(report.from, report.pictureIndex, path, sizeof(path));
+  if (!fs->rename(temporaryPath, path)) {
+    Serial.printf("pictureStore: Could not rename %s!\n", temporaryPath);
+    return false;
+  }
+  return success;
+}
+
+bool PictureStore::lookup(unsigned long pictureIndex, PictureIndexEntry &entry, char *path, size_t pathSize) {
+  if (!fs) {
+    return false;
+  }
+
+  xSemaphoreTake(mutex, portMAX_DELAY);
+  bool success = openIndex(pictureIndex / PICTURE_SHARD_SIZE, false)
+                 && indexFile.seek((pictureIndex % PICTURE_SHARD_SIZE) * sizeof(entry))
+                 && indexFile.read((uint8_t *) &entry, sizeof(entry)) == sizeof(entry);
+  xSemaphoreGive(mutex);
+
+  // Seeking past the end leaves a gap of undefined bytes on FAT
+  if (!success || entry.checksum != entryChecksum(entry) || entry.pictureIndex != pictureIndex) {
+    return false;
+  }
+  picturePath(entry.from, pictureIndex, path, pathSize);
+  return true;
+}
+
+File PictureStore::open(unsigned long pictureIndex, PictureIndexEntry &entry) {
+  char path[PICTURE_PATH_SIZE];
+  if (!lookup(pictureIndex, entry, path, sizeof(path))) {
+    return File();
+  }
+  return fs->open(path, FILE_READ);
+}
+
+File PictureStore::openThumbnail(unsigned long pictureIndex) {
+  PictureIndexEntry entry;
+  char path[PICTURE_PATH_SIZE];
+  if (!lookup(pictureIndex, entry, path, sizeof(path))) {
+    return File();
+  }
+  picturePath(entry.from, pictureIndex, path, sizeof(path), THUMBNAIL_SUFFIX);
+  return fs->open(path, FILE_READ);
+}
+
+bool PictureStore::readIndex(unsigned long firstIndex, PictureIndexEntry *entries, size_t count) {
+  if (!fs || firstIndex % PICTURE_SHARD_SIZE + count > PICTURE_SHARD_SIZE) {
+    return false;
+  }
+  char path[SHARD_PATH_SIZE + sizeof(PICTURE_INDEX_NAME)];
+  indexPath(firstIndex / PICTURE_SHARD_SIZE, path, sizeof(path));
+  File file = fs->open(path, FILE_READ);
+  if (!file) {
+    return false;
+  }
+  size_t readCount = 0;
+  if (file.seek((firstIndex % PICTURE_SHARD_SIZE) * sizeof(PictureIndexEntry))) {
+    readCount = file.read((uint8_t *) entries, count * sizeof(PictureIndexEntry)) / sizeof(PictureIndexEntry);
+  }
+  file.close();
+
+  for (size_t i = 0; i < count; i++) {
+    if (i >= readCount || entries[i].checksum != entryChecksum(entries[i])
+        || entries[i].pictureIndex != firstIndex + i) {
+      entries[i].size = 0;
+    }
+  }
+  return true;
+}
+
+// Rare next to the captures, so the file is opened for every mark
+bool PictureStore::markFetched(unsigned long pictureIndex) {
+  if (!fs) {
+    return false;
+  }
+  char path[SHARD_PATH_SIZE + sizeof(PICTURE_FETCHED_NAME)];
+  fetchedPath(pictureIndex / PICTURE_SHARD_SIZE, path, sizeof(path));
+  size_t offset = (pictureIndex % PICTURE_SHARD_SIZE) / 8;
+  uint8_t bits = 0;
+
+  xSemaphoreTake(mutex, portMAX_DELAY);
+  File file;
+  if (fs->exists(path)) {
+    file = fs->open(path, "r+");
+  } else {
+    // Written out in full, the gap behind a seek past the end is undefined on FAT
+    uint8_t empty[(PICTURE_SHARD_SIZE + 7) / 8] = {0};
+    file = fs->open(path, "w+");
+    if (file && file.write(empty, sizeof(empty)) != sizeof(empty)) {
+      file.close();
+    }
+  }
+  bool success = file && file.seek(offset) && file.read(&bits, 1) == 1;
+  if (success) {
+    bits |= 1 << (pictureIndex % PICTURE_SHARD_SIZE % 8);
+    success = file.seek(offset) && file.write(&bits, 1) == 1;
+  }
+  file.close();
+  xSemaphoreGive(mutex);
+
+  if (!success) {
+    Serial.printf("pictureStore: Could not mark picture %lu as fetched!\n", pictureIndex);
+  }
+  return success;
+}
+
+void PictureStore::readFetched(unsigned long firstIndex, bool *fetched, size_t count) {
+  for (size_t i = 0; i < count; i++) {
+    fetched[i] = false;
+  }
+  if (!fs || firstIndex % PICTURE_SHARD_SIZE + count > PICTURE_SHARD_SIZE) {
+    return;
+  }
+  char path[SHARD_PATH_SIZE + sizeof(PICTURE_FETCHED_NAME)];
+  fetchedPath(firstIndex / PICTURE_SHARD_SIZE, path, sizeof(path));
+  if (!fs->exists(path)) {
+    return;
+  }
+  File file = fs->open(path, FILE_READ);
+  if (!file) {
+    return;
+  }
+  size_t first = firstIndex % PICTURE_SHARD_SIZE;
+  uint8_t bits[(PICTURE_SHARD_SIZE + 7) / 8];
+  size_t readCount = 0;
+  if (file.seek(first / 8)) {
+    readCount = file.read(bits, (first + count + 7) / 8 - first / 8);
+  }
+  file.close();
+
+  for (size_t i = 0; i < count; i++) {
+    size_t bit = first + i - first / 8 * 8;
+    fetched[i] = bit / 8 < readCount && (bits[bit / 8] >> (bit % 8) & 1);
+  }
+}
+
+bool PictureStore::removePicture(const PictureIndexEntry &entry) {
+  if (!fs) {
+    return false;
+  }
+  char path[PICTURE_PATH_SIZE];
+  picturePath(entry.from, entry.pictureIndex, path, sizeof(path));
+  return fs->remove(path);
+}
+
+unsigned long PictureStore::oldestPictureIndex() {
+  if (!fs) {
+    return 0;
+  }
+  File directory = fs->open(PICTURES_PATH);
+  if (!directory || !directory.isDirectory()) {
+    return 0;
+  }
+
+  bool foundShard = false;
+  uint32_t oldestShard = UINT32_MAX;
+  for (File entry = directory.openNextFile(); entry; entry = directory.openNextFile()) {
+    const char *name = strrchr(entry.name(), '/');
+    name = name ? name + 1 : entry.name();
+    char *end;
+    uint32_t entryShard = strtoul(name, &end, 10);
+    if (entry.isDirectory() && end != name && *end == '\0') {
+      foundShard = true;
+      oldestShard = min(oldestShard, entryShard);
+    }
+    entry.close();
+  }
+  directory.close();
+  return foundShard ? (unsigned long) oldestShard * PICTURE_SHARD_SIZE : 0;
+}
+
+unsigned long PictureStore::nextPictureIndex() {
+  if (!fs) {
+    return 0;
+  }
+  File directory = fs->open(PICTURES_PATH);
+  if (!directory || !directory.isDirectory()) {
+    return 0;
+  }
+
+  // A capture that was dropped by recover() still used its index
+  PictureJournalEntry journal[PICTURE_JOURNAL_SLOTS];
+  uint8_t journalCount = readJournal(journal);
+  unsigned long nextIndex = 0;
+  for (uint8_t i = 0; i < journalCount; i++) {
+    nextIndex = max(nextIndex, (unsigned long) journal[i].pictureIndex + 1);
+  }
+  bool foundShard = false;
+  uint32_t newestShard = 0;
+  for (File entry = directory.openNextFile(); entry; entry = directory.openNextFile()) {
+    const char *name = strrchr(entry.name(), '/');
+    name = name ? name + 1 : entry.name();
+    unsigned long pictureIndex;
+    if (entry.isDirectory()) {
+      char *end;
+      uint32_t entryShard = strtoul(name, &end, 10);
+      if (end != name && *end == '\0' && entryShard >= newestShard) {
+        foundShard = true;
+        newestShard = entryShard;
+      }
+    } else if (parsePictureName(name, pictureIndex)) {
+      nextIndex = max(nextIndex, pictureIndex + 1);
+    }
+    entry.close();
+  }
+  directory.close();
+  if (!foundShard) {
+    return nextIndex;
+  }
+
+  // Only the newest shard can hold higher indices
+  char path[SHARD_PATH_SIZE];
+  shardPath(newestShard, path, sizeof(path));
+  directory = fs->open(path);
+  if (!directory) {
+    return nextIndex;
+  }
+  nextIndex = max(nextIndex, (unsigned long) newestShard * PICTURE_SHARD_SIZE);
+  for (File entry = directory.openNextFile(); entry; entry = directory.openNextFile()) {
+    unsigned long pictureIndex;
+    if (parsePictureName(entry.name(), pictureIndex)) {
+      nextIndex = max(nextIndex, pictureIndex + 1);
+    }
+    entry.close();
+  }
+  directory.close();
+  return nextIndex;
+}
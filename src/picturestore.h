@@ -0,0 +1,108 @@
+/****************************************************
+ * Pictures on the sd card, sharded by index.       *
+ * Picture N lives in PICTURES_PATH/<N / 1000>/, so *
+ * no directory grows beyond PICTURE_SHARD_SIZE     *
+ * entries. Every shard has an index file with one  *
+ * fixed-size entry per picture at offset           *
+ * (N % 1000) * entry size, so looking a picture up *
+ * is a single seek. A grayscale thumbnail of a     *
+ * positive picture sits next to it as              *
+ * <node>_<index>.thumb.jpg. A second file holds a  *
+ * bit per picture, set once a receiver got all of  *
+ * the full picture.                                *
+ * A picture is written under a ".tmp" name and     *
+ * only renamed once its index entry is on the      *
+ * card. Every capture is noted in a small journal  *
+ * first, so after a crash recover() finishes or    *
+ * deletes the last few without scanning the card.  *
+ ****************************************************/
+
+#ifndef PICTURESTORE_H
+#define PICTURESTORE_H
+
+#include <Arduino.h>
+#include "FS.h"
+#include "freertos/semphr.h"
+#include "packages.h"
+
+#define   PICTURES_PATH           "/pictures"
+#define   PICTURE_SHARD_SIZE      1000
+#define   PICTURE_INDEX_NAME      "index.bin"
+#define   PICTURE_FETCHED_NAME    "fetched.bin"   // PICTURE_SHARD_SIZE bits, written out in full on creation
+#define   PICTURE_PATH_SIZE       48
+#define   THUMBNAIL_JPEG_QUALITY  25      // 160x120 ends up at 2 to 4 KB
+#define   PICTURE_JOURNAL_PATH    "/pictures/journal.bin"
+#define   PICTURE_JOURNAL_SLOTS   4       // captures in flight at most, slot is index % slots
+
+// On-card layout of an index entry
+struct PictureIndexEntry {
+  uint32_t pictureIndex;    // tells a real entry from the gap in a new file
+  uint32_t from;
+  uint32_t size;
+  float deerProbability;
+  uint32_t checksum;
+};
+
+// On-card layout of a journal slot, the capture it names may not be complete
+struct PictureJournalEntry {
+  uint32_t pictureIndex;
+  uint32_t from;
+  uint32_t checksum;
+};
+
+class PictureStore {
+ public:
+  bool begin(fs::FS &fs);
+  // Finishes the captures of the journal that got indexed before a crash and
+  // deletes the rest. Call after a cold boot, before nextPictureIndex().
+  void recover();
+
+  // Writes the picture into its shard under a temporary name,
+  // path is set to the final one in any case
+  bool save(const PictureReportPackage &report, const uint8_t *data, size_t length,
+            char *path, size_t pathSize);
+  // Encodes 8 bit grayscale pixels straight into the file
+  bool saveThumbnail(const PictureReportPackage &report, const uint8_t *pixels, uint16_t width, uint16_t height);
+  // Call once the picture is classified. Gives the picture its final name.
+  bool addToIndex(const PictureReportPackage &report, size_t length);
+  bool lookup(unsigned long pictureIndex, PictureIndexEntry &entry, char *path, size_t pathSize);
+  // Looks the picture up and opens it for reading
+  File open(unsigned long pictureIndex, PictureIndexEntry &entry);
+  File openThumbnail(unsigned long pictureIndex);
+
+  // Reads count entries from firstIndex on, all in one shard, through a file
+  // of its own. Entries that are not valid come back with a size of 0.
+  // False if the shard has no index.
+  bool readIndex(unsigned long firstIndex, PictureIndexEntry *entries, size_t count);
+  // Notes that a receiver got all of the full picture
+  bool markFetched(unsigned long pictureIndex);
+  // Like readIndex(), pictures of a shard without marks come back as not fetched
+  void readFetched(unsigned long firstIndex, bool *fetched, size_t count);
+  // Deletes the full picture, its thumbnail and index entry stay
+  bool removePicture(const PictureIndexEntry &entry);
+
+  // Index after the highest one on the card, including the flat layout
+  // of older firmware
+  unsigned long nextPictureIndex();
+  // First index of the oldest shard, 0 if there is none
+  unsigned long oldestPictureIndex();
+
+ private:
+  fs::FS *fs = NULL;
+  SemaphoreHandle_t mutex = NULL;
+  uint32_t shard = UINT32_MAX;    // last directory made sure of
+  File indexFile;                 // of indexShard
+  uint32_t indexShard = UINT32_MAX;
+  File journalFile;
+
+  void shardPath(uint32_t shard, char *path, size_t size) const;
+  void indexPath(uint32_t shard, char *path, size_t size) const;
+  void fetchedPath(uint32_t shard, char *path, size_t size) const;
+  void picturePath(uint32_t from, unsigned long pictureIndex, char *path, size_t size,
+                   const char *extension = ".jpg") const;
+  bool openIndex(uint32_t newShard, bool create);
+  bool writeJournal(const PictureReportPackage &report);
+  uint8_t readJournal(PictureJournalEntry *entries);
+};
+
+#endif
@@ -0,0 +1,249 @@
+#include "picturetransfer.h"
+
+void PictureSender::begin(painlessMesh &mesh, PictureStore &store) {
+  this->mesh = &mesh;
+  this->store = &store;
+}
+
+// A chunk without data, totalSize 0 means the picture is not on the card
+void PictureSender::sendEmpty(const PictureRequestPackage &request, uint32_t size) {
+  PictureChunkPackage chunk;
+  chunk.from = mesh->getNodeId();
+  chunk.dest = request.from;
+  chunk.pictureIndex = request.pictureIndex;
+  chunk.thumbnail = request.thumbnail;
+  chunk.offset = size;
+  chunk.totalSize = size;
+  mesh->sendPackage(&chunk);
+}
+
+void PictureSender::onRequest(const PictureRequestPackage &request) {
+  if (!mesh) {
+    return;
+  }
+
+  bool sameTransfer = active && request.from == receiver && request.pictureIndex == pictureIndex
+                      && request.thumbnail == thumbnail;
+  if (active && !sameTransfer) {
+    // The other receiver asks again after its timeout
+    Serial.printf("pictureSender: Busy, ignoring request for picture %lu.\n", request.pictureIndex);
+    return;
+  }
+
+  if (!sameTransfer) {
+    PictureIndexEntry entry;
+    pictureFile = request.thumbnail ? store->openThumbnail(request.pictureIndex)
+                                    : store->open(request.pictureIndex, entry);
+    if (!pictureFile) {
+      Serial.printf("pictureSender: Picture %lu was requested, but is not on the card!\n", request.pictureIndex);
+      sendEmpty(request, 0);
+      return;
+    }
+    active = true;
+    receiver = request.from;
+    pictureIndex = request.pictureIndex;
+    thumbnail = request.thumbnail;
+    totalSize = pictureFile.size();
+    window.start(request.offset);
+    Serial.printf("pictureSender: Sending picture %lu from byte %u to node %u.\n", pictureIndex, request.offset, receiver);
+  }
+  window.onAck(request.offset);
+
+  if (request.offset >= totalSize) {
+    // Answered, a receiver that had it all before asking would ask forever
+    Serial.printf("pictureSender: Node %u has picture %lu.\n", receiver, pictureIndex);
+    if (!thumbnail && request.offset == totalSize) {
+      store->markFetched(pictureIndex);   // from now on retention may delete it
+    }
+    sendEmpty(request, totalSize);
+    finish();
+  }
+}
+
+void PictureSender::sendNext() {
+  if (!active) {
+    return;
+  }
+  if (window.isQuiet(PICTURE_TRANSFER_TIMEOUT)) {
+    Serial.printf("pictureSender: Node %u went quiet, stopping picture %lu.\n", receiver, pictureIndex);
+    finish();
+    return;
+  }
+  if (!window.canSend(totalSize, PICTURE_TRANSFER_WINDOW * PICTURE_CHUNK_SIZE, PICTURE_ACK_TIMEOUT)) {
+    return;
+  }
+
+  uint8_t buffer[PICTURE_CHUNK_SIZE];
+  size_t length = 0;
+  if (pictureFile.seek(window.nextOffset)) {
+    length = pictureFile.read(buffer, min<size_t>(sizeof(buffer), totalSize - window.nextOffset));
+  }
+  PictureChunkPackage chunk;
+  if (length == 0 || !base64Encode(buffer, length, chunk.data, sizeof(chunk.data))) {
+    Serial.printf("pictureSender: Could not read picture %lu!\n", pictureIndex);
+    finish();
+    return;
+  }
+  chunk.from = mesh->getNodeId();
+  chunk.dest = receiver;
+  chunk.pictureIndex = pictureIndex;
+  chunk.thumbnail = thumbnail;
+  chunk.offset = window.nextOffset;
+  chunk.totalSize = totalSize;
+  if (mesh->sendPackage(&chunk)) {
+    window.sent(length);
+  }
+}
+
+void PictureSender::finish() {
+  pictureFile.close();
+  active = false;
+}
+
+bool PictureReceiver::begin(painlessMesh &mesh, fs::FS &fs) {
+  this->mesh = &mesh;
+  if (!fs.exists(DOWNLOADS_PATH) && !fs.mkdir(DOWNLOADS_PATH)) {
+    Serial.printf("pictureReceiver: Could not create %s!\n", DOWNLOADS_PATH);
+    return false;
+  }
+  this->fs = &fs;
+  return true;
+}
+
+void PictureReceiver::downloadPath(const Fetch &fetch, bool part, char *path, size_t size) const {
+  snprintf(path, size, "%s/%u_%lu%s%s", DOWNLOADS_PATH, fetch.node, fetch.pictureIndex,
+           fetch.thumbnail ? ".thumb.jpg" : ".jpg", part ? ".part" : "");
+}
+
+bool PictureReceiver::fetch(uint32_t node, unsigned long pictureIndex, bool thumbnail) {
+  if (!fs || fetchCount == PICTURE_FETCH_QUEUE_SIZE) {
+    return false;
+  }
+  Fetch newFetch = {node, pictureIndex, thumbnail};
+  char path[DOWNLOAD_PATH_SIZE];
+  downloadPath(newFetch, false, path, sizeof(path));
+  if (fs->exists(path)) {
+    return true;
+  }
+  fetchQueue[(fetchHead + fetchCount++) % PICTURE_FETCH_QUEUE_SIZE] = newFetch;
+  return true;
+}
+
+// Continues a partial download from an earlier attempt
+bool PictureReceiver::start() {
+  current = fetchQueue[fetchHead];
+  fetchHead = (fetchHead + 1) % PICTURE_FETCH_QUEUE_SIZE;
+  fetchCount--;
+
+  char path[DOWNLOAD_PATH_SIZE];
+  downloadPath(current, true, path, sizeof(path));
+  partFile = fs->open(path, FILE_APPEND);
+  if (!partFile) {
+    Serial.printf("pictureReceiver: Could not open %s!\n", path);
+    return false;
+  }
+  window.start(partFile.size());
+  active = true;
+  Serial.printf("pictureReceiver: Fetching picture %lu of node %u from byte %u.\n",
+                current.pictureIndex, current.node, window.expectedOffset);
+  request();
+  return true;
+}
+
+void PictureReceiver::request() {
+  PictureRequestPackage request;
+  request.from = mesh->getNodeId();
+  request.dest = current.node;
+  request.pictureIndex = current.pictureIndex;
+  request.thumbnail = current.thumbnail;
+  request.offset = window.expectedOffset;
+  mesh->sendPackage(&request);
+  window.requested();
+}
+
+void PictureReceiver::onChunk(const PictureChunkPackage &chunk) {
+  if (!active || chunk.from != current.node || chunk.pictureIndex != current.pictureIndex
+      || chunk.thumbnail != current.thumbnail) {
+    return;
+  }
+  if (chunk.totalSize == 0) {
+    Serial.printf("pictureReceiver: Node %u does not have picture %lu!\n", current.node, current.pictureIndex);
+    finish(false);
+    return;
+  }
+  // The part file is complete, the answer with no data to the last ack finishes it,
+  // so the sender got that ack and noted the picture as fetched
+  if (window.expectedOffset >= chunk.totalSize) {
+    if (window.expectedOffset > chunk.totalSize) {
+      Serial.printf("pictureReceiver: Part of picture %lu is bigger than the picture, starting over!\n",
+                    current.pictureIndex);
+      finish(false);
+      char path[DOWNLOAD_PATH_SIZE];
+      downloadPath(current, true, path, sizeof(path));
+      fs->remove(path);
+      return;
+    }
+    if (chunk.offset >= chunk.totalSize) {
+      finish(true);
+    }
+    return;
+  }
+
+  if (chunk.offset != window.expectedOffset) {
+    if (window.reportGap(chunk.offset)) {
+      request();
+    }
+    return;
+  }
+
+  uint8_t buffer[PICTURE_CHUNK_SIZE];
+  size_t length = base64Decode(chunk.data, buffer, sizeof(buffer));
+  if (length == 0 || partFile.write(buffer, length) != length) {
+    Serial.printf("pictureReceiver: Could not store a chunk of picture %lu!\n", current.pictureIndex);
+    finish(false);
+    return;
+  }
+  window.received(length);
+  request();
+}
+
+void PictureReceiver::update() {
+  if (!fs) {
+    return;
+  }
+  if (!active) {
+    if (fetchCount > 0) {
+      start();
+    }
+    return;
+  }
+  if (!window.isQuiet(PICTURE_ACK_TIMEOUT)) {
+    return;
+  }
+  if (++window.retries > PICTURE_REQUEST_RETRIES) {
+    // The part file stays, a later fetch resumes it
+    Serial.printf("pictureReceiver: Giving up on picture %lu of node %u for now.\n",
+                  current.pictureIndex, current.node);
+    finish(false);
+    return;
+  }
+  request();
+}
+
+void PictureReceiver::finish(bool complete) {
+  partFile.close();
+  active = false;
+  if (!complete) {
+    return;
+  }
+
+  char partPath[DOWNLOAD_PATH_SIZE];
+  char path[DOWNLOAD_PATH_SIZE];
+  downloadPath(current, true, partPath, sizeof(partPath));
+  downloadPath(current, false, path, sizeof(path));
+  if (fs->rename(partPath, path)) {
+    Serial.printf("pictureReceiver: Saved picture to path: %s\n", path);
+  } else {
+    Serial.printf("pictureReceiver: Could not rename %s!\n", partPath);
+  }
+}
@@ -0,0 +1,100 @@
+/****************************************************
+ * Pulls pictures over the mesh on demand. The      *
+ * receiver asks for a picture from an offset, the  *
+ * sender answers with up to                        *
+ * PICTURE_TRANSFER_WINDOW chunks beyond the last   *
+ * offset it was asked for. Every chunk that        *
+ * arrives in order is acknowledged by asking for   *
+ * the next offset. If nothing arrives for a while  *
+ * the receiver asks again from where it is, which  *
+ * also resumes a transfer after either side lost   *
+ * the connection or rebooted. A request from the   *
+ * end of the picture is answered with an empty     *
+ * chunk, only that answer completes a download, so *
+ * the sender knows the picture was fetched.        *
+ * Thumbnails travel the same way.                  *
+ ****************************************************/
+
+#ifndef PICTURETRANSFER_H
+#define PICTURETRANSFER_H
+
+#include <Arduino.h>
+#include <painlessMesh.h>
+#include "FS.h"
+#include "packages.h"
+#include "picturestore.h"
+#include "transferwindow.h"
+
+#define   DOWNLOADS_PATH              "/downloads"
+#define   DOWNLOAD_PATH_SIZE          48
+#define   PICTURE_TRANSFER_WINDOW     4         // chunks in flight
+#define   PICTURE_CHUNK_INTERVAL      50        // ms between chunks, keeps the mesh usable
+#define   PICTURE_ACK_TIMEOUT         2000      // ms until the window is sent again
+#define   PICTURE_TRANSFER_TIMEOUT    30000     // ms until an unanswered transfer is given up
+#define   PICTURE_REQUEST_RETRIES     10
+#define   PICTURE_FETCH_QUEUE_SIZE    8
+
+// Camera node side
+class PictureSender {
+ public:
+  void begin(painlessMesh &mesh, PictureStore &store);
+
+  void onRequest(const PictureRequestPackage &request);
+  // Sends the next chunk if the window allows it. Call every
+  // PICTURE_CHUNK_INTERVAL, but not while reports are waiting.
+  void sendNext();
+  bool isActive() const { return active; }
+  bool isSending(unsigned long pictureIndex) const { return active && !thumbnail && this->pictureIndex == pictureIndex; }
+
+ private:
+  painlessMesh *mesh = NULL;
+  PictureStore *store = NULL;
+
+  bool active = false;
+  uint32_t receiver;
+  unsigned long pictureIndex;
+  bool thumbnail;
+  File pictureFile;
+  uint32_t totalSize;
+  SendWindow window;
+
+  void sendEmpty(const PictureRequestPackage &request, uint32_t size);
+  void finish();
+};
+
+// Destination node side
+class PictureReceiver {
+ public:
+  bool begin(painlessMesh &mesh, fs::FS &fs);
+
+  // Queues a picture, skipped if it is already downloaded
+  bool fetch(uint32_t node, unsigned long pictureIndex, bool thumbnail = false);
+  void onChunk(const PictureChunkPackage &chunk);
+  // Starts the next fetch and asks again if the sender went quiet
+  void update();
+
+ private:
+  painlessMesh *mesh = NULL;
+  fs::FS *fs = NULL;
+
+  struct Fetch {
+    uint32_t node;
+    unsigned long pictureIndex;
+    bool thumbnail;
+  };
+  Fetch fetchQueue[PICTURE_FETCH_QUEUE_SIZE];
+  uint8_t fetchHead = 0;
+  uint8_t fetchCount = 0;
+
+  bool active = false;
+  Fetch current;
+  File partFile;
+  ReceiveWindow window;
+
+  void downloadPath(const Fetch &fetch, bool part, char *path, size_t size) const;
+  bool start();
+  void request();
+  void finish(bool complete);
+};
+
+#endif
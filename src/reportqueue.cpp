@@ -0,0 +1,423 @@
+#include "reportqueue.h"
+
+#include "crc32.h"
+
+#define   CURSOR_MAGIC    0x52514355
+
+struct CursorSlot {
+  uint32_t magic;
+  uint32_t generation;
+  uint32_t readSequence;
+  uint32_t checksum;
+};
+
+static uint32_t recordChecksum(const QueueRecord &record) {
+  return crc32(&record, offsetof(QueueRecord, checksum));
+}
+
+static uint32_t slotChecksum(const CursorSlot &slot) {
+  return crc32(&slot, offsetof(CursorSlot, checksum));
+}
+
+static void toRecord(const PictureReportPackage &report, QueueRecord &record) {
+  record.from = report.from;
+  record.dest = report.dest;
+  record.pictureIndex = report.pictureIndex;
+  record.deerProbability = report.deerProbability;
+  record.pictureCount = report.pictureCount;
+  record.reserved = 0;
+  record.captureTime = report.captureTime;
+  record.enqueueTime = report.enqueueTime;
+  record.checksum = recordChecksum(record);
+}
+
+static void fromRecord(const QueueRecord &record, PictureReportPackage &report) {
+  report.from = record.from;
+  report.dest = record.dest;
+  report.pictureIndex = record.pictureIndex;
+  report.deerProbability = record.deerProbability;
+  report.pictureCount = record.pictureCount ? record.pictureCount : 1;
+  report.captureTime = record.captureTime;
+  report.enqueueTime = record.enqueueTime;
+}
+
+static long priorityOf(const QueueRecord &record) {
+  return lroundf(record.deerProbability / REPORT_PRIORITY_STEP);
+}
+
+// Higher probability first, the newer report of two equal ones
+static bool isMoreValuable(const QueueRecord &record, uint32_t sequence,
+                           const QueueRecord &other, uint32_t otherSequence) {
+  long priority = priorityOf(record);
+  long otherPriority = priorityOf(other);
+  return priority > otherPriority || (priority == otherPriority && sequence > otherSequence);
+}
+
+void PersistentReportQueue::segmentPath(uint32_t segment, char *path, size_t size) const {
+  snprintf(path, size, "%s/%08u.seg", REPORT_QUEUE_PATH, segment);
+}
+
+bool PersistentReportQueue::begin(fs::FS &fs, const ReportQueueState *warmState) {
+  this->fs = &fs;
+  cachedCount = 0;
+  if (warmState) {
+    readSequence = warmState->readSequence;
+    scanSequence = warmState->scanSequence;
+    writeSequence = warmState->writeSequence;
+    cursorGeneration = warmState->cursorGeneration;
+    cachedCount = min<uint16_t>(warmState->cachedCount, REPORT_QUEUE_PRIORITY_WINDOW);
+    memcpy(cache, warmState->cache, cachedCount * sizeof(QueueRecord));
+    memcpy(cacheSequence, warmState->cacheSequence, cachedCount * sizeof(uint32_t));
+    return true;
+  }
+
+  if (!fs.exists(REPORT_QUEUE_PATH) && !fs.mkdir(REPORT_QUEUE_PATH)) {
+    Serial.printf("reportQueue: Could not create %s!\n", REPORT_QUEUE_PATH);
+    this->fs = NULL;
+    return false;
+  }
+
+  bool hasCursor = loadReadCursor();
+  if (!recoverWriteCursor(hasCursor)) {
+    Serial.printf("reportQueue: Could not read %s!\n", REPORT_QUEUE_PATH);
+    this->fs = NULL;
+    return false;
+  }
+  scanSequence = readSequence;
+
+  Serial.printf("reportQueue: Recovered %u pending reports.\n", getCount());
+  return true;
+}
+
+void PersistentReportQueue::saveState(ReportQueueState &state) const {
+  state.readSequence = readSequence;
+  state.scanSequence = scanSequence;
+  state.writeSequence = writeSequence;
+  state.cursorGeneration = cursorGeneration;
+  state.cachedCount = cachedCount;
+  memcpy(state.cache, cache, cachedCount * sizeof(QueueRecord));
+  memcpy(state.cacheSequence, cacheSequence, cachedCount * sizeof(uint32_t));
+}
+
+// The newest segment tells where the last append ended
+bool PersistentReportQueue::recoverWriteCursor(bool hasCursor) {
+  File directory = fs->open(REPORT_QUEUE_PATH);
+  if (!directory || !directory.isDirectory()) {
+    return false;
+  }
+
+  bool foundSegment = false;
+  uint32_t oldestSegment = UINT32_MAX;
+  uint32_t newestSegment = 0;
+  size_t newestSize = 0;
+  for (File entry = directory.openNextFile(); entry; entry = directory.openNextFile()) {
+    const char *name = strrchr(entry.name(), '/');
+    name = name ? name + 1 : entry.name();
+    char *end;
+    uint32_t segment = strtoul(name, &end, 10);
+    if (end != name && strcmp(end, ".seg") == 0) {
+      foundSegment = true;
+      oldestSegment = min(oldestSegment, segment);
+      if (segment >= newestSegment) {
+        newestSegment = segment;
+        newestSize = entry.size();
+      }
+    }
+    entry.close();
+  }
+  directory.close();
+
+  if (!foundSegment) {
+    writeSequence = readSequence;
+    return true;
+  }
+
+  writeSequence = newestSegment * REPORT_QUEUE_SEGMENT_RECORDS + newestSize / sizeof(QueueRecord);
+  if (newestSize % sizeof(QueueRecord) != 0) {
+    // Torn record at the end, continue in a fresh segment
+    writeSequence = (newestSegment + 1) * REPORT_QUEUE_SEGMENT_RECORDS;
+  }
+  if (!hasCursor || readSequence < oldestSegment * REPORT_QUEUE_SEGMENT_RECORDS) {
+    readSequence = oldestSegment * REPORT_QUEUE_SEGMENT_RECORDS;
+  }
+  readSequence = min(readSequence, writeSequence);
+  return true;
+}
+
+bool PersistentReportQueue::loadReadCursor() {
+  File cursorFile = fs->open(REPORT_QUEUE_CURSOR_PATH, FILE_READ);
+  if (!cursorFile) {
+    return false;
+  }
+  CursorSlot slots[2];
+  size_t slotCount = cursorFile.read((uint8_t *) slots, sizeof(slots)) / sizeof(CursorSlot);
+  cursorFile.close();
+
+  // Newest valid slot wins, a torn write only ever hits one of them
+  bool found = false;
+  for (size_t i = 0; i < slotCount; i++) {
+    if (slots[i].magic != CURSOR_MAGIC || slots[i].checksum != slotChecksum(slots[i])) {
+      continue;
+    }
+    if (!found || slots[i].generation > cursorGeneration) {
+      found = true;
+      cursorGeneration = slots[i].generation;
+      readSequence = slots[i].readSequence;
+    }
+  }
+  return found;
+}
+
+void PersistentReportQueue::saveReadCursor() {
+  CursorSlot slot;
+  slot.magic = CURSOR_MAGIC;
+  slot.generation = ++cursorGeneration;
+  slot.readSequence = readSequence;
+  slot.checksum = slotChecksum(slot);
+
+  File cursorFile = fs->open(REPORT_QUEUE_CURSOR_PATH, fs->exists(REPORT_QUEUE_CURSOR_PATH) ? "r+" : FILE_WRITE);
+  if (!cursorFile) {
+    Serial.printf("reportQueue: Could not open %s!\n", REPORT_QUEUE_CURSOR_PATH);
+    return;
+  }
+  cursorFile.seek((slot.generation % 2) * sizeof(CursorSlot));
+  cursorFile.write((const uint8_t *) &slot, sizeof(slot));
+  cursorFile.close();
+}
+
+// False if the burst before could not be written
+bool PersistentReportQueue::push(const PictureReportPackage &report) {
+  if (!fs) {
+    return false;
+  }
+
+  QueueRecord record;
+  toRecord(report, record);
+  if (hasCoalesced && record.from == coalesced.from && record.dest == coalesced.dest
+      && record.pictureIndex == coalesced.pictureIndex + coalesced.pictureCount
+      && coalesced.pictureCount + record.pictureCount <= REPORT_COALESCE_MAX) {
+    coalesced.pictureCount += record.pictureCount;
+    coalesced.deerProbability = max(coalesced.deerProbability, record.deerProbability);
+    coalescedMillis = millis();
+    return true;
+  }
+
+  bool written = !hasCoalesced || write(coalesced);
+  coalesced = record;
+  hasCoalesced = true;
+  coalescedMillis = millis();
+  return written;
+}
+
+void PersistentReportQueue::flushCoalesced(bool force) {
+  if (!hasCoalesced || (!force && millis() - coalescedMillis < REPORT_COALESCE_WINDOW)) {
+    return;
+  }
+  if (!write(coalesced)) {
+    Serial.printf("reportQueue: Could not write the report about picture %u!\n", coalesced.pictureIndex);
+  }
+  hasCoalesced = false;
+}
+
+bool PersistentReportQueue::write(QueueRecord &record) {
+  record.checksum = recordChecksum(record);
+  uint32_t segment = writeSequence / REPORT_QUEUE_SEGMENT_RECORDS;
+  if (segment != writeSegment) {
+    if (writeFile) {
+      writeFile.close();
+    }
+    char path[48];
+    segmentPath(segment, path, sizeof(path));
+    writeFile = fs->open(path, FILE_APPEND);
+    if (!writeFile) {
+      writeSegment = UINT32_MAX;
+      return false;
+    }
+    writeSegment = segment;
+  }
+
+  if (writeFile.write((const uint8_t *) &record, sizeof(record)) != sizeof(record)) {
+    // Same as a torn record after a crash
+    writeFile.close();
+    writeSegment = UINT32_MAX;
+    writeSequence = (segment + 1) * REPORT_QUEUE_SEGMENT_RECORDS;
+    return false;
+  }
+  writeFile.flush();
+
+  // Saves reading it back if the cache has caught up with the card
+  if (scanSequence == writeSequence && cachedCount < REPORT_QUEUE_PRIORITY_WINDOW) {
+    cache[cachedCount] = record;
+    cacheSequence[cachedCount++] = writeSequence;
+    scanSequence++;
+  }
+  writeSequence++;
+  return true;
+}
+
+void PersistentReportQueue::fillCache() {
+  File segmentFile;
+  uint32_t openSegment = UINT32_MAX;
+  while (cachedCount < REPORT_QUEUE_PRIORITY_WINDOW && scanSequence < writeSequence) {
+    uint32_t segment = scanSequence / REPORT_QUEUE_SEGMENT_RECORDS;
+    if (segment != openSegment) {
+      if (segmentFile) {
+        segmentFile.close();
+      }
+      char path[48];
+      segmentPath(segment, path, sizeof(path));
+      segmentFile = fs->open(path, FILE_READ);
+      if (segmentFile) {
+        segmentFile.seek((scanSequence % REPORT_QUEUE_SEGMENT_RECORDS) * sizeof(QueueRecord));
+      }
+      openSegment = segment;
+    }
+
+    QueueRecord record;
+    if (!segmentFile || segmentFile.read((uint8_t *) &record, sizeof(record)) != sizeof(record)) {
+      // The rest of this segment was never written
+      scanSequence = min(writeSequence, (segment + 1) * REPORT_QUEUE_SEGMENT_RECORDS);
+      continue;
+    }
+    if (record.checksum == recordChecksum(record)) {
+      cache[cachedCount] = record;
+      cacheSequence[cachedCount++] = scanSequence;
+    }
+    scanSequence++;
+  }
+  if (segmentFile) {
+    segmentFile.close();
+  }
+
+  // Nothing valid left, skip whatever was unreadable
+  if (cachedCount == 0) {
+    advanceReadCursor();
+  }
+}
+
+uint16_t PersistentReportQueue::peekBest(PictureReportPackage *reports, uint16_t maxCount) {
+  memset(peeked, 0, sizeof(peeked));
+  if (!fs) {
+    return 0;
+  }
+  fillCache();
+
+  uint16_t count = min(maxCount, cachedCount);
+  for (uint16_t picked = 0; picked < count; picked++) {
+    int best = -1;
+    for (uint16_t i = 0; i < cachedCount; i++) {
+      if (!peeked[i] && (best < 0 || isMoreValuable(cache[i], cacheSequence[i], cache[best], cacheSequence[best]))) {
+        best = i;
+      }
+    }
+    peeked[best] = true;
+  }
+
+  // Oldest first keeps the index deltas of a compact batch small
+  uint16_t reportCount = 0;
+  for (uint16_t i = 0; i < cachedCount; i++) {
+    if (peeked[i]) {
+      fromRecord(cache[i], reports[reportCount++]);
+    }
+  }
+  return reportCount;
+}
+
+void PersistentReportQueue::dropPeeked() {
+  if (!fs) {
+    return;
+  }
+  removeCached(peeked);
+  memset(peeked, 0, sizeof(peeked));
+  advanceReadCursor();
+}
+
+bool PersistentReportQueue::evict(const PictureReportPackage &incoming, PictureReportPackage &evicted) {
+  if (!fs) {
+    return false;
+  }
+  fillCache();
+  if (cachedCount == 0) {
+    return false;
+  }
+
+  uint16_t least = 0;
+  for (uint16_t i = 1; i < cachedCount; i++) {
+    if (isMoreValuable(cache[least], cacheSequence[least], cache[i], cacheSequence[i])) {
+      least = i;
+    }
+  }
+  // The incoming report is the newest, so it wins a tie
+  QueueRecord incomingRecord;
+  toRecord(incoming, incomingRecord);
+  if (priorityOf(incomingRecord) < priorityOf(cache[least])) {
+    return false;
+  }
+
+  fromRecord(cache[least], evicted);
+  bool remove[REPORT_QUEUE_PRIORITY_WINDOW] = {};
+  remove[least] = true;
+  removeCached(remove);
+  advanceReadCursor();
+  return true;
+}
+
+// Reports that are only on the card keep their old times
+void PersistentReportQueue::shiftTimes(int32_t offset) {
+  for (uint16_t i = 0; i < cachedCount; i++) {
+    cache[i].captureTime += offset;
+    cache[i].enqueueTime += offset;
+  }
+  if (hasCoalesced) {
+    coalesced.captureTime += offset;
+    coalesced.enqueueTime += offset;
+  }
+}
+
+// Records are appended in picture order, so the cache holds the oldest ones
+uint32_t PersistentReportQueue::oldestPictureIndex() const {
+  if (cachedCount == 0 && scanSequence < writeSequence) {
+    return 0;
+  }
+  uint32_t oldest = hasCoalesced ? coalesced.pictureIndex : UINT32_MAX;
+  for (uint16_t i = 0; i < cachedCount; i++) {
+    oldest = min(oldest, cache[i].pictureIndex);
+  }
+  return oldest;
+}
+
+void PersistentReportQueue::removeCached(const bool *remove) {
+  uint16_t kept = 0;
+  for (uint16_t i = 0; i < cachedCount; i++) {
+    if (!remove[i]) {
+      cache[kept] = cache[i];
+      cacheSequence[kept++] = cacheSequence[i];
+    }
+  }
+  cachedCount = kept;
+}
+
+// Only what was sent in order is sent for good, the read cursor stops at
+// the oldest report still waiting
+void PersistentReportQueue::advanceReadCursor() {
+  uint32_t previousSequence = readSequence;
+  readSequence = cachedCount ? cacheSequence[0] : scanSequence;
+  if (readSequence != previousSequence) {
+    removeSegmentsBefore(readSequence, previousSequence);
+    saveReadCursor();
+  }
+}
+
+// Deletes the segments the read cursor has just left behind
+void PersistentReportQueue::removeSegmentsBefore(uint32_t sequence, uint32_t previousSequence) {
+  uint32_t lastSegment = min(sequence, writeSequence) / REPORT_QUEUE_SEGMENT_RECORDS;
+  for (uint32_t segment = previousSequence / REPORT_QUEUE_SEGMENT_RECORDS; segment < lastSegment; segment++) {
+    if (segment == writeSegment) {
+      writeFile.close();
+      writeSegment = UINT32_MAX;
+    }
+    char path[48];
+    segmentPath(segment, path, sizeof(path));
+    fs->remove(path);
+  }
+}
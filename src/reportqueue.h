@@ -0,0 +1,125 @@
+/****************************************************
+ * Durable report queue on the sd card.             *
+ * Reports are appended to numbered segment files   *
+ * of REPORT_QUEUE_SEGMENT_RECORDS records each.    *
+ * The write cursor follows from the segment files, *
+ * the read cursor is stored in two alternating     *
+ * checksummed slots, so a torn write never loses   *
+ * both. Segments are deleted once fully sent.      *
+ * Reports of consecutive pictures are coalesced    *
+ * into one before they are written. The oldest     *
+ * REPORT_QUEUE_PRIORITY_WINDOW reports are kept in *
+ * RAM and sent most valuable first, see priority.  *
+ * Reports sent out of order are only forgotten in  *
+ * RAM and in the state kept through deep sleep,    *
+ * after a cold boot they are sent once more.       *
+ ****************************************************/
+
+#ifndef REPORTQUEUE_H
+#define REPORTQUEUE_H
+
+#include <Arduino.h>
+#include "FS.h"
+#include "packages.h"
+
+#define   REPORT_QUEUE_PATH             "/reports/queue"
+#define   REPORT_QUEUE_CURSOR_PATH      "/reports/queue/cursor"
+#define   REPORT_QUEUE_SEGMENT_RECORDS  256
+#define   REPORT_QUEUE_MAX_SEGMENTS     64
+#define   REPORT_QUEUE_CAPACITY         (REPORT_QUEUE_SEGMENT_RECORDS * (REPORT_QUEUE_MAX_SEGMENTS - 1))
+#define   REPORT_QUEUE_PRIORITY_WINDOW  (4 * REPORT_BATCH_SIZE)   // reports to choose from
+#define   REPORT_PRIORITY_STEP          0.1       // closer probabilities count as equal, newer wins then
+#define   REPORT_COALESCE_WINDOW        3000      // ms until a burst is written
+#define   REPORT_COALESCE_MAX           32        // pictures per coalesced report
+
+// On-card layout of a queued report
+struct QueueRecord {
+  uint32_t from;
+  uint32_t dest;
+  uint32_t pictureIndex;
+  float deerProbability;
+  uint16_t pictureCount;
+  uint16_t reserved;
+  uint32_t captureTime;
+  uint32_t enqueueTime;
+  uint32_t checksum;
+};
+
+// Cursors and the priority window kept across deep sleep, see lowpower.h.
+// The window tells the reports sent out of order from the ones still waiting.
+struct ReportQueueState {
+  uint32_t readSequence;
+  uint32_t scanSequence;
+  uint32_t writeSequence;
+  uint32_t cursorGeneration;
+  uint16_t cachedCount;
+  QueueRecord cache[REPORT_QUEUE_PRIORITY_WINDOW];
+  uint32_t cacheSequence[REPORT_QUEUE_PRIORITY_WINDOW];
+};
+
+class PersistentReportQueue {
+ public:
+  // Recovers both cursors from the card, call once after mounting it.
+  // With a state saved before deep sleep the card is not scanned.
+  bool begin(fs::FS &fs, const ReportQueueState *warmState = NULL);
+  // After flushCoalesced(true), a burst that may still grow is not kept
+  void saveState(ReportQueueState &state) const;
+
+  // A report of the picture right after the last one joins it, the merged
+  // report is written REPORT_COALESCE_WINDOW after the last one joined
+  bool push(const PictureReportPackage &report);
+  // Writes the report that still waits for more of its burst, force before deep sleep
+  void flushCoalesced(bool force = false);
+
+  // Picks the up to maxCount most valuable reports, oldest first
+  uint16_t peekBest(PictureReportPackage *reports, uint16_t maxCount);
+  // Forgets the reports of the last peekBest()
+  void dropPeeked();
+  // Makes room for incoming by dropping the least valuable report of the
+  // window. False if incoming is worth even less, it should be dropped then.
+  bool evict(const PictureReportPackage &incoming, PictureReportPackage &evicted);
+  // Moves the timestamps of the reports in RAM along when the mesh time is adjusted
+  void shiftTimes(int32_t offset);
+
+  uint32_t getCount() const { return cachedCount + (writeSequence - scanSequence) + (hasCoalesced ? 1 : 0); }
+  bool isEmpty() const { return getCount() == 0; }
+  bool isFull() const { return getCount() >= limit; }
+  // Counts as full above this many reports, at most REPORT_QUEUE_CAPACITY
+  void setLimit(uint32_t reports) { limit = min<uint32_t>(reports, REPORT_QUEUE_CAPACITY); }
+  // Lowest picture index a report that was not sent yet points to, UINT32_MAX
+  // if none. 0 while reports wait on the card that are not in RAM yet.
+  uint32_t oldestPictureIndex() const;
+
+ private:
+  fs::FS *fs = NULL;
+  File writeFile;
+  uint32_t writeSegment = UINT32_MAX;     // segment writeFile belongs to
+  uint32_t readSequence = 0;              // oldest report not sent yet
+  uint32_t scanSequence = 0;              // next record to read into the cache
+  uint32_t writeSequence = 0;             // next record to append
+  uint32_t cursorGeneration = 0;
+  uint32_t limit = REPORT_QUEUE_CAPACITY;
+
+  // unsent valid records between readSequence and scanSequence, oldest first
+  QueueRecord cache[REPORT_QUEUE_PRIORITY_WINDOW];
+  uint32_t cacheSequence[REPORT_QUEUE_PRIORITY_WINDOW];
+  uint16_t cachedCount = 0;
+  bool peeked[REPORT_QUEUE_PRIORITY_WINDOW];
+
+  // the burst that may still grow
+  QueueRecord coalesced;
+  bool hasCoalesced = false;
+  unsigned long coalescedMillis = 0;
+
+  void segmentPath(uint32_t segment, char *path, size_t size) const;
+  bool recoverWriteCursor(bool hasCursor);
+  bool loadReadCursor();
+  void saveReadCursor();
+  bool write(QueueRecord &record);
+  void fillCache();
+  void removeCached(const bool *remove);
+  void advanceReadCursor();
+  void removeSegmentsBefore(uint32_t sequence, uint32_t previousSequence);
+};
+
+#endif
@@ -0,0 +1,99 @@
+#include "retention.h"
+
+#include "picturetransfer.h"
+
+bool RetentionManager::begin(PictureStore &store, PictureSender &sender, const RetentionState *warmState) {
+  this->store = &store;
+  this->sender = &sender;
+  if (warmState) {
+    negativeCursor = warmState->negativeCursor;
+    positiveCursor = warmState->positiveCursor;
+    evicting = warmState->evicting;
+    return true;
+  }
+  // Everything below the oldest shard is gone already
+  negativeCursor = positiveCursor = store.oldestPictureIndex();
+  evicting = false;
+  return true;
+}
+
+void RetentionManager::saveState(RetentionState &state) const {
+  state.negativeCursor = negativeCursor;
+  state.positiveCursor = positiveCursor;
+  state.evicting = evicting;
+}
+
+void RetentionManager::checkSpace(uint64_t totalBytes, uint64_t usedBytes) {
+  this->totalBytes = totalBytes;
+  freeBytes = (usedBytes < totalBytes) ? totalBytes - usedBytes : 0;
+  if (!evicting && freeBytes * 100 < totalBytes * RETENTION_LOW_SPACE) {
+    evicting = true;
+    Serial.printf("retention: Only %u of %u MB free, evicting old pictures.\n",
+                  (uint32_t) (freeBytes >> 20), (uint32_t) (totalBytes >> 20));
+  } else if (evicting && freeBytes * 100 >= totalBytes * RETENTION_TARGET_SPACE) {
+    evicting = false;
+    Serial.printf("retention: %u MB free again.\n", (uint32_t) (freeBytes >> 20));
+  }
+}
+
+// Looks at one batch of index entries from cursor on, never beyond the shard or limit
+uint8_t RetentionManager::sweep(uint32_t &cursor, uint32_t limit, float deerThreshold, bool positives) {
+  uint32_t shardEnd = (cursor / PICTURE_SHARD_SIZE + 1) * PICTURE_SHARD_SIZE;
+  size_t count = min<uint32_t>(RETENTION_SCAN_BATCH, min(limit, shardEnd) - cursor);
+  PictureIndexEntry entries[RETENTION_SCAN_BATCH];
+  if (!store->readIndex(cursor, entries, count)) {
+    cursor += count;    // nothing was indexed there
+    return 0;
+  }
+
+  bool fetched[RETENTION_SCAN_BATCH];
+  if (positives) {
+    store->readFetched(cursor, fetched, count);
+  }
+
+  uint8_t evicted = 0;
+  for (size_t i = 0; i < count && evicted < RETENTION_EVICT_BATCH; i++, cursor++) {
+    const PictureIndexEntry &entry = entries[i];
+    bool negative = entry.deerProbability < deerThreshold;
+    // A positive nobody fetched yet is the only copy there is
+    if (entry.size == 0 || (!negative && (!positives || !fetched[i])) || sender->isSending(cursor)) {
+      continue;
+    }
+    // Fails for the negatives that went in an earlier sweep
+    if (store->removePicture(entry)) {
+      evicted++;
+      evictedPictures++;
+      evictedBytes += entry.size;
+    }
+  }
+  return evicted;
+}
+
+bool RetentionManager::evictSome(float deerThreshold, uint32_t keepFrom, uint32_t waitedFor) {
+  if (!store) {
+    return false;
+  }
+  if (negativeCursor < keepFrom) {
+    sweep(negativeCursor, keepFrom, deerThreshold, false);
+    return true;
+  }
+  // Only behind the negative cursor, so the oldest negatives always go first
+  uint32_t positiveLimit = min(min(keepFrom, waitedFor), negativeCursor);
+  if (positiveCursor < positiveLimit) {
+    if (positiveCursor % PICTURE_SHARD_SIZE == 0) {
+      Serial.printf("retention: No negatives left, evicting the positives of shard %u.\n",
+                    positiveCursor / PICTURE_SHARD_SIZE);
+    }
+    sweep(positiveCursor, positiveLimit, deerThreshold, true);
+    return true;
+  }
+  return false;
+}
+
+void RetentionManager::print() const {
+  Serial.printf("retention: %u of %u MB free%s, evicted %u pictures with %u MB since the boot.\n",
+                (uint32_t) (freeBytes >> 20), (uint32_t) (totalBytes >> 20), evicting ? ", evicting" : "",
+                evictedPictures, (uint32_t) (evictedBytes >> 20));
+  Serial.printf("retention: Negatives are kept from %u on, full positives from %u on.\n",
+                negativeCursor, positiveCursor);
+}
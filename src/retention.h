@@ -0,0 +1,67 @@
+/****************************************************
+ * Keeps room on the sd card for new pictures. Once *
+ * less than RETENTION_LOW_SPACE percent of the     *
+ * card is free, pictures are deleted oldest first, *
+ * a few per call, until RETENTION_TARGET_SPACE     *
+ * percent is free again. Negatives go first.       *
+ * Positives only go once no negative is left, and  *
+ * then only the full picture once a receiver got   *
+ * all of it, their thumbnail and index entry stay. *
+ * Positives nobody fetched, pictures a queued      *
+ * report still points to and the one that is being *
+ * sent are kept. The logs and the report queue     *
+ * bound themselves, see segmentlog.h and           *
+ * reportqueue.h.                                   *
+ ****************************************************/
+
+#ifndef RETENTION_H
+#define RETENTION_H
+
+#include <Arduino.h>
+#include "picturestore.h"
+
+class PictureSender;
+
+#define   RETENTION_LOW_SPACE         10        // percent of the card free, evicting starts below
+#define   RETENTION_TARGET_SPACE      15        // and stops above
+#define   RETENTION_SCAN_BATCH        32        // index entries looked at per call
+#define   RETENTION_EVICT_BATCH       4         // pictures deleted per call
+
+// Kept across deep sleep, see lowpower.h
+struct RetentionState {
+  uint32_t negativeCursor;
+  uint32_t positiveCursor;
+  bool evicting;
+};
+
+class RetentionManager {
+ public:
+  // Without a state saved before deep sleep the oldest shard is looked up on the card
+  bool begin(PictureStore &store, PictureSender &sender, const RetentionState *warmState = NULL);
+  void saveState(RetentionState &state) const;
+
+  // Starts or stops evicting
+  void checkSpace(uint64_t totalBytes, uint64_t usedBytes);
+  bool isEvicting() const { return evicting; }
+  uint64_t getFreeBytes() const { return freeBytes; }
+  // Deletes up to RETENTION_EVICT_BATCH pictures below keepFrom, positives also
+  // only below waitedFor. False once nothing is left that may go.
+  bool evictSome(float deerThreshold, uint32_t keepFrom, uint32_t waitedFor);
+
+  void print() const;
+
+ private:
+  PictureStore *store = NULL;
+  PictureSender *sender = NULL;
+  uint32_t negativeCursor = 0;      // no negative below is left, but the ones being sent
+  uint32_t positiveCursor = 0;      // no fetched full picture below is left, but the kept ones
+  bool evicting = false;
+  uint64_t freeBytes = 0;           // at the last checkSpace()
+  uint64_t totalBytes = 0;
+  uint32_t evictedPictures = 0;     // since the boot
+  uint64_t evictedBytes = 0;
+
+  uint8_t sweep(uint32_t &cursor, uint32_t limit, float deerThreshold, bool positives);
+};
+
+#endif
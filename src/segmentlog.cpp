@@ -0,0 +1,249 @@
+#include "segmentlog.h"
+
+#define   LOG_PATH_SIZE   48
+
+void SegmentLog::segmentPath(uint32_t segment, const char *extension, char *path, size_t size) const {
+  snprintf(path, size, "%s/%05u%s", directory, segment, extension);
+}
+
+bool SegmentLog::begin(fs::FS &fs, const SegmentLogState *warmState) {
+  if (!mutex) {
+    mutex = xSemaphoreCreateMutex();
+  }
+  if (warmState) {
+    this->fs = &fs;
+    oldestSegment = warmState->oldestSegment;
+    if (!openSegment(warmState->segment)) {
+      this->fs = NULL;
+      return false;
+    }
+    return true;
+  }
+
+  if (!fs.exists(directory) && !fs.mkdir(directory)) {
+    Serial.printf("segmentLog: Could not create %s!\n", directory);
+    return false;
+  }
+  File directoryFile = fs.open(directory);
+  if (!directoryFile || !directoryFile.isDirectory()) {
+    Serial.printf("segmentLog: Could not read %s!\n", directory);
+    return false;
+  }
+
+  // Older files in the same directory simply don't match the pattern
+  bool foundSegment = false;
+  uint32_t newestSegment = 0;
+  oldestSegment = UINT32_MAX;
+  for (File entry = directoryFile.openNextFile(); entry; entry = directoryFile.openNextFile()) {
+    const char *name = strrchr(entry.name(), '/');
+    name = name ? name + 1 : entry.name();
+    char *end;
+    uint32_t entrySegment = strtoul(name, &end, 10);
+    if (end != name && strcmp(end, ".log") == 0) {
+      foundSegment = true;
+      oldestSegment = min(oldestSegment, entrySegment);
+      newestSegment = max(newestSegment, entrySegment);
+    }
+    entry.close();
+  }
+  directoryFile.close();
+  if (!foundSegment) {
+    oldestSegment = 0;
+  }
+
+  this->fs = &fs;
+  if (!openSegment(newestSegment)) {
+    this->fs = NULL;
+    return false;
+  }
+  // A torn index entry would shift every later one, start over instead
+  if (indexFile.size() % sizeof(LogIndexEntry) != 0 && !openSegment(newestSegment + 1)) {
+    this->fs = NULL;
+    return false;
+  }
+
+  Serial.printf("segmentLog: Appending to segment %u in %s.\n", segment, directory);
+  return true;
+}
+
+void SegmentLog::saveState(SegmentLogState &state) const {
+  state.segment = segment;
+  state.oldestSegment = oldestSegment;
+}
+
+// Switches to newSegment and deletes the ones that fell out of the window
+bool SegmentLog::openSegment(uint32_t newSegment) {
+  if (segmentFile) {
+    segmentFile.close();
+  }
+  if (indexFile) {
+    indexFile.close();
+  }
+
+  char path[LOG_PATH_SIZE];
+  segmentPath(newSegment, ".log", path, sizeof(path));
+  segmentFile = fs->open(path, FILE_APPEND);
+  segmentPath(newSegment, ".idx", path, sizeof(path));
+  indexFile = fs->open(path, FILE_APPEND);
+  if (!segmentFile || !indexFile) {
+    Serial.printf("segmentLog: Could not open %s!\n", path);
+    return false;
+  }
+  segment = newSegment;
+  segmentSize = segmentFile.size();
+
+  while (segment - oldestSegment >= LOG_MAX_SEGMENTS) {
+    segmentPath(oldestSegment, ".log", path, sizeof(path));
+    fs->remove(path);
+    segmentPath(oldestSegment, ".idx", path, sizeof(path));
+    fs->remove(path);
+    oldestSegment++;
+  }
+  return true;
+}
+
+bool SegmentLog::appendLocked(uint32_t key, const char *format, va_list arguments) {
+  if (pendingCount == LOG_INDEX_BUFFER_SIZE) {
+    return false;
+  }
+  // One byte is kept for the newline
+  size_t space = LOG_BUFFER_SIZE - bufferLength - 1;
+  int length = vsnprintf(buffer + bufferLength, space, format, arguments);
+  if (length < 0 || (size_t) length >= space) {
+    return false;
+  }
+
+  if (bufferLength == 0) {
+    firstPendingMillis = millis();
+  }
+  pendingEntries[pendingCount].key = key;
+  pendingEntries[pendingCount++].offset = bufferLength;
+  bufferLength += length;
+  buffer[bufferLength++] = '\n';
+  return true;
+}
+
+bool SegmentLog::append(uint32_t key, const char *format, ...) {
+  if (!fs) {
+    return false;
+  }
+
+  va_list arguments, retryArguments;
+  va_start(arguments, format);
+  va_copy(retryArguments, arguments);
+  xSemaphoreTake(mutex, portMAX_DELAY);
+  bool success = appendLocked(key, format, arguments);
+  if (!success && flushLocked()) {
+    success = appendLocked(key, format, retryArguments);   // the buffer is empty now
+  }
+  xSemaphoreGive(mutex);
+  va_end(retryArguments);
+  va_end(arguments);
+
+  if (!success) {
+    Serial.printf("segmentLog: Dropped a record for %s!\n", directory);
+  }
+  return success;
+}
+
+// Data goes first, so the index never points past the end of a segment
+bool SegmentLog::flushLocked() {
+  if (bufferLength == 0) {
+    return true;
+  }
+  if (segmentSize > 0 && segmentSize + bufferLength > LOG_SEGMENT_MAX_SIZE) {
+    openSegment(segment + 1);
+  }
+  if (!segmentFile || !indexFile) {
+    return false;
+  }
+
+  if (segmentFile.write((const uint8_t *) buffer, bufferLength) != bufferLength) {
+    Serial.printf("segmentLog: Could not write to %s!\n", directory);
+    // Later offsets can't be trusted anymore
+    openSegment(segment + 1);
+    return false;
+  }
+  segmentFile.flush();
+  for (size_t i = 0; i < pendingCount; i++) {
+    pendingEntries[i].offset += segmentSize;
+  }
+  indexFile.write((const uint8_t *) pendingEntries, pendingCount * sizeof(LogIndexEntry));
+  indexFile.flush();
+
+  segmentSize += bufferLength;
+  bufferLength = 0;
+  pendingCount = 0;
+  return true;
+}
+
+bool SegmentLog::flush() {
+  if (!fs) {
+    return false;
+  }
+  xSemaphoreTake(mutex, portMAX_DELAY);
+  bool success = flushLocked();
+  xSemaphoreGive(mutex);
+  return success;
+}
+
+void SegmentLog::flushIfStale(unsigned long maxAge) {
+  if (fs && bufferLength > 0 && millis() - firstPendingMillis >= maxAge) {
+    flush();
+  }
+}
+
+bool SegmentLog::findInSegment(uint32_t searchSegment, uint32_t key, char *record, size_t size) {
+  char path[LOG_PATH_SIZE];
+  segmentPath(searchSegment, ".idx", path, sizeof(path));
+  File searchIndex = fs->open(path, FILE_READ);
+  if (!searchIndex) {
+    return false;
+  }
+
+  bool found = false;
+  uint32_t offset = 0;
+  LogIndexEntry entries[LOG_INDEX_BUFFER_SIZE];
+  size_t count;
+  while ((count = searchIndex.read((uint8_t *) entries, sizeof(entries)) / sizeof(LogIndexEntry)) > 0) {
+    for (size_t i = 0; i < count; i++) {
+      if (entries[i].key == key) {
+        found = true;
+        offset = entries[i].offset;
+      }
+    }
+  }
+  searchIndex.close();
+  if (!found) {
+    return false;
+  }
+
+  segmentPath(searchSegment, ".log", path, sizeof(path));
+  File searchSegmentFile = fs->open(path, FILE_READ);
+  if (!searchSegmentFile || !searchSegmentFile.seek(offset)) {
+    return false;
+  }
+  size_t length = searchSegmentFile.read((uint8_t *) record, size - 1);
+  searchSegmentFile.close();
+  record[length] = '\0';
+  char *newline = strchr(record, '\n');
+  if (newline) {
+    *newline = '\0';
+  }
+  return length > 0;
+}
+
+bool SegmentLog::find(uint32_t key, char *record, size_t size) {
+  if (!fs || size == 0) {
+    return false;
+  }
+
+  xSemaphoreTake(mutex, portMAX_DELAY);
+  flushLocked();
+  bool found = false;
+  for (uint32_t searchSegment = segment + 1; searchSegment-- > oldestSegment && !found; ) {
+    found = findInSegment(searchSegment, key, record, size);
+  }
+  xSemaphoreGive(mutex);
+  return found;
+}
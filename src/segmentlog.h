@@ -0,0 +1,82 @@
+/****************************************************
+ * Buffered, append-only log on the sd card.        *
+ * Records are single json lines collected in RAM   *
+ * and written to numbered segment files when the   *
+ * buffer fills up or flushIfStale() finds it old.  *
+ * Every segment has an index file of (key, offset) *
+ * pairs, so a record is found without reading the  *
+ * text. The oldest segment is deleted once there   *
+ * are more than LOG_MAX_SEGMENTS of them.          *
+ ****************************************************/
+
+#ifndef SEGMENTLOG_H
+#define SEGMENTLOG_H
+
+#include <Arduino.h>
+#include <stdarg.h>
+#include "FS.h"
+#include "freertos/semphr.h"
+
+#define   LOG_BUFFER_SIZE         2048
+#define   LOG_INDEX_BUFFER_SIZE   32                  // records per flush at most
+#define   LOG_SEGMENT_MAX_SIZE    (512 * 1024)
+#define   LOG_MAX_SEGMENTS        32
+#define   LOG_FLUSH_INTERVAL      5000                // ms a record may wait in RAM
+#define   LOG_RECORD_SIZE         192                 // buffer for find(), fits every record in the tree
+
+// On-card layout of an index entry
+struct LogIndexEntry {
+  uint32_t key;
+  uint32_t offset;    // of the record in its segment
+};
+
+// Kept across deep sleep, see lowpower.h
+struct SegmentLogState {
+  uint32_t segment;
+  uint32_t oldestSegment;
+};
+
+class SegmentLog {
+ public:
+  SegmentLog(const char *directory) : directory(directory) {}
+
+  // Continues the newest segment in directory, call once after mounting.
+  // With a state saved before deep sleep the directory is not scanned.
+  bool begin(fs::FS &fs, const SegmentLogState *warmState = NULL);
+  // Flush first, the buffer does not survive deep sleep
+  void saveState(SegmentLogState &state) const;
+
+  // Formats a record into the buffer, the newline is added here.
+  // Safe to call from any task.
+  bool append(uint32_t key, const char *format, ...) __attribute__((format(printf, 3, 4)));
+  bool flush();
+  void flushIfStale(unsigned long maxAge = LOG_FLUSH_INTERVAL);
+
+  // Copies the newest record with this key into record, without the newline
+  bool find(uint32_t key, char *record, size_t size);
+
+ private:
+  const char *directory;
+  fs::FS *fs = NULL;
+  SemaphoreHandle_t mutex = NULL;
+
+  File segmentFile;
+  File indexFile;
+  uint32_t segment = 0;
+  uint32_t oldestSegment = 0;
+  size_t segmentSize = 0;
+
+  char buffer[LOG_BUFFER_SIZE];
+  size_t bufferLength = 0;
+  LogIndexEntry pendingEntries[LOG_INDEX_BUFFER_SIZE];   // offsets relative to buffer
+  size_t pendingCount = 0;
+  unsigned long firstPendingMillis = 0;
+
+  void segmentPath(uint32_t segment, const char *extension, char *path, size_t size) const;
+  bool openSegment(uint32_t newSegment);
+  bool appendLocked(uint32_t key, const char *format, va_list arguments);
+  bool flushLocked();
+  bool findInSegment(uint32_t searchSegment, uint32_t key, char *record, size_t size);
+};
+
+#endif
@@ -0,0 +1,55 @@
+/****************************************************
+ * Lock-free ring between exactly one producer task *
+ * and exactly one consumer task, which may run on  *
+ * different cores. Each side only writes its own   *
+ * index and reads the other one with acquire       *
+ * ordering, so neither side ever blocks or takes a *
+ * lock. N has to be a power of two.                *
+ ****************************************************/
+
+#ifndef SPSCRING_H
+#define SPSCRING_H
+
+#include <atomic>
+#include <stdint.h>
+
+template <typename T, uint32_t N>
+class SpscRing {
+  static_assert(N > 0 && (N & (N - 1)) == 0, "N has to be a power of two");
+
+ public:
+  // Producer only, false if the ring is full
+  bool push(const T &item) {
+    uint32_t writeIndex = head.load(std::memory_order_relaxed);
+    if (writeIndex - tail.load(std::memory_order_acquire) == N) {
+      return false;
+    }
+    items[writeIndex & (N - 1)] = item;
+    head.store(writeIndex + 1, std::memory_order_release);    // publishes the item
+    return true;
+  }
+
+  // Consumer only, false if the ring is empty
+  bool pop(T &item) {
+    uint32_t readIndex = tail.load(std::memory_order_relaxed);
+    if (head.load(std::memory_order_acquire) == readIndex) {
+      return false;
+    }
+    item = items[readIndex & (N - 1)];
+    tail.store(readIndex + 1, std::memory_order_release);    // hands the slot back
+    return true;
+  }
+
+  // Either side or a third task, already outdated when it returns
+  uint32_t count() const {
+    return head.load(std::memory_order_acquire) - tail.load(std::memory_order_acquire);
+  }
+  bool isEmpty() const { return count() == 0; }
+
+ private:
+  T items[N];
+  std::atomic<uint32_t> head{0};    // next slot to write, wraps around
+  std::atomic<uint32_t> tail{0};    // next slot to read
+};
+
+#endif
@@ -0,0 +1,131 @@
+#include "telemetry.h"
+
+#include "crc32.h"
+#include "esp_heap_caps.h"
+
+static uint32_t recordChecksum(const TelemetryRecord &record) {
+  return crc32(&record, offsetof(TelemetryRecord, checksum));
+}
+
+bool Telemetry::isValid(const TelemetryRecord &record) {
+  return record.version == TELEMETRY_VERSION && record.checksum == recordChecksum(record);
+}
+
+bool Telemetry::begin(fs::FS &fs) {
+  if (!fs.exists(TELEMETRY_PATH) && !fs.mkdir(TELEMETRY_PATH)) {
+    Serial.printf("telemetry: Could not create %s!\n", TELEMETRY_PATH);
+    return false;
+  }
+  this->fs = &fs;
+
+  // The slot after the newest valid record is next
+  File ringFile = fs.open(TELEMETRY_RING_PATH, FILE_READ);
+  if (!ringFile) {
+    return true;
+  }
+  uint32_t slotCount = min((uint32_t) (ringFile.size() / sizeof(TelemetryRecord)), (uint32_t) TELEMETRY_RING_SLOTS);
+  bool found = false;
+  TelemetryRecord record;
+  for (uint32_t slot = 0; slot < slotCount; slot++) {
+    if (ringFile.read((uint8_t *) &record, sizeof(record)) != sizeof(record)) {
+      break;
+    }
+    if (isValid(record) && (!found || record.sequence >= sequence)) {
+      found = true;
+      sequence = record.sequence + 1;
+      nextSlot = (slot + 1) % TELEMETRY_RING_SLOTS;
+    }
+  }
+  ringFile.close();
+  // A torn record at the end is simply overwritten
+  return true;
+}
+
+void Telemetry::stopTimer(TelemetryTimer timer, uint32_t startCycles) {
+  uint32_t cycles = ESP.getCycleCount() - startCycles;
+  portENTER_CRITICAL(&timerLock);
+  timers[timer].count++;
+  timers[timer].cycles += cycles;
+  timers[timer].maxCycles = max(timers[timer].maxCycles, cycles);
+  portEXIT_CRITICAL(&timerLock);
+}
+
+void Telemetry::snapshot(TelemetryRecord &record, uint32_t nodeId, uint32_t meshTime,
+                         uint32_t bootIndex, uint32_t queueDepth) {
+  TimerStats stats[TIMER_COUNT];
+  portENTER_CRITICAL(&timerLock);
+  memcpy(stats, timers, sizeof(stats));
+  memset(timers, 0, sizeof(timers));
+  portEXIT_CRITICAL(&timerLock);
+
+  memset(&record, 0, sizeof(record));
+  record.version = TELEMETRY_VERSION;
+  record.sequence = sequence++;
+  record.nodeId = nodeId;
+  record.meshTime = meshTime;
+  record.uptimeSeconds = millis() / 1000;
+  record.bootIndex = bootIndex;
+
+  uint32_t cyclesPerMicro = max((uint32_t) ESP.getCpuFreqMHz(), (uint32_t) 1);
+  for (int i = 0; i < TIMER_COUNT; i++) {
+    record.timers[i].count = stats[i].count;
+    record.timers[i].averageMicros = stats[i].count ? stats[i].cycles / stats[i].count / cyclesPerMicro : 0;
+    record.timers[i].maxMicros = stats[i].maxCycles / cyclesPerMicro;
+  }
+  for (int i = 0; i < COUNTER_COUNT; i++) {
+    record.counters[i] = counters[i];
+  }
+  record.queueDepth = queueDepth;
+
+  // bytes per ms are KB per s
+  uint32_t sdBytes = record.counters[COUNTER_SD_BYTES];
+  uint64_t sdWriteMillis = stats[TIMER_SD_WRITE].cycles / cyclesPerMicro / 1000;
+  record.sdWriteKilobytesPerSecond = sdWriteMillis ? (sdBytes - lastSdBytes) / sdWriteMillis : 0;
+  lastSdBytes = sdBytes;
+
+  record.freeHeap = heap_caps_get_free_size(MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+  record.largestHeapBlock = heap_caps_get_largest_free_block(MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+  record.freePsram = heap_caps_get_free_size(MALLOC_CAP_SPIRAM);
+  record.largestPsramBlock = heap_caps_get_largest_free_block(MALLOC_CAP_SPIRAM);
+  record.checksum = recordChecksum(record);
+}
+
+bool Telemetry::write(const TelemetryRecord &record) {
+  if (!fs) {
+    return false;
+  }
+  File ringFile = fs->open(TELEMETRY_RING_PATH, fs->exists(TELEMETRY_RING_PATH) ? "r+" : FILE_WRITE);
+  if (!ringFile) {
+    Serial.printf("telemetry: Could not open %s!\n", TELEMETRY_RING_PATH);
+    return false;
+  }
+  bool written = ringFile.seek(nextSlot * sizeof(TelemetryRecord))
+                 && ringFile.write((const uint8_t *) &record, sizeof(record)) == sizeof(record);
+  ringFile.close();
+  if (written) {
+    nextSlot = (nextSlot + 1) % TELEMETRY_RING_SLOTS;
+  }
+  return written;
+}
+
+int Telemetry::format(const TelemetryRecord &record, char *buffer, size_t size) {
+  static const char *timerNames[TIMER_COUNT] = {"capture", "sdWrite", "inference", "serialize", "send"};
+  int length = snprintf(buffer, size, "{\"node\":%u,\"sequence\":%u,\"boot\":%u,\"uptime\":%u,\"meshTime\":%u",
+                        record.nodeId, record.sequence, record.bootIndex, record.uptimeSeconds, record.meshTime);
+  for (int i = 0; i < TIMER_COUNT && length > 0 && (size_t) length < size; i++) {
+    // count, average and max in us
+    length += snprintf(buffer + length, size - length, ",\"%s\":[%u,%u,%u]", timerNames[i],
+                       record.timers[i].count, record.timers[i].averageMicros, record.timers[i].maxMicros);
+  }
+  if (length > 0 && (size_t) length < size) {
+    length += snprintf(buffer + length, size - length,
+                       ",\"reportsSent\":%u,\"sendFailures\":%u,\"drops\":%u,\"queueDepth\":%u"
+                       ",\"sdBytes\":%u,\"sdKBps\":%u,\"motionSkips\":%u,\"heap\":[%u,%u],\"psram\":[%u,%u]}",
+                       record.counters[COUNTER_REPORTS_SENT], record.counters[COUNTER_SEND_FAILURES],
+                       record.counters[COUNTER_DROPS], record.queueDepth,
+                       record.counters[COUNTER_SD_BYTES], record.sdWriteKilobytesPerSecond,
+                       record.counters[COUNTER_MOTION_SKIPS],
+                       record.freeHeap, record.largestHeapBlock, record.freePsram, record.largestPsramBlock);
+  }
+  return length;
+}
@@ -0,0 +1,104 @@
+/****************************************************
+ * Lightweight performance counters.                *
+ * Stage timers count CPU cycles, start and stop    *
+ * have to run on the same core. Every              *
+ * TELEMETRY_INTERVAL a snapshot of the timers and  *
+ * counters goes into a TelemetryRecord, which is   *
+ * sent to the destination node and written to a   *
+ * ring file of TELEMETRY_RING_SLOTS records on the *
+ * sd card. Timers start over with every snapshot,  *
+ * counters count since boot.                       *
+ ****************************************************/
+
+#ifndef TELEMETRY_H
+#define TELEMETRY_H
+
+#include <Arduino.h>
+#include <atomic>
+#include "FS.h"
+
+#define   TELEMETRY_PATH          "/telemetry"
+#define   TELEMETRY_RING_PATH     "/telemetry/ring.bin"
+#define   TELEMETRY_RING_SLOTS    1024    // a bit over 3 days every 5 minutes
+#define   TELEMETRY_VERSION       2
+#define   TELEMETRY_JSON_SIZE     512
+
+enum TelemetryTimer {
+  TIMER_CAPTURE,
+  TIMER_SD_WRITE,
+  TIMER_INFERENCE,
+  TIMER_SERIALIZE,
+  TIMER_SEND,
+  TIMER_COUNT
+};
+
+enum TelemetryCounter {
+  COUNTER_REPORTS_SENT,
+  COUNTER_SEND_FAILURES,
+  COUNTER_DROPS,
+  COUNTER_SD_BYTES,      // written through the TIMER_SD_WRITE stage
+  COUNTER_MOTION_SKIPS,  // frames the motion gate kept from the classifier
+  COUNTER_COUNT
+};
+
+struct TelemetryTimerRecord {
+  uint32_t count;
+  uint32_t averageMicros;
+  uint32_t maxMicros;
+};
+
+// On-card and on-air layout, both ends are little endian
+struct TelemetryRecord {
+  uint8_t version;
+  uint8_t reserved[3];
+  uint32_t sequence;
+  uint32_t nodeId;
+  uint32_t meshTime;
+  uint32_t uptimeSeconds;
+  uint32_t bootIndex;
+  TelemetryTimerRecord timers[TIMER_COUNT];
+  uint32_t counters[COUNTER_COUNT];
+  uint32_t queueDepth;
+  uint32_t sdWriteKilobytesPerSecond;   // during the interval
+  uint32_t freeHeap;
+  uint32_t largestHeapBlock;
+  uint32_t freePsram;
+  uint32_t largestPsramBlock;
+  uint32_t checksum;
+};
+
+class Telemetry {
+ public:
+  // Continues the ring file after its newest record
+  bool begin(fs::FS &fs);
+
+  static uint32_t startTimer() { return ESP.getCycleCount(); }
+  void stopTimer(TelemetryTimer timer, uint32_t startCycles);
+  void count(TelemetryCounter counter, uint32_t amount = 1) { counters[counter] += amount; }
+
+  // Takes the snapshot and starts the timers over
+  void snapshot(TelemetryRecord &record, uint32_t nodeId, uint32_t meshTime,
+                uint32_t bootIndex, uint32_t queueDepth);
+  bool write(const TelemetryRecord &record);
+
+  static bool isValid(const TelemetryRecord &record);
+  // One json line, for whatever collects the serial output of the destination node
+  static int format(const TelemetryRecord &record, char *buffer, size_t size);
+
+ private:
+  struct TimerStats {
+    uint32_t count;
+    uint64_t cycles;
+    uint32_t maxCycles;
+  };
+
+  portMUX_TYPE timerLock = portMUX_INITIALIZER_UNLOCKED;
+  TimerStats timers[TIMER_COUNT] = {};
+  std::atomic<uint32_t> counters[COUNTER_COUNT] = {};
+  uint32_t sequence = 0;
+  uint32_t nextSlot = 0;
+  uint32_t lastSdBytes = 0;
+  fs::FS *fs = NULL;
+};
+
+#endif
@@ -0,0 +1,47 @@
+#include "transferwindow.h"
+
+void SendWindow::start(uint32_t offset) {
+  ackedOffset = offset;
+  nextOffset = offset;
+}
+
+void SendWindow::onAck(uint32_t offset) {
+  lastAckMillis = millis();
+  windowMillis = lastAckMillis;
+  if (offset > ackedOffset) {
+    ackedOffset = offset;
+    nextOffset = max(nextOffset, ackedOffset);
+  } else {
+    // Asked for the same offset again, the chunk there got lost
+    ackedOffset = offset;
+    nextOffset = offset;
+  }
+}
+
+bool SendWindow::canSend(uint32_t end, uint32_t windowBytes, unsigned long ackTimeout) {
+  if (millis() - windowMillis >= ackTimeout && nextOffset > ackedOffset) {
+    nextOffset = ackedOffset;   // go back and send the window again
+    windowMillis = millis();
+  }
+  return nextOffset < end && nextOffset < ackedOffset + windowBytes;
+}
+
+void ReceiveWindow::start(uint32_t offset) {
+  expectedOffset = offset;
+  gapReported = false;
+  retries = 0;
+}
+
+bool ReceiveWindow::reportGap(uint32_t offset) {
+  if (offset <= expectedOffset || gapReported) {
+    return false;
+  }
+  gapReported = true;
+  return true;
+}
+
+void ReceiveWindow::received(size_t length) {
+  expectedOffset += length;
+  gapReported = false;
+  retries = 0;
+}
@@ -0,0 +1,50 @@
+/****************************************************
+ * Bookkeeping of the windowed transfers of         *
+ * pictures and updates, see picturetransfer.h. The *
+ * sender keeps a window of bytes in flight beyond  *
+ * the last offset it was asked for, goes back to   *
+ * that offset when it is asked for again and sends *
+ * the whole window again when no ack came for a    *
+ * while. The receiver only takes the chunk at the  *
+ * offset it expects and asks again once for a      *
+ * later one, which makes the sender go back.       *
+ ****************************************************/
+
+#ifndef TRANSFERWINDOW_H
+#define TRANSFERWINDOW_H
+
+#include <Arduino.h>
+
+// Sending side, one per receiver
+struct SendWindow {
+  uint32_t ackedOffset;         // receiver has everything before this
+  uint32_t nextOffset;          // next byte to send
+  unsigned long lastAckMillis;
+  unsigned long windowMillis;   // last ack or the last time the window was sent again
+
+  void start(uint32_t offset);
+  // Every request is an ack of everything before its offset
+  void onAck(uint32_t offset);
+  // False while the window is full or everything below end is sent. Goes back
+  // to the acked offset once no ack came for ackTimeout.
+  bool canSend(uint32_t end, uint32_t windowBytes, unsigned long ackTimeout);
+  void sent(size_t length) { nextOffset += length; }
+  bool isQuiet(unsigned long timeout) const { return millis() - lastAckMillis >= timeout; }
+};
+
+// Receiving side
+struct ReceiveWindow {
+  uint32_t expectedOffset;
+  unsigned long lastChunkMillis;  // or the last request
+  bool gapReported;               // asked again since the last chunk in order
+  uint8_t retries;
+
+  void start(uint32_t offset);
+  void requested() { lastChunkMillis = millis(); }
+  // True for the first later chunk after a lost one, asking again then makes the sender go back
+  bool reportGap(uint32_t offset);
+  void received(size_t length);
+  bool isQuiet(unsigned long timeout) const { return millis() - lastChunkMillis >= timeout; }
+};
+
+#endif
@@ -0,0 +1,238 @@
+#include "wireformat.h"
+
+#include <math.h>
+#include <string.h>
+
+static const char BASE64_ALPHABET[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+static size_t writeVarint(uint32_t value, uint8_t *buffer, size_t size) {
+  size_t length = 0;
+  do {
+    if (length >= size) {
+      return 0;
+    }
+    uint8_t byte = value & 0x7F;
+    value >>= 7;
+    buffer[length++] = value ? (byte | 0x80) : byte;
+  } while (value);
+  return length;
+}
+
+static size_t readVarint(const uint8_t *buffer, size_t length, uint32_t &value) {
+  value = 0;
+  for (size_t i = 0; i < length && i < 5; i++) {
+    value |= (uint32_t) (buffer[i] & 0x7F) << (7 * i);
+    if (!(buffer[i] & 0x80)) {
+      return i + 1;
+    }
+  }
+  return 0;
+}
+
+// Maps small negative deltas to small unsigned numbers
+static inline uint32_t zigzag(int32_t value) {
+  return ((uint32_t) value << 1) ^ (uint32_t) (value >> 31);
+}
+
+static inline int32_t unzigzag(uint32_t value) {
+  return (int32_t) (value >> 1) ^ -(int32_t) (value & 1);
+}
+
+// Ages travel in ms, that is plenty for a report
+static inline uint32_t ageMillis(uint32_t sendTime, uint32_t time) {
+  return (sendTime - time) / 1000;
+}
+
+size_t encodeReports(const PictureReport *reports, uint8_t count, uint32_t sendTime, uint8_t *buffer, size_t size) {
+  if (count == 0 || size < 2) {
+    return 0;
+  }
+
+  // Older readers are still fine as long as nothing newer is needed
+  uint8_t version = 1;
+  if (sendTime) {
+    version = 3;
+  }
+  for (uint8_t i = 0; i < count && version < 2; i++) {
+    if (reports[i].pictureCount > 1) {
+      version = 2;
+    }
+  }
+
+  size_t length = 0;
+  buffer[length++] = version;
+  size_t written = writeVarint(count, buffer + length, size - length);
+  if (!written) {
+    return 0;
+  }
+  length += written;
+  if (version >= 3) {
+    written = writeVarint(sendTime, buffer + length, size - length);
+    if (!written) {
+      return 0;
+    }
+    length += written;
+  }
+
+  uint32_t previousIndex = 0;
+  for (uint8_t i = 0; i < count; i++) {
+    uint32_t pictureIndex = (uint32_t) reports[i].pictureIndex;
+    uint32_t delta = (i == 0) ? pictureIndex : zigzag((int32_t) (pictureIndex - previousIndex));
+    written = writeVarint(delta, buffer + length, size - length);
+    if (!written || length + written >= size) {
+      return 0;
+    }
+    length += written;
+    previousIndex = pictureIndex;
+
+    // The model output is quantized to 8 bit anyway
+    float probability = reports[i].deerProbability;
+    probability = probability < 0.0f ? 0.0f : (probability > 1.0f ? 1.0f : probability);
+    buffer[length++] = (uint8_t) lroundf(probability * 255.0f);
+
+    if (version >= 2) {
+      uint16_t furtherPictures = reports[i].pictureCount ? reports[i].pictureCount - 1 : 0;
+      written = writeVarint(furtherPictures, buffer + length, size - length);
+      if (!written) {
+        return 0;
+      }
+      length += written;
+    }
+
+    if (version >= 3) {
+      written = writeVarint(ageMillis(sendTime, reports[i].captureTime), buffer + length, size - length);
+      if (!written) {
+        return 0;
+      }
+      length += written;
+      written = writeVarint(ageMillis(sendTime, reports[i].enqueueTime), buffer + length, size - length);
+      if (!written) {
+        return 0;
+      }
+      length += written;
+    }
+  }
+  return length;
+}
+
+uint8_t decodeReports(const uint8_t *buffer, size_t length, PictureReport *reports, uint8_t maxCount,
+                      uint32_t &sendTime) {
+  sendTime = 0;
+  uint8_t version = length ? buffer[0] : 0;
+  if (length < 2 || version < 1 || version > COMPACT_FORMAT_VERSION) {
+    return 0;
+  }
+
+  size_t position = 1;
+  uint32_t count;
+  size_t read = readVarint(buffer + position, length - position, count);
+  if (!read || count == 0 || count > maxCount) {
+    return 0;
+  }
+  position += read;
+  if (version >= 3) {
+    read = readVarint(buffer + position, length - position, sendTime);
+    if (!read) {
+      return 0;
+    }
+    position += read;
+  }
+
+  uint32_t previousIndex = 0;
+  for (uint32_t i = 0; i < count; i++) {
+    uint32_t delta;
+    read = readVarint(buffer + position, length - position, delta);
+    if (!read || position + read >= length) {
+      return 0;
+    }
+    position += read;
+    previousIndex = (i == 0) ? delta : previousIndex + unzigzag(delta);
+    reports[i].pictureIndex = previousIndex;
+    reports[i].deerProbability = buffer[position++] / 255.0f;
+
+    reports[i].pictureCount = 1;
+    if (version >= 2) {
+      uint32_t furtherPictures;
+      read = readVarint(buffer + position, length - position, furtherPictures);
+      if (!read || furtherPictures >= UINT16_MAX) {
+        return 0;
+      }
+      position += read;
+      reports[i].pictureCount = furtherPictures + 1;
+    }
+
+    reports[i].captureTime = 0;
+    reports[i].enqueueTime = 0;
+    if (version >= 3) {
+      uint32_t captureAge, queueAge;
+      read = readVarint(buffer + position, length - position, captureAge);
+      if (!read) {
+        return 0;
+      }
+      position += read;
+      read = readVarint(buffer + position, length - position, queueAge);
+      if (!read) {
+        return 0;
+      }
+      position += read;
+      reports[i].captureTime = sendTime - captureAge * 1000;
+      reports[i].enqueueTime = sendTime - queueAge * 1000;
+    }
+  }
+  return (uint8_t) count;
+}
+
+size_t base64Encode(const uint8_t *data, size_t length, char *text, size_t size) {
+  if (size < BASE64_SIZE(length)) {
+    return 0;
+  }
+
+  size_t textLength = 0;
+  for (size_t i = 0; i < length; i += 3) {
+    uint32_t block = (uint32_t) data[i] << 16;
+    if (i + 1 < length) block |= (uint32_t) data[i + 1] << 8;
+    if (i + 2 < length) block |= data[i + 2];
+    text[textLength++] = BASE64_ALPHABET[(block >> 18) & 0x3F];
+    text[textLength++] = BASE64_ALPHABET[(block >> 12) & 0x3F];
+    text[textLength++] = (i + 1 < length) ? BASE64_ALPHABET[(block >> 6) & 0x3F] : '=';
+    text[textLength++] = (i + 2 < length) ? BASE64_ALPHABET[block & 0x3F] : '=';
+  }
+  text[textLength] = '\0';
+  return textLength;
+}
+
+static int base64Value(char character) {
+  const char *position = (character != '\0') ? strchr(BASE64_ALPHABET, character) : NULL;
+  return position ? (int) (position - BASE64_ALPHABET) : -1;
+}
+
+size_t base64Decode(const char *text, uint8_t *data, size_t size) {
+  size_t textLength = strlen(text);
+  if (textLength % 4 != 0) {
+    return 0;
+  }
+
+  size_t length = 0;
+  for (size_t i = 0; i < textLength; i += 4) {
+    uint32_t block = 0;
+    int padding = 0;
+    for (int j = 0; j < 4; j++) {
+      int value = base64Value(text[i + j]);
+      if (value < 0) {
+        if (text[i + j] != '=' || i + 4 != textLength) {
+          return 0;
+        }
+        value = 0;
+        padding++;
+      }
+      block = (block << 6) | value;
+    }
+    if (length + 3 - padding > size) {
+      return 0;
+    }
+    data[length++] = (block >> 16) & 0xFF;
+    if (padding < 2) data[length++] = (block >> 8) & 0xFF;
+    if (padding < 1) data[length++] = block & 0xFF;
+  }
+  return length;
+}
@@ -0,0 +1,54 @@
+/****************************************************
+ * Compact binary encoding of picture reports.      *
+ * Layout of an encoded batch:                      *
+ *   version, count (varint),                       *
+ *   since version 3 the send time (varint),        *
+ *   first picture index (varint),                  *
+ *   per report: index delta (zigzag varint),       *
+ *               probability (one byte),            *
+ *               since version 2 the number of      *
+ *               further pictures (varint),         *
+ *               since version 3 the ms from        *
+ *               capture and from enqueue to send   *
+ *               (varints).                         *
+ * Without a send time the oldest version that      *
+ * holds the batch is written.                      *
+ * The bytes travel base64 encoded inside a single  *
+ * json string, see CompactReportPackage.           *
+ ****************************************************/
+
+#ifndef WIREFORMAT_H
+#define WIREFORMAT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define   REPORT_BATCH_SIZE             8
+#define   COMPACT_FORMAT_VERSION        3
+
+// version + count + send time + first index + worst case per report
+#define   COMPACT_REPORTS_MAX_SIZE      (1 + 1 + 5 + 5 + REPORT_BATCH_SIZE * (5 + 1 + 3 + 5 + 5))
+#define   BASE64_SIZE(bytes)            ((((bytes) + 2) / 3) * 4 + 1)
+
+// The part of a report that changes from picture to picture
+struct PictureReport {
+  unsigned long pictureIndex;
+  float deerProbability;
+  uint16_t pictureCount;      // consecutive pictures from pictureIndex on, see PersistentReportQueue::push()
+  uint32_t captureTime;       // mesh time in us, of the first picture
+  uint32_t enqueueTime;
+};
+
+// Returns the number of bytes written, 0 if buffer is too small.
+// A sendTime of 0 leaves the timestamps out.
+size_t encodeReports(const PictureReport *reports, uint8_t count, uint32_t sendTime, uint8_t *buffer, size_t size);
+// Returns the number of reports read, 0 if the data is malformed.
+// sendTime and the timestamps are 0 if the batch has none.
+uint8_t decodeReports(const uint8_t *buffer, size_t length, PictureReport *reports, uint8_t maxCount,
+                      uint32_t &sendTime);
+
+// Both return the number of characters/bytes written, 0 if it did not fit
+size_t base64Encode(const uint8_t *data, size_t length, char *text, size_t size);
+size_t base64Decode(const char *text, uint8_t *data, size_t size);
+
+#endif